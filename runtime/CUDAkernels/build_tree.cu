@@ -728,6 +728,115 @@ KERNEL_DECLARE(store_group_list)(int    n_particles,
   }
 }
 
+//Copies the nodes of one tree into a merged tree in which every level has moved
+//down by one. Per source level levelMap holds: x the first source node, y the
+//first merged node, z and w the shift of the leaf and non-leaf entries in leafNodeIdx
+KERNEL_DECLARE(merge_tree_nodes)(const int n_nodes,
+                                 const int n_leafs,
+                                 const uint bodyOffset,
+                                 int4  *levelMap,
+                                 uint2 *src_node_bodies,
+                                 uint  *src_n_children,
+                                 uint  *src_leafNodeIdx,
+                                 real4 *src_multipole,
+                                 real4 *src_boxSizeInfo,
+                                 real4 *src_boxCenterInfo,
+                                 uint2 *node_bodies,
+                                 uint  *n_children,
+                                 uint  *leafNodeIdx,
+                                 real4 *multipole,
+                                 real4 *boxSizeInfo,
+                                 real4 *boxCenterInfo)
+{
+  CUXTIMER("merge_tree_nodes");
+  const uint bid = blockIdx.y * gridDim.x + blockIdx.x;
+  const uint tid = threadIdx.x;
+  const int  idx = bid * blockDim.x + tid;
+
+  if(idx >= n_nodes) return;
+
+  const uint2 bij   = src_node_bodies[idx];
+  const uint  level = (bij.x & LEVELMASK) >> BITLEVELS;
+  const int   dst   = levelMap[level].y + (idx - levelMap[level].x);
+
+  node_bodies[dst] = make_uint2(((bij.x & ILEVELMASK) + bodyOffset) | ((level+1) << BITLEVELS),
+                                bij.y + bodyOffset);
+
+  //Leaves have no children, their first child field is not used
+  uint children = src_n_children[idx];
+  if(children >> 28)
+    children = (levelMap[level+1].y + ((children & 0x0FFFFFFF) - levelMap[level+1].x)) | (children & 0xF0000000);
+  else
+    children = 0;
+  n_children[dst] = children;
+
+  multipole[3*dst + 0] = src_multipole[3*idx + 0];
+  multipole[3*dst + 1] = src_multipole[3*idx + 1];
+  multipole[3*dst + 2] = src_multipole[3*idx + 2];
+
+  const real4 center = src_boxCenterInfo[idx];
+  real4 size         = src_boxSizeInfo[idx];
+  if(center.w <= 0)
+  {
+    //Leaf, points to its particles
+    const uint pfirst = __float_as_int(size.w);
+    const uint mask   = (1 << LEAFBIT) - 1;
+    size.w = __int_as_float(((pfirst & mask) + bodyOffset) | (pfirst & ~mask));
+  }
+  else
+    size.w = __int_as_float(children);
+  boxCenterInfo[dst] = center;
+  boxSizeInfo  [dst] = size;
+
+  //The leaves and non-leaves are sorted on their level
+  const uint node      = src_leafNodeIdx[idx];
+  const uint nodeLevel = (src_node_bodies[node].x & LEVELMASK) >> BITLEVELS;
+  const int  shift     = (idx < n_leafs) ? levelMap[nodeLevel].z : levelMap[nodeLevel].w;
+  leafNodeIdx[idx + shift] = levelMap[nodeLevel].y + (node - levelMap[nodeLevel].x);
+}
+
+//Copies the groups of one tree into a merged tree, the particles of the
+//tree start at bodyOffset and its groups at groupOffset
+KERNEL_DECLARE(merge_tree_groups)(const int n_particles,
+                                  const int n_groups,
+                                  const uint bodyOffset,
+                                  const uint groupOffset,
+                                  uint  *src_body2group_list,
+                                  uint  *src_oriParticleOrder,
+                                  uint2 *src_group_list,
+                                  real4 *src_groupSizeInfo,
+                                  real4 *src_groupCenterInfo,
+                                  uint  *body2group_list,
+                                  uint  *oriParticleOrder,
+                                  uint2 *group_list,
+                                  real4 *groupSizeInfo,
+                                  real4 *groupCenterInfo)
+{
+  CUXTIMER("merge_tree_groups");
+  const uint bid = blockIdx.y * gridDim.x + blockIdx.x;
+  const uint tid = threadIdx.x;
+  const int  idx = bid * blockDim.x + tid;
+
+  if(idx < n_particles)
+  {
+    body2group_list [bodyOffset + idx] = src_body2group_list[idx] + groupOffset;
+    oriParticleOrder[bodyOffset + idx] = src_oriParticleOrder[idx] + bodyOffset;
+  }
+
+  if(idx < n_groups)
+  {
+    const uint2 grp = src_group_list[idx];
+    group_list[groupOffset + idx] = make_uint2(grp.x + bodyOffset, grp.y + bodyOffset);
+
+    real4 size       = src_groupSizeInfo[idx];
+    const uint start = __float_as_int(size.w);
+    const uint mask  = (1 << CRITBIT) - 1;
+    size.w           = __int_as_float(((start & mask) + bodyOffset) | (start & ~mask));
+    groupSizeInfo  [groupOffset + idx] = size;
+    groupCenterInfo[groupOffset + idx] = src_groupCenterInfo[idx];
+  }
+}
+
 
 
 
@@ -132,6 +132,12 @@ extern "C" void thrustDataReorderF2(const int N, my_dev::dev_mem<uint> &permutat
 extern "C" void thrustDataReorderF1(const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<float> &dIn, my_dev::dev_mem<float> &dOut) {
   thrust::gather(permutation.thrustPtr(), permutation.thrustPtr() + N, dIn.thrustPtr(), dOut.thrustPtr());
 }
+extern "C" void thrustDataReorderI2(const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<int2> &dIn, my_dev::dev_mem<int2> &dOut) {
+  thrust::gather(permutation.thrustPtr(), permutation.thrustPtr() + N, dIn.thrustPtr(), dOut.thrustPtr());
+}
+extern "C" void thrustDataReorderU1(const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<uint> &dIn, my_dev::dev_mem<uint> &dOut) {
+  thrust::gather(permutation.thrustPtr(), permutation.thrustPtr() + N, dIn.thrustPtr(), dOut.thrustPtr());
+}
 
 typedef unsigned long long ullong; //ulonglong1
 extern "C" void thrustDataReorderULL(const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<ullong> &dIn, my_dev::dev_mem<ullong> &dOut) {
@@ -1,12 +1,24 @@
 #pragma once
 
+/* define BONSAIIO_NO_MPI to only use the MPI free MMapReader */
+#ifndef BONSAIIO_NO_MPI
 #include <mpi.h>
+#endif
 #include <string>
 #include <vector>
 #include <exception>
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <cstdio>
+#include <limits>
+#include <cmath>
+#include <stdint.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 namespace BonsaiIO
@@ -35,6 +47,12 @@ namespace BonsaiIO
   typedef long long int long_t;
 #define MPI_LONGT MPI_LONG_LONG
 
+  /* per field encoding, V3 files only */
+  enum CODEC
+  {
+    CODEC_NONE = 0, CODEC_DELTA = 1, CODEC_QUANT = 2
+  };
+
   /*#####################################*/
   /*#####################################*/
   /*#####################################*/
@@ -57,8 +75,46 @@ namespace BonsaiIO
       virtual void seek (const size_t offset) = 0;
       virtual void read (      void *data, const size_t count, const std::string &errString, const size_t batchMax = (1U << 30) - 1) = 0;
       virtual void write(const void *data, const size_t count, const std::string &errString, const size_t batchMax = (1U << 30) - 1) = 0;
+
+      /* non-blocking write of count elements at offset, data must stay valid until wait() */
+      /* the default falls back to a blocking write */
+      virtual void iwrite(const size_t offset, const void *data, const size_t count, const size_t elementSize,
+          const bool collective, const std::string &errString)
+      {
+        seek(offset);
+        write(data, count*elementSize, errString);
+      }
+      virtual bool test() { return true; }
+      virtual void wait() {}
+
+      /* read count elements at offset, taking every stride-th element of the file */
+      /* the default reads the whole range in batches and picks the elements */
+      virtual void readStrided(const size_t offset, void *data, const size_t count, const size_t elementSize,
+          const size_t stride, const std::string &errString)
+      {
+        seek(offset);
+        const size_t nBatch = std::max(count, static_cast<size_t>(1))*elementSize;
+        std::vector<char> tmp(nBatch);
+        size_t nRead = count > 0 ? ((count-1)*stride + 1)*elementSize : 0;
+        size_t el = 0, previous = 0;
+        while (nRead > 0)
+        {
+          const size_t n = std::min(nRead, nBatch);
+          read(&tmp[0], n, errString);
+          for (size_t i = 0; i < n; i += elementSize)
+            if ((previous + i)%(stride*elementSize) == 0)
+            {
+              memcpy(reinterpret_cast<char*>(data) + el*elementSize, &tmp[i], elementSize);
+              el++;
+            }
+          previous += n;
+          nRead    -= n;
+        }
+        assert(el == count);
+      }
   };
 
+#ifndef BONSAIIO_NO_MPI
   /* MPI-IO implementation */
   class MPIFileIO : public FileIO
   {
@@ -69,6 +125,27 @@ namespace BonsaiIO
       MPI_Offset offset;
       int checkCount;
 
+      /* outstanding non-blocking writes */
+      std::vector<MPI_Request> requests;
+      std::vector<MPI_Status>  statuses;
+      std::vector<size_t>      requestBytes;
+      std::vector<std::string> requestErrors;
+
+      void checkRequests()
+      {
+        const int n = requests.size();
+        for (int i = 0; i < n; i++)
+        {
+          MPI_Get_count(&statuses[i], MPI_BYTE, &checkCount);
+          if (static_cast<size_t>(checkCount) != requestBytes[i])
+            throw Exception(requestErrors[i]);
+        }
+        requests.clear();
+        statuses.clear();
+        requestBytes.clear();
+        requestErrors.clear();
+      }
+
     public:
       MPIFileIO(const MPI_Comm &_comm) : FileIO(), comm(_comm) {}
       virtual ~MPIFileIO() {}
@@ -109,6 +186,7 @@ namespace BonsaiIO
       void close() 
       {
         assert(isOpened());
+        wait();
         MPI_File_close(&fh);
         _opened = false;
       }
@@ -162,6 +240,175 @@ namespace BonsaiIO
           offset += count;
         }
       }
+
+      void iwrite(const size_t offset, const void *data, const size_t count, const size_t elementSize,
+          const bool collective, const std::string &errString)
+      {
+        assert(isWrite());
+        /* one element per datatype item keeps the count below 2^31 for large writes */
+        if (count > static_cast<size_t>(std::numeric_limits<int>::max()))
+          throw Exception(errString);
+        MPI_Datatype type;
+        MPI_Type_contiguous(elementSize, MPI_BYTE, &type);
+        MPI_Type_commit(&type);
+
+        MPI_Request request;
+        const int err = collective ?
+          MPI_File_iwrite_at_all(fh, offset, (void*)data, static_cast<int>(count), type, &request) :
+          MPI_File_iwrite_at    (fh, offset, (void*)data, static_cast<int>(count), type, &request);
+        /* the type is released once the pending write completes */
+        MPI_Type_free(&type);
+        if (err != MPI_SUCCESS)
+          throw Exception(errString);
+
+        requests.push_back(request);
+        statuses.push_back(MPI_Status());
+        requestBytes.push_back(count*elementSize);
+        requestErrors.push_back(errString);
+      }
+
+      /* collective, the file view selects the elements so only those are read */
+      void readStrided(const size_t offset, void *data, const size_t count, const size_t elementSize,
+          const size_t stride, const std::string &errString)
+      {
+        assert(isRead());
+        if (count > static_cast<size_t>(std::numeric_limits<int>::max()))
+          throw Exception(errString);
+
+        MPI_Datatype elementType, fileType;
+        MPI_Type_contiguous(elementSize, MPI_BYTE, &elementType);
+        MPI_Type_commit(&elementType);
+        MPI_Type_create_resized(elementType, 0, stride*elementSize, &fileType);
+        MPI_Type_commit(&fileType);
+
+        MPI_File_set_view(fh, offset, elementType, fileType, (char*)"native", MPI_INFO_NULL);
+        MPI_File_read_all(fh, data, static_cast<int>(count), elementType, &status);
+        MPI_Get_count(&status, elementType, &checkCount);
+        MPI_File_set_view(fh, 0, MPI_BYTE, MPI_BYTE, (char*)"native", MPI_INFO_NULL);
+
+        MPI_Type_free(&fileType);
+        MPI_Type_free(&elementType);
+        if (static_cast<size_t>(checkCount) != count)
+          throw Exception(errString);
+      }
+
+      bool test()
+      {
+        if (requests.empty())
+          return true;
+        int flag = 0;
+        MPI_Testall(requests.size(), &requests[0], &flag, &statuses[0]);
+        if (flag)
+          checkRequests();
+        return flag != 0;
+      }
+
+      void wait()
+      {
+        if (requests.empty())
+          return;
+        MPI_Waitall(requests.size(), &requests[0], &statuses[0]);
+        checkRequests();
+      }
+  };
+#endif /* BONSAIIO_NO_MPI */
+
+  /* Read-only POSIX mmap implementation, does not need MPI. The file is mapped
+   * copy-on-write, so only the pages that are accessed are read from disk. */
+  class MMapFileIO : public FileIO
+  {
+    private:
+      int fd;
+      char *base;
+      size_t fileSize;
+      size_t pos;
+
+    public:
+      MMapFileIO() : FileIO(), fd(-1), base(NULL), fileSize(0), pos(0) {}
+      virtual ~MMapFileIO() { if (isOpened()) close(); }
+
+      void open(const std::string &fileName, const IOTYPE _iotype)
+      {
+        assert(!isOpened());
+        if (_iotype != READ)
+          throw Exception("MMapFileIO only supports reading.");
+        iotype = _iotype;
+
+        fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd < 0)
+          throw Exception("Unable to open a file to read.");
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+          ::close(fd);
+          fd = -1;
+          throw Exception("Unable to stat a file to read.");
+        }
+        fileSize = st.st_size;
+
+        void *ptr = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED)
+        {
+          ::close(fd);
+          fd = -1;
+          throw Exception("Unable to mmap a file to read.");
+        }
+        base = reinterpret_cast<char*>(ptr);
+        /* fields are accessed by offset, no point in readahead of the whole file */
+        madvise(base, fileSize, MADV_RANDOM);
+        pos = 0;
+        _opened = true;
+      }
+      void close()
+      {
+        assert(isOpened());
+        munmap(base, fileSize);
+        ::close(fd);
+        base = NULL;
+        fd   = -1;
+        _opened = false;
+      }
+      void seek(const size_t offset)
+      {
+        pos = offset;
+      }
+
+      void read(void *data, const size_t count, const std::string &errString, const size_t batchMax)
+      {
+        assert(isRead());
+        memcpy(data, map(pos, count, errString), count);
+        pos += count;
+      }
+      void write(const void *data, const size_t count, const std::string &errString, const size_t batchMax)
+      {
+        throw Exception(errString);
+      }
+
+      void readStrided(const size_t offset, void *data, const size_t count, const size_t elementSize,
+          const size_t stride, const std::string &errString)
+      {
+        if (count == 0)
+          return;
+        const char *src = map(offset, ((count-1)*stride + 1)*elementSize, errString);
+        for (size_t i = 0; i < count; i++)
+          memcpy(reinterpret_cast<char*>(data) + i*elementSize, src + i*stride*elementSize, elementSize);
+      }
+
+      /* pointer to count bytes at offset, the range is prefetched with advice */
+      char* map(const size_t offset, const size_t count, const std::string &errString, const int advice = MADV_NORMAL)
+      {
+        assert(isOpened());
+        if (offset + count > fileSize)
+          throw Exception(errString);
+        if (count > 0 && advice != MADV_NORMAL)
+        {
+          const size_t pageSize = sysconf(_SC_PAGESIZE);
+          const size_t beg = offset & ~(pageSize - 1);
+          madvise(base + beg, offset + count - beg, advice);
+        }
+        return base + offset;
+      }
+      size_t size() const { return fileSize; }
   };
 
   /*#####################################*/
@@ -196,11 +443,13 @@ namespace BonsaiIO
   {
     private:
       T *data;
+      bool owner;
       void free()
       {
-        if (data != NULL)
+        if (data != NULL && owner)
           ::free(data);
         data = NULL;
+        owner = true;
         numElements = 0;
       }
       void malloc(const size_t _numElements)
@@ -210,13 +459,17 @@ namespace BonsaiIO
           data = (T*)::malloc(sizeof(T)*numElements);
       }
     public:
-      DataType(std::string name, const size_t n = 0) : DataTypeBase(name), data(NULL)
+      DataType(std::string name, const size_t n = 0) : DataTypeBase(name), data(NULL), owner(true)
       {
         if (n > 0)
           malloc(n);
       }
       ~DataType() { free(); }
       void   resize(const size_t n) {free(); malloc(n); }
+
+      /* point to n elements owned by someone else, e.g. a MMapReader mapping */
+      void   view(T *ptr, const size_t n) {free(); data = ptr; numElements = n; owner = false; }
+      bool   isView() const { return !owner; }
       size_t getElementSize() const {return sizeof(T);}
       size_t getNumElements() const {return numElements;}
       size_t getNumBytes   () const {return numElements*sizeof(T);}
@@ -232,11 +485,211 @@ namespace BonsaiIO
   /*#####################################*/
   /*#####################################*/
 
+  /*********** Field codecs (V3) *******/
+
+  /* Each rank encodes its own slice into an independent block, so blocks can be
+   * decoded in parallel by the ranks that read them.
+   * CODEC_DELTA: lossless, zigzag delta between consecutive elements per 64-bit
+   *              word, varint coded. For IDType in (PH ordered) file order.
+   * CODEC_QUANT: lossy, the first nQuant floats of an element are stored as
+   *              fixed point relative to the bounding box of the block, the
+   *              remainder of the element is stored raw.
+   *              codecParam = bits | (nQuant << 8), bits <= 32
+   */
+  class FieldCodec
+  {
+    private:
+      static void putVarint(std::vector<char> &out, uint64_t v)
+      {
+        while (v >= 0x80)
+        {
+          out.push_back(static_cast<char>((v & 0x7F) | 0x80));
+          v >>= 7;
+        }
+        out.push_back(static_cast<char>(v));
+      }
+      static uint64_t getVarint(const unsigned char *&p, const unsigned char *end)
+      {
+        uint64_t v = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7)
+        {
+          const uint64_t b = *p++;
+          v |= (b & 0x7F) << shift;
+          if (!(b & 0x80))
+            return v;
+        }
+        throw Exception("Corrupt varint in compressed field.");
+      }
+      template<typename T>
+        static void put(std::vector<char> &out, const T &v)
+        {
+          const char *p = reinterpret_cast<const char*>(&v);
+          out.insert(out.end(), p, p + sizeof(T));
+        }
+
+    public:
+      static int quantParam(const int bits, const int nQuant) { return bits | (nQuant << 8); }
+
+      static void encode(const CODEC codec, const int codecParam,
+          const void *data, const size_t n, const size_t elementSize, std::vector<char> &out)
+      {
+        out.clear();
+        const char *src = reinterpret_cast<const char*>(data);
+        switch (codec)
+        {
+          case CODEC_DELTA:
+            {
+              assert(elementSize % sizeof(uint64_t) == 0);
+              const size_t nWord = elementSize / sizeof(uint64_t);
+              out.reserve(n*elementSize/2);
+              std::vector<uint64_t> prev(nWord, 0), cur(nWord);
+              for (size_t i = 0; i < n; i++)
+              {
+                memcpy(&cur[0], src + i*elementSize, elementSize);
+                for (size_t k = 0; k < nWord; k++)
+                {
+                  const int64_t d = static_cast<int64_t>(cur[k] - prev[k]);
+                  putVarint(out, (static_cast<uint64_t>(d) << 1) ^ static_cast<uint64_t>(d >> 63));
+                  prev[k] = cur[k];
+                }
+              }
+            }
+            break;
+          case CODEC_QUANT:
+            {
+              const int bits   = codecParam & 0xFF;
+              const int nQuant = codecParam >> 8;
+              assert(bits > 0 && bits <= 32);
+              assert(nQuant > 0 && nQuant*sizeof(float) <= elementSize);
+              const size_t qBytes = bits <= 16 ? sizeof(uint16_t) : sizeof(uint32_t);
+              const size_t rest   = elementSize - nQuant*sizeof(float);
+              const double qMax   = static_cast<double>((1ULL << bits) - 1);
+
+              std::vector<float> lo(nQuant, +HUGE_VALF), hi(nQuant, -HUGE_VALF);
+              for (size_t i = 0; i < n; i++)
+              {
+                const float *x = reinterpret_cast<const float*>(src + i*elementSize);
+                for (int k = 0; k < nQuant; k++)
+                {
+                  lo[k] = std::min(lo[k], x[k]);
+                  hi[k] = std::max(hi[k], x[k]);
+                }
+              }
+              for (int k = 0; k < nQuant; k++)
+              {
+                put(out, lo[k]);
+                put(out, hi[k]);
+              }
+
+              out.reserve(out.size() + n*(nQuant*qBytes + rest));
+              for (size_t i = 0; i < n; i++)
+              {
+                const float *x = reinterpret_cast<const float*>(src + i*elementSize);
+                for (int k = 0; k < nQuant; k++)
+                {
+                  const double range = static_cast<double>(hi[k]) - lo[k];
+                  const uint32_t q = range > 0 ?
+                    static_cast<uint32_t>(std::min(qMax, std::floor((x[k] - lo[k])/range*qMax + 0.5))) : 0;
+                  if (qBytes == sizeof(uint16_t))
+                    put(out, static_cast<uint16_t>(q));
+                  else
+                    put(out, q);
+                }
+                out.insert(out.end(), src + i*elementSize + nQuant*sizeof(float), src + (i+1)*elementSize);
+              }
+            }
+            break;
+          default:
+            throw Exception("Unknown codec.");
+        }
+      }
+
+      static void decode(const CODEC codec, const int codecParam,
+          const void *in, const size_t nBytes, void *data, const size_t n, const size_t elementSize)
+      {
+        const unsigned char *p   = reinterpret_cast<const unsigned char*>(in);
+        const unsigned char *end = p + nBytes;
+        char *dst = reinterpret_cast<char*>(data);
+        switch (codec)
+        {
+          case CODEC_DELTA:
+            {
+              const size_t nWord = elementSize / sizeof(uint64_t);
+              std::vector<uint64_t> cur(nWord, 0);
+              for (size_t i = 0; i < n; i++)
+              {
+                for (size_t k = 0; k < nWord; k++)
+                {
+                  const uint64_t z = getVarint(p, end);
+                  cur[k] += (z >> 1) ^ (~(z & 1) + 1);
+                }
+                memcpy(dst + i*elementSize, &cur[0], elementSize);
+              }
+            }
+            break;
+          case CODEC_QUANT:
+            {
+              const int bits   = codecParam & 0xFF;
+              const int nQuant = codecParam >> 8;
+              const size_t qBytes = bits <= 16 ? sizeof(uint16_t) : sizeof(uint32_t);
+              const size_t rest   = elementSize - nQuant*sizeof(float);
+              const double qMax   = static_cast<double>((1ULL << bits) - 1);
+              if (nBytes != 2*nQuant*sizeof(float) + n*(nQuant*qBytes + rest))
+                throw Exception("Corrupt quantized field.");
+
+              std::vector<float> lo(nQuant), hi(nQuant);
+              for (int k = 0; k < nQuant; k++)
+              {
+                memcpy(&lo[k], p, sizeof(float)); p += sizeof(float);
+                memcpy(&hi[k], p, sizeof(float)); p += sizeof(float);
+              }
+              for (size_t i = 0; i < n; i++)
+              {
+                float *x = reinterpret_cast<float*>(dst + i*elementSize);
+                for (int k = 0; k < nQuant; k++)
+                {
+                  uint32_t q;
+                  if (qBytes == sizeof(uint16_t))
+                  {
+                    uint16_t q16;
+                    memcpy(&q16, p, sizeof(uint16_t));
+                    q = q16;
+                  }
+                  else
+                    memcpy(&q, p, sizeof(uint32_t));
+                  p += qBytes;
+                  x[k] = static_cast<float>(lo[k] + q*((static_cast<double>(hi[k]) - lo[k])/qMax));
+                }
+                memcpy(dst + i*elementSize + nQuant*sizeof(float), p, rest);
+                p += rest;
+              }
+            }
+            break;
+          default:
+            throw Exception("Unknown codec.");
+        }
+      }
+  };
+
+  /*#####################################*/
+  /*#####################################*/
+  /*#####################################*/
+
   /*********** Header ******************/
 
   class Header
   {
     private:
+      /* V1 and V2 layout */
+      struct DataInfoV2
+      {
+        enum {NAMEMAX = 255};
+        char name[NAMEMAX+1];
+        size_t elementSize;
+        long_t offset;
+        int nRank;
+      };
+      /* V3 adds the codec of the field */
       struct DataInfo
       {
         enum {NAMEMAX = 255};
@@ -244,6 +697,8 @@ namespace BonsaiIO
         size_t elementSize;
         long_t offset;
         int nRank;
+        int codec;
+        int codecParam;
       };
 
       std::vector<DataInfo> data;
@@ -264,6 +719,8 @@ namespace BonsaiIO
           fprintf(stderr, "elementSize= %d\n", (int)data[i].elementSize);
           fprintf(stderr, "nRank=       %d\n", (int)data[i].nRank);
           fprintf(stderr, "offset=      %lld\n", data[i].offset);
+          if (data[i].codec != CODEC_NONE)
+            fprintf(stderr, "codec=       %d [%d]\n", data[i].codec, data[i].codecParam);
         }
         fprintf(stderr, "------------------------------------\n");
       }
@@ -299,8 +756,19 @@ namespace BonsaiIO
         assert(idx >= 0);
         return data[idx].offset;
       }
+      CODEC getCodec(const int idx) const
+      {
+        assert(idx >= 0);
+        return static_cast<CODEC>(data[idx].codec);
+      }
+      int getCodecParam(const int idx) const
+      {
+        assert(idx >= 0);
+        return data[idx].codecParam;
+      }
 
-      bool add(const DataTypeBase &dataVec, const long_t offset, const int nRank)
+      bool add(const DataTypeBase &dataVec, const long_t offset, const int nRank,
+          const CODEC codec = CODEC_NONE, const int codecParam = 0)
       {
         assert(dataVec.getName().size() <= DataInfo::NAMEMAX);
         if (find(dataVec.getName()) == -1)
@@ -310,6 +778,8 @@ namespace BonsaiIO
           d.offset      = offset;
           d.elementSize = dataVec.getElementSize();
           d.nRank       = nRank;
+          d.codec       = codec;
+          d.codecParam  = codecParam;
           data.push_back(d);
           return true;
         }
@@ -319,11 +789,31 @@ namespace BonsaiIO
       void write(FileIO &fh)
       {
         assert(fh.isWrite());
+        /* files without compressed fields stay readable by V2 readers */
+        bool useCodec = false;
+        for (const auto &d : data)
+          useCodec |= d.codec != CODEC_NONE;
+
         char versionString[16] = "V2";
+        if (useCodec)
+          sprintf(versionString, "V3");
         fh.write(versionString, 16*sizeof(char), "Error writing versionString.");
         int nData = data.size();
         fh.write(&nData, sizeof(int), "Error writing nData.");
-        fh.write(&data[0], sizeof(DataInfo)*nData, "Error writing dataInfo.");
+        if (useCodec)
+          fh.write(&data[0], sizeof(DataInfo)*nData, "Error writing dataInfo.");
+        else
+        {
+          std::vector<DataInfoV2> dataV2(nData);
+          for (int i = 0; i < nData; i++)
+          {
+            memcpy(dataV2[i].name, data[i].name, sizeof(dataV2[i].name));
+            dataV2[i].elementSize = data[i].elementSize;
+            dataV2[i].offset      = data[i].offset;
+            dataV2[i].nRank       = data[i].nRank;
+          }
+          fh.write(&dataV2[0], sizeof(DataInfoV2)*nData, "Error writing dataInfo.");
+        }
         fh.write(&time, sizeof(double), "Error writing time.");
       }
 
@@ -334,12 +824,28 @@ namespace BonsaiIO
         fh.read(versionString, 16*sizeof(char), "Error reading versionString.");
         assert(
             std::string(versionString) == "V1" ||
-            std::string(versionString) == "V2" );
+            std::string(versionString) == "V2" ||
+            std::string(versionString) == "V3" );
         int nData;
         fh.read(&nData, sizeof(int), "Error reading nData.");
 
         data.resize(nData);
-        fh.read(&data[0], sizeof(DataInfo)*nData, "Error reading dataInfo.");
+        if (std::string(versionString) == "V3")
+          fh.read(&data[0], sizeof(DataInfo)*nData, "Error reading dataInfo.");
+        else
+        {
+          std::vector<DataInfoV2> dataV2(nData);
+          fh.read(&dataV2[0], sizeof(DataInfoV2)*nData, "Error reading dataInfo.");
+          for (int i = 0; i < nData; i++)
+          {
+            memcpy(data[i].name, dataV2[i].name, sizeof(data[i].name));
+            data[i].elementSize = dataV2[i].elementSize;
+            data[i].offset      = dataV2[i].offset;
+            data[i].nRank       = dataV2[i].nRank;
+            data[i].codec       = CODEC_NONE;
+            data[i].codecParam  = 0;
+          }
+        }
 
         if (std::string(versionString) == "V1")
           fh.read(&time, sizeof(float), "Error reading time.");
@@ -356,6 +862,7 @@ namespace BonsaiIO
 
   /*********** Core reader/writer *************/
 
+#ifndef BONSAIIO_NO_MPI
   class Core
   {
     private:
@@ -373,6 +880,121 @@ namespace BonsaiIO
       Header header;
       bool isMaster() const { return myRank == 0; }
 
+      /* numElementsPerRank and encoded blocks written by iwrite, kept alive until the writes complete */
+      std::vector<std::vector<long_t>> pendingCounts;
+      std::vector<std::vector<char>>   pendingBlocks;
+
+      /* compressed layout: numElementsPerRank, numBytesPerRank, one encoded block per rank */
+      bool writeEncoded(const DataTypeBase &data, const CODEC codec, const int codecParam, const bool async)
+      {
+        const double tWrite = MPI_Wtime();
+        assert(fh.isWrite());
+
+        std::vector<char> blockLoc;
+        std::vector<long_t> countsLoc;
+        if (async)
+        {
+          pendingBlocks.push_back(std::vector<char>());
+          pendingCounts.push_back(std::vector<long_t>());
+        }
+        std::vector<char>   &block  = async ? pendingBlocks.back() : blockLoc;
+        std::vector<long_t> &counts = async ? pendingCounts.back() : countsLoc;
+
+        FieldCodec::encode(codec, codecParam, data.getDataPtr(), data.getNumElements(), data.getElementSize(), block);
+
+        /* gather #elements and #bytes to all ranks */
+        long_t loc[2] = {static_cast<long_t>(data.getNumElements()), static_cast<long_t>(block.size())};
+        std::vector<long_t> glb(2*nRank);
+        MPI_Allgather(loc, 2, MPI_LONGT, &glb[0], 2, MPI_LONGT, comm);
+
+        counts.resize(2*nRank);
+        long_t blockOffset = 0, numBytesGlb = 0;
+        for (int i = 0; i < nRank; i++)
+        {
+          counts[      i] = glb[2*i  ];
+          counts[nRank+i] = glb[2*i+1];
+          if (i < myRank)
+            blockOffset += glb[2*i+1];
+          numBytesGlb += glb[2*i+1];
+        }
+
+        if (isMaster())
+        {
+          /* add data description to the header */ 
+          if (!header.add(data, dataOffsetGlb, nRank, codec, codecParam))
+            throw Exception("Data type is already added.");
+
+          if (async)
+            fh.iwrite(dataOffsetGlb, &counts[0], 2*nRank, sizeof(long_t), false,
+                "Error while writing numElementsPerRank.");
+          else
+          {
+            fh.seek(dataOffsetGlb);
+            fh.write(&counts[0], sizeof(long_t)*2*nRank, "Error while writing numElementsPerRank.");
+          }
+        }
+        dataOffsetGlb += sizeof(long_t)*2*nRank;
+
+        if (async)
+          fh.iwrite(dataOffsetGlb + blockOffset, block.empty() ? NULL : &block[0], block.size(), 1, true,
+              "Error while writing encoded data.");
+        else if (!block.empty())
+        {
+          fh.seek(dataOffsetGlb + blockOffset);
+          fh.write(&block[0], block.size(), "Error while writing encoded data.");
+        }
+
+        dataOffsetGlb += numBytesGlb;
+
+        numBytes += sizeof(long_t)*2*nRank + numBytesGlb;
+        dtIO += MPI_Wtime() - tWrite;
+        return true;
+      }
+
+      /* decodes the blocks that overlap with elements [elBeg,elEnd) of the field */
+      void readEncoded(DataTypeBase &data, const int idx, long_t offset,
+          const std::vector<long_t> &numElementsPerRank,
+          const long_t elBeg, const long_t elEnd, const int reduceFactor)
+      {
+        const CODEC codec    = header.getCodec(idx);
+        const int codecParam = header.getCodecParam(idx);
+        const int nRankFile  = numElementsPerRank.size();
+        const size_t size    = data.getElementSize();
+
+        std::vector<long_t> numBytesPerRank(nRankFile);
+        fh.seek(offset);
+        fh.read(&numBytesPerRank[0], sizeof(long_t)*nRankFile, "Error while reading numBytesPerRank.");
+        offset   += nRankFile*sizeof(long_t);
+        numBytes += nRankFile*sizeof(long_t);
+
+        const long_t stride = std::max(reduceFactor, 1);
+        data.resize((elEnd - elBeg + stride - 1) / stride);
+        char *dst = reinterpret_cast<char*>(data.getDataPtr());
+
+        std::vector<char> block, decoded;
+        long_t blockBeg = 0;
+        for (int i = 0; i < nRankFile; i++)
+        {
+          const long_t blockEnd = blockBeg + numElementsPerRank[i];
+          const long_t b = std::max(blockBeg, elBeg);
+          const long_t e = std::min(blockEnd, elEnd);
+          if (b < e)
+          {
+            block.resize(numBytesPerRank[i]);
+            fh.seek(offset);
+            fh.read(&block[0], numBytesPerRank[i], "Error while reading encoded data.");
+            decoded.resize(numElementsPerRank[i]*size);
+            FieldCodec::decode(codec, codecParam, &block[0], block.size(), &decoded[0], numElementsPerRank[i], size);
+            for (long_t j = b; j < e; j++)
+              if ((j - elBeg) % stride == 0)
+                memcpy(dst + ((j - elBeg)/stride)*size, &decoded[(j - blockBeg)*size], size);
+            numBytes += numBytesPerRank[i];
+          }
+          offset  += numBytesPerRank[i];
+          blockBeg = blockEnd;
+        }
+      }
+
 
     public:
       Header const & getHeader() { return header; }
@@ -466,11 +1088,18 @@ namespace BonsaiIO
           assert(sumGlb == numElementsGlb);
         }
 
+        if (header.getCodec(idx) != CODEC_NONE)
+        {
+          readEncoded(data, idx, offset, numElementsPerRank, beg[myRank], end[myRank], reduceFactor);
+          dtIO += MPI_Wtime() - tRead;
+          return true;
+        }
+
         offset += beg[myRank]*data.getElementSize();;
-        fh.seek(offset);
 
         if (reduceFactor <= 1)
         {
+          fh.seek(offset);
           data.resize(numElementsLoc);
           const long_t nBytes = (end[myRank] - beg[myRank]) * data.getElementSize();
           if (nBytes > 0)
@@ -479,43 +1108,23 @@ namespace BonsaiIO
         }
         else
         {
-          long_t numElements = 0;
-          for (long_t i = 0; i < numElementsLoc; i++)
-            if (i%reduceFactor==0)
-              numElements++;
+          /* every reduceFactor-th element of the local slice */
+          const long_t numElements = (numElementsLoc + reduceFactor - 1) / reduceFactor;
           data.resize(numElements);
-
-          const long_t size = data.getElementSize();
-
-          const long_t nBatch = numElements*size;
-          std::vector<char> tmp(nBatch);
-
-          long_t nRead = numElementsLoc*size;
-          long_t el = 0;
-          long_t previous = 0;
-          while (nRead > 0)
-          {
-            const long_t count = std::min(nRead, nBatch);
-            fh.read(&tmp[0], count, "Error while reading reduced data.");
-            for (long_t i = 0; i < count; i += size)
-              if ((previous + i)%(reduceFactor*size) == 0)
-              {
-                memcpy(reinterpret_cast<char*>(data.getDataPtr()) + el*size, &tmp[i], size);
-                el++;
-              }
-            previous += count;
-            nRead    -= count;
-            assert(el <= numElements);
-          }
-          numBytes+= numElementsGlb*data.getElementSize();
+          fh.readStrided(offset, data.getDataPtr(), numElements, data.getElementSize(), reduceFactor,
+              "Error while reading reduced data.");
+          numBytes+= numElementsGlb*data.getElementSize() / reduceFactor;
         }
 
         dtIO += MPI_Wtime() - tRead;
         return true;
       }
 
-      bool write(const DataTypeBase &data)
+      bool write(const DataTypeBase &data, const CODEC codec = CODEC_NONE, const int codecParam = 0)
       {
+        if (codec != CODEC_NONE)
+          return writeEncoded(data, codec, codecParam, false);
+
         const double tWrite = MPI_Wtime();
 
         /* make sure we are in the writing phase */
@@ -566,9 +1175,92 @@ namespace BonsaiIO
         return true;
       }
 
+      /* Same layout as write(), but the data is written with non-blocking collective
+       * MPI-IO. The caller must keep data alive until test() returns true, or until
+       * wait() or close() returns.
+       */
+      bool iwrite(const DataTypeBase &data, const CODEC codec = CODEC_NONE, const int codecParam = 0)
+      {
+        if (codec != CODEC_NONE)
+          return writeEncoded(data, codec, codecParam, true);
+
+        const double tWrite = MPI_Wtime();
+
+        /* make sure we are in the writing phase */
+        assert(fh.isWrite());
+
+        long_t numElementsLoc = data.getNumElements();
+
+        /* gather numELementsLoc to all ranks */
+        pendingCounts.push_back(std::vector<long_t>(nRank));
+        std::vector<long_t> &numElementsPerRank = pendingCounts.back();
+        MPI_Allgather(
+            &numElementsLoc,        1, MPI_LONGT,
+            &numElementsPerRank[0], 1, MPI_LONGT,
+            comm);
+
+        std::vector<long_t> beg(nRank+1, 0), end(nRank+1, 0);
+        for (int i = 0; i < nRank; i++)
+        {
+          end[i  ] = beg[i] + numElementsPerRank[i];
+          beg[i+1] = end[i];
+        }
+
+        const size_t numElementsGlb = end[nRank-1];
+
+        if (isMaster())
+        {
+          /* add data description to the header */ 
+          if (!header.add(data, dataOffsetGlb, nRank))
+            throw Exception("Data type is already added.");
+
+          fh.iwrite(dataOffsetGlb, &numElementsPerRank[0], nRank, sizeof(long_t), false,
+              "Error while writing numElementsPerRank.");
+        }
+        numBytes += nRank*sizeof(long_t);
+
+        dataOffsetGlb += sizeof(long_t)*nRank;
+
+        /* every rank takes part in the collective write, also with zero elements */
+        fh.iwrite(dataOffsetGlb + beg[myRank]*data.getElementSize(),
+            data.getDataPtr(), numElementsLoc, data.getElementSize(), true,
+            "Error while writing data.");
+
+        dataOffsetGlb += numElementsGlb*data.getElementSize();
+
+        numBytes += numElementsGlb*data.getElementSize();
+        dtIO += MPI_Wtime() - tWrite;
+        return true;
+      }
+
+      /* progress the pending iwrites, true once all of them completed */
+      bool test()
+      {
+        const double tTest = MPI_Wtime();
+        const bool done = fh.test();
+        if (done)
+        {
+          pendingCounts.clear();
+          pendingBlocks.clear();
+        }
+        dtIO += MPI_Wtime() - tTest;
+        return done;
+      }
+
+      void wait()
+      {
+        const double tWait = MPI_Wtime();
+        fh.wait();
+        pendingCounts.clear();
+        pendingBlocks.clear();
+        dtIO += MPI_Wtime() - tWait;
+      }
+
 
       void close()
       {
+        if (fh.isWrite())
+          wait();
         if (isMaster() && fh.isWrite())
         {
           fh.seek(0);
@@ -582,5 +1274,140 @@ namespace BonsaiIO
 
       double computeBandwidth() const { return numBytes/dtIO; }
   };
+#endif /* BONSAIIO_NO_MPI */
+
+  /*********** Zero-copy reader *************/
+
+  /* Serial reader on top of MMapFileIO. view() points a DataType straight into
+   * the mapping, so only the pages of the requested fields are touched. The views
+   * stay valid as long as the reader is alive.
+   */
+  class MMapReader
+  {
+    private:
+      MMapFileIO fh;
+      Header header;
+
+    public:
+      MMapReader(const std::string &fileName)
+      {
+        FileIO &io = fh;
+        io.open(fileName, READ);
+        long_t headerOffset;
+        io.read(&headerOffset, sizeof(long_t), "Unable to read header offset.");
+        io.seek(headerOffset);
+        header.read(io);
+      }
+
+      Header const & getHeader() const { return header; }
+      double getTime() const { return header.getTime(); }
+
+      /* number of elements of a field written by each rank, empty if not found */
+      std::vector<long_t> getNumElementsPerRank(const std::string &name)
+      {
+        const int idx = header.find(name);
+        if (idx == -1)
+          return std::vector<long_t>();
+        const int nRankFile = header.getNRank(idx);
+        std::vector<long_t> numElementsPerRank(nRankFile);
+        memcpy(&numElementsPerRank[0],
+            fh.map(header.getDataOffset(idx), sizeof(long_t)*nRankFile, "Error while reading numElementsPerRank."),
+            sizeof(long_t)*nRankFile);
+        return numElementsPerRank;
+      }
+
+      /* view of the whole field, or of the slice written by rank if rank >= 0 */
+      /* encoded (V3) fields can not be viewed, use read() */
+      template<typename T>
+        bool view(DataType<T> &data, const int rank = -1)
+        {
+          const int idx = header.find(data.getName());
+          if (idx == -1)
+            return false;
+          if (header.getElementSize(idx) != data.getElementSize())
+            return false;
+          if (header.getCodec(idx) != CODEC_NONE)
+            return false;
+
+          const std::vector<long_t> numElementsPerRank = getNumElementsPerRank(data.getName());
+          const int nRankFile = numElementsPerRank.size();
+          assert(rank < nRankFile);
+
+          long_t beg = 0, end = 0;
+          for (int i = 0; i < nRankFile; i++)
+          {
+            if (i == rank)
+              beg = end;
+            end += numElementsPerRank[i];
+            if (i == rank)
+              break;
+          }
+
+          const long_t offset = header.getDataOffset(idx) + nRankFile*sizeof(long_t) + beg*sizeof(T);
+          const size_t nBytes = (end - beg)*sizeof(T);
+          data.view(reinterpret_cast<T*>(fh.map(offset, nBytes, "Error while mapping data.", MADV_WILLNEED)), end - beg);
+          return true;
+        }
+
+      /* copy of a field through the generic interface */
+      bool read(DataTypeBase &data)
+      {
+        const int idx = header.find(data.getName());
+        if (idx == -1)
+          return false;
+        if (header.getElementSize(idx) != data.getElementSize())
+          return false;
+
+        const std::vector<long_t> numElementsPerRank = getNumElementsPerRank(data.getName());
+        const int nRankFile = numElementsPerRank.size();
+        long_t numElementsGlb = 0;
+        for (int i = 0; i < nRankFile; i++)
+          numElementsGlb += numElementsPerRank[i];
+
+        const long_t offset = header.getDataOffset(idx) + nRankFile*sizeof(long_t);
+        const size_t size   = data.getElementSize();
+        data.resize(numElementsGlb);
+
+        const CODEC codec = header.getCodec(idx);
+        if (codec != CODEC_NONE)
+        {
+          /* numBytesPerRank follows numElementsPerRank, the blocks are independent */
+          std::vector<long_t> numBytesPerRank(nRankFile), blockOffset(nRankFile+1, 0), elOffset(nRankFile+1, 0);
+          memcpy(&numBytesPerRank[0],
+              fh.map(offset, sizeof(long_t)*nRankFile, "Error while reading numBytesPerRank."),
+              sizeof(long_t)*nRankFile);
+          for (int i = 0; i < nRankFile; i++)
+          {
+            blockOffset[i+1] = blockOffset[i] + numBytesPerRank[i];
+            elOffset   [i+1] = elOffset   [i] + numElementsPerRank[i];
+          }
+          const long_t blockBase = offset + nRankFile*sizeof(long_t);
+          char *dst = reinterpret_cast<char*>(data.getDataPtr());
+          bool failed = false;
+#pragma omp parallel for schedule(dynamic) reduction(||:failed)
+          for (int i = 0; i < nRankFile; i++)
+          {
+            try
+            {
+              FieldCodec::decode(codec, header.getCodecParam(idx),
+                  fh.map(blockBase + blockOffset[i], numBytesPerRank[i], "Error while reading encoded data.", MADV_SEQUENTIAL),
+                  numBytesPerRank[i], dst + elOffset[i]*size, numElementsPerRank[i], size);
+            }
+            catch (const Exception &)
+            {
+              failed = true;
+            }
+          }
+          if (failed)
+            throw Exception("Error while decoding " + data.getName() + ".");
+          return true;
+        }
+
+        const size_t nBytes = numElementsGlb*size;
+        if (nBytes > 0)
+          memcpy(data.getDataPtr(), fh.map(offset, nBytes, "Error while reading data.", MADV_SEQUENTIAL), nBytes);
+        return true;
+      }
+  };
 
 }
@@ -0,0 +1,131 @@
+#ifndef _DD_NODE_LEVEL_H_
+#define _DD_NODE_LEVEL_H_
+
+//Node level of a two-level domain decomposition. The first DD2D level splits
+//the PH curve over the shared-memory nodes, the second over the processes of a
+//node. Between global updates the processes of a node can move their inner
+//boundaries among themselves, the outer boundaries of the node stay the same.
+//This requires the same number of processes on every node and consecutive
+//ranks within a node, otherwise isHierarchical() returns false.
+
+#include <mpi.h>
+#include <vector>
+#include <algorithm>
+#include "dd2d.h"
+
+class DDNodeLevel
+{
+private:
+  MPI_Comm nodeComm;
+  int      nodeRank, nodeSize, nodeId, nNodes;
+  bool     hierarchical;
+
+public:
+  DDNodeLevel() : nodeComm(MPI_COMM_NULL), nodeRank(0), nodeSize(1), nodeId(0), nNodes(1),
+                  hierarchical(false) {}
+
+  ~DDNodeLevel()
+  {
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if(!finalized && nodeComm != MPI_COMM_NULL) MPI_Comm_free(&nodeComm);
+  }
+
+  bool     isInitialized()   const { return nodeComm != MPI_COMM_NULL; }
+  bool     isHierarchical()  const { return hierarchical; }
+  int      getNodeCount()    const { return nNodes;   }
+  int      getNodeId()       const { return nodeId;   }
+  int      getRanksPerNode() const { return nodeSize; }
+  MPI_Comm getNodeComm()     const { return nodeComm; }
+
+  //Collective over comm
+  void init(MPI_Comm comm)
+  {
+    int procId, nProcs;
+    MPI_Comm_rank(comm, &procId);
+    MPI_Comm_size(comm, &nProcs);
+
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, procId, MPI_INFO_NULL, &nodeComm);
+    MPI_Comm_rank(nodeComm, &nodeRank);
+    MPI_Comm_size(nodeComm, &nodeSize);
+
+    //Check that node k holds ranks [k*nodeSize, (k+1)*nodeSize)
+    int firstRank = procId;
+    MPI_Bcast(&firstRank, 1, MPI_INT, 0, nodeComm);
+    int layout[2] = {firstRank % nodeSize == 0 && procId == firstRank + nodeRank, nodeSize};
+    int minLayout[2], maxLayout[2];
+    MPI_Allreduce(layout, minLayout, 2, MPI_INT, MPI_MIN, comm);
+    MPI_Allreduce(layout, maxLayout, 2, MPI_INT, MPI_MAX, comm);
+
+    hierarchical = minLayout[0] == 1 && minLayout[1] == maxLayout[1] && nodeSize > 1 && nodeSize < nProcs;
+    nNodes       = hierarchical ? nProcs / nodeSize : 1;
+    nodeId       = hierarchical ? firstRank / nodeSize : 0;
+  }
+
+  //Imbalance, in percent of the average, of the load summed per node (between
+  //nodes) and of the load of the processes within a node (the worst node and
+  //our own node). Collective over comm
+  void levelImbalance(MPI_Comm comm, const double load,
+                      double &nodeImbalance, double &rankImbalance, double &ownRankImbalance)
+  {
+    double nodeLoad = 0, nodeMax = 0;
+    MPI_Allreduce(&load, &nodeLoad, 1, MPI_DOUBLE, MPI_SUM, nodeComm);
+    MPI_Allreduce(&load, &nodeMax,  1, MPI_DOUBLE, MPI_MAX, nodeComm);
+
+    const double nodeAvg = nodeLoad / nodeSize;
+    ownRankImbalance     = nodeAvg > 0 ? 100*(nodeMax - nodeAvg) / nodeAvg : 0;
+
+    double localMax[2] = {nodeLoad, ownRankImbalance}, globalMax[2];
+    double globalSum   = 0;
+    MPI_Allreduce(localMax, globalMax, 2, MPI_DOUBLE, MPI_MAX, comm);
+    MPI_Allreduce(&load,   &globalSum, 1, MPI_DOUBLE, MPI_SUM, comm);
+
+    const double avgNodeLoad = globalSum / nNodes;
+    nodeImbalance = avgNodeLoad > 0 ? 100*(globalMax[0] - avgNodeLoad) / avgNodeLoad : 0;
+    rankImbalance = globalMax[1];
+  }
+
+  //Collective over the node. Gathers the samples of the node, that lie within
+  //[beg, end), and chops them into nodeSize parts. Returns false, and leaves
+  //boundaries untouched, if there are not enough distinct samples
+  bool chopNodeBoundaries(const std::vector<DD2D::Key> &samples, const DD2D::Key &beg,
+                          const DD2D::Key &end, std::vector<DD2D::Key> &boundaries)
+  {
+    std::vector<unsigned long long> local;
+    for(size_t i=0; i < samples.size(); i++)
+      if(samples[i] >= beg && samples[i] < end) local.push_back(samples[i].key);
+
+    int nLocal = local.size();
+    std::vector<int> counts(nodeSize), displs(nodeSize+1, 0);
+    MPI_Gather(&nLocal, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, nodeComm);
+    for(int i=0; i < nodeSize; i++) displs[i+1] = displs[i] + counts[i];
+
+    std::vector<unsigned long long> all(std::max(1, displs[nodeSize]));
+    MPI_Gatherv(nLocal ? &local[0] : NULL, nLocal, MPI_UNSIGNED_LONG_LONG,
+                &all[0], &counts[0], &displs[0], MPI_UNSIGNED_LONG_LONG, 0, nodeComm);
+
+    std::vector<unsigned long long> chopped(nodeSize+1, 0);
+    if(nodeRank == 0)
+    {
+      const int nAll = displs[nodeSize];
+      std::sort(all.begin(), all.begin() + nAll);
+
+      bool ok    = nAll >= nodeSize;
+      chopped[0] = beg.key;
+      for(int i=1; i < nodeSize && ok; i++)
+      {
+        chopped[i] = all[(size_t)i*nAll/nodeSize];
+        ok = chopped[i] > chopped[i-1];
+      }
+      chopped[nodeSize] = ok;
+    }
+    MPI_Bcast(&chopped[0], nodeSize+1, MPI_UNSIGNED_LONG_LONG, 0, nodeComm);
+
+    if(!chopped[nodeSize]) return false;
+    boundaries.resize(nodeSize);
+    for(int i=0; i < nodeSize; i++) boundaries[i] = DD2D::Key(chopped[i]);
+    return true;
+  }
+};
+
+#endif // _DD_NODE_LEVEL_H_
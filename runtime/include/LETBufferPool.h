@@ -0,0 +1,164 @@
+#ifndef _LET_BUFFER_POOL_H_
+#define _LET_BUFFER_POOL_H_
+
+//Size-classed pool for the LET buffers that are exported and received every
+//iteration. Buffers are page aligned and rounded up to a size class (steps of
+//1 and 1.5 times a power of two) so that they can be registered with
+//cudaHostRegister, and are recycled across iterations instead of being
+//allocated and first-touched again.
+//The pool is shared by the LET threads, all bookkeeping is done in a critical
+//section.
+
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <algorithm>
+#include <sys/time.h>
+
+class LETBufferPool
+{
+private:
+  enum {PAGESIZE = 4096, NCLASSES = 64};
+
+  std::vector<void*>    freeList[NCLASSES];
+  std::map<void*, int>  inUse;              //Outstanding buffer -> size class
+
+  int    nInUseClass  [NCLASSES];
+  int    nPeakIterClass[NCLASSES];          //Maximum buffers in use this iteration
+
+  //Statistics, per iteration and totals
+  int    nAcquire, nNew, nTrimmed;
+  double tAlloc;
+  size_t bytesReserved, bytesInUse, bytesPeakInUse;
+  long long nAcquireTotal, nNewTotal;
+
+  static double wallTime()
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1.e-6*tv.tv_usec;
+  }
+
+  static size_t classBytes(const int c)
+  {
+    const size_t base = (size_t)PAGESIZE << (c/2);
+    return (c & 1) ? base + base/2 : base;
+  }
+
+  static int sizeClass(const size_t bytes)
+  {
+    int c = 0;
+    while(classBytes(c) < bytes) c++;
+    assert(c < NCLASSES);
+    return c;
+  }
+
+public:
+  LETBufferPool() : nAcquire(0), nNew(0), nTrimmed(0), tAlloc(0),
+                    bytesReserved(0), bytesInUse(0), bytesPeakInUse(0),
+                    nAcquireTotal(0), nNewTotal(0)
+  {
+    for(int c=0; c < NCLASSES; c++)
+    {
+      nInUseClass[c]    = 0;
+      nPeakIterClass[c] = 0;
+    }
+  }
+
+  ~LETBufferPool()
+  {
+    for(int c=0; c < NCLASSES; c++)
+      for(size_t i=0; i < freeList[c].size(); i++)
+        free(freeList[c][i]);
+    for(std::map<void*, int>::iterator it = inUse.begin(); it != inUse.end(); it++)
+      free(it->first);
+  }
+
+  //Returns a buffer of at least n elements of type T
+  template<typename T>
+  T *acquire(const size_t n)
+  {
+    const int c = sizeClass(n*sizeof(T));
+    void *ptr   = NULL;
+
+    #pragma omp critical(letBufferPool)
+    {
+      if(!freeList[c].empty())
+      {
+        ptr = freeList[c].back();
+        freeList[c].pop_back();
+      }
+      else
+      {
+        const double t0 = wallTime();
+        if(posix_memalign(&ptr, PAGESIZE, classBytes(c)) != 0)
+        {
+          fprintf(stderr, "LETBufferPool: failed to allocate %zu bytes\n", classBytes(c));
+          ::exit(-1);
+        }
+        tAlloc        += wallTime() - t0;
+        bytesReserved += classBytes(c);
+        nNew++;
+        nNewTotal++;
+      }
+      inUse[ptr]      = c;
+      nInUseClass[c]++;
+      nPeakIterClass[c] = std::max(nPeakIterClass[c], nInUseClass[c]);
+      bytesInUse     += classBytes(c);
+      bytesPeakInUse  = std::max(bytesPeakInUse, bytesInUse);
+      nAcquire++;
+      nAcquireTotal++;
+    }
+    return reinterpret_cast<T*>(ptr);
+  }
+
+  void release(void *ptr)
+  {
+    if(ptr == NULL) return;
+    #pragma omp critical(letBufferPool)
+    {
+      std::map<void*, int>::iterator it = inUse.find(ptr);
+      assert(it != inUse.end());
+      const int c = it->second;
+      inUse.erase(it);
+      nInUseClass[c]--;
+      bytesInUse -= classBytes(c);
+      freeList[c].push_back(ptr);
+    }
+  }
+
+  //Called once all buffers of an iteration are released. Frees the buffers that
+  //were not needed during this iteration, writes the statistics into buff and
+  //resets the per iteration counters.
+  void endIteration(char *buff, const int procId, const int iter)
+  {
+    #pragma omp critical(letBufferPool)
+    {
+      for(int c=0; c < NCLASSES; c++)
+      {
+        while((int)freeList[c].size() + nInUseClass[c] > nPeakIterClass[c] && !freeList[c].empty())
+        {
+          free(freeList[c].back());
+          freeList[c].pop_back();
+          bytesReserved -= classBytes(c);
+          nTrimmed++;
+        }
+        nPeakIterClass[c] = nInUseClass[c];
+      }
+
+      sprintf(buff, "LETPOOL-%d: iter: %d acquire: %d new: %d reused: %d trimmed: %d tAlloc: %lg "
+                    "reservedMB: %f peakInUseMB: %f totalAcquire: %lld totalNew: %lld\n",
+                    procId, iter, nAcquire, nNew, nAcquire-nNew, nTrimmed, tAlloc,
+                    bytesReserved/(1024.0*1024.0), bytesPeakInUse/(1024.0*1024.0),
+                    nAcquireTotal, nNewTotal);
+
+      nAcquire = nNew = nTrimmed = 0;
+      tAlloc         = 0;
+      bytesPeakInUse = bytesInUse;
+    }
+  }
+};
+
+#endif // _LET_BUFFER_POOL_H_
@@ -0,0 +1,136 @@
+#ifndef _LET_NODE_SHARE_H_
+#define _LET_NODE_SHARE_H_
+
+//Node level sharing of received LETs. The processes of a shared-memory node
+//(optionally split into groups of at most maxRanks processes) each own a
+//segment of an MPI_Win_allocate_shared window. A LET that is walked against the
+//groups of several processes of a node is received once into the segment of
+//one of them, the others get its offset and read it in place.
+//The segments are used as bump allocators that are reset at the start of every
+//exchange, a segment that was too small is grown at the next exchange.
+
+#include <mpi.h>
+#include <vector>
+#include <algorithm>
+
+class LETNodeShare
+{
+private:
+  enum {ALIGN = 64, INITIAL_BYTES = 16*1024*1024};
+
+  MPI_Comm nodeComm;
+  MPI_Win  win;
+  int      nodeRank, nodeSize;
+
+  std::vector<int>    nodeOfRank;   //Node id (world rank of the first process) of every process
+  std::vector<int>    worldToNode;  //World rank -> rank in nodeComm, -1 if on another node
+  std::vector<char*>  segments;     //Base pointer of the segment of every process on the node
+
+  size_t capacity, used, needed;
+
+  void allocate(const size_t bytes)
+  {
+    if(win != MPI_WIN_NULL)
+    {
+      MPI_Win_unlock_all(win);
+      MPI_Win_free(&win);
+    }
+
+    char *base;
+    MPI_Win_allocate_shared(bytes, 1, MPI_INFO_NULL, nodeComm, &base, &win);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+
+    for(int i=0; i < nodeSize; i++)
+    {
+      MPI_Aint size;
+      int      dispUnit;
+      MPI_Win_shared_query(win, i, &size, &dispUnit, &segments[i]);
+    }
+    capacity = bytes;
+  }
+
+public:
+  LETNodeShare() : nodeComm(MPI_COMM_NULL), win(MPI_WIN_NULL), nodeRank(0), nodeSize(1),
+                   capacity(0), used(0), needed(0) {}
+
+  ~LETNodeShare()
+  {
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if(finalized) return;
+    if(win != MPI_WIN_NULL)
+    {
+      MPI_Win_unlock_all(win);
+      MPI_Win_free(&win);
+    }
+    if(nodeComm != MPI_COMM_NULL) MPI_Comm_free(&nodeComm);
+  }
+
+  bool isInitialized() const { return nodeComm != MPI_COMM_NULL; }
+
+  //Collective over comm
+  void init(MPI_Comm comm, const int maxRanks)
+  {
+    int procId, nProcs;
+    MPI_Comm_rank(comm, &procId);
+    MPI_Comm_size(comm, &nProcs);
+
+    MPI_Comm shmComm;
+    int      shmRank;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, procId, MPI_INFO_NULL, &shmComm);
+    MPI_Comm_rank(shmComm, &shmRank);
+    MPI_Comm_split(shmComm, shmRank / std::max(1, maxRanks), shmRank, &nodeComm);
+    MPI_Comm_free(&shmComm);
+
+    MPI_Comm_rank(nodeComm, &nodeRank);
+    MPI_Comm_size(nodeComm, &nodeSize);
+
+    int nodeId = procId;
+    MPI_Bcast(&nodeId, 1, MPI_INT, 0, nodeComm);
+    nodeOfRank.resize(nProcs);
+    MPI_Allgather(&nodeId, 1, MPI_INT, &nodeOfRank[0], 1, MPI_INT, comm);
+
+    std::vector<int> members(nodeSize);
+    MPI_Allgather(&procId, 1, MPI_INT, &members[0], 1, MPI_INT, nodeComm);
+    worldToNode.assign(nProcs, -1);
+    for(int i=0; i < nodeSize; i++) worldToNode[members[i]] = i;
+
+    segments.resize(nodeSize);
+    allocate(INITIAL_BYTES);
+  }
+
+  //Collective over the node, all LETs of the previous exchange have to be processed
+  void beginExchange()
+  {
+    unsigned long long localNeeded = needed, nodeNeeded = 0;
+    MPI_Allreduce(&localNeeded, &nodeNeeded, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, nodeComm);
+    if(nodeNeeded > capacity) allocate(nodeNeeded + nodeNeeded/4);
+    used   = 0;
+    needed = 0;
+  }
+
+  //Space in our own segment, NULL if it does not fit
+  char *allocate(const size_t bytes, unsigned long long &offset)
+  {
+    const size_t aligned = ((bytes + ALIGN - 1) / ALIGN) * ALIGN;
+    needed += aligned;
+    if(used + aligned > capacity) return NULL;
+    offset = used;
+    used  += aligned;
+    return segments[nodeRank] + offset;
+  }
+
+  //Data in the segment of another process on our node
+  char *remote(const int worldRank, const unsigned long long offset)
+  {
+    return segments[worldToNode[worldRank]] + offset;
+  }
+
+  int nodeOf(const int worldRank) const { return nodeOfRank[worldRank]; }
+  int getNodeSize()               const { return nodeSize; }
+
+  //Makes the stores to the window visible to the other processes and vice versa
+  void sync() { MPI_Win_sync(win); }
+};
+
+#endif // _LET_NODE_SHARE_H_
@@ -0,0 +1,101 @@
+#ifndef _LET_WORK_QUEUE_H_
+#define _LET_WORK_QUEUE_H_
+
+//Work-stealing queue of destination ranks for the LET threads. fill() deals
+//the items round-robin over the per-thread deques, a thread pops from the
+//front of its own deque and, when that is empty, steals from the back of
+//the other deques. The thread passed as skipThread (the communication thread)
+//gets no items.
+
+#include <vector>
+#include <deque>
+#include <omp.h>
+
+class LETWorkQueue
+{
+private:
+  struct ThreadQueue
+  {
+    std::deque<int> items;
+    omp_lock_t      lock;
+    char            pad[64];  //Keep the locks of different threads apart
+  };
+
+  std::vector<ThreadQueue> queues;
+  int nSteals;
+
+public:
+  LETWorkQueue(const int nThreads) : queues(nThreads), nSteals(0)
+  {
+    for(int i=0; i < nThreads; i++) omp_init_lock(&queues[i].lock);
+  }
+  ~LETWorkQueue()
+  {
+    for(size_t i=0; i < queues.size(); i++) omp_destroy_lock(&queues[i].lock);
+  }
+
+  //Not thread safe, call before the items are being popped
+  void fill(const std::vector<int> &work, const int skipThread = -1)
+  {
+    const int nThreads = queues.size();
+    int t = 0;
+    for(size_t i=0; i < work.size(); i++)
+    {
+      if(t == skipThread && nThreads > 1) t = (t+1) % nThreads;
+      queues[t].items.push_back(work[i]);
+      t = (t+1) % nThreads;
+    }
+  }
+
+  bool pop(const int tid, int &item)
+  {
+    const int nThreads = queues.size();
+
+    //Own items first, in order
+    omp_set_lock(&queues[tid].lock);
+    bool found = !queues[tid].items.empty();
+    if(found)
+    {
+      item = queues[tid].items.front();
+      queues[tid].items.pop_front();
+    }
+    omp_unset_lock(&queues[tid].lock);
+    if(found) return true;
+
+    //Steal the last item of another thread
+    for(int i=1; i < nThreads && !found; i++)
+    {
+      const int victim = (tid+i) % nThreads;
+      omp_set_lock(&queues[victim].lock);
+      if(!queues[victim].items.empty())
+      {
+        item = queues[victim].items.back();
+        queues[victim].items.pop_back();
+        found = true;
+      }
+      omp_unset_lock(&queues[victim].lock);
+    }
+    if(found)
+    {
+      #pragma omp atomic
+      nSteals++;
+    }
+    return found;
+  }
+
+  bool empty()
+  {
+    for(size_t i=0; i < queues.size(); i++)
+    {
+      omp_set_lock(&queues[i].lock);
+      const bool e = queues[i].items.empty();
+      omp_unset_lock(&queues[i].lock);
+      if(!e) return false;
+    }
+    return true;
+  }
+
+  int getSteals() const { return nSteals; }
+};
+
+#endif // _LET_WORK_QUEUE_H_
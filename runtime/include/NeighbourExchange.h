@@ -0,0 +1,233 @@
+#ifndef _NEIGHBOUR_EXCHANGE_H_
+#define _NEIGHBOUR_EXCHANGE_H_
+
+//Persistent particle exchange with the neighbouring domains. After a domain
+//update particles mostly move to the same few processes (neighbours in PH
+//order), so the set of processes that we exchanged particles with is kept and
+//the next exchanges use persistent requests (MPI_Send_init / MPI_Recv_init)
+//for the particle counts and for the receives. The receives are posted into a
+//per neighbour region of a buffer that is kept across steps.
+//Counts are only exchanged with the neighbours, a single Allreduce checks that
+//nobody has to send outside its neighbour set. If someone has to, the caller
+//falls back to the MPI_Alltoall path and sets up a new neighbour set from the
+//result. Sends use MPI_Isend since a persistent send has a fixed count.
+
+#include <mpi.h>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "node_specs.h"
+
+class NeighbourExchange
+{
+private:
+  enum {COUNT_TAG = 993, DATA_TAG = 992};
+  enum {ELEMDOUBLES = sizeof(bodyStruct) / sizeof(double)};
+
+  MPI_Comm comm;
+  int      nProcs;
+
+  std::vector<int>          neighbours;     //Ranks we exchange with
+  std::vector<int>          neighbourIdx;   //Rank -> index in neighbours, -1 if not a neighbour
+  std::vector<int>          sendCounts, recvCounts;
+  std::vector<MPI_Request>  countReqs;      //Persistent, nNb sends followed by nNb receives
+  std::vector<MPI_Request>  recvReqs;       //Persistent data receives
+  std::vector<MPI_Request>  sendReqs;
+  std::vector<int>          recvCapacity;   //In particles, per neighbour
+  std::vector<int>          recvOffset;
+  std::vector<bodyStruct>   recvBuffer;
+
+  int nReuse, nRebuildRecv;
+
+  void freeRequests(std::vector<MPI_Request> &reqs)
+  {
+    for(size_t i=0; i < reqs.size(); i++)
+      if(reqs[i] != MPI_REQUEST_NULL) MPI_Request_free(&reqs[i]);
+    reqs.clear();
+  }
+
+  //(Re)creates the persistent receives, the capacity of each neighbour is the
+  //current count plus some slack to keep the requests valid for a few steps
+  void setupReceives(const int *nreceive)
+  {
+    freeRequests(recvReqs);
+    const int nNb = neighbours.size();
+    recvCapacity.resize(nNb);
+    recvOffset  .resize(nNb);
+
+    int total = 0;
+    for(int i=0; i < nNb; i++)
+    {
+      const int n     = nreceive[neighbours[i]];
+      recvCapacity[i] = std::max(64, n + n/2);
+      recvOffset  [i] = total;
+      total          += recvCapacity[i];
+    }
+    recvBuffer.resize(total);
+
+    recvReqs.resize(nNb);
+    for(int i=0; i < nNb; i++)
+    {
+      MPI_Recv_init(&recvBuffer[recvOffset[i]], recvCapacity[i]*ELEMDOUBLES, MPI_DOUBLE,
+                    neighbours[i], DATA_TAG, comm, &recvReqs[i]);
+    }
+    nRebuildRecv++;
+  }
+
+public:
+  NeighbourExchange() : comm(MPI_COMM_NULL), nProcs(0), nReuse(0), nRebuildRecv(0) {}
+
+  ~NeighbourExchange()
+  {
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if(finalized) return;
+    freeRequests(countReqs);
+    freeRequests(recvReqs);
+  }
+
+  bool isInitialized() const { return comm != MPI_COMM_NULL; }
+  bool isValid()       const { return !countReqs.empty(); }
+  int  getNeighbourCount() const { return neighbours.size(); }
+  int  getReuseCount()     const { return nReuse; }
+  int  getRebuildCount()   const { return nRebuildRecv; }
+
+  void init(MPI_Comm comm_)
+  {
+    comm = comm_;
+    MPI_Comm_size(comm, &nProcs);
+    neighbourIdx.assign(nProcs, -1);
+  }
+
+  //Sets up the neighbour set from the counts of a general (Alltoall) exchange.
+  //The set is symmetric: we are a neighbour of everyone we send to or receive from
+  void setNeighbours(const int *nparticles, const int *nreceive)
+  {
+    freeRequests(countReqs);
+    freeRequests(recvReqs);
+
+    neighbours.clear();
+    neighbourIdx.assign(nProcs, -1);
+    for(int i=0; i < nProcs; i++)
+    {
+      if(nparticles[i] > 0 || nreceive[i] > 0)
+      {
+        neighbourIdx[i] = neighbours.size();
+        neighbours.push_back(i);
+      }
+    }
+
+    const int nNb = neighbours.size();
+    if(nNb == 0) return; //Nothing to reuse, next step takes the general path again
+
+    sendCounts.assign(nNb, 0);
+    recvCounts.assign(nNb, 0);
+    countReqs.resize(2*nNb);
+    for(int i=0; i < nNb; i++)
+    {
+      MPI_Send_init(&sendCounts[i], 1, MPI_INT, neighbours[i], COUNT_TAG, comm, &countReqs[i]);
+      MPI_Recv_init(&recvCounts[i], 1, MPI_INT, neighbours[i], COUNT_TAG, comm, &countReqs[nNb+i]);
+    }
+    setupReceives(nreceive);
+  }
+
+  //Collective. Returns false if any process has to send outside its neighbour
+  //set, in that case nothing has been exchanged. Otherwise nreceive is filled
+  bool exchangeCounts(const int *nparticles, int *nreceive)
+  {
+    int ok = isValid();
+    for(int i=0; i < nProcs && ok; i++)
+      if(nparticles[i] > 0 && neighbourIdx[i] < 0) ok = 0;
+
+    int allOk = 0;
+    MPI_Allreduce(&ok, &allOk, 1, MPI_INT, MPI_MIN, comm);
+    if(!allOk) return false;
+
+    const int nNb = neighbours.size();
+    for(int i=0; i < nNb; i++) sendCounts[i] = nparticles[neighbours[i]];
+
+    MPI_Startall(2*nNb, &countReqs[0]);
+    MPI_Waitall (2*nNb, &countReqs[0], MPI_STATUSES_IGNORE);
+
+    memset(nreceive, 0, sizeof(int)*nProcs);
+    for(int i=0; i < nNb; i++) nreceive[neighbours[i]] = recvCounts[i];
+    nReuse++;
+    return true;
+  }
+
+  //Starts the persistent receives of the neighbours that send something to us
+  //and the sends of our particles
+  void startExchange(const bodyStruct *particlesToSend, const int *nparticles,
+                     const int *nsendDispls, const int *nreceive)
+  {
+    const int nNb = neighbours.size();
+
+    bool fits = true;
+    for(int i=0; i < nNb; i++) fits = fits && nreceive[neighbours[i]] <= recvCapacity[i];
+    if(!fits) setupReceives(nreceive);
+
+    for(int i=0; i < nNb; i++)
+      if(nreceive[neighbours[i]] > 0) MPI_Start(&recvReqs[i]);
+
+    sendReqs.clear();
+    for(int i=0; i < nNb; i++)
+    {
+      const int dst    = neighbours[i];
+      const int scount = nparticles[dst] * ELEMDOUBLES;
+      if(scount > 0)
+      {
+        sendReqs.push_back(MPI_REQUEST_NULL);
+        MPI_Isend(const_cast<bodyStruct*>(&particlesToSend[nsendDispls[dst]]), scount, MPI_DOUBLE,
+                  dst, DATA_TAG, comm, &sendReqs.back());
+      }
+    }
+  }
+
+  //Returns true once all receives started by startExchange have completed,
+  //does not block. The sends are not tested
+  bool testExchange(const int *nreceive)
+  {
+    const int nNb = neighbours.size();
+    for(int i=0; i < nNb; i++)
+    {
+      if(nreceive[neighbours[i]] == 0) continue;
+      int flag = 0;
+      MPI_Test(&recvReqs[i], &flag, MPI_STATUS_IGNORE);
+      if(!flag) return false;
+    }
+    return true;
+  }
+
+  //Waits for the receives started by startExchange and copies the received
+  //particles, in neighbour order, into a contiguous buffer
+  void finishReceives(const int *nreceive, bodyStruct *dest)
+  {
+    const int nNb = neighbours.size();
+    for(int i=0; i < nNb; i++)
+      if(nreceive[neighbours[i]] > 0) MPI_Wait(&recvReqs[i], MPI_STATUS_IGNORE);
+
+    int offset = 0;
+    for(int i=0; i < nNb; i++)
+    {
+      const int n = nreceive[neighbours[i]];
+      if(n > 0) memcpy(&dest[offset], &recvBuffer[recvOffset[i]], n*sizeof(bodyStruct));
+      offset += n;
+    }
+  }
+
+  void finishSends()
+  {
+    if(!sendReqs.empty()) MPI_Waitall(sendReqs.size(), &sendReqs[0], MPI_STATUSES_IGNORE);
+    sendReqs.clear();
+  }
+
+  //Waits for the exchange started by startExchange and copies the received
+  //particles, in neighbour order, into a contiguous buffer
+  void finishExchange(const int *nreceive, bodyStruct *dest)
+  {
+    finishReceives(nreceive, dest);
+    finishSends();
+  }
+};
+
+#endif // _NEIGHBOUR_EXCHANGE_H_
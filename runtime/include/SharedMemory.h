@@ -13,6 +13,11 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+//HUGE is not defined in strict ANSI mode when the CUDA headers are absent
+#ifndef HUGE
+#define HUGE 3.40282347e+38F
+#endif
+
 template<typename T>
 class SharedMemoryBase
 {
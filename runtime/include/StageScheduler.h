@@ -0,0 +1,128 @@
+#ifndef _STAGE_SCHEDULER_H_
+#define _STAGE_SCHEDULER_H_
+
+//Host side scheduler for the stages of a pipelined time step. A stage runs
+//once the stages it depends on have finished and, if it has a ready test
+//(e.g. an MPI_Test on the messages it consumes), once that test succeeds.
+//Of the runnable stages the one added first goes first. When no stage can
+//run, the wait function of the first stage that is only blocked on its test
+//is called (e.g. an MPI_Waitall) and that stage runs next.
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <cassert>
+#include <omp.h>
+
+class StageScheduler
+{
+public:
+  typedef std::function<void()> Action;
+  typedef std::function<bool()> Test;
+
+private:
+  struct Stage
+  {
+    std::string      name;
+    Action           run;
+    Test             ready;     //Empty if the stage only waits for other stages
+    Action           wait;      //Blocks until ready() would return true
+    std::vector<int> deps;
+    bool             done;
+    double           tStart, tEnd;
+  };
+
+  std::vector<Stage> stages;
+  double tBegin, tWait;
+
+  bool depsDone(const Stage &s) const
+  {
+    for(size_t i=0; i < s.deps.size(); i++)
+      if(!stages[s.deps[i]].done) return false;
+    return true;
+  }
+
+  void execute(Stage &s)
+  {
+    s.tStart = omp_get_wtime();
+    s.run();
+    s.tEnd   = omp_get_wtime();
+    s.done   = true;
+  }
+
+public:
+  StageScheduler() : tBegin(0), tWait(0) {}
+
+  //Returns the id of the stage, used in the dependency lists of later stages
+  int add(const char *name, Action run, const std::vector<int> &deps = std::vector<int>(),
+          Test ready = Test(), Action wait = Action())
+  {
+    for(size_t i=0; i < deps.size(); i++) assert(deps[i] >= 0 && deps[i] < (int)stages.size());
+
+    Stage s;
+    s.name   = name;
+    s.run    = run;
+    s.ready  = ready;
+    s.wait   = wait;
+    s.deps   = deps;
+    s.done   = false;
+    s.tStart = s.tEnd = 0;
+    stages.push_back(s);
+    return stages.size()-1;
+  }
+
+  void run()
+  {
+    tBegin = omp_get_wtime();
+    tWait  = 0;
+
+    for(size_t nDone = 0; nDone < stages.size(); nDone++)
+    {
+      int next = -1, blocked = -1;
+      for(size_t i=0; i < stages.size() && next < 0; i++)
+      {
+        Stage &s = stages[i];
+        if(s.done || !depsDone(s)) continue;
+        if(!s.ready || s.ready())  next = i;
+        else if(blocked < 0)       blocked = i;
+      }
+
+      if(next < 0)
+      {
+        //Dependencies only point backwards, so something is always blocked on its test
+        assert(blocked >= 0 && stages[blocked].wait);
+        const double t0 = omp_get_wtime();
+        stages[blocked].wait();
+        tWait += omp_get_wtime() - t0;
+        next   = blocked;
+      }
+      execute(stages[next]);
+    }
+  }
+
+  //Time spent blocked in the wait functions during the last run
+  double waitTime() const { return tWait; }
+
+  //Writes "name: start-end" of the stages in execution order, relative to the start of run
+  void report(char *buff, const size_t size) const
+  {
+    std::vector<int> order;
+    for(size_t i=0; i < stages.size(); i++) order.push_back(i);
+    for(size_t i=1; i < order.size(); i++)
+      for(size_t j=i; j > 0 && stages[order[j]].tStart < stages[order[j-1]].tStart; j--)
+        std::swap(order[j], order[j-1]);
+
+    size_t len = 0;
+    buff[0]    = 0;
+    for(size_t i=0; i < order.size() && len < size; i++)
+    {
+      const Stage &s = stages[order[i]];
+      len += snprintf(buff + len, size - len, " %s: %.4f-%.4f", s.name.c_str(),
+                      s.tStart - tBegin, s.tEnd - tBegin);
+    }
+  }
+};
+
+#endif // _STAGE_SCHEDULER_H_
@@ -36,6 +36,8 @@ extern "C" void  (cl_link_tree)(int n_nodes, uint *n_children, uint2 *node_bodie
 extern "C" void  (store_group_list)(int    n_particles, int n_groups, uint  *validList, uint  *body2group_list, uint2 *group_list);
 extern "C" void  (build_group_list2)(const int n_particles, uint *validList, const uint2 startLevelBeginEnd, uint2 *node_bodies, int *node_level_list, int treeDepth);
 extern "C" void  (gpu_build_level_list)(const int n_nodes, const int n_leafs, uint *leafsIdxs, uint2 *node_bodies,  uint* valid_list);
+extern "C" void  (merge_tree_nodes)(const int n_nodes, const int n_leafs, const uint bodyOffset, int4 *levelMap, uint2 *src_node_bodies, uint *src_n_children, uint *src_leafNodeIdx, real4 *src_multipole, real4 *src_boxSizeInfo, real4 *src_boxCenterInfo, uint2 *node_bodies, uint *n_children, uint *leafNodeIdx, real4 *multipole, real4 *boxSizeInfo, real4 *boxCenterInfo);
+extern "C" void  (merge_tree_groups)(const int n_particles, const int n_groups, const uint bodyOffset, const uint groupOffset, uint *src_body2group_list, uint *src_oriParticleOrder, uint2 *src_group_list, real4 *src_groupSizeInfo, real4 *src_groupCenterInfo, uint *body2group_list, uint *oriParticleOrder, uint2 *group_list, real4 *groupSizeInfo, real4 *groupCenterInfo);
 
 
 //Tree-properties kernels
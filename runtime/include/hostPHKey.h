@@ -0,0 +1,153 @@
+#ifndef _HOST_PH_KEY_H_
+#define _HOST_PH_KEY_H_
+
+//Table based Peano-Hilbert key encoder for the host code paths.
+//host_get_key walks the 30 coordinate bits one triple at a time and swaps /
+//inverts the coordinates depending on the octant. Those transformations are
+//tracked here as a state (which original axis ends up in x, y and z and if
+//it is inverted) so that one table lookup handles 2 levels (6 bits). The
+//keys are bit-identical to host_get_key / get_key in build_tree.cu.
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+struct PHKeyLUT
+{
+  enum {MAXSTATES = 48};
+
+  unsigned char digits[MAXSTATES][64];  //Key digits of 2 levels
+  unsigned char next  [MAXSTATES][64];  //State after 2 levels
+
+  PHKeyLUT()
+  {
+    int stateId[512];
+    int stateCode[MAXSTATES];
+    for(int i=0; i < 512; i++) stateId[i] = -1;
+
+    //Identity, original x, y, z in transformed x, y, z without inversion
+    int nStates   = 1;
+    stateCode[0]  = 0 | (1 << 2) | (2 << 4);
+    stateId[stateCode[0]] = 0;
+
+    for(int s=0; s < nStates; s++)
+    {
+      for(int idx=0; idx < 64; idx++)
+      {
+        int d1, d2, code;
+        step(stateCode[s], idx >> 3, d1, code);
+        step(code,         idx &  7, d2, code);
+
+        if(stateId[code] < 0)
+        {
+          stateId[code]        = nStates;
+          stateCode[nStates++] = code;
+        }
+        digits[s][idx] = (d1 << 3) | d2;
+        next  [s][idx] = stateId[code];
+      }
+    }
+  }
+
+  //Processes one level, 'bits' holds the original x,y,z bits as xyz
+  static void step(const int code, const int bits, int &digit, int &newCode)
+  {
+    //0= 000, 1=001, 2=011, 3=010, 4=110, 5=111, 6=101, 7=100
+    //000=0=0, 001=1=1, 011=3=2, 010=2=3, 110=6=4, 111=7=5, 101=5=6, 100=4=7
+    const int C[8] = {0, 1, 7, 6, 3, 2, 4, 5};
+
+    //Transformed coordinate k reads original axis a[k], inverted if v[k]
+    int a[3] = {code & 3, (code >> 2) & 3, (code >> 4) & 3};
+    int v[3] = {(code >> 6) & 1, (code >> 7) & 1, (code >> 8) & 1};
+    const int ob[3] = {(bits >> 2) & 1, (bits >> 1) & 1, bits & 1};
+
+    const int index = ((ob[a[0]] ^ v[0]) << 2) | ((ob[a[1]] ^ v[1]) << 1) | (ob[a[2]] ^ v[2]);
+    digit = C[index];
+
+    int ta, tv;
+    if(index == 0)
+    {
+      ta = a[2]; a[2] = a[1]; a[1] = ta;
+      tv = v[2]; v[2] = v[1]; v[1] = tv;
+    }
+    else if(index == 1 || index == 5)
+    {
+      ta = a[0]; a[0] = a[1]; a[1] = ta;
+      tv = v[0]; v[0] = v[1]; v[1] = tv;
+    }
+    else if(index == 4 || index == 6)
+    {
+      v[0] ^= 1;
+      v[2] ^= 1;
+    }
+    else if(index == 7 || index == 3)
+    {
+      ta = a[0]; a[0] = a[1]; a[1] = ta;
+      tv = v[0]; v[0] = v[1] ^ 1; v[1] = tv ^ 1;
+    }
+    else
+    {
+      ta = a[2]; a[2] = a[1]; a[1] = ta;
+      tv = v[2]; v[2] = v[1] ^ 1; v[1] = tv ^ 1;
+    }
+
+    newCode = a[0] | (a[1] << 2) | (a[2] << 4) | (v[0] << 6) | (v[1] << 7) | (v[2] << 8);
+  }
+};
+
+static inline const PHKeyLUT &getPHKeyLUT()
+{
+  static const PHKeyLUT lut;
+  return lut;
+}
+
+//Spread 10 bits so that there are 2 zero bits between each of them
+static inline unsigned int spreadBits10(unsigned int x)
+{
+#ifdef __BMI2__
+  return _pdep_u32(x, 0x09249249);
+#else
+  x &= 0x3FF;
+  x = (x | (x << 16)) & 0x030000FF;
+  x = (x | (x <<  8)) & 0x0300F00F;
+  x = (x | (x <<  4)) & 0x030C30C3;
+  x = (x | (x <<  2)) & 0x09249249;
+  return x;
+#endif
+}
+
+//Same key as host_get_key(crd) without the initial swap of y and z, the
+//callers that swap (get_key on the device) pass (crd.x, crd.z, crd.y)
+static inline uint4 host_get_key_lut(const int x, const int y, const int z)
+{
+  const PHKeyLUT &lut = getPHKeyLUT();
+
+  unsigned int words[3];
+  int state = 0;
+
+  //Each key word holds 10 levels
+  for(int w=0; w < 3; w++)
+  {
+    const int shift = 20 - 10*w;
+    const unsigned int crd =  (spreadBits10((x >> shift) & 0x3FF) << 2) |
+                              (spreadBits10((y >> shift) & 0x3FF) << 1) |
+                               spreadBits10((z >> shift) & 0x3FF);
+    unsigned int key = 0;
+    for(int s=24; s >= 0; s -= 6)
+    {
+      const int idx = (crd >> s) & 63;
+      key   = (key << 6) | lut.digits[state][idx];
+      state = lut.next[state][idx];
+    }
+    words[w] = key;
+  }
+
+  uint4 key_new;
+  key_new.x = words[0];
+  key_new.y = words[1];
+  key_new.z = words[2];
+  key_new.w = 0;
+  return key_new;
+}
+
+#endif // _HOST_PH_KEY_H_
@@ -6,6 +6,8 @@
 #include <vector>
 using namespace std;
 
+#include "hostPHKey.h"
+
 #if 1
 
 
@@ -94,79 +96,10 @@ private:
   #endif
   }
 
+  //PH key of the cell, the y and z coordinates are swapped like on the device
   static uint4 host_get_key(uint4 crd)
   {
-    const int bits = 30;  //20 to make it same number as morton order
-    int i,xi, yi, zi;
-    int mask;
-    int key;
-
-    mask = crd.y;
-    crd.y = crd.z;
-    crd.z = mask;
-
-    //0= 000, 1=001, 2=011, 3=010, 4=110, 5=111, 6=101, 7=100
-    //000=0=0, 001=1=1, 011=3=2, 010=2=3, 110=6=4, 111=7=5, 101=5=6, 100=4=7
-    const int C[8] = {0, 1, 7, 6, 3, 2, 4, 5};
-
-    int temp;
-
-    mask = 1 << (bits - 1);
-    key  = 0;
-
-    uint4 key_new;
-
-    for(i = 0; i < bits; i++, mask >>= 1)
-    {
-      xi = (crd.x & mask) ? 1 : 0;
-      yi = (crd.y & mask) ? 1 : 0;
-      zi = (crd.z & mask) ? 1 : 0;
-
-      int index = (xi << 2) + (yi << 1) + zi;
-
-      if(index == 0)
-      {
-        temp = crd.z; crd.z = crd.y; crd.y = temp;
-      }
-      else  if(index == 1 || index == 5)
-      {
-        temp = crd.x; crd.x = crd.y; crd.y = temp;
-      }
-      else  if(index == 4 || index == 6)
-      {
-        crd.x = (crd.x) ^ (-1);
-        crd.z = (crd.z) ^ (-1);
-      }
-      else  if(index == 7 || index == 3)
-      {
-        temp = (crd.x) ^ (-1);
-        crd.x = (crd.y) ^ (-1);
-        crd.y = temp;
-      }
-      else
-      {
-        temp = (crd.z) ^ (-1);
-        crd.z = (crd.y) ^ (-1);
-        crd.y = temp;
-      }
-
-      key = (key << 3) + C[index];
-
-      if(i == 19)
-      {
-        key_new.y = key;
-        key = 0;
-      }
-      if(i == 9)
-      {
-        key_new.x = key;
-        key = 0;
-      }
-    } //end for
-
-    key_new.z = key;
-
-    return key_new;
+    return host_get_key_lut(crd.x, crd.z, crd.y);
   }
 
   void inline mergeBoxesForGrpTree(float4 cntA, float4 sizeA, float4 cntB, float4 sizeB,
@@ -429,6 +362,7 @@ public:
     std::vector<int >   tempBufferInt(nGroups);  //Used for reorder
     std::vector<uint4> keys(nGroups);
     //Compute the keys for the boundary boxes based on their geometric centers
+#pragma omp parallel for
     for(int i=0; i < nGroups; i++)
     {
       float4 center = groupCentre[i];
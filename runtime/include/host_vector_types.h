@@ -0,0 +1,49 @@
+#ifndef _HOST_VECTOR_TYPES_H_
+#define _HOST_VECTOR_TYPES_H_
+
+//Host replacements for the CUDA builtin vector types, used when
+//compiling without the CUDA toolkit (USE_HOST). Sizes and alignments
+//match vector_types.h so buffers and structures keep the same layout.
+
+#define __align__(n) __attribute__((aligned(n)))
+#define __builtin_align__(a) __align__(a)
+
+struct __builtin_align__(8)  float2 { float x, y; };
+struct                       float3 { float x, y, z; };
+struct __builtin_align__(16) float4 { float x, y, z, w; };
+
+struct __builtin_align__(16) double2 { double x, y; };
+struct                       double3 { double x, y, z; };
+struct __builtin_align__(16) double4 { double x, y, z, w; };
+
+struct __builtin_align__(8)  int2 { int x, y; };
+struct                       int3 { int x, y, z; };
+struct __builtin_align__(16) int4 { int x, y, z, w; };
+
+struct __builtin_align__(8)  uint2 { unsigned int x, y; };
+struct                       uint3 { unsigned int x, y, z; };
+struct __builtin_align__(16) uint4 { unsigned int x, y, z, w; };
+
+struct __builtin_align__(8)  ulonglong1 { unsigned long long x; };
+
+struct dim3
+{
+  unsigned int x, y, z;
+  dim3(unsigned int vx = 1, unsigned int vy = 1, unsigned int vz = 1) : x(vx), y(vy), z(vz) {}
+};
+
+static inline float2  make_float2 (float x, float y)                    { float2  t; t.x = x; t.y = y; return t; }
+static inline float3  make_float3 (float x, float y, float z)           { float3  t; t.x = x; t.y = y; t.z = z; return t; }
+static inline float4  make_float4 (float x, float y, float z, float w)  { float4  t; t.x = x; t.y = y; t.z = z; t.w = w; return t; }
+static inline double2 make_double2(double x, double y)                  { double2 t; t.x = x; t.y = y; return t; }
+static inline double3 make_double3(double x, double y, double z)        { double3 t; t.x = x; t.y = y; t.z = z; return t; }
+static inline double4 make_double4(double x, double y, double z, double w) { double4 t; t.x = x; t.y = y; t.z = z; t.w = w; return t; }
+static inline int2    make_int2   (int x, int y)                        { int2    t; t.x = x; t.y = y; return t; }
+static inline int3    make_int3   (int x, int y, int z)                 { int3    t; t.x = x; t.y = y; t.z = z; return t; }
+static inline int4    make_int4   (int x, int y, int z, int w)          { int4    t; t.x = x; t.y = y; t.z = z; t.w = w; return t; }
+static inline uint2   make_uint2  (unsigned int x, unsigned int y)      { uint2   t; t.x = x; t.y = y; return t; }
+static inline uint3   make_uint3  (unsigned int x, unsigned int y, unsigned int z) { uint3 t; t.x = x; t.y = y; t.z = z; return t; }
+static inline uint4   make_uint4  (unsigned int x, unsigned int y, unsigned int z, unsigned int w) { uint4 t; t.x = x; t.y = y; t.z = z; t.w = w; return t; }
+static inline ulonglong1 make_ulonglong1(unsigned long long x)         { ulonglong1 t; t.x = x; return t; }
+
+#endif // _HOST_VECTOR_TYPES_H_
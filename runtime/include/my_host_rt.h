@@ -0,0 +1,863 @@
+#ifndef _MY_HOST_H_
+#define _MY_HOST_H_
+
+//Host (CPU) implementation of the my_dev interface. Offers the same
+//context / dev_stream / dev_mem / kernel classes as my_cuda_rt.h but
+//the 'device' memory lives in host memory and kernels are executed by
+//OpenMP implementations registered in hostKernels.cpp.
+//Enabled by compiling with USE_HOST.
+
+#include <cmath>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cassert>
+#include <vector>
+#include <map>
+#include <unistd.h>
+#include <sys/time.h>
+#include <type_traits>
+
+#include <iostream>
+#include <omp.h>
+#include "log.h"
+#include "host_vector_types.h"
+
+//Normally pulled in via the CUDA headers, hidden by glibc with -std=c++11
+#ifndef HUGE
+  #define HUGE 3.40282347e+38F
+#endif
+
+//Some easy to use typedefs
+typedef float4 real4;
+typedef float real;
+#define make_real4 make_float4
+typedef unsigned int uint;
+
+using namespace std;
+
+extern const void * getTexturePointer(const char*);
+
+
+#define cl_mem void*
+
+
+//Minimal CUDA runtime replacements so the host code compiles unchanged.
+//Streams do not exist on the host, every call is synchronous.
+typedef int   cudaError_t;
+typedef void* cudaStream_t;
+typedef double* cudaEvent_t;    //Holds the time stamp of the record call
+
+enum { cudaSuccess = 0, cudaErrorNotReady = 1 };
+enum { cudaFuncCachePreferL1 = 0, cudaFuncCachePreferShared = 1 };
+
+static inline double __hostWallTime()
+{
+  struct timeval Tvalue;
+  gettimeofday(&Tvalue, NULL);
+  return ((double) Tvalue.tv_sec + 1.e-6*((double) Tvalue.tv_usec));
+}
+
+static inline const char*  cudaGetErrorString(cudaError_t)        { return "host backend error"; }
+static inline cudaError_t  cudaEventCreate(cudaEvent_t *ev)        { *ev = new double(0); return cudaSuccess; }
+static inline cudaError_t  cudaEventDestroy(cudaEvent_t ev)        { delete ev; return cudaSuccess; }
+static inline cudaError_t  cudaEventSynchronize(cudaEvent_t)       { return cudaSuccess; }
+static inline cudaError_t  cudaEventRecord(cudaEvent_t ev, cudaStream_t = 0) { *ev = __hostWallTime(); return cudaSuccess; }
+static inline cudaError_t  cudaEventElapsedTime(float *ms, cudaEvent_t start, cudaEvent_t stop)
+{
+  *ms = (float)(1000.0*(*stop - *start));
+  return cudaSuccess;
+}
+static inline cudaError_t  cudaStreamSynchronize(cudaStream_t)     { return cudaSuccess; }
+static inline cudaError_t  cudaDeviceSynchronize()                 { return cudaSuccess; }
+static inline cudaError_t  cudaFuncSetCacheConfig(const void*, int) { return cudaSuccess; }
+
+
+#  define CU_SAFE_CALL_KERNEL( call , kernel )       CU_SAFE_CALL(call);
+
+#define CU_SAFE_CALL(err)  __checkCudaErrors (err, __FILE__, __LINE__)
+
+inline void __checkCudaErrors(cudaError_t err, const char *file, const int line )
+{
+    if(cudaSuccess != err)
+    {
+      LOGF(stderr, "%s(%i) : Host runtime error %d: %s.\n",file, line, (int)err, cudaGetErrorString( err ) );
+      fprintf(stderr, "%s(%i) : Host runtime error %d: %s.\n",file, line, (int)err, cudaGetErrorString( err ) );
+      ::exit(-1);
+    }
+}
+
+#define getLastCudaError(msg)
+
+inline cudaError_t clFinish(int param)
+{
+  return cudaSuccess;
+}
+
+
+//The host acts as a single device
+static int getNumberOfCUDADevices()
+{
+  return 1;
+}
+
+
+namespace my_dev {
+
+  //Launch configuration of the kernel that is currently being executed by
+  //this thread, the host kernels use it as their gridDim / blockDim
+  struct hostLaunchConfig
+  {
+    dim3 gridDim;
+    dim3 blockDim;
+  };
+  extern thread_local hostLaunchConfig hostLaunch;
+
+  //Kernels are looked up by the address of the (extern "C") kernel symbol
+  //that is passed to kernel::create, the launcher unpacks the argument list
+  typedef void (*hostKernelLauncher)(void **args);
+  void               registerHostKernel(const void *funcPointer, hostKernelLauncher launcher);
+  hostKernelLauncher findHostKernel    (const void *funcPointer);
+
+
+  class context {
+  protected:
+    size_t dev;
+
+    int ciDeviceCount;
+
+    bool hContext_flag;
+    bool hInit_flag;
+    bool logfile_flag;
+    bool disable_timing;
+
+    ostream *logFile;
+
+    int logID;  //Unique ID to every log line
+
+    double start;
+
+    //Compute capability, important for default compilation mode
+    int ccMajor;
+    int ccMinor;
+    int defaultComputeMode;
+
+    std::string logPrepend;
+
+  public:
+
+     int multiProcessorCount;   //Required to configure parts of the code
+
+    context() {
+      hContext_flag     = false;
+      hInit_flag        = false;
+      logfile_flag      = false;
+      disable_timing    = false;
+
+      hInit_flag        = true;
+    }
+    ~context() {}
+
+    int getComputeCapability() const { return 100 * ccMajor + 10 * ccMinor; }
+    int getComputeCapabilityMajor() const {return ccMajor;}
+    int getComputeCapabilityMinor() const {return ccMajor;}
+
+
+    int create(std::ostream &log, bool disableTiming = false)
+    {
+      disable_timing = disableTiming;
+      logfile_flag   = true;
+      logFile        = &log;
+      logID          = 0;
+      return create(disable_timing);
+    }
+
+
+    int create(bool disableT = false) {
+      assert(hInit_flag);
+
+      disable_timing = disableT;
+
+      LOG("Creating host context \n");
+      ciDeviceCount = 1;
+      LOG("Found %d suitable devices: \n",ciDeviceCount);
+      LOG(" %d: %s\n", 0, "Host (OpenMP)");
+      return ciDeviceCount;
+    }
+
+    void createQueue(size_t dev = 0, int ctxCreateFlags = 0)
+    {
+      assert(!hContext_flag);
+      assert(hInit_flag);
+      this->dev = 0;
+
+      LOG("Trying to use device: %d ...success!\n", (int)dev);
+
+      //One 'multiprocessor' with Fermi settings keeps the per block
+      //tree-walk buffers small, the kernels parallelise internally
+      multiProcessorCount = 1;
+      ccMajor = 2;
+      ccMinor = 0;
+
+      //The compute loop runs inside an OpenMP region (main.cpp), allow the
+      //kernels to open their own nested team
+      omp_set_max_active_levels(2);
+
+      hContext_flag = true;
+    }
+
+    void startTiming(cudaStream_t stream=0)
+    {
+      if(disable_timing) return;
+      start = __hostWallTime();
+    }
+
+    //Text and ID to be printed with the log message on screen / in the file
+    void stopTiming(const char *text, int type = -1, cudaStream_t stream=0)
+    {
+      if(disable_timing) return;
+
+      float time = (float)(1000.0*(__hostWallTime() - start));
+
+      LOG("%s took:\t%f\t millisecond\n", text, time);
+
+      if(logfile_flag)
+      {
+        (*logFile) << logPrepend << logID++ << "\t"  << type << "\t" << text << "\t" << time << endl;
+      }
+    }
+
+    void writeLogEvent(const char *text)
+    {
+      if(disable_timing) return;
+      if(logfile_flag)
+      {
+        (*logFile) << logPrepend << text;
+      }
+    }
+
+    void setLogPreamble(std::string text)
+    {
+      logPrepend = text;
+    }
+
+    //This function returns the currently recorded log-data and will clear the log-buffer
+    std::string getLogData()
+    {
+      std::stringstream temp;
+      temp << logFile->rdbuf();
+      return temp.str();
+    }
+  };
+
+
+  ////////////////////////////////////////
+
+  //Streams are a no-op, kernels and copies complete before returning
+  class dev_stream
+  {
+    public:
+      dev_stream(unsigned int flags = 0) {}
+      void createStream(unsigned int flags = 0) {}
+      void destroyStream() {}
+      void sync() {}
+      bool isFinished() { return true; }
+      cudaStream_t s() { return 0; }
+  };
+
+
+  ///////////////////////
+
+  class base_mem
+  {
+    public:
+    //Memory usage counters
+    static long long currentMemUsage;
+    static long long maxMemUsage;
+
+    void increaseMemUsage(int bytes)
+    {
+      currentMemUsage +=  bytes;
+
+      if(currentMemUsage > maxMemUsage)
+        maxMemUsage = currentMemUsage;
+    }
+
+    void decreaseMemUsage(int bytes)
+    {
+      currentMemUsage -=  bytes;
+    }
+
+    static void printMemUsage()
+    {
+      LOG("Current usage: %lld bytes ( %lld MB) \n", currentMemUsage, currentMemUsage / (1024*1024));
+      LOG("Maximum usage: %lld bytes ( %lld MB) \n", maxMemUsage, maxMemUsage / (1024*1024));
+    }
+
+    static long long getMaxMemUsage()
+    {
+      return maxMemUsage;
+    }
+
+  };
+
+
+  //The 'device' buffer is a second host allocation. Keeping it separate
+  //from host_ptr preserves the explicit d2h / h2d staging semantics that
+  //the octree code relies on.
+  template<class T>
+  class dev_mem : base_mem {
+  protected:
+
+    int size;
+    T           *hDeviceMem;
+    T           *host_ptr;
+
+    bool pinned_mem, flags;
+    bool hDeviceMem_flag;
+    bool childMemory; //Indicates that this is a shared buffer that will be freed by a parent
+
+    void host_free() {
+      if(childMemory) //Only free if we are NOT a child
+      {
+        return;
+      }
+
+      if (hDeviceMem_flag)
+      {
+        assert(size > 0);
+        free(hDeviceMem);
+        free(host_ptr);
+        decreaseMemUsage(size*sizeof(T));
+        hDeviceMem_flag = false;
+      }
+    }
+
+    //Returns memory aligned the same way cudaMalloc does
+    static T* dev_alloc(int n)
+    {
+      void *ptr = NULL;
+      if(posix_memalign(&ptr, 256, std::max((size_t)n, (size_t)1)*sizeof(T)) != 0)
+      {
+        LOGF(stderr, "Host allocation of %ld bytes failed, exit\n", (long)(n*sizeof(T)));
+        ::exit(-1);
+      }
+      return (T*)ptr;
+    }
+
+  public:
+
+    ///////// Constructors
+
+    dev_mem(): hDeviceMem(NULL), flags(0){
+      size              = 0;
+      pinned_mem        = false;
+      hDeviceMem_flag   = false;
+      host_ptr          = NULL;
+      childMemory       = false;
+    }
+
+    void free_mem()
+    {
+      host_free();
+    }
+
+    //////// Destructor
+
+    ~dev_mem() {
+      host_free();
+    }
+
+
+    ///////////
+    //Return the number of elements (of type uint) to be padded
+    //to get to the correct address boundary
+    static int getGlobalMemAllignmentPadding(int n)
+    {
+      const int allignBoundary = 128*sizeof(uint);
+
+      int offset = 0;
+      offset = n*sizeof(uint);
+      offset = (offset / allignBoundary) + (((offset % allignBoundary) > 0) ? 1 : 0);
+      offset = (offset * allignBoundary) - n*sizeof(uint);
+      offset = offset / sizeof(uint);
+
+      return offset;
+    }
+
+    //Get the reference of memory allocated by another piece of memory
+    //see my_cuda_rt.h for the meaning of the arguments
+    int  cmalloc_copy(dev_mem<uint> &sourcemem, const int n, const int offset)
+    {
+      this->pinned_mem  = sourcemem.get_pinned();
+      this->flags       = sourcemem.get_flags();
+      this->childMemory = true;
+      this->size        = n;
+
+      host_ptr          = (T*)((char*)&sourcemem[offset]);
+      hDeviceMem        = (T*)sourcemem.get_devMem() + ((offset*sizeof(uint)) / sizeof(T));
+      hDeviceMem_flag   = true;
+
+      int currentOffset = offset + ((n*sizeof(T)) / sizeof(uint));
+      int padding       = getGlobalMemAllignmentPadding(currentOffset);
+
+      return currentOffset + padding;
+    }
+
+    void cmalloc(int n, bool pinned = false, int flags = 0)
+    {
+      this->pinned_mem = pinned;
+      this->flags = (flags == 0) ? false : true;
+      if (size > 0) host_free();
+      size = n;
+
+      host_ptr   = (T*)malloc(size*sizeof(T));
+      hDeviceMem = dev_alloc(size);
+      increaseMemUsage(size*sizeof(T));
+
+      hDeviceMem_flag = true;
+    }
+
+    void ccalloc(int n, bool pinned = false, int flags = 0) {
+      this->pinned_mem = pinned;
+      this->flags = (flags == 0) ? false : true;
+      if (size > 0) host_free();
+      size = n;
+
+      host_ptr   = (T*)calloc(size, sizeof(T));
+      hDeviceMem = dev_alloc(size);
+      memset(hDeviceMem, 0, size*sizeof(T));
+      increaseMemUsage(size*sizeof(T));
+
+      hDeviceMem_flag = true;
+    }
+
+    //Set reduce to false to not reduce the size, to speed up pinned memory buffers
+    void cresize(int n, bool reduce = true)
+    {
+      if(size == n)     //No need if we are already at the correct size
+        return;
+
+      if(size > n && reduce == false) //Do not make the memory size smaller
+      {
+        return;
+      }
+
+      host_ptr = (T*)realloc(host_ptr, n*sizeof(T));
+      if(host_ptr == NULL)
+      {
+        fprintf(stderr,"Realloc failed, size-old: %d new: %d, exit\n", size, n);
+        ::exit(0);
+      }
+
+      T *hDeviceMemNew = dev_alloc(n);
+      increaseMemUsage(n*sizeof(T));
+      int nToCopy = min(size, n); //Do not copy more than we have memory
+      if(nToCopy > 0) memcpy(hDeviceMemNew, hDeviceMem, nToCopy*sizeof(T));
+      free(hDeviceMem);
+      decreaseMemUsage(size*sizeof(T));
+      hDeviceMem = hDeviceMemNew;
+      size = n;
+    }
+
+    //Set reduce to false to not reduce the size, to speed up pinned memory buffers
+    //This one does not copy/preserve memory, its just a free and realloc no memory cpy
+    void cresize_nocpy(int n, bool reduce = true)
+    {
+      if(size == n)     //No need if we are already at the correct size
+        return;
+
+      if(size > n && reduce == false) //Do not make the memory size smaller
+      {
+        return;
+      }
+
+      free(host_ptr);
+      host_ptr = (T*)malloc(n*sizeof(T));
+
+      free(hDeviceMem);
+      decreaseMemUsage(size*sizeof(T));
+      hDeviceMem = dev_alloc(n);
+      increaseMemUsage(n*sizeof(T));
+      size = n;
+    }
+
+
+    //Set the memory to zero
+    void zeroMem()
+    {
+      assert(hDeviceMem_flag);
+
+      if(size > 0) {
+        memset(host_ptr,   0, size*sizeof(T));
+        memset(hDeviceMem, 0, size*sizeof(T));
+      }
+    }
+
+    void zeroMemGPUAsync(cudaStream_t stream)
+    {
+      assert(hDeviceMem_flag);
+      memset(hDeviceMem, 0, size*sizeof(T));
+    }
+
+    //////////////
+
+    void d2h(bool OCL_BLOCKING = true, cudaStream_t stream = 0)   {
+      d2h(size, OCL_BLOCKING, stream);
+    }
+
+    //D2h that only copies a certain number of items to the host
+    void d2h(int number, bool OCL_BLOCKING = true, cudaStream_t stream = 0)   {
+      assert(hDeviceMem_flag);
+      if(number == 0) return;
+      assert(size > 0);
+      memcpy(&host_ptr[0], hDeviceMem, number*sizeof(T));
+    }
+
+    //Copy to a specified buffer
+    void d2h(int number, void* dst, bool OCL_BLOCKING = true, cudaStream_t stream = 0)   {
+      assert(hDeviceMem_flag);
+      if(number == 0) return;
+      assert(size > 0);
+      memcpy(dst, hDeviceMem, number*sizeof(T));
+    }
+
+    void h2d(bool OCL_BLOCKING  = true, cudaStream_t stream = 0)   {
+      assert(hDeviceMem_flag);
+      assert(size > 0);
+      memcpy(hDeviceMem, &host_ptr[0], size*sizeof(T));
+    }
+
+    void h2d(int number, bool OCL_BLOCKING = true, cudaStream_t stream = 0)   {
+      assert(hDeviceMem_flag);
+      assert(size > 0);
+      if(number == 0) return;
+      memcpy(hDeviceMem, &host_ptr[0], number*sizeof(T));
+    }
+
+    void waitForCopyEvent() {}
+    void streamWaitForCopyEvent(my_dev::dev_stream &stream) {}
+
+    //Copies a device buffer to an other device buffer, and the
+    //host buffer to the other host buffer
+    void copy(dev_mem &src_buffer, int n, bool OCL_BLOCKING = true)   {
+      assert(hDeviceMem_flag);
+      if (size < n) {
+        host_free();
+        cmalloc(n, flags);
+        size = n;
+      }
+
+      memcpy(hDeviceMem, src_buffer.d(), n*sizeof(T));
+      memcpy(((void*) &host_ptr[0]), ((void*) &src_buffer[0]), n*sizeof(T));
+    }
+
+    void copy_devonly(dev_mem &src_buffer, int n, int offset = 0)
+    {
+      memmove(hDeviceMem + offset, src_buffer.d(), n*sizeof(T));
+    }
+    void copy_devonly(T* src, const int n, int offset = 0)
+    {
+      memmove(hDeviceMem + offset, src, sizeof(T)*n);
+    }
+    void copy_devonly_async(dev_mem &src_buffer, const int n, int offset = 0, cudaStream_t stream = 0)
+    {
+      memmove(hDeviceMem + offset, src_buffer.d(), sizeof(T)*n);
+    }
+
+    /////////
+
+    T& operator[] (int i){ return host_ptr[i]; }
+
+    void*  get_devMem() {return (void*)hDeviceMem;}
+    void*  d()          {return (void*)hDeviceMem;}
+
+    T* raw_p() {return  hDeviceMem;}
+
+    void*   p() {return &hDeviceMem;}
+    void*   a(int offset)
+    {
+      return (void*)(size_t)(hDeviceMem + offset);
+    }
+
+    int  get_size(){return size;}
+    bool get_pinned(){return pinned_mem;}
+    bool get_flags(){return flags;}
+  };     // end of class dev_mem
+
+  ////////////////////
+
+
+  class kernel {
+  protected:
+    char       *hKernelFilename;
+    char       *hKernelName;
+public:
+    const void *hKernelPointer;
+protected:
+    vector<size_t> hGlobalWork;
+    vector<size_t> hLocalWork;
+
+    #define MAXKERNELARGUMENTS 128
+    std::vector<void*> kArguments;
+
+    hostKernelLauncher launcher;
+
+    bool context_flag;
+    bool kernel_flag;
+    bool program_flag;
+    bool work_flag;
+
+    size_t sharedMemorySize;
+
+    void init()
+    {
+      hKernelName     = (char*)malloc(256);
+      hKernelFilename = (char*)malloc(1024);
+      hGlobalWork.clear();
+      hLocalWork.clear();
+
+      context_flag = false;
+      kernel_flag  = false;
+      program_flag = false;
+      work_flag    = false;
+
+      sharedMemorySize = 0;
+      launcher         = NULL;
+
+      kArguments.assign(MAXKERNELARGUMENTS, NULL);
+    }
+
+  public:
+
+    kernel() { init(); }
+
+    kernel(class context &c) {
+      init();
+      setContext(c);
+    }
+
+    ~kernel() {
+      free(hKernelName);
+      free(hKernelFilename);
+    }
+
+    ////////////
+
+    void setContext(class context &c) {
+      assert(!context_flag);
+      context_flag     = true;
+    }
+
+    ////////////
+
+    void load_source(const char *fileName, string &ptx_source)
+    {
+      //Keep for compatibility
+    }
+
+    void load_source(const char *kernel_name, const char *subfolder,
+                     const char *compilerOptions = "",
+                     int maxrregcount = -1,
+                     int architecture = 0) {
+      assert(context_flag);
+      assert(!program_flag);
+      sprintf(hKernelFilename, "%s%s", subfolder, kernel_name);
+      program_flag = true;
+    }
+
+    void create(const char *kernel_name, const void *funcPointer) {
+      program_flag = true;
+      assert(!kernel_flag);
+      assert(!context_flag);
+      context_flag     = true;
+
+      sprintf(hKernelName, "%s", kernel_name);
+
+      LOG("Setting kernel: %s \n", kernel_name);
+
+      hKernelPointer = funcPointer;
+      launcher       = findHostKernel(funcPointer);
+      if(launcher == NULL)
+      {
+        LOGF(stderr, "No host implementation for kernel: %s \n", kernel_name);
+        ::exit(-1);
+      }
+
+      kernel_flag = true;
+    }
+
+    //Overwrite one of the previous set arguments with a new value
+    void reset_arg(const int idx, void *arg) {kArguments[idx] = arg; }
+
+    void set_argsb(int idx){}
+
+    template<typename T, typename... Targs>
+    void set_argsb(int idx, T arg, Targs... Fargs)
+    {
+        kArguments[idx] = arg;
+        set_argsb(++idx, Fargs...);
+    }
+
+    //First argument is the size of the shared-memory reservation in bytes
+    //each following argument is a pointer to the value for the kernel
+    template<typename T, typename... Targs>
+    void set_args(const size_t shMemSize, T arg, Targs... Fargs)
+    {
+        sharedMemorySize = shMemSize;
+        set_argsb(0, arg, Fargs...);
+    }
+
+    template<class T>
+    void set_arg(unsigned int arg, void* ptr, int size = 1)  {
+      assert(kernel_flag);
+      kArguments[arg] = ptr;
+    }
+
+    //Textures are not used on the host, the kernels read the
+    //buffers directly via their pointer arguments
+    template<class T>
+    void set_arg(unsigned int arg, my_dev::dev_mem<T> &memobj,
+                 const char *textureName, int offset = -1, int mem_size = -1)  {}
+
+    template<class T>
+      void set_texture(const int arg, my_dev::dev_mem<T> &memobj,
+                       const char *textureName, int offset = 0, int mem_size = -1) {}
+
+    void bindTextures() {}
+
+
+    void setWork(int items, int n_threads, int blocks = -1)
+    {
+      vector<size_t> localWork(2), globalWork(2);
+
+      int nx, ny;
+
+      if(blocks == -1)
+      {
+        //Calculate dynamic
+        int ng = (items) / n_threads + 1;
+        nx = (int)sqrt((double)ng);
+        ny = (ng -1)/nx +  1;
+      }
+      else
+      {
+        if(blocks >= 65536)
+        {
+          nx = (int)sqrt((double)blocks);
+          ny = (blocks -1)/nx +  1;
+        }
+        else
+        {
+          nx = blocks;
+          ny = 1;
+        }
+      }
+
+      globalWork[0] = nx*n_threads;  globalWork[1] = ny*1;
+      localWork [0] = n_threads;     localWork[1]  = 1;
+      setWork(globalWork, localWork);
+    }
+
+
+    void setWork(vector<size_t> global_work, vector<size_t> local_work) {
+      assert(kernel_flag);
+      assert(global_work.size() == local_work.size());
+
+      hGlobalWork.resize(3);
+      hLocalWork. resize(3);
+
+      hLocalWork [0] = local_work[0];
+      hLocalWork [1] = (local_work.size()  > 1) ? local_work[1] : 1;
+      hLocalWork [2] = (local_work.size()  > 2) ? local_work[2] : 1;
+
+      hGlobalWork[0] = global_work[0];
+      hGlobalWork[1] = (global_work.size() > 1) ? global_work[1] : 1;
+      hGlobalWork[2] = 1;
+
+      hGlobalWork[0] /= hLocalWork[0];
+      hGlobalWork[1] /= hLocalWork[1];
+      hGlobalWork[2] /= hLocalWork[2];
+
+      work_flag = true;
+    }
+
+
+    void execute2(cudaStream_t hStream = 0, int* event = NULL) {
+        hGlobalWork.resize(3);
+        hLocalWork.resize(3);
+
+        hostLaunchConfig cfg;
+        cfg.gridDim  = dim3((uint)hGlobalWork[0], (uint)hGlobalWork[1], 1);
+        cfg.blockDim = dim3((uint)hLocalWork[0],  (uint)hLocalWork[1], (uint)hLocalWork[2]);
+
+        if(cfg.blockDim.x == 0 || cfg.gridDim.x == 0)
+          return;
+
+        hostLaunch = cfg;
+        launcher(&kArguments[0]);
+    }
+
+
+    void printWorkSize(const char *s)
+    {
+      LOG("%sBlocks: (%ld, %ld, %ld) Threads: (%ld, %ld, %ld) \n", s,
+              hGlobalWork[0], hGlobalWork[1], hGlobalWork[2],
+              hLocalWork[0], hLocalWork[1], hLocalWork[2]);
+    }
+
+    void printWorkSize()
+    {
+      printWorkSize("");
+    }
+
+    void execute(cudaStream_t hStream = 0, int* event = NULL) {
+      assert(kernel_flag);
+      assert(work_flag);
+      execute2(hStream, event);
+    }
+  };
+
+
+  //Unpacks the kernel argument list (pointers to the values, as stored
+  //by kernel::set_args) and calls the host implementation
+  template<int...> struct hostIndexList {};
+  template<int N, int... I> struct hostIndexBuild : hostIndexBuild<N-1, N-1, I...> {};
+  template<int... I> struct hostIndexBuild<0, I...> { typedef hostIndexList<I...> type; };
+
+  template<typename F> struct hostLauncher;
+  template<typename... A>
+  struct hostLauncher<void(A...)>
+  {
+    template<int... I>
+    static void unpack(void (*f)(A...), void **args, hostIndexList<I...>)
+    {
+      f(*(typename std::remove_cv<typename std::remove_reference<A>::type>::type*)args[I]...);
+    }
+
+    template<void (*f)(A...)>
+    static void call(void **args)
+    {
+      unpack(f, args, typename hostIndexBuild<sizeof...(A)>::type());
+    }
+  };
+
+  struct hostKernelRegistrar
+  {
+    hostKernelRegistrar(const void *funcPointer, hostKernelLauncher launcher)
+    {
+      registerHostKernel(funcPointer, launcher);
+    }
+  };
+
+}     // end of namespace my_dev
+
+//Registers 'func' as the host implementation of the kernel symbol 'func'
+#define HOST_KERNEL_REGISTER(func) \
+  static my_dev::hostKernelRegistrar func ## _hostRegistrar((const void*)&func, &my_dev::hostLauncher<decltype(func)>::call<&func>)
+
+#endif // _MY_HOST_H_
@@ -15,10 +15,14 @@
 #include <windows.h>
 #endif
 
-#define USE_CUDA
+#ifndef USE_HOST
+  #define USE_CUDA
+#endif
 
 #ifdef USE_CUDA
   #include "my_cuda_rt.h"
+#elif defined(USE_HOST)
+  #include "my_host_rt.h"
 #else
   #include "my_ocl.h"
 #endif
@@ -36,11 +40,15 @@
 #include "tipsyIO.h"
 #include "log.h"
 #include "FileIO.h"
+#include "LETBufferPool.h"
 
 
 
 #ifdef USE_MPI
   #include "MPIComm.h"
+  #include "LETNodeShare.h"
+  #include "NeighbourExchange.h"
+  #include "DDNodeLevel.h"
   extern MPIComm *myComm;
 #endif
 
@@ -369,6 +377,8 @@ protected:
   my_dev::kernel  define_groups;
   my_dev::kernel  build_level_list;
   my_dev::kernel  store_groups;
+  my_dev::kernel  mergeTreeNodes;
+  my_dev::kernel  mergeTreeGroups;
 
   my_dev::kernel  boundaryReduction;
   my_dev::kernel  boundaryReductionGroups;
@@ -425,6 +435,7 @@ public:
 
    tree_structure localTree;
    tree_structure remoteTree;
+   tree_structure boundaryTree;   //Particles received in a pipelined domain update, merged into localTree
 
    tipsyIO *fileIO;
 
@@ -468,11 +479,16 @@ public:
     void getBoundaries(tree_structure &tree, real4 &r_min, real4 &r_max);
     void getBoundariesGroups(tree_structure &tree, real4 &r_min, real4 &r_max);  
 
-    void allocateParticleMemory(tree_structure &tree);
+    void allocateParticleMemory(tree_structure &tree, const bool sharedBuffers = true);
     void allocateTreePropMemory(tree_structure &tree);
     void reallocateParticleMemory(tree_structure &tree);
+    void applyParticleOrder(tree_structure &tree);
+    void reorderGravityResults(tree_structure &tree);
 
     void build(tree_structure &tree);
+    void build_NodesFromKeys(const int n_bodies, uint4 *bodies_key, uint4 *node_key,
+                             uint2 *node_bodies, uint *n_children, uint2 *level_list,
+                             uint *levelOffset, uint *lastLevel);
     void compute_properties (tree_structure &tree);
     void compute_properties_double(tree_structure &tree);
     void setActiveGrpsFunc(tree_structure &tree);
@@ -531,6 +547,8 @@ public:
   //Sub functions of iterate, should probably be private
   void   predict(tree_structure &tree);
   void   approximate_gravity(tree_structure &tree);
+  void   approximate_gravity_boundary(tree_structure &tree, tree_structure &srcTree, const bool accumulate);
+  void   runDomainPipeline();
   void   direct_gravity(tree_structure &tree);
   void   correct(tree_structure &tree);
   double compute_energies(tree_structure &tree);
@@ -556,6 +574,52 @@ public:
   int  *fullGrpAndLETRequest;
   int2 *fullGrpAndLETRequestStatistics;
 
+  LETBufferPool letBufferPool;          //Recycled buffers for the exported and received LETs
+  int  letThreads;                      //Threads used for the LET construction, <= 0 is one per core
+  bool letPinThreads;                   //Pin the LET threads to the cores of our cpuset
+
+  //Node and particle lists of the last LET walk per destination, reused on steps
+  //without a tree rebuild as long as the groups of the destination stay within
+  //the boxes that were used for the walk
+  struct LETCacheEntry
+  {
+    bool               valid;
+    int                depth;
+    float              refDisp;         //Displacement of our particles when the walk was done
+    std::vector<int2>  node;
+    std::vector<int>   ptcl;
+    std::vector<real4> grpCenter;       //Group boxes of the destination at the time of the walk
+    std::vector<real4> grpSize;
+
+    LETCacheEntry() : valid(false), depth(0), refDisp(0) {}
+  };
+  std::vector<LETCacheEntry> letCache;
+  std::vector<real4>         letCachePos;   //Particle positions at the last tree rebuild
+  float letCacheTol;                        //Absolute inflation of the group boxes (length units), <= 0 disables the cache
+
+  int   letNodeSize;                        //Aggregate LETs for at most this many processes of a node, <= 0 disables
+  bool  letGather;                          //Gather the exported particles in place instead of copying bodies_Ppos
+#ifdef USE_MPI
+  LETNodeShare letNodeShare;
+  NeighbourExchange particleExchange;       //Persistent particle exchange with the neighbouring domains
+
+  //Particle exchange of the domain update that is left in flight on a pipelined
+  //step (--overlapdomain), completed by the arrivals stage of runDomainPipeline
+  struct PendingExchange
+  {
+    bool                     active;          //Receives not yet completed
+    bool                     sendsActive;
+    bool                     neighbourExchange;
+    int                      recvCount;
+    const int               *nreceive;
+    std::vector<MPI_Request> sendReq, recvReq;
+    std::vector<bodyStruct>  sendBuffer;    //The sends outlive the buffer of gpuRedistributeParticles_SFC
+    std::vector<bodyStruct>  recvBuffer;
+    PendingExchange() : active(false), sendsActive(false), neighbourExchange(false), recvCount(0), nreceive(NULL) {}
+  };
+  PendingExchange pendingExchange;
+#endif
+
   std::vector<int> infoGrpTreeBuffer;
   std::vector<int> exchangePartBuffer;
 
@@ -563,6 +627,18 @@ public:
   float maxExecTimePrevStep;      //Maximum duration of gravity computation over all processes
   float avgExecTimePrevStep;      //Average duration of gravity computation over all processes
 
+  bool   lbUseCost;               //Balance on the interaction counts of the particles instead of the gravity time
+  bool   lbCostActive;            //Hysteresis state of the interaction cost balancer
+  bool   interactionsOnHost;      //Host copy of interactions belongs to the current particles
+  double lbCostLocal, lbCostTotal;
+
+  bool   ddNodeLevel;             //Two-level domain decomposition, first over the nodes then within a node
+#ifdef USE_MPI
+  DDNodeLevel ddNode;
+#endif
+
+  bool   overlapDomain;           //Build and walk the staying particles while the domain update is in flight, no barrier after it
+
 
   int grpTree_n_nodes;
   int grpTree_n_topNodes;
@@ -604,7 +680,14 @@ public:
   int gpu_exchange_particles_with_overflow_check_SFC2(tree_structure &tree,
                                                     bodyStruct *particlesToSend,
                                                     int *nparticles, int *nsendDispls, int *nreceive,
-                                                    int nToSend);
+                                                    int nToSend, bool neighbourExchange, bool deferArrivals);
+  void resizeParticleArrays(tree_structure &tree, const int newN);
+  void insertReceivedParticles(tree_structure &tree, bodyStruct *particles, const int count, int insertAt);
+  void waitParticleExchange(const bool waitSends = true);
+  bool testParticleExchange();
+  void loadBoundaryParticles(tree_structure &boundary);
+  void appendReceivedParticles(tree_structure &tree);
+  void mergeBoundaryTree(tree_structure &tree, tree_structure &boundary);
   void approximate_gravity_let(tree_structure &tree, tree_structure &remoteTree,
                                  int bufferSize, bool doActivePart);
 
@@ -637,9 +720,13 @@ public:
   void makeLET();
 
   void parallelDataSummary(tree_structure &tree, float lastExecTime, float lastExecTime2, double &domUpdate, double &domExch, bool initalSetup);
+  bool updateCostImbalance(tree_structure &tree);
+  void initNodeDecomposition();
+  bool checkNodeImbalance(const float lastExecTime, const bool imbalanced, bool &updateNode);
+  void updateNodeBoundaries(uint4 *parallelBoundaries, const float lastExecTime);
 
 
-  void gpuRedistributeParticles_SFC(uint4 *boundaries);
+  void gpuRedistributeParticles_SFC(uint4 *boundaries, const bool deferArrivals = false);
 
   void build_GroupTree(int n_bodies, uint4 *keys, uint2 *nodes, uint4 *node_keys, uint  *node_levels,
                        int &n_levels, int &n_nodes, int &startGrp, int &endGrp);
@@ -648,6 +735,7 @@ public:
                               real4 *treeSize,  uint2 *nodes,   uint  *node_levels, int    n_levels);
 
   void sendCurrentInfoGrpTree();
+  real4 *getLETBodies(tree_structure &tree);
 
   void exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys,    int  nSamples,
                                            uint4 *globalSamples, int  *nReceiveCnts, int *nReceiveDpls,
@@ -701,6 +789,13 @@ public:
   void set_t_current(const float t) { t_current = t_previous = t; }
   float get_t_current() const       { return t_current; }
   void setUseDirectGravity(bool s)  { useDirectGravity = s;    }
+  void setLETThreads(const int n, const bool pin) { letThreads = n; letPinThreads = pin; }
+  void setLETCache(const float tol) { letCacheTol = tol; }
+  void setLETNodeSize(const int n)  { letNodeSize = n;   }
+  void setLETGather(const bool gather);
+  void setLoadBalanceCost(const bool c) { lbUseCost = c; }
+  void setNodeDecomposition(const bool d) { ddNodeLevel = d; }
+  void setOverlapDomain(const bool o)     { overlapDomain = o; }
   bool getUseDirectGravity() const  { return useDirectGravity; }
 
   octree(const MPI_Comm &comm,
@@ -744,6 +839,12 @@ public:
     snapshotFile      = snapF;
     store_energy_flag = true;
 
+    letThreads        = 0;
+    letPinThreads     = false;
+    letCacheTol       = 0;
+    letNodeSize       = 0;
+    letGather         = false;
+
     timeStep = tempTimeStep;
     tEnd     = tempTend;
     iterEnd  = _iterEnd;
@@ -771,6 +872,14 @@ public:
     maxExecTimePrevStep = 100;    //Some large values to force updates
     avgExecTimePrevStep = 1;      //Some large values to force updates
 
+    lbUseCost           = false;
+    lbCostActive        = false;
+    interactionsOnHost  = false;
+    lbCostLocal         = 0;
+    lbCostTotal         = 0;
+    ddNodeLevel         = false;
+    overlapDomain       = false;
+
 
     //An initial guess for group broadcasted information
     //We set the statistics for our neighboring processes
@@ -2,53 +2,59 @@
 #include <omp.h>
 
 #if 1 
+/* multi-word key, BITS is a multiple of 32 and word[0] holds the least
+ * significant bits. Used for the 96-bit PH keys (x,y,z) */
 template<int BITS>
-struct Keys;
-
-template<>
-struct Keys<32>
+struct Keys
 {
   private:
-    typedef unsigned int ulong;
     typedef unsigned int uint;
-    ulong key;
+    enum {NWORDS = BITS/32};
+    uint word[NWORDS];
 
   public:
     Keys() {}
-    Keys(const uint x) : key(static_cast<ulong>(x)) {}
-
-    uint get_uint(const int i) const
+    Keys(const uint x)
     {
-      return (key >> (32*i)) & static_cast<ulong>(0xFFFFFFFF);
+      word[0] = x;
+      for (int i = 1; i < NWORDS; i++)
+        word[i] = 0;
     }
 
-    Keys operator<<(const int bits) const
+    uint get_uint(const int i) const
     {
-      return key << bits;
+      return word[i];
     }
 
-    Keys operator>>(const int bits) const
+    /* bits starting at 'bit', a radix digit never crosses a word */
+    uint get_bits(const int bit) const
     {
-      return key >> bits;
+      return word[bit >> 5] >> (bit & 31);
     }
 
-
     operator uint() const {return get_uint(0);}
-
 #if 1
-    Keys(const uint4 value) : key(static_cast<ulong>(value.x)) {}
+    Keys(const uint4 value)
+    {
+      const uint v[4] = {value.x, value.y, value.z, value.w};
+      for (int i = 0; i < NWORDS; i++)
+        word[i] = v[NWORDS-1-i];
+    }
     uint4 get_uint4() const 
     {
-      return (uint4){get_uint(0), 0,0,0};
+      uint v[4] = {0, 0, 0, 0};
+      for (int i = 0; i < NWORDS; i++)
+        v[NWORDS-1-i] = word[i];
+      return (uint4){v[0], v[1], v[2], v[3]};
     }
 #endif
 };
 
 template<>
-struct Keys<64>
+struct Keys<32>
 {
   private:
-    typedef unsigned long long ulong;
+    typedef unsigned int ulong;
     typedef unsigned int uint;
     ulong key;
 
@@ -72,23 +78,27 @@ struct Keys<64>
     }
 
 
+    uint get_bits(const int bit) const
+    {
+      return key >> bit;
+    }
+
     operator uint() const {return get_uint(0);}
+
 #if 1
-    Keys(const uint4 value) :
-      key((static_cast<ulong>(value.x) << 32) | static_cast<ulong>(value.y)) {}
+    Keys(const uint4 value) : key(static_cast<ulong>(value.x)) {}
     uint4 get_uint4() const 
     {
-      return (uint4){get_uint(1), get_uint(0),0,0};
+      return (uint4){get_uint(0), 0,0,0};
     }
 #endif
 };
 
-#ifdef __SIZEOF_INT128__
 template<>
-struct Keys<96>
+struct Keys<64>
 {
   private:
-    typedef unsigned __int128 ulong;
+    typedef unsigned long long ulong;
     typedef unsigned int uint;
     ulong key;
 
@@ -96,7 +106,6 @@ struct Keys<96>
     Keys() {}
     Keys(const uint x) : key(static_cast<ulong>(x)) {}
 
-
     uint get_uint(const int i) const
     {
       return (key >> (32*i)) & static_cast<ulong>(0xFFFFFFFF);
@@ -113,18 +122,22 @@ struct Keys<96>
     }
 
 
+    uint get_bits(const int bit) const
+    {
+      return static_cast<uint>(key >> bit);
+    }
+
     operator uint() const {return get_uint(0);}
 #if 1
     Keys(const uint4 value) :
-      key((static_cast<ulong>(value.x) << 64) | 
-          (static_cast<ulong>(value.y) << 32) | static_cast<ulong>(value.z)) {}
+      key((static_cast<ulong>(value.x) << 32) | static_cast<ulong>(value.y)) {}
     uint4 get_uint4() const 
     {
-      return (uint4){get_uint(2), get_uint(1), get_uint(0),0};
+      return (uint4){get_uint(1), get_uint(0),0,0};
     }
 #endif
 };
-#endif
+
 
 template<int BITS>
 struct RadixSort
@@ -136,7 +149,8 @@ struct RadixSort
     PAD = 1,
     numBits = 8,
     numBuckets = (1<<numBits),
-    numBucketsPad = numBuckets * PAD
+    numBucketsPad = numBuckets * PAD,
+    wcSize = (64/sizeof(key_t) < 4) ? 4 : 64/sizeof(key_t)  /* keys per write-combining buffer, >= 1 cache line */
   };
 
   int count;
@@ -145,6 +159,7 @@ struct RadixSort
   int numBlocks;
 
   key_t *sorted;
+  int   *sortedValues;
   int *excScanBlockPtr, *countsBlockPtr;
 
   public:
@@ -170,28 +185,38 @@ struct RadixSort
 
     const int ntmp = numBlocks * numBucketsPad;
     posix_memalign((void**)&sorted, 64, count*sizeof(key_t));
+    posix_memalign((void**)&sortedValues, 64, count*sizeof(int));
     posix_memalign((void**)&excScanBlockPtr, 64, ntmp*sizeof(int));
     posix_memalign((void**)& countsBlockPtr, 64, ntmp*sizeof(int));
 
     int (*excScanBlock)[numBucketsPad] = (int (*)[numBucketsPad])excScanBlockPtr;
     int (* countsBlock)[numBucketsPad] = (int (*)[numBucketsPad]) countsBlockPtr;
 
+    /* first touch: the pages of a block end up on the NUMA node
+     * of the thread that reads that block in the next pass */
 #pragma omp parallel
     {
       const int blockIdx = omp_get_thread_num();
       for(int block = blockIdx; block < numBlocks; block += gridDim)
+      {
 #pragma simd
         for (int i = 0; i < numBuckets; i++)
           countsBlock[block][i] = excScanBlock[block][i] = 0;
-#pragma omp for
-      for (int i = 0; i < count; i++)
-        sorted[i] = 0;
+
+        const int end = std::min(count, (block+1)*blockSize);
+        for (int i = block*blockSize; i < end; i++)
+        {
+          sorted[i]       = 0;
+          sortedValues[i] = 0;
+        }
+      }
     }
   } 
 
   ~RadixSort()
   {
     free(sorted);
+    free(sortedValues);
     free(excScanBlockPtr);
     free(countsBlockPtr);
   }
@@ -213,53 +238,87 @@ struct RadixSort
 #if 1
     for(int i = 0; i < count; ++i) 
     {
-      const int key = (keys[i] >> bit) & mask;
+      const int key = keys[i].get_bits(bit) & mask;
       counts[key]++;
     }
 #endif
   }
 
+  template<bool WITH_VALUES>
   void sortPass(
       const key_t * keys,
+      const int   * values,
       key_t * sorted, 
+      int   * sortedValues,
       int bit, 
       const int count,
-      const int* digitOffsets,
-      int* counts)
+      const int* digitOffsets)
   {
-
-    // Compute the histogram of radix digits for this block only. This
-    // corresponds exactly to the count kernel in the GPU implementation.
-    const int numBuckets = 1 << numBits;
     const int mask = numBuckets - 1;
 
-#if 1
+    // Software write-combining, the keys are collected per digit in a
+    // cache line sized buffer which is written out in one go. This avoids
+    // a read-for-ownership of the destination line for every single key.
+    key_t bufKeys  [numBuckets][wcSize] __attribute__((aligned(64)));
+    int   bufValues[numBuckets][wcSize] __attribute__((aligned(64)));
+    int   bufCount [numBuckets];
+    int   offsets  [numBuckets];
+
+    for (int i = 0; i < numBuckets; i++)
+    {
+      bufCount[i] = 0;
+      offsets [i] = digitOffsets[i];
+    }
+
     for(int i = 0; i < count; i++)
     {
       // Extract the key 
-      const int key = (keys[i]>> bit) & mask;
-      const int rel = counts[key];
-      const int scatter = rel + digitOffsets[key];
+      const int key = keys[i].get_bits(bit) & mask;
+      const int n   = bufCount[key];
 
-      sorted[scatter] = keys[i];
+      bufKeys[key][n] = keys[i];
+      if (WITH_VALUES) bufValues[key][n] = values[i];
 
-      counts[key] = 1 + rel;
+      if (n + 1 == wcSize)
+      {
+        const int scatter = offsets[key];
+        for (int k = 0; k < wcSize; k++)
+          sorted[scatter + k] = bufKeys[key][k];
+        if (WITH_VALUES)
+          for (int k = 0; k < wcSize; k++)
+            sortedValues[scatter + k] = bufValues[key][k];
+        offsets [key] = scatter + wcSize;
+        bufCount[key] = 0;
+      }
+      else
+        bufCount[key] = n + 1;
     }
-#endif
-  }
 
-  public:
+    /* flush the partially filled buffers */
+    for (int key = 0; key < numBuckets; key++)
+    {
+      const int scatter = offsets[key];
+      for (int k = 0; k < bufCount[key]; k++)
+        sorted[scatter + k] = bufKeys[key][k];
+      if (WITH_VALUES)
+        for (int k = 0; k < bufCount[key]; k++)
+          sortedValues[scatter + k] = bufValues[key][k];
+    }
+  }
 
-  void sort(key_t *keys)
+  template<bool WITH_VALUES>
+  void sortKeys(key_t *keys, int *values)
   {
     int  countsGlobal[numBuckets] __attribute__((aligned(64))) = {0};
     int excScanGlobal[numBuckets] __attribute__((aligned(64))) = {0};
-    int excScanBlockL[numBuckets] __attribute__((aligned(64))) = {0};
-    int  digitOffsets[numBuckets] __attribute__((aligned(64))) = {0};
 
     int (*excScanBlock)[numBucketsPad] = (int (*)[numBucketsPad])excScanBlockPtr;
     int (* countsBlock)[numBucketsPad] = (int (*)[numBucketsPad]) countsBlockPtr;
 
+    key_t *src  = keys,   *dst  = sorted;
+    int   *srcV = values, *dstV = sortedValues;
+    int nSwaps  = 0;
+
 
 #if 0
 #define PROFILE
@@ -288,7 +347,7 @@ struct RadixSort
         /* histogramming each of the block */
         for(int block = blockIdx; block < numBlocks; block += gridDim)
           countPass(
-              keys + block*blockSize,
+              src + block*blockSize,
               bit,
               std::min(count - block*blockSize, blockSize),
               &countsBlock[block][0]);
@@ -318,65 +377,89 @@ struct RadixSort
         { t1 = rtc(); dt2 += t1 - t0; t0 = t1; }
 #endif
 
-        /* exclusive scan on the histogram */
-#pragma omp single
-        for(int digit = 1; digit < numBuckets; digit++)
-          excScanGlobal[digit] = excScanGlobal[digit - 1] + countsGlobal[digit - 1];
+        /* all keys share this digit (e.g. the unused top bits of the
+         * PH key words), the pass would not change the order */
+        bool skipPass = false;
+        for (int digit = 0; digit < numBuckets; digit++)
+          skipPass |= (countsGlobal[digit] == count);
 
 #pragma omp barrier
 
+        if (!skipPass)
+        {
+          /* exclusive scan on the histogram */
+#pragma omp single
+          for(int digit = 1; digit < numBuckets; digit++)
+            excScanGlobal[digit] = excScanGlobal[digit - 1] + countsGlobal[digit - 1];
+
 #ifdef PROFILE
 #pragma omp master
-        { t1 = rtc(); dt3 += t1 - t0; t0 = t1; }
+          { t1 = rtc(); dt3 += t1 - t0; t0 = t1; }
 #endif
 
-        /* computing offsets for each digit */
-        for (int digit = blockIdx; digit < numBuckets; digit += gridDim)
-        {
-          int dgt =  digitOffsets[digit];
-          for (int block = 0; block < numBlocks; block++)
+          /* computing offsets for each digit */
+          for (int digit = blockIdx; digit < numBuckets; digit += gridDim)
           {
-            excScanBlock[block][digit] = dgt + excScanGlobal[digit];
-            dgt += countsBlock[block][digit];
+            int dgt = 0;
+            for (int block = 0; block < numBlocks; block++)
+            {
+              excScanBlock[block][digit] = dgt + excScanGlobal[digit];
+              dgt += countsBlock[block][digit];
+            }
           }
-          digitOffsets[digit] = 0;
-        }
 
 #pragma omp barrier
 
 #ifdef PROFILE
 #pragma omp master
-        { t1 = rtc(); dt4 += t1 - t0; t0 = t1; }
+          { t1 = rtc(); dt4 += t1 - t0; t0 = t1; }
 #endif
 
-        /* sorting */
-        for(int block = blockIdx; block < numBlocks; block += gridDim)
-        {
-          int counts[numBuckets] = {0};
-
-          const int keyIndex = block * blockSize;
-          sortPass(
-              keys + keyIndex, 
-              sorted,
-              bit, 
-              std::min(count - keyIndex, blockSize), 
-              &excScanBlock[block][0],
-              &counts[0]);
-        }
+          /* sorting */
+          for(int block = blockIdx; block < numBlocks; block += gridDim)
+          {
+            const int keyIndex = block * blockSize;
+            sortPass<WITH_VALUES>(
+                src + keyIndex, 
+                WITH_VALUES ? srcV + keyIndex : NULL,
+                dst,
+                dstV,
+                bit, 
+                std::min(count - keyIndex, blockSize), 
+                &excScanBlock[block][0]);
+          }
 
 #pragma omp barrier
 
 #ifdef PROFILE
 #pragma omp master
-        { t1 = rtc(); dt5 += t1 - t0; t0 = t1; }
+          { t1 = rtc(); dt5 += t1 - t0; t0 = t1; }
 #endif
 
+#pragma omp single
+          {
+            std::swap(src,  dst);
+            std::swap(srcV, dstV);
+            nSwaps++;
+          }
+        }
+
 #pragma omp single
         {
 #pragma simd
           for (int i = 0; i < numBuckets; i++)
             countsGlobal[i] = excScanGlobal[i]  = 0;
-          std::swap(keys, sorted);
+        }
+      }
+
+      /* odd number of passes, the result is in the internal buffer */
+      if (nSwaps & 1)
+      {
+#pragma omp for
+        for (int i = 0; i < count; i++)
+        {
+          keys[i] = src[i];
+          if (WITH_VALUES) values[i] = srcV[i];
         }
       }
     }
@@ -393,6 +476,30 @@ struct RadixSort
 #endif
   }
 
+  public:
+
+  void sort(key_t *keys)
+  {
+    sortKeys<false>(keys, NULL);
+  }
+
+  /* sorts the keys and returns in perm the original index of each key,
+   * which can be used to reorder the data belonging to the keys */
+  void sort(key_t *keys, int *perm)
+  {
+#pragma omp parallel
+    {
+      const int blockIdx = omp_get_thread_num();
+      for(int block = blockIdx; block < numBlocks; block += gridDim)
+      {
+        const int end = std::min(count, (block+1)*blockSize);
+        for (int i = block*blockSize; i < end; i++)
+          perm[i] = i;
+      }
+    }
+    sortKeys<true>(keys, perm);
+  }
+
 };
 #endif
 
@@ -28,7 +28,11 @@
 #include <string>
 #include <cassert>
 
-#include "cuda_runtime.h"
+#ifdef USE_HOST
+  #include "host_vector_types.h"
+#else
+  #include "cuda_runtime.h"
+#endif
 
 typedef unsigned int uint;
 
@@ -156,6 +160,11 @@ private:
     void ICSend(int destination, real4 *bodyPositions, real4 *bodyVelocities,  ullong *bodiesIDs, int toSend, const MPI_Comm &mpiCommWorld);
     void ICRecv(int recvFrom, int procId, std::vector<real4> &bodyPositions, std::vector<real4> &bodyVelocities,  std::vector<ullong> &bodiesIDs, const MPI_Comm &mpiCommWorld);
 
+    void readRecords(int fd, const dumpV2 &h, const int fileFormatVersion,
+                     const long long iBeg, const long long iEnd,
+                     std::vector<real4> &bodyPositions, std::vector<real4> &bodyVelocities,
+                     std::vector<ullong> &bodiesIDs, int reduce_bodies_factor);
+
 
 public:
 /******************************************************************/
@@ -183,8 +192,8 @@ void writeFile(real4 *bodyPositions,
 
 /*
  * If 'restart' is true then each process will read it'so own file
- * Otherwise each process receives it's data from process 0 which
- * reads he full file and distributes it to the other processes
+ * Otherwise each process reads its own contiguous range of records
+ * from the single file
  */
 void readFile(const MPI_Comm &mpiCommWorld,
                               std::vector<real4> &bodyPositions,
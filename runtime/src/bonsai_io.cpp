@@ -1,6 +1,8 @@
 #undef NDEBUG
 #include <mpi.h>
-#include <cuda_runtime_api.h>
+#ifndef USE_HOST
+  #include <cuda_runtime_api.h>
+#endif
 #include <sstream>
 #include "anyoption.h"
 #include "SharedMemory.h"
@@ -8,6 +10,7 @@
 #include "BonsaiIO.h"
 #include "IDType.h"
 #include <array>
+#include <memory>
 
 using ShmQHeader = SharedMemoryClient<BonsaiSharedQuickHeader>;
 using ShmQData   = SharedMemoryClient<BonsaiSharedQuickData>;
@@ -20,31 +23,106 @@ using ShmSData   = SharedMemoryClient<BonsaiSharedSnapData>;
 #undef _DEBUG
 #endif
 
-static double write(
-    const int rank, const MPI_Comm &comm,
-    const std::vector<BonsaiIO::DataTypeBase*> &data,
-    BonsaiIO::Core &out)
+/* A snapshot that is flushed with non-blocking MPI-IO. It owns the copies of
+ * the shared memory data, so the simulation may fill the shared memory with
+ * the next snapshot while this one is still being written.
+ */
+struct AsyncSnapshot
 {
-  double dtWrite = 0;
-  for (const auto &type : data)
+  typedef float float4[4];
+  typedef float float3[3];
+  typedef float float2[2];
+
+  std::unique_ptr<BonsaiIO::Core> out;
+  size_t nDM, nS;
+  double tBeg, dtOpen, dtWrite;
+
+  BonsaiIO::DataType<IDType> DM_id, S_id;
+  BonsaiIO::DataType<float4> DM_pos, S_pos;
+  BonsaiIO::DataType<float3> DM_vel, S_vel;
+  BonsaiIO::DataType<float2> DM_rhoh, S_rhoh;
+
+  AsyncSnapshot(const double _tBeg, const size_t _nDM, const size_t _nS) :
+    nDM(_nDM), nS(_nS), tBeg(_tBeg), dtOpen(0), dtWrite(0),
+    DM_id  ("DM:IDType",           nDM), S_id  ("Stars:IDType",           nS),
+    DM_pos ("DM:POS:real4",        nDM), S_pos ("Stars:POS:real4",        nS),
+    DM_vel ("DM:VEL:float[3]",     nDM), S_vel ("Stars:VEL:float[3]",     nS),
+    DM_rhoh("DM:RHOH:float[2]",    nDM), S_rhoh("Stars:RHOH:float[2]",    nS)
+  {}
+
+  /* open the file and issue the non-blocking writes, returns immediately */
+  /* compressIDs and quantBits > 0 select the V3 codecs */
+  void write(const int rank, const int nrank, const MPI_Comm &comm,
+      const std::string &fn, const float tCurrent,
+      const bool compressIDs, const int quantBits)
   {
-    double t0 = MPI_Wtime();
-    long long int nLoc = type->getNumElements();
-    long long int nGlb;
-    MPI_Allreduce(&nLoc, &nGlb, 1, MPI_DOUBLE, MPI_SUM, comm);
-    if (nGlb > 0)
-      assert(out.write(*type));
-    dtWrite += MPI_Wtime() - t0;
+    const double tOpen = MPI_Wtime(); 
+    out.reset(new BonsaiIO::Core(rank, nrank, comm, BonsaiIO::WRITE, fn));
+    dtOpen = MPI_Wtime() - tOpen;
+    out->setTime(tCurrent);
+
+    const std::vector<BonsaiIO::DataTypeBase*> data =
+    {
+      &DM_id, &DM_pos, &DM_vel, &DM_rhoh,
+      &S_id, &S_pos, &S_vel, &S_rhoh
+    };
+
+    for (const auto &type : data)
+    {
+      double t0 = MPI_Wtime();
+      long long int nLoc = type->getNumElements();
+      long long int nGlb;
+      MPI_Allreduce(&nLoc, &nGlb, 1, MPI_LONG_LONG, MPI_SUM, comm);
+
+      BonsaiIO::CODEC codec = BonsaiIO::CODEC_NONE;
+      int codecParam = 0;
+      if (compressIDs && (type == &DM_id || type == &S_id))
+        codec = BonsaiIO::CODEC_DELTA;
+      if (quantBits > 0 && (type == &DM_pos || type == &S_pos || type == &DM_vel || type == &S_vel))
+      {
+        codec      = BonsaiIO::CODEC_QUANT;
+        codecParam = BonsaiIO::FieldCodec::quantParam(quantBits, 3);
+      }
+
+      if (nGlb > 0)
+        assert(out->iwrite(*type, codec, codecParam));
+      dtWrite += MPI_Wtime() - t0;
+    }
   }
 
-  return dtWrite;
-}
+  bool test() { return out->test(); }
+
+  /* wait for the writes to complete, write the header and report */
+  void finish(const int rank, const MPI_Comm &comm)
+  {
+    const double tClose = MPI_Wtime(); 
+    out->close();
+    double dtClose = MPI_Wtime() - tClose;
+
+    const double writeBW = out->computeBandwidth();
+    const double tEnd = MPI_Wtime();
+
+    long long nGlb[2], nLoc[2];
+    nLoc[0] = nDM;
+    nLoc[1] = nS;
+    MPI_Reduce(nLoc, nGlb, 2, MPI_LONG_LONG, MPI_SUM, 0, comm);
+
+
+    if (rank == 0)
+      fprintf(stderr, " BonsaiIO:: total= %g sec nDM= %gM  nS= %gM [open= %g  write= %g close= %g] BW= %g MB/s \n",
+          tEnd-tBeg, nGlb[0]/1e6, nGlb[1]/1e6, dtOpen, dtWrite, dtClose, writeBW/1e6);
+  }
+};
 
 template<typename ShmHeader, typename ShmData>
-bool writeLoop(ShmHeader &header, ShmData &data, const int rank, const int nrank, const MPI_Comm &comm)
+bool writeLoop(ShmHeader &header, ShmData &data, const int rank, const int nrank, const MPI_Comm &comm,
+    const bool compressIDs, const int quantBits)
 {
   double tLast = -1;
 
+  /* snapshot that is still being flushed, at most one is in flight */
+  std::unique_ptr<AsyncSnapshot> pending;
+
 
   /* handshake */
 
@@ -63,7 +141,15 @@ bool writeLoop(ShmHeader &header, ShmData &data, const int rank, const int nrank
 
   while (1)
   {
-    while (header[0].done_writing);
+    while (header[0].done_writing)
+    {
+      /* progress the previous snapshot while waiting for the next one */
+      if (pending && pending->test())
+      {
+        pending->finish(rank, comm);
+        pending.reset();
+      }
+    }
 
     assert(tLast != header[0].tCurrent);
     tLast = header[0].tCurrent;
@@ -86,131 +172,105 @@ bool writeLoop(ShmHeader &header, ShmData &data, const int rank, const int nrank
     const size_t size = data.size();
     assert(size == nBodies);
 
-    /* write data */
+    /* copy the data out of the shared memory */
 
-    {
-      const double tBeg  = MPI_Wtime();
-      const double tOpen = MPI_Wtime(); 
-      BonsaiIO::Core out(rank, nrank, comm, BonsaiIO::WRITE, fn);
-      double dtOpen = MPI_Wtime() - tOpen;
-
-      out.setTime(tCurrent);
-      tLast = tCurrent;
-
-      /* prepare data */ 
+    const double tBeg  = MPI_Wtime();
 
-      size_t nDM = 0, nS = 0;
-      constexpr int ntypecount = 10;
-      std::array<size_t,ntypecount> ntypeloc, ntypeglb;
-      std::fill(ntypeloc.begin(), ntypeloc.end(), 0);
-      for (size_t i = 0; i < size; i++)
-      {
-        const int type = data[i].ID.getType();
-        if  (type < ntypecount)
-          ntypeloc[type]++;
-        switch(type)
-        {
-          case 0:
-            nDM++;
-            break;
-          default:
-            nS++;
-        }
-      }
-    
-      MPI_Reduce(&ntypeloc, &ntypeglb, ntypecount, MPI_LONG_LONG, MPI_SUM, 0, comm);
-      if (rank == 0)
+    size_t nDM = 0, nS = 0;
+    constexpr int ntypecount = 10;
+    std::array<size_t,ntypecount> ntypeloc, ntypeglb;
+    std::fill(ntypeloc.begin(), ntypeloc.end(), 0);
+    for (size_t i = 0; i < size; i++)
+    {
+      const int type = data[i].ID.getType();
+      if  (type < ntypecount)
+        ntypeloc[type]++;
+      switch(type)
       {
-        fprintf(stderr, "writing to %s \n", fn);
-        for (int type = 0; type < ntypecount; type++)
-          if (ntypeglb[type] > 0)
-            fprintf(stderr, " BonsaiIO:: ptype= %d:  np= %zu \n",type, ntypeglb[type]);
+        case 0:
+          nDM++;
+          break;
+        default:
+          nS++;
       }
+    }
 
-      typedef float float4[4];
-      typedef float float3[3];
-      typedef float float2[2];
-      BonsaiIO::DataType<IDType> DM_id ("DM:IDType",        nDM);
-      BonsaiIO::DataType<float4> DM_pos("DM:POS:real4",     nDM);
-      BonsaiIO::DataType<float3> DM_vel("DM:VEL:float[3]",  nDM);
-      BonsaiIO::DataType<float2> DM_rhoh("DM:RHOH:float[2]", nDM);
-
-      BonsaiIO::DataType<IDType> S_id ("Stars:IDType",        nS);
-      BonsaiIO::DataType<float4> S_pos("Stars:POS:real4",     nS);
-      BonsaiIO::DataType<float3> S_vel("Stars:VEL:float[3]",  nS);
-      BonsaiIO::DataType<float2> S_rhoh("Stars:RHOH:float[2]", nS);
-
+    std::unique_ptr<AsyncSnapshot> next(new AsyncSnapshot(tBeg, nDM, nS));
+    AsyncSnapshot &snap = *next;
+    tLast = tCurrent;
 
-      size_t iDM = 0, iS = 0;
-      for (size_t i = 0; i < size; i++)
+    size_t iDM = 0, iS = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+      assert(iDM + iS == i);
+      switch (data[i].ID.getType())
       {
-        assert(iDM + iS == i);
-        switch (data[i].ID.getType())
-        {
-          case 0:
-            DM_id  [iDM]    = data[i].ID;
-            DM_pos [iDM][0] = data[i].x;
-            DM_pos [iDM][1] = data[i].y;
-            DM_pos [iDM][2] = data[i].z;
-            DM_pos [iDM][3] = data[i].mass;
-            DM_vel [iDM][0] = data[i].vx;
-            DM_vel [iDM][1] = data[i].vy;
-            DM_vel [iDM][2] = data[i].vz;
-            DM_rhoh[iDM][0] = data[i].rho;
-            DM_rhoh[iDM][1] = data[i].h;
-            iDM++;
-            assert(iDM <= nDM);
-            break;
-          default:
-            S_id  [iS]    = data[i].ID;
-            S_pos [iS][0] = data[i].x;
-            S_pos [iS][1] = data[i].y;
-            S_pos [iS][2] = data[i].z;
-            S_pos [iS][3] = data[i].mass;
-            S_vel [iS][0] = data[i].vx;
-            S_vel [iS][1] = data[i].vy;
-            S_vel [iS][2] = data[i].vz;
-            S_rhoh[iS][0] = data[i].rho;
-            S_rhoh[iS][1] = data[i].h;
-            iS++;
-            assert(iS <= nS);
-        }
+        case 0:
+          snap.DM_id  [iDM]    = data[i].ID;
+          snap.DM_pos [iDM][0] = data[i].x;
+          snap.DM_pos [iDM][1] = data[i].y;
+          snap.DM_pos [iDM][2] = data[i].z;
+          snap.DM_pos [iDM][3] = data[i].mass;
+          snap.DM_vel [iDM][0] = data[i].vx;
+          snap.DM_vel [iDM][1] = data[i].vy;
+          snap.DM_vel [iDM][2] = data[i].vz;
+          snap.DM_rhoh[iDM][0] = data[i].rho;
+          snap.DM_rhoh[iDM][1] = data[i].h;
+          iDM++;
+          assert(iDM <= nDM);
+          break;
+        default:
+          snap.S_id  [iS]    = data[i].ID;
+          snap.S_pos [iS][0] = data[i].x;
+          snap.S_pos [iS][1] = data[i].y;
+          snap.S_pos [iS][2] = data[i].z;
+          snap.S_pos [iS][3] = data[i].mass;
+          snap.S_vel [iS][0] = data[i].vx;
+          snap.S_vel [iS][1] = data[i].vy;
+          snap.S_vel [iS][2] = data[i].vz;
+          snap.S_rhoh[iS][0] = data[i].rho;
+          snap.S_rhoh[iS][1] = data[i].h;
+          iS++;
+          assert(iS <= nS);
       }
-      
-      for (int i = 0; i < nDM; i++)
-        assert(DM_id[i].getType() == 0);
-      for (int i = 0; i < nS; i++)
-        assert(S_id[i].getType() > 0);
-
-      const double dtWrite = write(rank, comm, 
-          {
-            &DM_id, &DM_pos, &DM_vel, &DM_rhoh,  
-            &S_id, &S_pos, &S_vel, &S_rhoh
-          }, out);
-
-      const double tClose = MPI_Wtime(); 
-      out.close();
-      double dtClose = MPI_Wtime() - tClose;
-
-      const double writeBW = out.computeBandwidth();
-      const double tEnd = MPI_Wtime();
-
-      long long nGlb[2], nLoc[2];
-      nLoc[0] = nDM;
-      nLoc[1] = nS;
-      MPI_Reduce(nLoc, nGlb, 2, MPI_LONG_LONG, MPI_SUM, 0, comm);
-
-
-      if (rank == 0)
-        fprintf(stderr, " BonsaiIO:: total= %g sec nDM= %gM  nS= %gM [open= %g  write= %g close= %g] BW= %g MB/s \n",
-            tEnd-tBeg, nGlb[0]/1e6, nGlb[1]/1e6, dtOpen, dtWrite, dtClose, writeBW/1e6);
     }
+
+    for (size_t i = 0; i < nDM; i++)
+      assert(snap.DM_id[i].getType() == 0);
+    for (size_t i = 0; i < nS; i++)
+      assert(snap.S_id[i].getType() > 0);
+
+    /* the shared memory is free for the next snapshot */
     header[0].done_writing = true;
 
     data.releaseLock();
     header.releaseLock();
+
+    /* previous snapshot must be complete before the next file is opened, this
+     * comes before any other collective so that all ranks stay in the same order */
+    if (pending)
+      pending->finish(rank, comm);
+
+    MPI_Reduce(&ntypeloc, &ntypeglb, ntypecount, MPI_LONG_LONG, MPI_SUM, 0, comm);
+    if (rank == 0)
+    {
+      fprintf(stderr, "writing to %s \n", fn);
+      for (int type = 0; type < ntypecount; type++)
+        if (ntypeglb[type] > 0)
+          fprintf(stderr, " BonsaiIO:: ptype= %d:  np= %zu \n",type, ntypeglb[type]);
+    }
+
+    pending = std::move(next);
+    pending->write(rank, nrank, comm, fn, tCurrent, compressIDs, quantBits);
+  }
+
+  if (pending)
+  {
+    pending->finish(rank, comm);
+    pending.reset();
   }
 
+  return true;
 }
 
 int main(int argc, char * argv[], MPI_Comm commWorld, int shrMemPID)
@@ -245,6 +305,8 @@ int main(int argc, char * argv[], MPI_Comm commWorld, int shrMemPID)
   MPI_Get_processor_name(processor_name,&namelen);
   fprintf(stderr, "bonsai_io:: Rank: %d @ %s , total ranks: %d (mpiInit) \n", rank, processor_name, nrank);
   bool snapDump = true;
+  bool compressIDs = false;
+  int  quantBits   = 0;
   {
 		AnyOption opt;
     
@@ -256,9 +318,13 @@ int main(int argc, char * argv[], MPI_Comm commWorld, int shrMemPID)
 		ADDUSAGE(" ");
 		ADDUSAGE(" -h  --help             Prints this help ");
 		ADDUSAGE(" -q  --quick            Write a subsampled snapshot [default is a full restart-quality snapshots]");
+		ADDUSAGE(" -c  --compress         Lossless delta coding of the IDs [V3 file]");
+		ADDUSAGE("     --quantize #       Store positions and velocities as #-bit fixed point, lossy [V3 file]");
 		
     opt.setFlag( "help" ,   'h');
     opt.setFlag( "quick",  'q');
+    opt.setFlag( "compress",  'c');
+    opt.setOption( "quantize");
     
     opt.processCommandArgs( argc, argv );
 
@@ -271,6 +337,10 @@ int main(int argc, char * argv[], MPI_Comm commWorld, int shrMemPID)
     }
 
     if (opt.getFlag("quick")) snapDump = false;
+    if (opt.getFlag("compress")) compressIDs = true;
+    char *optarg = NULL;
+    if ((optarg = opt.getValue("quantize"))) quantBits = atoi(optarg);
+    assert(quantBits >= 0 && quantBits <= 32);
   }
 
   const std::string mode(snapDump  ? "SNAPSHOT" : "QUICKDUMP");
@@ -281,13 +351,13 @@ int main(int argc, char * argv[], MPI_Comm commWorld, int shrMemPID)
   {
     ShmSHeader shmSHeader(ShmSHeader::type::sharedFile(rank, shrMemPID));
     ShmSData   shmSData  (ShmSData  ::type::sharedFile(rank, shrMemPID));
-    writeLoop(shmSHeader, shmSData, rank, nrank, comm);
+    writeLoop(shmSHeader, shmSData, rank, nrank, comm, compressIDs, quantBits);
   }
   else
   {
     ShmQHeader shmQHeader(ShmQHeader::type::sharedFile(rank, shrMemPID));
     ShmQData   shmQData  (ShmQData  ::type::sharedFile(rank, shrMemPID));
-    writeLoop(shmQHeader, shmQData, rank, nrank, comm);
+    writeLoop(shmQHeader, shmQData, rank, nrank, comm, compressIDs, quantBits);
   }
 
   if (rank == 0)
@@ -1,11 +1,13 @@
 #include "octree.h"
 #include "build.h"
 
-void octree::allocateParticleMemory(tree_structure &tree)
+void octree::allocateParticleMemory(tree_structure &tree, const bool sharedBuffers)
 {
   //Allocates the memory to hold the particles data
   //and the arrays that have the same size as there are
   //particles. Eg valid arrays used in tree construction
+  //sharedBuffers is false for the boundaryTree, which uses the
+  //shared buffers and remoteTree of the local tree
   int n_bodies = tree.n;
 
 
@@ -74,6 +76,7 @@ void octree::allocateParticleMemory(tree_structure &tree)
   tree.node_bodies.cmalloc(tempmem, false);
 
   //General memory buffers
+  if(!sharedBuffers) return;
 
   //Allocate shared buffers
   this->tnext.		  ccalloc(NBLOCK_REDUCE,false);
@@ -195,6 +198,131 @@ void octree::allocateTreePropMemory(tree_structure &tree)
   devContext->stopTiming("Memory", 11, execStream->s());
 }
 
+static inline uint4 get_mask2(int level) {
+  int mask_levels = 3*std::max(MAXLEVELS - level, 0);
+  uint4 mask = {0x3FFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF,0xFFFFFFFF};
+
+  if (mask_levels > 60)
+  {
+    mask.z = 0;
+    mask.y = 0;
+    mask.x = (mask.x >> (mask_levels - 60)) << (mask_levels - 60);
+  }
+  else if (mask_levels > 30) {
+    mask.z = 0;
+    mask.y = (mask.y >> (mask_levels - 30)) << (mask_levels - 30);
+  } else {
+    mask.z = (mask.z >> mask_levels) << mask_levels;
+  }
+
+  return mask;
+}
+
+static inline uint4 mask_key(const uint4 key, const uint4 mask)
+{
+  return make_uint4(key.x & mask.x, key.y & mask.y, key.z & mask.z, 0);
+}
+
+//Host replacement of the build_valid_list / gpuCompact / build_nodes level loop.
+//The bodies are sorted on their PH key, so the children of a node are the
+//consecutive runs of bodies that share the key masked at the child level.
+//These runs (at most 8 per node) are found with a binary search and all nodes
+//of a level are created in parallel, in the same order as the compact based
+//loop would store them. The output (node_bodies, node_key, n_children,
+//level_list, levelOffset, lastLevel and the masked body keys of leafs) is
+//identical, so link_tree and the group construction can follow as usual.
+void octree::build_NodesFromKeys(const int n_bodies, uint4 *bodies_key, uint4 *node_key,
+                                 uint2 *node_bodies, uint *n_children, uint2 *level_list,
+                                 uint *levelOffset, uint *lastLevel)
+{
+  const uint4 key_F = {0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+
+  std::vector<uint2> parents(1, make_uint2(0, n_bodies)); //Body ranges that are split on this level
+  std::vector<uint2> children;
+  std::vector<int>   childOffset;
+
+  uint offset = 0;
+  *lastLevel  = 0;
+
+  for(int level = 0; level < MAXLEVELS; level++)
+  {
+    const int   nParents        = parents.size();
+    const bool  minLevelReached = (*lastLevel != 0);
+    const uint4 mask            = get_mask2(level);
+
+    children.resize(8*nParents);
+    childOffset.resize(nParents+1);
+
+    //Partition the parent ranges on the 3 key bits of this level
+#pragma omp parallel for schedule(dynamic, 64)
+    for(int i=0; i < nParents; i++)
+    {
+      int  nc = 0;
+      uint bi = parents[i].x;
+      while(bi < parents[i].y)
+      {
+        //Find the first body with a different masked key
+        const uint4 key = mask_key(bodies_key[bi], mask);
+        uint l = bi + 1, r = parents[i].y;
+        while(l < r)
+        {
+          const uint m = (l + r) >> 1;
+          if(cmp_uint4(mask_key(bodies_key[m], mask), key) == 0) l = m + 1;
+          else                                                   r = m;
+        }
+        children[8*i + nc++] = make_uint2(bi, l);
+        bi = l;
+      }
+      childOffset[i+1] = nc;
+    }
+
+    childOffset[0] = 0;
+    for(int i=0; i < nParents; i++)
+      childOffset[i+1] += childOffset[i];
+    const int n = childOffset[nParents];
+
+    //Store the nodes, leafs can only have NLEAF particles, mark their bodies as used
+#pragma omp parallel for schedule(dynamic, 64)
+    for(int i=0; i < nParents; i++)
+    {
+      for(int c=0; c < childOffset[i+1]-childOffset[i]; c++)
+      {
+        const int   id  = offset + childOffset[i] + c;
+        const uint2 bij = children[8*i + c];
+
+        node_bodies[id] = make_uint2(bij.x | (level << BITLEVELS), bij.y);
+        node_key   [id] = mask_key(bodies_key[bij.x], mask);
+        n_children [id] = 0;
+
+        if(minLevelReached && (bij.y - bij.x <= NLEAF))
+          for(uint k = bij.x; k < bij.y; k++)
+            bodies_key[k] = key_F;
+      }
+    }
+
+    //The nodes that are not leafs are split on the next level
+    parents.clear();
+    for(int i=0; i < nParents; i++)
+      for(int c=0; c < childOffset[i+1]-childOffset[i]; c++)
+      {
+        const uint2 bij = children[8*i + c];
+        if(!(minLevelReached && (bij.y - bij.x <= NLEAF)))
+          parents.push_back(bij);
+      }
+
+    level_list[level] = (n > 0) ? make_uint2(offset, offset + n) : make_uint2(0, 0);
+    offset           += n;
+
+    if(n > START_LEVEL_MIN_NODES)
+      *lastLevel = 1;
+
+    if ((level > 0) && (n <= 0) && (level_list[level - 1].x > 0))
+      *lastLevel = level;
+  }
+
+  *levelOffset = offset;
+}
+
 void octree::build (tree_structure &tree) {
 
   devContext->startTiming(execStream->s());
@@ -254,7 +382,7 @@ void octree::build (tree_structure &tree) {
   this->devMemCountsx.waitForCopyEvent();
 //  devContext.startTiming(execStream->s());
 
-  if(nProcs > 1)
+  if(nProcs > 1 && !letGather && &tree == &localTree)
   {
       LOGF(stderr,"Before copy ppos valid\n");
     //Start copying the particle positions to the host, will overlap with tree-construction
@@ -265,6 +393,10 @@ void octree::build (tree_structure &tree) {
 
 #if 0
   build_tree_node_levels(*this, validList, compactList, levelOffset, maxLevel, execStream->s());
+#elif defined(USE_HOST)
+  //Bodies and keys are in host memory, build all levels in one call
+  build_NodesFromKeys(tree.n, tree.bodies_key.raw_p(), node_key.raw_p(), tree.node_bodies.raw_p(),
+                      tree.n_children.raw_p(), tree.level_list.raw_p(), levelOffset.raw_p(), maxLevel.raw_p());
 #else
   for (level = 0; level < MAXLEVELS; level++) {
     build_valid_list.execute2(execStream->s());         //Mark bodies to be combined into nodes
@@ -415,9 +547,22 @@ void octree::parallelDataSummary(tree_structure &tree,
 
   //Update if the maximum duration is 10% larger than average duration
   //and always update the first couple of iterations to create load-balance
-  if(iter < 32 || (  100*((maxExecTimePrevStep-avgExecTimePrevStep) / avgExecTimePrevStep) > 10 ))
+  bool imbalanced = 100*((maxExecTimePrevStep-avgExecTimePrevStep) / avgExecTimePrevStep) > 10;
+
+  //Or use the interaction counts of the previous step, these are not affected by timing noise
+  if(lbUseCost && interactionsOnHost && !initialSetup)
+    imbalanced = updateCostImbalance(tree);
+
+  //With the two-level decomposition only an imbalance between nodes needs a global
+  //update, the processes of a node can rebalance among themselves
+  bool updateNode = false;
+  if(ddNodeLevel && !initialSetup)
+    imbalanced = checkNodeImbalance(lastExecTime, imbalanced, updateNode);
+
+  if(iter < 32 || imbalanced)
   {
     updateBoundaries = true;
+    updateNode       = false;
   }
 
   //updateBoundaries = true; //TEST, keep always update for now
@@ -428,7 +573,7 @@ void octree::parallelDataSummary(tree_structure &tree,
   this->getBoundaries(tree, r_min, r_max); //Used for predicted position keys further down
 
   build_key_list.set_args(0, tree.bodies_key.p(), tree.bodies_pos.p(), &tree.n, &tree.corner);
-  if(updateBoundaries)
+  if(updateBoundaries || updateNode)
   {
     //Build keys on current positions, since those are already sorted, while predicted are not
     build_key_list.set_args(0, tree.bodies_key.p(), tree.bodies_pos.p(), &tree.n, &tree.corner);
@@ -441,6 +586,9 @@ void octree::parallelDataSummary(tree_structure &tree,
 
    //Get the global boundaries and compute the corner / size of tree
    this->sendCurrentRadiusInfo(r_min, r_max);
+   //Store the box for sort_bodies. The redistribution below does not change the
+   //union of the predicted positions, so it does not have to be reduced again.
+   rMinGlobal = r_min;   rMaxGlobal = r_max;
    real size     = 1.001f*std::max(r_max.z - r_min.z,
                           std::max(r_max.y - r_min.y, r_max.x - r_min.x));
 
@@ -449,7 +597,7 @@ void octree::parallelDataSummary(tree_structure &tree,
                               0.5f*(r_min.z + r_max.z) - 0.5f*size,
                               size/(1 << MAXLEVELS));
 
-   if(updateBoundaries)
+   if(updateBoundaries || updateNode)
      execStream->sync(); //This one has to be finished when we start updating the domain
                          //as it contains the keys on which we sample to update boundaries
 
@@ -467,6 +615,10 @@ void octree::parallelDataSummary(tree_structure &tree,
                                          &tree.parallelBoundaries[0], lastExecTime,
                                          initialSetup);
    }
+   else if(updateNode)
+   {
+     updateNodeBoundaries(&tree.parallelBoundaries[0], lastExecTime);
+   }
 
 
     domComp = get_time()-t0;
@@ -477,7 +629,9 @@ void octree::parallelDataSummary(tree_structure &tree,
     //Boundaries computed, now exchange the particles
     LOGF(stderr, "Computing, exchanging and recompute of domain boundaries took: %f \n",domComp);
     t0 = get_time();
-    gpuRedistributeParticles_SFC(&tree.parallelBoundaries[0]); //Redistribute the particles
+    //On a pipelined step the arrivals are left in flight for runDomainPipeline
+    const bool deferArrivals = overlapDomain && !initialSetup && !useDirectGravity;
+    gpuRedistributeParticles_SFC(&tree.parallelBoundaries[0], deferArrivals); //Redistribute the particles
     domExch = get_time()-t0;
 
     LOGF(stderr, "Redistribute domain took: %f\n", get_time()-t0);
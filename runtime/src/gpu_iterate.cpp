@@ -1,6 +1,7 @@
 #undef NDEBUG
 #include "octree.h"
 #include  "postProcessModules.h"
+#include "StageScheduler.h"
 
 #include <iostream>
 #include <algorithm>
@@ -15,6 +16,12 @@ cudaEvent_t startLocalGrav;
 cudaEvent_t startRemoteGrav;
 cudaEvent_t endLocalGrav;
 cudaEvent_t endRemoteGrav;
+cudaEvent_t startBoundaryGrav;
+cudaEvent_t endBoundaryGrav;
+
+//With fewer arrivals or staying particles the arrivals are added to the staying
+//particles before the build, the tree construction does not handle trees of a few particles
+static const int minPipelineArrivals = 4*NCRIT;
 
 float runningLETTimeSum, lastTotal, lastLocal;
 
@@ -29,6 +36,11 @@ void octree::makeLET()
   localTree.boxSizeInfo.d2h  (  localTree.n_nodes, false, LETDataToHostStream->s());
   localTree.boxCenterInfo.d2h(  localTree.n_nodes, false, LETDataToHostStream->s());
   localTree.multipole.d2h    (3*localTree.n_nodes, false, LETDataToHostStream->s());
+  //The positions are only copied during the tree-construction, update them on the
+  //other steps so the exported particles are not stale. Not needed in gather mode
+  const bool copyPositions = (iter % rebuild_tree_rate) != 0 && !letGather;
+  if(copyPositions)
+    localTree.bodies_Ppos.d2h(localTree.n, false, LETDataToHostStream->s());
   localTree.boxSizeInfo.waitForCopyEvent();
   localTree.boxCenterInfo.waitForCopyEvent();
   
@@ -40,6 +52,7 @@ void octree::makeLET()
 
 
   localTree.multipole.waitForCopyEvent();
+  if(copyPositions) localTree.bodies_Ppos.waitForCopyEvent();
   double t40 = get_time();
   LOGF(stderr,"MakeLET Preparing data-copy: %lg  sendGroups: %lg Total: %lg \n",
                t10-t00, t20-t10, t40-t00);
@@ -73,6 +86,8 @@ void octree::iterate_setup() {
       CU_SAFE_CALL(cudaEventCreate(&endLocalGrav));
       CU_SAFE_CALL(cudaEventCreate(&startRemoteGrav));
       CU_SAFE_CALL(cudaEventCreate(&endRemoteGrav));
+      CU_SAFE_CALL(cudaEventCreate(&startBoundaryGrav));
+      CU_SAFE_CALL(cudaEventCreate(&endBoundaryGrav));
 
       devContext->writeLogEvent("Start execution\n");
   }
@@ -135,6 +150,7 @@ bool octree::iterate_once(IterationData &idata) {
     
     bool forceTreeRebuild = false;
     bool needDomainUpdate = true;
+    bool pipelineStep     = false;  //The arrivals of the domain update go through runDomainPipeline
 
     double tTempTime = get_time();
 
@@ -162,14 +178,28 @@ bool octree::iterate_once(IterationData &idata) {
         idata.totalDomUp += domUp;
         idata.totalDomEx += domEx;
 
-        devContext->startTiming(execStream->s());
-        mpiSync();
-        devContext->stopTiming("DomainUnbalance", 12, execStream->s());
+        if(!overlapDomain)
+        {
+          devContext->startTiming(execStream->s());
+          mpiSync();
+          devContext->stopTiming("DomainUnbalance", 12, execStream->s());
+        }
 
         idata.totalDomWait += get_time()-tZZ;
 
-        needDomainUpdate    = false; //We did a boundary sync in the parallel decomposition part
-        needDomainUpdate    = true; //TODO if I set it to false results degrade. Check why, for now just updte
+        //parallelDataSummary stored the union box of the predicted positions in
+        //rMinGlobal/rMaxGlobal. The redistribution only moves particles between
+        //processes, so that box is unchanged and sort_bodies can reuse it
+        needDomainUpdate    = false;
+
+        #ifdef USE_MPI
+          if(pendingExchange.active)
+          {
+            pipelineStep = pendingExchange.recvCount >= minPipelineArrivals &&
+                           localTree.n               >= minPipelineArrivals;
+            if(!pipelineStep) appendReceivedParticles(localTree);
+          }
+        #endif
       }
     }
 
@@ -186,7 +216,23 @@ bool octree::iterate_once(IterationData &idata) {
       bool rebuild_tree = true;
 
       rebuild_tree = ((iter % rebuild_tree_rate) == 0);
-      if(rebuild_tree)
+      if(pipelineStep)
+      {
+        //Builds the tree and computes the local gravity, the build time
+        //is included in the gravity time since the two overlap
+        t1 = get_time();
+        runDomainPipeline();
+
+        #ifdef DO_BLOCK_TIMESTEP
+                devContext->startTiming(execStream->s());
+                setActiveGrpsFunc(this->localTree);
+                devContext->stopTiming("setActiveGrpsFunc", 10, execStream->s());
+                idata.Nact_since_last_tree_rebuild = 0;
+        #endif
+
+        idata.lastBuildTime   = 0;
+      }
+      else if(rebuild_tree)
       {
         //Rebuild the tree
         t1 = get_time();
@@ -221,11 +267,14 @@ bool octree::iterate_once(IterationData &idata) {
 
       }//end rebuild tree
 
-      //Approximate gravity
-      t1 = get_time();
-      //devContext.startTiming(gravStream->s());
-      approximate_gravity(this->localTree);
-//      devContext.stopTiming("Approximation", 4, gravStream->s());
+      //Approximate gravity, the pipeline already did the local part
+      if(!pipelineStep)
+      {
+        t1 = get_time();
+        //devContext.startTiming(gravStream->s());
+        approximate_gravity(this->localTree);
+//        devContext.stopTiming("Approximation", 4, gravStream->s());
+      }
 
       runningLETTimeSum = 0;
 
@@ -244,6 +293,7 @@ bool octree::iterate_once(IterationData &idata) {
     tTempTime = get_time();
 #if 1
    localTree.interactions.d2h();
+   interactionsOnHost = true; //Used by the cost based load balancer
 
    long long directSum = 0;
    long long apprSum = 0;
@@ -257,6 +307,11 @@ bool octree::iterate_once(IterationData &idata) {
    sprintf(buff2, "INT Interaction at (rank= %d ) iter: %d\tdirect: %llu\tappr: %llu\tavg dir: %f\tavg appr: %f\n",
                    procId,iter, directSum ,apprSum, directSum / (float)localTree.n, apprSum / (float)localTree.n);
    devContext->writeLogEvent(buff2);
+   //Throughput reference for comparing the GPU and host (USE_HOST) kernels
+   sprintf(buff2, "INT Throughput at (rank= %d ) iter: %d\tinteractions/sec: %g\n",
+                   procId, iter, (directSum + apprSum) / idata.lastGravTime);
+   LOGF(stderr, "%s", buff2);
+   devContext->writeLogEvent(buff2);
 #endif
    LOGF(stderr,"Stats calculation took: %lg \n", get_time()-tTempTime);
 
@@ -264,6 +319,12 @@ bool octree::iterate_once(IterationData &idata) {
     float ms=0, msLET=0;
 #if 1 //enable when load-balancing, gets the accurate GPU time from events
     CU_SAFE_CALL(cudaEventElapsedTime(&ms, startLocalGrav, endLocalGrav));
+    if(pipelineStep)
+    {
+      float msBoundary = 0;
+      CU_SAFE_CALL(cudaEventElapsedTime(&msBoundary, startBoundaryGrav, endBoundaryGrav));
+      ms += msBoundary;
+    }
     if(nProcs > 1)  CU_SAFE_CALL(cudaEventElapsedTime(&msLET,startRemoteGrav, endRemoteGrav));
 
     msLET += runningLETTimeSum;
@@ -684,6 +745,108 @@ if(firstIter0 == true || iter == 40){
 }
 //end approximate
 
+//Walks the groups of tree through the nodes of srcTree, with accumulate the
+//result is added to what is already in acc1. Used by the domain pipeline for
+//the interactions between the staying and the received particles
+void octree::approximate_gravity_boundary(tree_structure &tree, tree_structure &srcTree, const bool accumulate)
+{
+  uint2 node_begend;
+  int level_start = srcTree.startLevelMin;
+  node_begend.x   = srcTree.level_list[level_start].x;
+  node_begend.y   = srcTree.level_list[level_start].y;
+
+  //The LET kernel is the local kernel that adds to the previous result
+  my_dev::kernel &walk = accumulate ? approxGravLET : approxGrav;
+
+  tree.activePartlist.zeroMemGPUAsync(gravStream->s()); //Resets atomics
+
+  walk.set_args(0, &tree.n_active_groups,
+                   &tree.n,
+                   &(this->eps2),
+                   &node_begend,
+                   tree.active_group_list.p(),
+                   srcTree.bodies_Ppos.p(),
+                   srcTree.multipole.p(),
+                   tree.bodies_acc1.p(),
+                   tree.bodies_Ppos.p(),
+                   tree.ngb.p(),
+                   tree.activePartlist.p(),
+                   tree.interactions.p(),
+                   srcTree.boxSizeInfo.p(),
+                   tree.groupSizeInfo.p(),
+                   srcTree.boxCenterInfo.p(),
+                   tree.groupCenterInfo.p(),
+                   tree.bodies_Pvel.p(),
+                   tree.generalBuffer1.p(),  //The buffer to store the tree walks
+                   tree.bodies_h.p(),        //Per particle search radius
+                   tree.bodies_dens.p());    //Per particle density (x) and nnb (y)
+
+  walk.set_texture<real4>(0,  srcTree.boxSizeInfo,    "texNodeSize");
+  walk.set_texture<real4>(1,  srcTree.boxCenterInfo,  "texNodeCenter");
+  walk.set_texture<real4>(2,  srcTree.multipole,      "texMultipole");
+  walk.set_texture<real4>(3,  srcTree.bodies_Ppos,    "texBody");
+
+  walk.setWork(-1, NTHREAD, nBlocksForTreeWalk);
+  walk.execute2(gravStream->s());
+}
+
+//Rebuild step with the arrivals of the domain update still in flight. The
+//staying (interior) particles are sorted, built into the local tree and
+//their gravity is started. The arrivals get a tree of their own, the walks
+//between the two sets are added and then the boundary tree is merged into the
+//local tree under a new root, without a rebuild
+void octree::runDomainPipeline()
+{
+#ifdef USE_MPI
+  const int nInterior = localTree.n;
+  StageScheduler pipeline;
+
+  const int arrivals = pipeline.add("arrivals",
+      [&]{ loadBoundaryParticles(boundaryTree); }, {},
+      [&]{ return testParticleExchange(); },
+      [&]{ waitParticleExchange(false); });
+
+  const int boundaryBuild = pipeline.add("boundaryTree", [&]{
+      sort_bodies(boundaryTree, false);
+      build(boundaryTree);
+      allocateTreePropMemory(boundaryTree);
+      compute_properties(boundaryTree);
+    }, {arrivals});
+
+  const int interiorBuild = pipeline.add("interiorTree", [&]{
+      sort_bodies(localTree, false);
+      build(localTree);
+      allocateTreePropMemory(localTree);
+      compute_properties(localTree);
+    });
+
+  const int interiorGrav = pipeline.add("interiorGravity",
+      [&]{ approximate_gravity(localTree); }, {interiorBuild});
+
+  //Adds to the interior result, so it has to follow the interior walk
+  const int boundaryGrav = pipeline.add("boundaryGravity", [&]{
+      CU_SAFE_CALL(cudaEventRecord(startBoundaryGrav, gravStream->s()));
+      approximate_gravity_boundary(localTree,    boundaryTree, true);
+      approximate_gravity_boundary(boundaryTree, localTree,    false);
+      approximate_gravity_boundary(boundaryTree, boundaryTree, true);
+      CU_SAFE_CALL(cudaEventRecord(endBoundaryGrav, gravStream->s()));
+    }, {interiorGrav, boundaryBuild});
+
+  pipeline.add("merge", [&]{ mergeBoundaryTree(localTree, boundaryTree); }, {boundaryGrav});
+
+  pipeline.run();
+  waitParticleExchange(); //Our own sends
+
+  char stages[1024];
+  pipeline.report(stages, sizeof(stages));
+  char buff[1280];
+  sprintf(buff, "PIPELINE-%d: nInterior: %d nArrived: %d tWait: %lg%s\n",
+          procId, nInterior, boundaryTree.n, pipeline.waitTime(), stages);
+  LOGF(stderr, "%s", buff);
+  devContext->writeLogEvent(buff);
+#endif
+}
+
 
 void octree::approximate_gravity_let(tree_structure &tree, tree_structure &remoteTree, int bufferSize, bool doActiveParticles)
 {
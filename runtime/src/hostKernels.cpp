@@ -0,0 +1,1867 @@
+//Host (OpenMP) implementations of the compute kernels in CUDAkernels/.
+//Only compiled when building with USE_HOST, each kernel keeps the exact
+//signature of its CUDA counterpart so that load_kernels.cpp can connect
+//to it via the same symbol and the same argument lists.
+
+#include "octree.h"
+#include "hostPHKey.h"
+#include "radix.h"
+#include <algorithm>
+#include <numeric>
+#include <omp.h>
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+typedef unsigned long long ullong;
+
+namespace my_dev {
+
+  thread_local hostLaunchConfig hostLaunch;
+
+  static std::map<const void*, hostKernelLauncher> &hostKernelRegistry()
+  {
+    static std::map<const void*, hostKernelLauncher> registry;
+    return registry;
+  }
+
+  void registerHostKernel(const void *funcPointer, hostKernelLauncher launcher)
+  {
+    hostKernelRegistry()[funcPointer] = launcher;
+  }
+
+  hostKernelLauncher findHostKernel(const void *funcPointer)
+  {
+    std::map<const void*, hostKernelLauncher>::iterator it = hostKernelRegistry().find(funcPointer);
+    return (it == hostKernelRegistry().end()) ? NULL : it->second;
+  }
+}
+
+
+//Replacements for the CUDA builtins used by the kernels
+
+double get_time() {
+  struct timeval Tvalue;
+  struct timezone dummy;
+
+  gettimeofday(&Tvalue,&dummy);
+  return ((double) Tvalue.tv_sec +1.e-6*((double) Tvalue.tv_usec));
+}
+
+//No textures on the host
+const void* getTexturePointer(const char* name)
+{
+  return NULL;
+}
+
+static inline float int_as_float(const uint i) { float f; memcpy(&f, &i, sizeof(f)); return f; }
+static inline uint  float_as_uint(const float f) { uint i; memcpy(&i, &f, sizeof(i)); return i; }
+
+//Total number of blocks of the current launch
+static inline int hostNumBlocks()
+{
+  return my_dev::hostLaunch.gridDim.x*my_dev::hostLaunch.gridDim.y;
+}
+
+
+/********** Support functions, see CUDAkernels/support_kernels.cu **********/
+
+//The device version swaps y and z before encoding
+static inline uint4 get_key(int4 crd)
+{
+  return host_get_key_lut(crd.x, crd.z, crd.y);
+}
+
+static uint4 get_mask(int level) {
+  int mask_levels = 3*std::max(MAXLEVELS - level, 0);
+  uint4 mask = {0x3FFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF,0xFFFFFFFF};
+
+  if (mask_levels > 60)
+  {
+    mask.z = 0;
+    mask.y = 0;
+    mask.x = (mask.x >> (mask_levels - 60)) << (mask_levels - 60);
+  }
+  else if (mask_levels > 30) {
+    mask.z = 0;
+    mask.y = (mask.y >> (mask_levels - 30)) << (mask_levels - 30);
+  } else {
+    mask.z = (mask.z >> mask_levels) << mask_levels;
+  }
+
+  return mask;
+}
+
+//cmp_uint4 is defined in octree.h
+
+//Binary search of the key within the node list
+static int find_key(uint4 key, uint2 cij, uint4 *keys) {
+  int l = cij.x;
+  int r = cij.y - 1;
+  while (r - l > 1) {
+    int m = (r + l) >> 1;
+    int cmp = cmp_uint4(keys[m], key);
+    if (cmp == -1) {
+      l = m;
+    } else {
+      r = m;
+    }
+  }
+  if (cmp_uint4(keys[l], key) >= 0) return l;
+
+  return r;
+}
+
+static inline int4 get_crd(const real4 pos, const real4 corner)
+{
+  const real domain_fac = corner.w;
+  int4 crd;
+  crd.x = (int)roundf((pos.x - corner.x) / domain_fac);
+  crd.y = (int)roundf((pos.y - corner.y) / domain_fac);
+  crd.z = (int)roundf((pos.z - corner.z) / domain_fac);
+  return crd;
+}
+
+
+/********** Scan, compact, split, see CUDAkernels/scanKernels.cu **********/
+
+//Start (in uints) and number of items of the range handled by block 'bid'
+static inline void compactRange(const setupParams &sParam, const int bid, int &offSet, int &nItems)
+{
+  int jobSize = sParam.jobs;
+  if(bid < sParam.blocksWithExtraJobs)
+    jobSize++;
+
+  if(bid <= sParam.blocksWithExtraJobs)
+    offSet = (sParam.jobs+1)*64*bid;
+  else
+  {
+    offSet  = sParam.blocksWithExtraJobs*(sParam.jobs+1)*64;
+    offSet += (bid-sParam.blocksWithExtraJobs)*(sParam.jobs)*64;
+  }
+  nItems = jobSize*64;
+}
+
+extern "C" void compact_count(volatile uint2 *values,
+                              uint *counts,
+                              const int N,
+                              setupParams sParam,
+                              const uint *workToDo)
+{
+  if ((workToDo == 0) || (*workToDo == 0)) return;
+
+  const uint *value2  = (const uint*)values;
+  const int   nBlocks = my_dev::hostLaunch.gridDim.x*my_dev::hostLaunch.blockDim.y;
+
+#pragma omp parallel for
+  for(int bid=0; bid < nBlocks; bid++)
+  {
+    int offSet, nItems;
+    compactRange(sParam, bid, offSet, nItems);
+    uint count = 0;
+    for(int i=offSet; i < offSet+nItems; i++)
+      count += value2[i] >> 31;
+    counts[bid] = count;
+  }
+
+  uint count = 0;
+  for(int i=sParam.extraOffset; i < N; i++)
+    count += value2[i] >> 31;
+  counts[nBlocks] = count;
+}
+HOST_KERNEL_REGISTER(compact_count);
+
+extern "C" void exclusive_scan_block(int *ptr, const int N, int *count)
+{
+  if (*count == 0) return;
+
+  const int n = my_dev::hostLaunch.blockDim.x;
+  int sum = 0;
+  for(int i=0; i < n; i++)
+  {
+    const int value = (i < N+1) ? ptr[i] : 0;
+    ptr[i] = sum;
+    sum   += value;
+  }
+  *count = ptr[n-1];
+}
+HOST_KERNEL_REGISTER(exclusive_scan_block);
+
+extern "C" void compact_move(uint2 *values,
+                             uint *output,
+                             uint *counts,
+                             const int N,
+                             setupParams sParam,
+                             const uint *workToDo)
+{
+  if ((workToDo == 0) || (*workToDo == 0)) return;
+
+  const uint *value2  = (const uint*)values;
+  const int   nBlocks = my_dev::hostLaunch.gridDim.x*my_dev::hostLaunch.blockDim.y;
+
+#pragma omp parallel for
+  for(int bid=0; bid < nBlocks; bid++)
+  {
+    int offSet, nItems;
+    compactRange(sParam, bid, offSet, nItems);
+    uint outputOffset = counts[bid];
+    for(int i=offSet; i < offSet+nItems; i++)
+      if(value2[i] >> 31)
+        output[outputOffset++] = value2[i] & 0x7FFFFFFF;
+  }
+
+  uint outputOffset = counts[nBlocks];
+  for(int i=sParam.extraOffset; i < N; i++)
+    if(value2[i] >> 31)
+      output[outputOffset++] = value2[i] & 0x7FFFFFFF;
+}
+HOST_KERNEL_REGISTER(compact_move);
+
+extern "C" void split_move(uint2 *valid,
+                           uint *output,
+                           uint *counts,
+                           const int N,
+                           setupParams sParam)
+{
+  const uint *value2  = (const uint*)valid;
+  const int   nBlocks = my_dev::hostLaunch.gridDim.x*my_dev::hostLaunch.blockDim.y;
+
+  //The invalid items start at: totalValidItems + startReadOffset - startOutputOffset
+#pragma omp parallel for
+  for(int bid=0; bid < nBlocks; bid++)
+  {
+    int offSet, nItems;
+    compactRange(sParam, bid, offSet, nItems);
+    uint outputOffset      = counts[bid];
+    uint rightOutputOffset = counts[nBlocks+1] + offSet - outputOffset;
+    for(int i=offSet; i < offSet+nItems; i++)
+    {
+      if(value2[i] >> 31)
+        output[outputOffset++]      = value2[i] & 0x7FFFFFFF;
+      else
+        output[rightOutputOffset++] = value2[i] & 0x7FFFFFFF;
+    }
+  }
+
+  uint outputOffset      = counts[nBlocks];
+  uint rightOutputOffset = counts[nBlocks+1] + sParam.extraOffset - outputOffset;
+  for(int i=sParam.extraOffset; i < N; i++)
+  {
+    if(value2[i] >> 31)
+      output[outputOffset++]      = value2[i] & 0x7FFFFFFF;
+    else
+      output[rightOutputOffset++] = value2[i] & 0x7FFFFFFF;
+  }
+}
+HOST_KERNEL_REGISTER(split_move);
+
+
+/********** Tree construction, see CUDAkernels/build_tree.cu **********/
+
+//The reductions store the full result in the first block entry, the
+//others get the neutral value so the host-side final reduction is unchanged
+static void boundaryReductionStore(float3 *output_min, float3 *output_max,
+                                   const float3 r_min, const float3 r_max)
+{
+  const int nBlocks = hostNumBlocks();
+  output_min[0] = r_min;
+  output_max[0] = r_max;
+  for(int i=1; i < nBlocks; i++)
+  {
+    output_min[i] = make_float3(+1e10f, +1e10f, +1e10f);
+    output_max[i] = make_float3(-1e10f, -1e10f, -1e10f);
+  }
+}
+
+extern "C" void gpu_boundaryReduction(const int n_particles,
+                                      real4     *positions,
+                                      float3    *output_min,
+                                      float3    *output_max)
+{
+  float minx = +1e10f, miny = +1e10f, minz = +1e10f;
+  float maxx = -1e10f, maxy = -1e10f, maxz = -1e10f;
+
+#pragma omp parallel for reduction(min:minx,miny,minz) reduction(max:maxx,maxy,maxz)
+  for(int i=0; i < n_particles; i++)
+  {
+    const real4 pos = positions[i];
+    minx = fminf(pos.x, minx); miny = fminf(pos.y, miny); minz = fminf(pos.z, minz);
+    maxx = fmaxf(pos.x, maxx); maxy = fmaxf(pos.y, maxy); maxz = fmaxf(pos.z, maxz);
+  }
+
+  boundaryReductionStore(output_min, output_max,
+                         make_float3(minx, miny, minz), make_float3(maxx, maxy, maxz));
+}
+HOST_KERNEL_REGISTER(gpu_boundaryReduction);
+
+extern "C" void gpu_boundaryReductionGroups(const int n_groups,
+                                            real4     *positions,
+                                            real4     *sizes,
+                                            float3    *output_min,
+                                            float3    *output_max)
+{
+  float minx = +1e10f, miny = +1e10f, minz = +1e10f;
+  float maxx = -1e10f, maxy = -1e10f, maxz = -1e10f;
+
+#pragma omp parallel for reduction(min:minx,miny,minz) reduction(max:maxx,maxy,maxz)
+  for(int i=0; i < n_groups; i++)
+  {
+    const real4 pos  = positions[i];
+    const real4 size = sizes[i];
+    minx = fminf(pos.x-size.x, minx); miny = fminf(pos.y-size.y, miny); minz = fminf(pos.z-size.z, minz);
+    maxx = fmaxf(pos.x+size.x, maxx); maxy = fmaxf(pos.y+size.y, maxy); maxz = fmaxf(pos.z+size.z, maxz);
+  }
+
+  boundaryReductionStore(output_min, output_max,
+                         make_float3(minx, miny, minz), make_float3(maxx, maxy, maxz));
+}
+HOST_KERNEL_REGISTER(gpu_boundaryReductionGroups);
+
+extern "C" void cl_build_key_list(uint4  *body_key,
+                                  real4  *body_pos,
+                                  int     n_bodies,
+                                  real4   corner)
+{
+  //Note the <= the extra item is the boundary key
+#pragma omp parallel for
+  for(int id=0; id <= n_bodies; id++)
+  {
+    uint4 key = get_key(get_crd(body_pos[id], corner));
+
+    if (id == n_bodies) key = make_uint4(0xFFFFFFFF, 0xFFFFFFFF, 0, 0);
+
+    key.w        = id;
+    body_key[id] = key;
+  }
+}
+HOST_KERNEL_REGISTER(cl_build_key_list);
+
+extern "C" void cl_build_valid_list(int n_bodies,
+                                    int level,
+                                    uint4  *body_key,
+                                    uint *valid_list,
+                                    const uint *workToDo)
+{
+  if (0 == *workToDo) return;
+
+  const uint4 key_F = {0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+
+  uint4 mask = get_mask(level);
+  mask.x     = mask.x | ((uint)1 << 30) | ((uint)1 << 31);
+
+#pragma omp parallel for
+  for(int id=0; id < n_bodies; id++)
+  {
+    uint4 key_c = body_key[id];
+    uint4 key_m = (id == 0)           ? key_F : body_key[id-1];
+    uint4 key_p = (id+1 <  n_bodies)  ? body_key[id+1] : key_F;
+
+    int valid0 = 0;
+    int valid1 = 0;
+
+    if (cmp_uint4(key_c, key_F) != 0) {
+      key_c.x = key_c.x & mask.x; key_c.y = key_c.y & mask.y; key_c.z = key_c.z & mask.z;
+      key_p.x = key_p.x & mask.x; key_p.y = key_p.y & mask.y; key_p.z = key_p.z & mask.z;
+      key_m.x = key_m.x & mask.x; key_m.y = key_m.y & mask.y; key_m.z = key_m.z & mask.z;
+
+      valid0 = abs(cmp_uint4(key_c, key_m));
+      valid1 = abs(cmp_uint4(key_c, key_p));
+    }
+
+    valid_list[id*2]   = id | ((uint)(valid0) << 31);
+    valid_list[id*2+1] = id | ((uint)(valid1) << 31);
+  }
+}
+HOST_KERNEL_REGISTER(cl_build_valid_list);
+
+extern "C" void cl_build_nodes(uint level,
+                               uint  *compact_list_len,
+                               uint  *level_offset,
+                               uint  *last_level,
+                               uint2 *level_list,
+                               uint  *compact_list,
+                               uint4 *bodies_key,
+                               uint4 *node_key,
+                               uint  *n_children,
+                               uint2 *node_bodies)
+{
+  const int  n               = (*compact_list_len)/2;
+  const uint offset          = *level_offset;
+  const bool minLevelReached = (int)*last_level;
+  const uint4 mask           = get_mask(level);
+
+#pragma omp parallel for
+  for (int id=0; id < n; id++)
+  {
+    const uint bi   = compact_list[id*2];
+    const uint bj   = compact_list[id*2+1] + 1;
+
+    const uint4 key = bodies_key[bi];
+
+    node_bodies[offset+id] = make_uint2(bi | (level << BITLEVELS), bj);
+    node_key   [offset+id] = make_uint4(key.x & mask.x, key.y & mask.y, key.z & mask.z, 0);
+    n_children [offset+id] = 0;
+
+    //Leaf can only have NLEAF particles, mark its bodies as used
+    if(minLevelReached)
+      if (bj - bi <= NLEAF)
+        for (uint i = bi; i < bj; i++)
+          bodies_key[i] = make_uint4(0xFFFFFFFF,0xFFFFFFFF,0xFFFFFFFF,0xFFFFFFFF);
+  }
+
+  level_list[level] = (n > 0) ? make_uint2(offset, offset + n) : make_uint2(0, 0);
+  *level_offset     = offset + n;
+
+  if(n > START_LEVEL_MIN_NODES)
+    *last_level = 1;
+
+  if ((level > 0) && (n <= 0) && (level_list[level - 1].x > 0))
+    *last_level = level;
+}
+HOST_KERNEL_REGISTER(cl_build_nodes);
+
+extern "C" void cl_link_tree(int n_nodes,
+                             uint *n_children,
+                             uint2 *node_bodies,
+                             real4 *bodies_pos,
+                             real4 corner,
+                             uint2 *level_list,
+                             uint* valid_list,
+                             uint4 *node_keys,
+                             uint4 *bodies_key,
+                             uint  levelMin)
+{
+#pragma omp parallel for
+  for(int id=0; id < n_nodes; id++)
+  {
+    const uint2 bij  = node_bodies[id];
+    const uint level = (bij.x &  LEVELMASK) >> BITLEVELS;
+    const uint bi    =  bij.x & ILEVELMASK;
+    const uint bj    =  bij.y;
+
+    const uint4 crdKey = get_key(get_crd(bodies_pos[bi], corner));
+
+    //Accumulate children, the root has no parent
+    if(id > 0)
+    {
+      const uint4 mask = get_mask(level - 1);
+      const uint4 key  = make_uint4(crdKey.x & mask.x, crdKey.y & mask.y, crdKey.z & mask.z, 0);
+      const int   ci   = find_key(key, level_list[level-1], node_keys);
+      __sync_fetch_and_add(&n_children[ci], (1 << 28));
+    }
+
+    //Store the 1st child
+    const uint4 mask = get_mask(level);
+    const uint4 key  = make_uint4(crdKey.x & mask.x, crdKey.y & mask.y, crdKey.z & mask.z, 0);
+    const int   cj   = find_key(key, level_list[level+1], node_keys);
+    __sync_fetch_and_or(&n_children[id], (uint)cj);
+
+    //If valid its a leaf otherwise a node
+    uint valid = id;
+    if ((int)level > (int)(levelMin))
+      if ((bj - bi) <= NLEAF)
+        valid = id | (uint)(1 << 31);
+
+    valid_list[id] = valid;
+  }
+}
+HOST_KERNEL_REGISTER(cl_link_tree);
+
+extern "C" void gpu_build_level_list(const int    n_nodes,
+                                     const int    n_leafs,
+                                     uint  *leafsIdxs,
+                                     uint2 *node_bodies,
+                                     uint  *valid_list)
+{
+  const int n = n_nodes-n_leafs;
+
+#pragma omp parallel for
+  for(int id=0; id < n; id++)
+  {
+    const int nodeID = leafsIdxs[id+n_leafs];
+
+    const int level_c = (node_bodies[nodeID].x & LEVELMASK) >> BITLEVELS;
+    const int level_p = (id+1 < n) ? (int)((node_bodies[leafsIdxs[id+1+n_leafs]].x & LEVELMASK) >> BITLEVELS)
+                                   : MAXLEVELS+5; //Last is always an end
+    const int level_m = (nodeID == 0) ? -1
+                                      : (int)((node_bodies[leafsIdxs[id-1+n_leafs]].x & LEVELMASK) >> BITLEVELS);
+
+    valid_list[id*2]   = (uint)(level_c != level_m) << 31 | (id+n_leafs);
+    valid_list[id*2+1] = (uint)(level_c != level_p) << 31 | (id+n_leafs);
+  }
+}
+HOST_KERNEL_REGISTER(gpu_build_level_list);
+
+extern "C" void build_group_list2(const int   n_particles,
+                                  uint       *validList,
+                                  const uint2 startLevelBeginEnd,
+                                  uint2      *node_bodies,
+                                  int        *node_level_list,
+                                  int         treeDepth)
+{
+  //Convert the begin/end pairs into a list of level starts
+  int shmem[MAXLEVELS*2];
+  memcpy(shmem, node_level_list, sizeof(shmem));
+  for(int i=0; i < MAXLEVELS; i++)
+  {
+    node_level_list[i] = shmem[i*2];
+    if(i == treeDepth-1)
+      node_level_list[i] = shmem[i*2-1]+1;
+  }
+
+#pragma omp parallel for
+  for(int idx=0; idx < n_particles; idx++)
+  {
+    //The -1 to prevent last node
+    if (idx < (int)startLevelBeginEnd.y-1)
+    {
+      const uint lastChild       = node_bodies[idx].y;
+      validList[2*lastChild - 1] = lastChild | (uint)(1 << 31);
+      validList[2*lastChild]     = lastChild | (uint)(1 << 31);
+    }
+
+    const bool validStart = ((idx     % NCRIT) == 0);
+    const bool validEnd   = (((idx+1) % NCRIT) == 0) || (idx+1 == n_particles);
+
+    if(validStart) validList[2*idx + 0] = (idx)   | (uint)(1 << 31);
+    if(validEnd)   validList[2*idx + 1] = (idx+1) | (uint)(1 << 31);
+  }
+}
+HOST_KERNEL_REGISTER(build_group_list2);
+
+extern "C" void store_group_list(int    n_particles,
+                                 int    n_groups,
+                                 uint  *validList,
+                                 uint  *body2group_list,
+                                 uint2 *group_list)
+{
+#pragma omp parallel for
+  for(int bid=0; bid < n_groups; bid++)
+  {
+    const int start = validList[2*bid];
+    const int end   = validList[2*bid+1];
+
+    for(int i=start; i < end; i++)
+      body2group_list[i] = bid;
+
+    group_list[bid] = make_uint2(start,end);
+  }
+}
+HOST_KERNEL_REGISTER(store_group_list);
+
+//Copies the nodes of one tree into a merged tree in which every level has moved
+//down by one. Per source level levelMap holds: x the first source node, y the
+//first merged node, z and w the shift of the leaf and non-leaf entries in leafNodeIdx
+extern "C" void merge_tree_nodes(const int n_nodes,
+                                 const int n_leafs,
+                                 const uint bodyOffset,
+                                 int4  *levelMap,
+                                 uint2 *src_node_bodies,
+                                 uint  *src_n_children,
+                                 uint  *src_leafNodeIdx,
+                                 real4 *src_multipole,
+                                 real4 *src_boxSizeInfo,
+                                 real4 *src_boxCenterInfo,
+                                 uint2 *node_bodies,
+                                 uint  *n_children,
+                                 uint  *leafNodeIdx,
+                                 real4 *multipole,
+                                 real4 *boxSizeInfo,
+                                 real4 *boxCenterInfo)
+{
+#pragma omp parallel for
+  for(int idx=0; idx < n_nodes; idx++)
+  {
+    const uint2 bij   = src_node_bodies[idx];
+    const uint  level = (bij.x & LEVELMASK) >> BITLEVELS;
+    const int   dst   = levelMap[level].y + (idx - levelMap[level].x);
+
+    node_bodies[dst] = make_uint2(((bij.x & ILEVELMASK) + bodyOffset) | ((level+1) << BITLEVELS),
+                                  bij.y + bodyOffset);
+
+    //Leaves have no children, their first child field is not used
+    uint children = src_n_children[idx];
+    if(children >> 28)
+      children = (levelMap[level+1].y + ((children & 0x0FFFFFFF) - levelMap[level+1].x)) | (children & 0xF0000000);
+    else
+      children = 0;
+    n_children[dst] = children;
+
+    multipole[3*dst + 0] = src_multipole[3*idx + 0];
+    multipole[3*dst + 1] = src_multipole[3*idx + 1];
+    multipole[3*dst + 2] = src_multipole[3*idx + 2];
+
+    const real4 center = src_boxCenterInfo[idx];
+    real4 size         = src_boxSizeInfo[idx];
+    if(center.w <= 0)
+    {
+      //Leaf, points to its particles
+      const uint pfirst = float_as_uint(size.w);
+      const uint mask   = (1 << LEAFBIT) - 1;
+      size.w = int_as_float(((pfirst & mask) + bodyOffset) | (pfirst & ~mask));
+    }
+    else
+      size.w = int_as_float(children);
+    boxCenterInfo[dst] = center;
+    boxSizeInfo  [dst] = size;
+
+    //The leaves and non-leaves are sorted on their level
+    const uint  node      = src_leafNodeIdx[idx];
+    const uint  nodeLevel = (src_node_bodies[node].x & LEVELMASK) >> BITLEVELS;
+    const int   shift     = (idx < n_leafs) ? levelMap[nodeLevel].z : levelMap[nodeLevel].w;
+    leafNodeIdx[idx + shift] = levelMap[nodeLevel].y + (node - levelMap[nodeLevel].x);
+  }
+}
+HOST_KERNEL_REGISTER(merge_tree_nodes);
+
+//Copies the groups of one tree into a merged tree, the particles of the
+//tree start at bodyOffset and its groups at groupOffset
+extern "C" void merge_tree_groups(const int n_particles,
+                                  const int n_groups,
+                                  const uint bodyOffset,
+                                  const uint groupOffset,
+                                  uint  *src_body2group_list,
+                                  uint  *src_oriParticleOrder,
+                                  uint2 *src_group_list,
+                                  real4 *src_groupSizeInfo,
+                                  real4 *src_groupCenterInfo,
+                                  uint  *body2group_list,
+                                  uint  *oriParticleOrder,
+                                  uint2 *group_list,
+                                  real4 *groupSizeInfo,
+                                  real4 *groupCenterInfo)
+{
+#pragma omp parallel for
+  for(int idx=0; idx < n_particles; idx++)
+  {
+    body2group_list [bodyOffset + idx] = src_body2group_list[idx] + groupOffset;
+    oriParticleOrder[bodyOffset + idx] = src_oriParticleOrder[idx] + bodyOffset;
+  }
+
+#pragma omp parallel for
+  for(int idx=0; idx < n_groups; idx++)
+  {
+    const uint2 grp = src_group_list[idx];
+    group_list[groupOffset + idx] = make_uint2(grp.x + bodyOffset, grp.y + bodyOffset);
+
+    real4 size         = src_groupSizeInfo[idx];
+    const uint start   = float_as_uint(size.w);
+    const uint mask    = (1 << CRITBIT) - 1;
+    size.w             = int_as_float(((start & mask) + bodyOffset) | (start & ~mask));
+    groupSizeInfo  [groupOffset + idx] = size;
+    groupCenterInfo[groupOffset + idx] = src_groupCenterInfo[idx];
+  }
+}
+HOST_KERNEL_REGISTER(merge_tree_groups);
+
+
+/********** Tree properties, see CUDAkernels/compute_propertiesD.cu **********/
+
+extern "C" void compute_leaf(const int n_leafs,
+                             uint *leafsIdxs,
+                             uint2 *node_bodies,
+                             real4 *body_pos,
+                             double4 *multipole,
+                             real4 *nodeLowerBounds,
+                             real4 *nodeUpperBounds,
+                             real4  *body_vel,
+                             ulonglong1 *body_id,
+                             real  *body_h,
+                             const float h_min)
+{
+#pragma omp parallel for
+  for(int id=0; id < n_leafs; id++)
+  {
+    const int  nodeID     = leafsIdxs[id];
+    const uint2 bij       = node_bodies[nodeID];
+    const uint firstChild = bij.x & ILEVELMASK;
+    const uint lastChild  = bij.y;
+
+    double mass, posx, posy, posz;
+    mass = posx = posy = posz = 0.0;
+
+    double oct_q11, oct_q22, oct_q33;
+    double oct_q12, oct_q13, oct_q23;
+    oct_q11 = oct_q22 = oct_q33 = 0.0;
+    oct_q12 = oct_q13 = oct_q23 = 0.0;
+
+    float3 r_min = make_float3(+1e10f, +1e10f, +1e10f);
+    float3 r_max = make_float3(-1e10f, -1e10f, -1e10f);
+
+    float maxEps = -100.0f;
+
+    for(uint i=firstChild; i < lastChild; i++)
+    {
+      const float4 p = body_pos[i];
+      maxEps = fmaxf(body_vel[i].w, maxEps);      //Determine the max softening within this leaf
+
+      mass += p.w;
+      posx += p.w*p.x;
+      posy += p.w*p.y;
+      posz += p.w*p.z;
+
+      oct_q11 += p.w * p.x*p.x;
+      oct_q22 += p.w * p.y*p.y;
+      oct_q33 += p.w * p.z*p.z;
+      oct_q12 += p.w * p.x*p.y;
+      oct_q13 += p.w * p.y*p.z;
+      oct_q23 += p.w * p.z*p.x;
+
+      r_min.x = fminf(r_min.x, p.x); r_min.y = fminf(r_min.y, p.y); r_min.z = fminf(r_min.z, p.z);
+      r_max.x = fmaxf(r_max.x, p.x); r_max.y = fmaxf(r_max.y, p.y); r_max.z = fmaxf(r_max.z, p.z);
+    }
+
+    double4 mon = {posx, posy, posz, mass};
+    double im = 1.0/mon.w;
+    if(mon.w == 0) im = 0;        //Allow tracer/massless particles
+    mon.x *= im;
+    mon.y *= im;
+    mon.z *= im;
+
+    multipole[3*nodeID + 0] = mon;
+    multipole[3*nodeID + 1] = make_double4(oct_q11, oct_q22, oct_q33, maxEps); //Store max softening
+    multipole[3*nodeID + 2] = make_double4(oct_q12, oct_q13, oct_q23, 0.0f);
+
+    nodeLowerBounds[nodeID] = make_float4(r_min.x, r_min.y, r_min.z, 0.0f);
+    nodeUpperBounds[nodeID] = make_float4(r_max.x, r_max.y, r_max.z, 1.0f);  //4th parameter is set to 1 to indicate this is a leaf
+
+    //Initial smoothing length estimate for the particles that do not have one yet
+    const float3 len = make_float3(r_max.x-r_min.x, r_max.y-r_min.y, r_max.z-r_min.z);
+    const float  vol = cbrtf(len.x*len.y*len.z);
+    float hp  = 0;
+    if (vol > 0.0f)
+    {
+      const float nd  = float(lastChild - firstChild) / vol;
+      hp  = cbrtf(42.0f / nd);
+    }
+    hp = std::max(hp, h_min);
+    for(uint i=firstChild; i < lastChild; i++)
+      if(body_h[i] < 0)
+        body_h[i] = hp;
+  }
+}
+HOST_KERNEL_REGISTER(compute_leaf);
+
+extern "C" void compute_non_leaf(const int curLevel,
+                                 uint  *leafsIdxs,
+                                 uint  *node_level_list,
+                                 uint  *n_children,
+                                 double4 *multipole,
+                                 real4 *nodeLowerBounds,
+                                 real4 *nodeUpperBounds)
+{
+  const int endNode   = node_level_list[curLevel];
+  const int startNode = node_level_list[curLevel-1];
+
+#pragma omp parallel for
+  for(int idx=0; idx < endNode-startNode; idx++)
+  {
+    const int  nodeID     = leafsIdxs[idx + startNode];
+    const uint firstChild =  n_children[nodeID] & 0x0FFFFFFF;
+    const uint nChildren  = (n_children[nodeID] & 0xF0000000) >> 28;
+
+    double mass, posx, posy, posz;
+    mass = posx = posy = posz = 0.0;
+
+    double oct_q11, oct_q22, oct_q33;
+    double oct_q12, oct_q13, oct_q23;
+    oct_q11 = oct_q22 = oct_q33 = 0.0;
+    oct_q12 = oct_q13 = oct_q23 = 0.0;
+
+    float3 r_min = make_float3(+1e10f, +1e10f, +1e10f);
+    float3 r_max = make_float3(-1e10f, -1e10f, -1e10f);
+
+    float maxEps = -100.0f;
+
+    for(uint i=firstChild; i < firstChild+nChildren; i++)
+    {
+      const double4 tmon = multipole[3*i + 0];
+      const double4 Q0   = multipole[3*i + 1];
+      const double4 Q1   = multipole[3*i + 2];
+      maxEps = std::max((float)Q0.w, maxEps);
+
+      mass += tmon.w;
+      posx += tmon.w*tmon.x;
+      posy += tmon.w*tmon.y;
+      posz += tmon.w*tmon.z;
+
+      oct_q11 += Q0.x; oct_q22 += Q0.y; oct_q33 += Q0.z;
+      oct_q12 += Q1.x; oct_q13 += Q1.y; oct_q23 += Q1.z;
+
+      const float4 node_min = nodeLowerBounds[i];
+      const float4 node_max = nodeUpperBounds[i];
+      r_min.x = fminf(r_min.x, node_min.x); r_min.y = fminf(r_min.y, node_min.y); r_min.z = fminf(r_min.z, node_min.z);
+      r_max.x = fmaxf(r_max.x, node_max.x); r_max.y = fmaxf(r_max.y, node_max.y); r_max.z = fmaxf(r_max.z, node_max.z);
+    }
+
+    nodeLowerBounds[nodeID] = make_float4(r_min.x, r_min.y, r_min.z, 0.0f);
+    nodeUpperBounds[nodeID] = make_float4(r_max.x, r_max.y, r_max.z, 0.0f); //4th is set to 0 to indicate a non-leaf
+
+    double4 mon = {posx, posy, posz, mass};
+    double im = 1.0/mon.w;
+    if(mon.w == 0) im = 0; //Allow tracer/massless particles
+    mon.x *= im;
+    mon.y *= im;
+    mon.z *= im;
+
+    multipole[3*nodeID + 0] = mon;
+    multipole[3*nodeID + 1] = make_double4(oct_q11, oct_q22, oct_q33, maxEps); //store max Eps
+    multipole[3*nodeID + 2] = make_double4(oct_q12, oct_q13, oct_q23, 0.0f);
+  }
+}
+HOST_KERNEL_REGISTER(compute_non_leaf);
+
+extern "C" void compute_scaling(const int node_count,
+                                double4 *multipole,
+                                real4 *nodeLowerBounds,
+                                real4 *nodeUpperBounds,
+                                uint  *n_children,
+                                real4 *multipoleF,
+                                float theta,
+                                real4 *boxSizeInfo,
+                                real4 *boxCenterInfo,
+                                uint2 *node_bodies)
+{
+#pragma omp parallel for
+  for(int idx=0; idx < node_count; idx++)
+  {
+    const double4 monD = multipole[3*idx + 0];
+    double4 Q0         = multipole[3*idx + 1];
+    double4 Q1         = multipole[3*idx + 2];
+
+    //Scale the quadropole
+    double im = 1.0 / monD.w;
+    if(monD.w == 0) im = 0;               //Allow tracer/massless particles
+    Q0.x = Q0.x*im - monD.x*monD.x;
+    Q0.y = Q0.y*im - monD.y*monD.y;
+    Q0.z = Q0.z*im - monD.z*monD.z;
+    Q1.x = Q1.x*im - monD.x*monD.y;
+    Q1.y = Q1.y*im - monD.y*monD.z;
+    Q1.z = Q1.z*im - monD.x*monD.z;
+
+    //Switch the y and z parameter
+    std::swap(Q1.y, Q1.z);
+
+    const float4 mon      = make_float4(monD.x, monD.y, monD.z, monD.w);
+    multipoleF[3*idx + 0] = mon;
+    multipoleF[3*idx + 1] = make_float4(Q0.x, Q0.y, Q0.z, Q0.w);
+    multipoleF[3*idx + 2] = make_float4(Q1.x, Q1.y, Q1.z, Q1.w);
+
+    const float4 r_min = nodeLowerBounds[idx];
+    const float4 r_max = nodeUpperBounds[idx];
+
+    float3 boxCenter;
+    boxCenter.x = 0.5*(r_min.x + r_max.x);
+    boxCenter.y = 0.5*(r_min.y + r_max.y);
+    boxCenter.z = 0.5*(r_min.z + r_max.z);
+
+    const float3 boxSize = make_float3(fmaxf(fabs(boxCenter.x-r_min.x), fabs(boxCenter.x-r_max.x)),
+                                       fmaxf(fabs(boxCenter.y-r_min.y), fabs(boxCenter.y-r_max.y)),
+                                       fmaxf(fabs(boxCenter.z-r_min.z), fabs(boxCenter.z-r_max.z)));
+
+    //Calculate distance between center of the box and the center of mass
+    const float3 s3 = make_float3((boxCenter.x - mon.x), (boxCenter.y - mon.y), (boxCenter.z - mon.z));
+    double s        = sqrt((s3.x*s3.x) + (s3.y*s3.y) + (s3.z*s3.z));
+
+    //If mass-less particles form a node, the s would be huge in opening angle, make it 0
+    if(fabs(mon.w) < 1e-10) s = 0;
+
+    //Length of the box, note times 2 since we only computed half the distance before
+    float l = 2*fmaxf(boxSize.x, fmaxf(boxSize.y, boxSize.z));
+
+    boxSizeInfo[idx] = make_float4(boxSize.x, boxSize.y, boxSize.z, int_as_float(n_children[idx]));
+
+    //Extra check, shouldnt be necessary, probably it is otherwise the test for leaf can fail
+    if(l < 0.000001)
+      l = 0.000001;
+
+  #ifdef IMPBH
+    float cellOp = (l/theta) + s;
+  #else
+    float cellOp = (l/theta);
+  #endif
+    cellOp = cellOp*cellOp;
+
+    const uint2 bij = node_bodies[idx];
+    uint pfirst     = bij.x & ILEVELMASK;
+    const uint nchild = bij.y - pfirst;
+
+    //If this is (leaf)node with only 1 particle then we change the opening criteria
+    if(nchild == 1)
+      cellOp = 10e10; //Force this node to be opened
+
+    if(r_max.w > 0)
+      cellOp = -cellOp;       //This is a leaf node
+
+    boxCenterInfo[idx] = make_float4(boxCenter.x, boxCenter.y, boxCenter.z, cellOp);
+
+    //Change the indirections of the leaf nodes so they point to the particle data
+    if(r_max.w > 0)
+    {
+      pfirst = pfirst | ((nchild-1) << LEAFBIT);
+      boxSizeInfo[idx].w = int_as_float(pfirst);
+    }
+  }
+}
+HOST_KERNEL_REGISTER(compute_scaling);
+
+extern "C" void gpu_setPHGroupData(const int n_groups,
+                                   const int n_particles,
+                                   real4 *bodies_pos,
+                                   int2  *group_list,
+                                   real4 *groupCenterInfo,
+                                   real4 *groupSizeInfo)
+{
+#pragma omp parallel for
+  for(int bid=0; bid < n_groups; bid++)
+  {
+    float3 r_min = make_float3(+1e10f, +1e10f, +1e10f);
+    float3 r_max = make_float3(-1e10f, -1e10f, -1e10f);
+
+    int start = group_list[bid].x;
+    int end   = group_list[bid].y;
+
+    for(int i=start; i < end; i++)
+    {
+      const real4 p = bodies_pos[i];
+      r_min.x = fminf(r_min.x, p.x); r_min.y = fminf(r_min.y, p.y); r_min.z = fminf(r_min.z, p.z);
+      r_max.x = fmaxf(r_max.x, p.x); r_max.y = fmaxf(r_max.y, p.y); r_max.z = fmaxf(r_max.z, p.z);
+    }
+
+    //Compute the group center and size
+    float3 grpCenter;
+    grpCenter.x = 0.5*(r_min.x + r_max.x);
+    grpCenter.y = 0.5*(r_min.y + r_max.y);
+    grpCenter.z = 0.5*(r_min.z + r_max.z);
+
+    const float3 grpSize = make_float3(fmaxf(fabs(grpCenter.x-r_min.x), fabs(grpCenter.x-r_max.x)),
+                                       fmaxf(fabs(grpCenter.y-r_min.y), fabs(grpCenter.y-r_max.y)),
+                                       fmaxf(fabs(grpCenter.z-r_min.z), fabs(grpCenter.z-r_max.z)));
+
+    const int nchild = end-start;
+    start            = start | (nchild-1) << CRITBIT;
+
+    const float l = std::max(grpSize.x, std::max(grpSize.y, grpSize.z));
+
+    groupSizeInfo  [bid] = make_float4(grpSize.x, grpSize.y, grpSize.z, int_as_float(start));
+    groupCenterInfo[bid] = make_float4(grpCenter.x, grpCenter.y, grpCenter.z, l);
+  }
+}
+HOST_KERNEL_REGISTER(gpu_setPHGroupData);
+
+
+/********** Time integration, see CUDAkernels/timestep.cu **********/
+
+extern "C" void get_Tnext(const int n_bodies,
+                          float2 *time,
+                          float *tnext)
+{
+  float tmin = 1.0e10f;
+#pragma omp parallel for reduction(min:tmin)
+  for(int i=0; i < n_bodies; i++)
+    tmin = fminf(tmin, time[i].y);
+
+  tnext[0] = tmin;
+  for(uint i=1; i < my_dev::hostLaunch.gridDim.x; i++)
+    tnext[i] = 1.0e10f;
+}
+HOST_KERNEL_REGISTER(get_Tnext);
+
+extern "C" void get_nactive(const int n_bodies,
+                            uint *valid,
+                            uint *tnact)
+{
+  uint sum = 0;
+#pragma omp parallel for reduction(+:sum)
+  for(int i=0; i < n_bodies; i++)
+    sum += valid[i];
+
+  tnact[0] = sum;
+  for(uint i=1; i < my_dev::hostLaunch.gridDim.x; i++)
+    tnact[i] = 0;
+}
+HOST_KERNEL_REGISTER(get_nactive);
+
+extern "C" void predict_particles(const int n_bodies,
+                                  float  tc,
+                                  float  tp,
+                                  real4  *pos,
+                                  real4  *vel,
+                                  real4  *acc,
+                                  float2 *time,
+                                  real4  *pPos,
+                                  real4  *pVel)
+{
+#pragma omp parallel for
+  for(int idx=0; idx < n_bodies; idx++)
+  {
+    float4 p = pos [idx];
+    float4 v = vel [idx];
+    float4 a = acc [idx];
+    float tb = time[idx].x;
+
+  #ifdef DO_BLOCK_TIMESTEP
+    float dt_cb  = tc - tb;
+  #else
+    float dt_cb  = tc - tp;
+    time[idx].x  = tp;
+  #endif
+
+    p.x += v.x*dt_cb + a.x*dt_cb*dt_cb*0.5f;
+    p.y += v.y*dt_cb + a.y*dt_cb*dt_cb*0.5f;
+    p.z += v.z*dt_cb + a.z*dt_cb*dt_cb*0.5f;
+
+    v.x += a.x*dt_cb;
+    v.y += a.y*dt_cb;
+    v.z += a.z*dt_cb;
+
+    pPos[idx] = p;
+    pVel[idx] = v;
+  }
+}
+HOST_KERNEL_REGISTER(predict_particles);
+
+extern "C" void setActiveGroups(const int n_bodies,
+                                float tc,
+                                float2 *time,
+                                uint  *body2grouplist,
+                                uint  *valid_list)
+{
+#pragma omp parallel for
+  for(int idx=0; idx < n_bodies; idx++)
+  {
+    if(tc == time[idx].y)
+    {
+      const int grpID   = body2grouplist[idx];
+      valid_list[grpID] = grpID | (1 << 31);
+    }
+  }
+}
+HOST_KERNEL_REGISTER(setActiveGroups);
+
+extern "C" void correct_particles(const int n_bodies,
+                                  float tc,
+                                  float2 *time,
+                                  uint   *active_list,
+                                  real4 *vel,
+                                  real4 *acc0,
+                                  real4 *acc1,
+                                  float   *body_h,
+                                  float2  *body_dens,
+                                  real4 *pos,
+                                  real4 *pPos,
+                                  real4 *pVel,
+                                  uint  *unsorted,
+                                  real4 *acc0_new,
+                                  float2 *time_new)
+{
+#pragma omp parallel for
+  for(int idx=0; idx < n_bodies; idx++)
+  {
+  #ifdef DO_BLOCK_TIMESTEP
+    if (active_list[idx] != 1) continue;
+  #endif
+
+    const uint unsortedIdx = unsorted[idx];
+    const float4 a0 = acc0[unsortedIdx];
+    const float4 a1 = acc1[idx];
+    const float  tb = time[unsortedIdx].x;
+    float4 v        = pVel[unsortedIdx];
+
+    pos[idx] = pPos[idx];
+
+    float dt_cb  = tc - tb;
+    dt_cb *= 0.5f;
+
+    v.x += (a1.x - a0.x)*dt_cb;
+    v.y += (a1.y - a0.y)*dt_cb;
+    v.z += (a1.z - a0.z)*dt_cb;
+
+    vel     [idx] = v;
+    acc0_new[idx] = a1;
+    time_new[idx] = time[unsortedIdx];
+    unsorted[idx] = idx;  //Have to reset it in case we do not resort the particles
+
+    //Adjust the smoothing length towards the desired number of neighbours
+    const float nbDesired = 32;
+    const float f         = 0.5f * (1.0f + cbrtf(nbDesired / body_dens[idx].y));
+    const float fScale    = std::max(std::min(f, 2.0f), 0.5f);
+    body_h[idx]           = body_h[idx]*fScale;
+  }
+}
+HOST_KERNEL_REGISTER(correct_particles);
+
+extern "C" void compute_dt(const int n_bodies,
+                           float    tc,
+                           float    eta,
+                           int      dt_limit,
+                           float    eps2,
+                           float2   *time,
+                           real4    *vel,
+                           int      *ngb,
+                           real4    *bodies_pos,
+                           real4    *bodies_acc,
+                           uint     *active_list,
+                           float    timeStep)
+{
+  //The CUDA kernel computes an Aarseth step but overrides it with the
+  //fixed timeStep, only that final result is reproduced here
+#pragma omp parallel for
+  for(int idx=0; idx < n_bodies; idx++)
+  {
+    if (active_list[idx] != 1) continue;
+
+    time[idx].x = tc;
+    time[idx].y = tc + timeStep;
+  }
+}
+HOST_KERNEL_REGISTER(compute_dt);
+
+extern "C" void compute_energy_double(const int n_bodies,
+                                      real4 *pos,
+                                      real4 *vel,
+                                      real4 *acc,
+                                      double2 *energy)
+{
+  double eKin = 0, ePot = 0;
+#pragma omp parallel for reduction(+:eKin,ePot)
+  for(int i=0; i < n_bodies; i++)
+  {
+    const real4 v = vel[i];
+    eKin += pos[i].w*0.5*(v.x*v.x + v.y*v.y + v.z*v.z);
+    ePot += pos[i].w*0.5*acc[i].w;
+  }
+
+  energy[0] = make_double2(eKin, ePot);
+  for(uint i=1; i < my_dev::hostLaunch.gridDim.x; i++)
+    energy[i] = make_double2(0, 0);
+}
+HOST_KERNEL_REGISTER(compute_energy_double);
+
+
+/********** Tree-walk, see CUDAkernels/dev_approximate_gravity_warp_new.cu **********/
+
+//The particles of a group are stored in SIMD lanes, the width follows the
+//instruction set this file is compiled for (-march=native)
+#if defined(__AVX512F__)
+  #define HOST_SIMD_WIDTH 16
+#elif defined(__AVX__)
+  #define HOST_SIMD_WIDTH 8
+#else
+  #define HOST_SIMD_WIDTH 4
+#endif
+#define HOST_SIMD_BLOCKS ((NCRIT + HOST_SIMD_WIDTH - 1) / HOST_SIMD_WIDTH)
+#define HOST_WALK_BATCH  64     //Number of approximate / direct interactions batched per flush
+
+typedef float _vwsf __attribute__((vector_size(HOST_SIMD_WIDTH*sizeof(float))));
+typedef int   _vwsi __attribute__((vector_size(HOST_SIMD_WIDTH*sizeof(int))));
+
+static inline _vwsf vec_sqrt(const _vwsf x)
+{
+#if defined(__AVX512F__)
+  return (_vwsf)_mm512_sqrt_ps((__m512)x);
+#elif defined(__AVX__)
+  return (_vwsf)_mm256_sqrt_ps((__m256)x);
+#elif defined(__SSE__)
+  return (_vwsf)_mm_sqrt_ps((__m128)x);
+#else
+  _vwsf r;
+  for(int k=0; k < HOST_SIMD_WIDTH; k++) r[k] = sqrtf(x[k]);
+  return r;
+#endif
+}
+
+static inline _vwsf vec_abs(const _vwsf x)
+{
+  return (_vwsf)((_vwsi)x & 0x7fffffff);
+}
+
+//Particles of the group being walked, structure of arrays with one
+//SIMD block per HOST_SIMD_WIDTH particles
+struct hostGroupLanes
+{
+  _vwsf px[HOST_SIMD_BLOCKS], py[HOST_SIMD_BLOCKS], pz[HOST_SIMD_BLOCKS];
+  _vwsf hinv2[HOST_SIMD_BLOCKS];   //1/h^2 to speed up the density computation
+  _vwsf ax[HOST_SIMD_BLOCKS], ay[HOST_SIMD_BLOCKS], az[HOST_SIMD_BLOCKS], aw[HOST_SIMD_BLOCKS];
+  _vwsf dens[HOST_SIMD_BLOCKS], nngb[HOST_SIMD_BLOCKS];
+  int   nBlocks;
+};
+
+//Per thread lists, reused between groups
+struct hostWalkBuffers
+{
+  std::vector<int> cells, nextCells;
+  std::vector<int> approxList, directList;
+};
+
+//Improved Barnes Hut criterium, the same test as split_node_grav_impbh_box4a/box8a
+//in parallel.cpp but evaluated for HOST_SIMD_WIDTH cells against one group
+static inline _vwsi split_node_grav_impbh_simd(const _vwsf comx, const _vwsf comy,
+                                               const _vwsf comz, const _vwsf openSize,
+                                               const float4 groupCenter,
+                                               const float4 groupSize)
+{
+  const _vwsf zero = {};
+  _vwsf dx = vec_abs(groupCenter.x - comx) - groupSize.x;
+  _vwsf dy = vec_abs(groupCenter.y - comy) - groupSize.y;
+  _vwsf dz = vec_abs(groupCenter.z - comz) - groupSize.z;
+
+  dx = dx > zero ? dx : zero;
+  dy = dy > zero ? dy : zero;
+  dz = dz > zero ? dz : zero;
+
+  //Distance squared, no need to do sqrt since opening criteria has been squared
+  const _vwsf ds2 = dx*dx + dy*dy + dz*dz;
+
+  return ds2 <= vec_abs(openSize);
+}
+
+static void approx_flush(hostGroupLanes &g, const real4 *multipole_data,
+                         const std::vector<int> &list, const float eps2)
+{
+  const int n = list.size();
+  for(int b=0; b < g.nBlocks; b++)
+  {
+    const _vwsf px = g.px[b], py = g.py[b], pz = g.pz[b];
+    _vwsf ax = g.ax[b], ay = g.ay[b], az = g.az[b], aw = g.aw[b];
+
+    for(int c=0; c < n; c++)
+    {
+      const float4 M0 = multipole_data[3*list[c]+0];
+      const float4 Q0 = multipole_data[3*list[c]+1];
+      const float4 Q1 = multipole_data[3*list[c]+2];
+
+      const _vwsf dx = px - M0.x;
+      const _vwsf dy = py - M0.y;
+      const _vwsf dz = pz - M0.z;
+      const _vwsf r2 = dx*dx + dy*dy + dz*dz + eps2;
+
+      const _vwsf rinv   = 1.0f/vec_sqrt(r2);
+      const _vwsf rinv2  = rinv *rinv;
+      const _vwsf mrinv  = M0.w*rinv;
+      const _vwsf mrinv3 = rinv2*mrinv;
+      const _vwsf mrinv5 = rinv2*mrinv3;
+      const _vwsf mrinv7 = rinv2*mrinv5;
+
+      const _vwsf D0 =  mrinv;
+      const _vwsf D1 = -mrinv3;
+      const _vwsf D2 =  mrinv5*(  3.0f);
+      const _vwsf D3 =  mrinv7*(-15.0f);
+
+      //Q0 = (q11, q22, q33), Q1 = (q12, q13, q23)
+      const float q   = Q0.x + Q0.y + Q0.z;
+      const _vwsf qRx = Q0.x*dx + Q1.x*dy + Q1.y*dz;
+      const _vwsf qRy = Q1.x*dx + Q0.y*dy + Q1.z*dz;
+      const _vwsf qRz = Q1.y*dx + Q1.z*dy + Q0.z*dz;
+      const _vwsf qRR = qRx*dx + qRy*dy + qRz*dz;
+
+      aw -= D0 + 0.5f*(D1*q + D2*qRR);
+      const _vwsf C = D1 + 0.5f*(D2*q + D3*qRR);
+      ax += C*dx + D2*qRx;
+      ay += C*dy + D2*qRy;
+      az += C*dz + D2*qRz;
+    }
+
+    g.ax[b] = ax; g.ay[b] = ay; g.az[b] = az; g.aw[b] = aw;
+  }
+}
+
+static void direct_flush(hostGroupLanes &g, const real4 *body_pos,
+                         const std::vector<int> &list, const float eps2)
+{
+  const int n = list.size();
+  const _vwsf zero = {};
+  const _vwsf one  = zero + 1.0f;
+  for(int b=0; b < g.nBlocks; b++)
+  {
+    const _vwsf px = g.px[b], py = g.py[b], pz = g.pz[b], hinv2 = g.hinv2[b];
+    _vwsf ax = g.ax[b], ay = g.ay[b], az = g.az[b], aw = g.aw[b];
+    _vwsf dens = g.dens[b], nngb = g.nngb[b];
+
+    for(int j=0; j < n; j++)
+    {
+      const float4 posj = body_pos[list[j]];
+
+      const _vwsf dx = posj.x - px;
+      const _vwsf dy = posj.y - py;
+      const _vwsf dz = posj.z - pz;
+      const _vwsf r2 = dx*dx + dy*dy + dz*dz;
+
+      const _vwsf rinv   = 1.0f/vec_sqrt(r2 + eps2);
+      const _vwsf mrinv  = posj.w * rinv;
+      const _vwsf mrinv3 = mrinv * rinv*rinv;
+
+      aw -= mrinv;
+      ax += mrinv3 * dx;
+      ay += mrinv3 * dy;
+      az += mrinv3 * dz;
+
+      _vwsf rho = 1.0f - r2*hinv2;
+      rho = rho > zero ? rho : zero;
+      const _vwsf rho2 = rho*rho;
+      dens += rho2*rho2;
+      nngb += rho2 > zero ? one : zero;   //ceilf(rho2), rho2 is in [0,1]
+    }
+
+    g.ax[b] = ax; g.ay[b] = ay; g.az[b] = az; g.aw[b] = aw;
+    g.dens[b] = dens; g.nngb[b] = nngb;
+  }
+}
+
+//Walks the tree for one group of particles. Like the GPU kernel the tree is
+//traversed level by level, the opening test is done for HOST_SIMD_WIDTH
+//cells at once and the resulting interactions are batched into lists that
+//are evaluated with the group particles in SIMD lanes
+template<bool ACCUMULATE>
+static void treewalk_group(const int    grpIdx,
+                           const float  eps2,
+                           const uint2  node_begend,
+                           const real4  *body_pos,
+                           const real4  *multipole_data,
+                           const real4  *group_body_pos,
+                           const float4 *boxSizeInfo,
+                           const float4 *boxCenterInfo,
+                           const float4 *groupSizeInfo,
+                           const float4 *groupCenterInfo,
+                           hostWalkBuffers &buf,
+                           float4 *acc_out,
+                           int2   *interactions,
+                           int    *ngb_out,
+                           int    *active_inout,
+                           float  *body_h,
+                           float2 *body_dens_out)
+{
+  const float4 groupSize  = groupSizeInfo  [grpIdx];
+  const float4 groupPos   = groupCenterInfo[grpIdx];
+  const uint   groupData  = float_as_uint(groupSize.w);
+  const uint   body_addr  =   groupData & CRITMASK;
+  const uint   nb_i       = ((groupData & INVCMASK) >> CRITBIT) + 1;
+
+  hostGroupLanes g;
+  g.nBlocks = (nb_i + HOST_SIMD_WIDTH - 1) / HOST_SIMD_WIDTH;
+  for(int b=0; b < g.nBlocks; b++)
+  {
+    for(int k=0; k < HOST_SIMD_WIDTH; k++)
+    {
+      //Unused lanes duplicate the first particle, their results are dropped
+      const uint   i    = b*HOST_SIMD_WIDTH + k;
+      const uint   addr = body_addr + (i < nb_i ? i : 0);
+      const float4 pos  = group_body_pos[addr];
+      const float  hinv = 1.0f/body_h[addr];
+      g.px[b][k] = pos.x;
+      g.py[b][k] = pos.y;
+      g.pz[b][k] = pos.z;
+      g.hinv2[b][k] = hinv*hinv;
+    }
+    g.ax  [b] = g.ay  [b] = g.az[b] = g.aw[b] = (_vwsf){};
+    g.dens[b] = g.nngb[b] = (_vwsf){};
+  }
+
+  uint nApprox = 0, nDirect = 0;
+
+  buf.cells.clear();
+  buf.approxList.clear();
+  buf.directList.clear();
+  for(uint c=node_begend.x; c < node_begend.y; c++)
+    buf.cells.push_back(c);
+
+  while(!buf.cells.empty())
+  {
+    buf.nextCells.clear();
+    const int nCells = buf.cells.size();
+
+    for(int c0=0; c0 < nCells; c0 += HOST_SIMD_WIDTH)
+    {
+      const int n = std::min(HOST_SIMD_WIDTH, nCells - c0);
+
+      _vwsf comx, comy, comz, openSize;
+      uint  cellData[HOST_SIMD_WIDTH];
+      bool  isNode  [HOST_SIMD_WIDTH];
+      for(int k=0; k < HOST_SIMD_WIDTH; k++)
+      {
+        const int    cellIdx = buf.cells[c0 + (k < n ? k : 0)];
+        const float4 cellCOM = multipole_data[3*cellIdx];
+        const float4 cellPos = boxCenterInfo[cellIdx];
+        comx[k] = cellCOM.x; comy[k] = cellCOM.y; comz[k] = cellCOM.z;
+        openSize[k] = cellPos.w;
+        cellData[k] = float_as_uint(boxSizeInfo[cellIdx].w);
+        isNode  [k] = cellPos.w > 0.0f;
+      }
+
+      //Check if cell opening condition is satisfied
+      const _vwsi split = split_node_grav_impbh_simd(comx, comy, comz, openSize, groupPos, groupSize);
+
+      for(int k=0; k < n; k++)
+      {
+        const bool splitCell = split[k] && cellData[k] != 0xFFFFFFFF;
+
+        if(!splitCell)
+        {
+          //Approximate using the multipole of this cell
+          buf.approxList.push_back(buf.cells[c0+k]);
+          nApprox++;
+          if(buf.approxList.size() >= HOST_WALK_BATCH)
+          {
+            approx_flush(g, multipole_data, buf.approxList, eps2);
+            buf.approxList.clear();
+          }
+        }
+        else if(isNode[k])
+        {
+          const uint firstChild =  cellData[k] & 0x0FFFFFFF;
+          const uint nChildren  = (cellData[k] & 0xF0000000) >> 28;
+          for(uint i=0; i < nChildren; i++)
+            buf.nextCells.push_back(firstChild + i);
+        }
+        else
+        {
+          //Leaf that has to be opened, interact with its particles
+          const uint firstBody =   cellData[k] & BODYMASK;
+          const uint nBody     = ((cellData[k] & INVBMASK) >> LEAFBIT)+1;
+          for(uint j=firstBody; j < firstBody+nBody; j++)
+            buf.directList.push_back(j);
+          nDirect += nBody;
+          if(buf.directList.size() >= HOST_WALK_BATCH)
+          {
+            direct_flush(g, body_pos, buf.directList, eps2);
+            buf.directList.clear();
+          }
+        }
+      }
+    }
+    buf.cells.swap(buf.nextCells);
+  }
+
+  if(!buf.approxList.empty()) approx_flush(g, multipole_data, buf.approxList, eps2);
+  if(!buf.directList.empty()) direct_flush(g, body_pos,       buf.directList, eps2);
+
+  for(uint i=0; i < nb_i; i++)
+  {
+    const int addr = body_addr+i;
+    const int b    = i / HOST_SIMD_WIDTH;
+    const int k    = i % HOST_SIMD_WIDTH;
+
+    const float hinv = 1.0f/body_h[addr];
+    const float4 acc = make_float4(g.ax[b][k], g.ay[b][k], g.az[b][k], g.aw[b][k]);
+    const float2 dens = make_float2(g.dens[b][k]*3465.0f/(512.0f*M_PI)*hinv*hinv*hinv,  /* scale rho */
+                                    g.nngb[b][k]);
+
+    if (ACCUMULATE)
+    {
+      acc_out      [addr].x += acc.x;
+      acc_out      [addr].y += acc.y;
+      acc_out      [addr].z += acc.z;
+      acc_out      [addr].w += acc.w;
+      body_dens_out[addr].x += dens.x;
+      body_dens_out[addr].y += dens.y;
+      interactions [addr].x += nApprox;
+      interactions [addr].y += nDirect;
+    }
+    else
+    {
+      acc_out      [addr]   = acc;
+      body_dens_out[addr]   = dens;
+      interactions [addr].x = nApprox;
+      interactions [addr].y = nDirect;
+    }
+    ngb_out     [addr] = addr;
+    active_inout[addr] = 1;
+  }
+}
+
+template<bool ACCUMULATE>
+static void approximate_gravity_main(const int n_active_groups,
+                                     const float eps2,
+                                     const uint2 node_begend,
+                                     const int    *active_groups,
+                                     const real4  *body_pos,
+                                     const real4  *multipole_data,
+                                     float4 *acc_out,
+                                     const real4  *group_body_pos,
+                                     int    *ngb_out,
+                                     int    *active_inout,
+                                     int2   *interactions,
+                                     const float4 *boxSizeInfo,
+                                     const float4 *groupSizeInfo,
+                                     const float4 *boxCenterInfo,
+                                     const float4 *groupCenterInfo,
+                                     float  *body_h,
+                                     float2 *body_dens)
+{
+#pragma omp parallel
+  {
+    hostWalkBuffers buf;
+    buf.cells.reserve(LMEM_STACK_SIZE);
+    buf.nextCells.reserve(LMEM_STACK_SIZE);
+    buf.approxList.reserve(HOST_WALK_BATCH);
+    buf.directList.reserve(HOST_WALK_BATCH + NLEAF);
+
+    //Groups differ a lot in cost, small dynamic chunks let idle threads
+    //pick up the remaining work
+#pragma omp for schedule(dynamic, 4)
+    for(int bid=0; bid < n_active_groups; bid++)
+    {
+    #ifdef DO_BLOCK_TIMESTEP
+      const int grpIdx = active_groups[bid];
+    #else
+      const int grpIdx = bid;
+    #endif
+      treewalk_group<ACCUMULATE>(grpIdx, eps2, node_begend,
+                                 body_pos, multipole_data, group_body_pos,
+                                 boxSizeInfo, boxCenterInfo, groupSizeInfo, groupCenterInfo,
+                                 buf, acc_out, interactions, ngb_out, active_inout,
+                                 body_h, body_dens);
+    }
+  }
+}
+
+extern "C" void dev_approximate_gravity(const int n_active_groups,
+                                        int    n_bodies,
+                                        float eps2,
+                                        uint2 node_begend,
+                                        int    *active_groups,
+                                        real4  *body_pos,
+                                        real4  *multipole_data,
+                                        float4 *acc_out,
+                                        real4  *group_body_pos,
+                                        int    *ngb_out,
+                                        int    *active_inout,
+                                        int2   *interactions,
+                                        float4  *boxSizeInfo,
+                                        float4  *groupSizeInfo,
+                                        float4  *boxCenterInfo,
+                                        float4  *groupCenterInfo,
+                                        real4   *body_vel,
+                                        int     *MEM_BUF,
+                                        float   *body_h,
+                                        float2  *body_dens)
+{
+  approximate_gravity_main<false>(n_active_groups, eps2, node_begend, active_groups,
+                                  body_pos, multipole_data, acc_out, group_body_pos,
+                                  ngb_out, active_inout, interactions,
+                                  boxSizeInfo, groupSizeInfo, boxCenterInfo, groupCenterInfo,
+                                  body_h, body_dens);
+}
+HOST_KERNEL_REGISTER(dev_approximate_gravity);
+
+extern "C" void dev_approximate_gravity_let(const int n_active_groups,
+                                            int    n_bodies,
+                                            float eps2,
+                                            uint2 node_begend,
+                                            int    *active_groups,
+                                            real4  *body_pos,
+                                            real4  *multipole_data,
+                                            float4 *acc_out,
+                                            real4  *group_body_pos,
+                                            int    *ngb_out,
+                                            int    *active_inout,
+                                            int2   *interactions,
+                                            float4  *boxSizeInfo,
+                                            float4  *groupSizeInfo,
+                                            float4  *boxCenterInfo,
+                                            float4  *groupCenterInfo,
+                                            real4   *body_vel,
+                                            int     *MEM_BUF,
+                                            float   *body_h,
+                                            float2  *body_dens)
+{
+  approximate_gravity_main<true>(n_active_groups, eps2, node_begend, active_groups,
+                                 body_pos, multipole_data, acc_out, group_body_pos,
+                                 ngb_out, active_inout, interactions,
+                                 boxSizeInfo, groupSizeInfo, boxCenterInfo, groupCenterInfo,
+                                 body_h, body_dens);
+}
+HOST_KERNEL_REGISTER(dev_approximate_gravity_let);
+
+extern "C" void dev_direct_gravity(float4 *accel, float4 *i_positions, float4 *j_positions,
+                                   int numBodies_i, int numBodies_j, float eps2)
+{
+#pragma omp parallel for
+  for(int i=0; i < numBodies_i; i++)
+  {
+    const float4 iPos = i_positions[i];
+    float3 acc = {0.0f, 0.0f, 0.0f};
+    for(int j=0; j < numBodies_j; j++)
+    {
+      const float4 jPos = j_positions[j];
+      const float3 r    = make_float3(jPos.x - iPos.x, jPos.y - iPos.y, jPos.z - iPos.z);
+      const float invDist = 1.0f/sqrtf(r.x*r.x + r.y*r.y + r.z*r.z + eps2);
+      const float s       = jPos.w * invDist*invDist*invDist;
+      acc.x += r.x * s;
+      acc.y += r.y * s;
+      acc.z += r.z * s;
+    }
+    accel[i] = make_float4(acc.x, acc.y, acc.z, 0.f);
+  }
+}
+HOST_KERNEL_REGISTER(dev_direct_gravity);
+
+
+/********** Domain decomposition, see CUDAkernels/parallel.cu **********/
+
+extern "C" void gpu_domainCheckSFCAndAssign(int    n_bodies,
+                                            int    nProcs,
+                                            uint4  lowBoundary,
+                                            uint4  highBoundary,
+                                            uint4  *boundaryList,
+                                            uint4  *body_key,
+                                            uint2  *validList,
+                                            uint   *idList,
+                                            int     procId)
+{
+#pragma omp parallel for
+  for(int id=0; id < n_bodies; id++)
+  {
+    const uint4 key  = body_key[id];
+    const int bottom = cmp_uint4(key, lowBoundary);
+    const int top    = cmp_uint4(key, highBoundary);
+
+    uint valid = 0;
+    if(!(bottom >= 0 && top < 0))
+    {
+      //Outside our domain, find the one it belongs to
+      int domain = find_key(key, make_uint2(0, nProcs+1), &boundaryList[1]);
+      if(procId == domain) domain = domain + 1;
+      valid = domain | ((uint)1 << 31);
+    }
+    validList[id] = make_uint2(valid, id);
+    idList[id]    = 1;
+  }
+}
+HOST_KERNEL_REGISTER(gpu_domainCheckSFCAndAssign);
+
+extern "C" void gpu_internalMoveSFC2(int       n_extract,
+                                     int       n_bodies,
+                                     uint4     lowBoundary,
+                                     uint4     highBoundary,
+                                     int2      *extractList,
+                                     int       *indexList,
+                                     real4     *Ppos,
+                                     real4     *Pvel,
+                                     real4     *pos,
+                                     real4     *vel,
+                                     real4     *acc0,
+                                     real4     *acc1,
+                                     float2    *time,
+                                     unsigned long long *body_id,
+                                     uint4     *body_key,
+                                     float     *h)
+{
+  //Sequential, the destination slots are handed out by a shared counter
+  for(int id=0; id < n_extract; id++)
+  {
+    const int srcIdx = (n_bodies-n_extract) + id;
+    const uint4 key  = body_key[srcIdx];
+    const int bottom = cmp_uint4(key, lowBoundary);
+    const int top    = cmp_uint4(key, highBoundary);
+
+    if((bottom >= 0 && top < 0))
+    {
+      const int dstIdx = extractList[(*indexList)++].y;
+
+      Ppos[dstIdx]     = Ppos[srcIdx];
+      Pvel[dstIdx]     = Pvel[srcIdx];
+      pos[dstIdx]      = pos[srcIdx];
+      vel[dstIdx]      = vel[srcIdx];
+      acc0[dstIdx]     = acc0[srcIdx];
+      acc1[dstIdx]     = acc1[srcIdx];
+      time[dstIdx]     = time[srcIdx];
+      body_key[dstIdx] = body_key[srcIdx];
+      body_id[dstIdx]  = body_id[srcIdx];
+      h[dstIdx]        = h[srcIdx];
+    }
+  }
+}
+HOST_KERNEL_REGISTER(gpu_internalMoveSFC2);
+
+extern "C" void gpu_extractOutOfDomainParticlesAdvancedSFC2(int offset,
+                                                            int n_extract,
+                                                            uint2 *extractList,
+                                                            real4 *Ppos,
+                                                            real4 *Pvel,
+                                                            real4 *pos,
+                                                            real4 *vel,
+                                                            real4 *acc0,
+                                                            real4 *acc1,
+                                                            float2 *time,
+                                                            unsigned long long *body_id,
+                                                            uint4 *body_key,
+                                                            float *h,
+                                                            bodyStruct *destination)
+{
+#pragma omp parallel for
+  for(int id=0; id < n_extract; id++)
+  {
+    const int srcIdx = extractList[offset+id].y;
+
+    destination[id].pos    = pos [srcIdx];
+    destination[id].vel    = vel [srcIdx];
+    destination[id].Ppos   = Ppos[srcIdx];
+    destination[id].Pvel   = Pvel[srcIdx];
+    destination[id].acc0   = acc0[srcIdx];
+    destination[id].time   = time[srcIdx];
+    destination[id].id     = body_id[srcIdx];
+    destination[id].Pvel.w = h[srcIdx];
+#ifdef DO_BLOCK_TIMESTEP_EXCHANGE_MPI
+    destination[id].key    = body_key[srcIdx];
+    destination[id].acc1   = acc1[srcIdx];
+#endif
+  }
+}
+HOST_KERNEL_REGISTER(gpu_extractOutOfDomainParticlesAdvancedSFC2);
+
+extern "C" void gpu_insertNewParticlesSFC(int        n_extract,
+                                          int        n_insert,
+                                          int        n_oldbodies,
+                                          int        offset,
+                                          real4     *Ppos,
+                                          real4     *Pvel,
+                                          real4     *pos,
+                                          real4     *vel,
+                                          real4     *acc0,
+                                          real4     *acc1,
+                                          float2    *time,
+                                          unsigned long long *body_id,
+                                          uint4     *body_key,
+                                          float     *h,
+                                          bodyStruct *source)
+{
+#pragma omp parallel for
+  for(int id=0; id < n_insert; id++)
+  {
+    const int idx = (n_oldbodies-n_extract) + id + offset;
+
+    pos [idx]    = source[id].pos;
+    vel [idx]    = source[id].vel;
+    Ppos[idx]    = source[id].Ppos;
+    Pvel[idx]    = source[id].Pvel;
+    acc0[idx]    = source[id].acc0;
+    time[idx]    = source[id].time;
+    body_id[idx] = source[id].id;
+    h[idx]       = source[id].Pvel.w;
+#ifdef DO_BLOCK_TIMESTEP_EXCHANGE_MPI
+    body_key[idx] = source[id].key;
+    acc1[idx]     = source[id].acc1;
+#endif
+  }
+}
+HOST_KERNEL_REGISTER(gpu_insertNewParticlesSFC);
+
+
+/********** Thrust / CUB replacements, see CUDAkernels/sortKernels.cu and parallel.cu **********/
+
+//Permutation that sorts the keys on x, y, z (stable)
+static void hostSortKeys(const uint4 *keys, uint *permutation, const int N)
+{
+  typedef RadixSort<96> Radix;
+
+  Radix::key_t *sortKeys;
+  posix_memalign((void**)&sortKeys, 64, N*sizeof(Radix::key_t));
+
+#pragma omp parallel for
+  for(int i=0; i < N; i++)
+    sortKeys[i] = Radix::key_t(keys[i]);
+
+  Radix radix(N);
+  radix.sort(sortKeys, (int*)permutation);
+
+  free(sortKeys);
+}
+
+extern "C" void cubSort(my_dev::dev_mem<uint4>  &srcKeys,
+                        my_dev::dev_mem<uint>   &outPermutation,
+                        my_dev::dev_mem<char>   &tempBuffer,
+                        my_dev::dev_mem<uint>   &tempB,
+                        my_dev::dev_mem<uint>   &tempC,
+                        my_dev::dev_mem<uint>   &tempD,
+                        int N)
+{
+  hostSortKeys(srcKeys.raw_p(), outPermutation.raw_p(), N);
+}
+
+extern "C" void thrustSort(my_dev::dev_mem<uint4> &srcKeys,
+                           my_dev::dev_mem<uint>  &permutation_buffer,
+                           my_dev::dev_mem<uint>  &temp_buffer,
+                           int N)
+{
+  hostSortKeys(srcKeys.raw_p(), permutation_buffer.raw_p(), N);
+}
+
+template<typename T>
+static void hostDataReorder(const int N, my_dev::dev_mem<uint> &permutation,
+                            my_dev::dev_mem<T> &dIn, my_dev::dev_mem<T> &dOut)
+{
+  const uint *perm = permutation.raw_p();
+  const T    *in   = dIn.raw_p();
+  T          *out  = dOut.raw_p();
+#pragma omp parallel for
+  for(int i=0; i < N; i++)
+    out[i] = in[perm[i]];
+}
+
+extern "C" void thrustDataReorderU4(const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<uint4> &dIn, my_dev::dev_mem<uint4> &dOut) {
+  hostDataReorder(N, permutation, dIn, dOut);
+}
+extern "C" void thrustDataReorderF4(const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<float4> &dIn, my_dev::dev_mem<float4> &dOut) {
+  hostDataReorder(N, permutation, dIn, dOut);
+}
+extern "C" void thrustDataReorderF2(const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<float2> &dIn, my_dev::dev_mem<float2> &dOut) {
+  hostDataReorder(N, permutation, dIn, dOut);
+}
+extern "C" void thrustDataReorderF1(const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<float> &dIn, my_dev::dev_mem<float> &dOut) {
+  hostDataReorder(N, permutation, dIn, dOut);
+}
+extern "C" void thrustDataReorderI2(const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<int2> &dIn, my_dev::dev_mem<int2> &dOut) {
+  hostDataReorder(N, permutation, dIn, dOut);
+}
+extern "C" void thrustDataReorderU1(const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<uint> &dIn, my_dev::dev_mem<uint> &dOut) {
+  hostDataReorder(N, permutation, dIn, dOut);
+}
+extern "C" void thrustDataReorderULL(const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<ullong> &dIn, my_dev::dev_mem<ullong> &dOut) {
+  hostDataReorder(N, permutation, dIn, dOut);
+}
+
+extern "C" uint2 thrust_partitionDomains(my_dev::dev_mem<uint2> &validList,
+                                         my_dev::dev_mem<uint2> &validList2, //Unsorted compacted list
+                                         my_dev::dev_mem<uint>  &idList,
+                                         my_dev::dev_mem<uint2> &outputKeys,
+                                         my_dev::dev_mem<uint>  &outputValues,
+                                         const int N,
+                                         my_dev::dev_mem<uint>  &generalBuffer,
+                                         const int currentOffset)
+{
+  uint2 *values     = validList.raw_p();
+  uint  *listofones = idList.raw_p();
+  uint2 *outKeys    = outputKeys.raw_p();
+  uint  *outValues  = outputValues.raw_p();
+
+  //Partition the values by in or out of domain. Result: [[outside],[inside ids]]
+  double t1 = get_time();
+  uint2 *res = std::stable_partition(values, values + N, [](const uint2 &val) { return (val.x >> 31) != 0; });
+  const int remoteParticles = (int) (res-values);
+  double t2 = get_time();
+
+  validList2.copy_devonly(validList, remoteParticles); //Copy the list before sorting, needed for internal move
+
+  //Sort the outside our domain particles by their domain index
+  std::stable_sort(values, values + remoteParticles, [](const uint2 &a, const uint2 &b) { return a.x < b.x; });
+
+  double t3 = get_time();
+  //Reduce the domains, per domain the number of particles that will be send to that process
+  int nValues = 0;
+  for(int i=0; i < remoteParticles; i++)
+  {
+    if(i == 0 || values[i].x != values[i-1].x)
+    {
+      outKeys  [nValues] = values[i];
+      outValues[nValues] = 0;
+      nValues++;
+    }
+    outValues[nValues-1] += listofones[i];
+  }
+
+  LOGF(stderr,"Sorting detail: N: %d partition: %lg sort: %lg reduce: %lg \n",remoteParticles, t2-t1,t3-t2,get_time()-t3);
+
+  //return the number of remote particles and the number of remote domains
+  return make_uint2(remoteParticles, nValues);
+}
@@ -36,6 +36,8 @@ void octree::load_kernels() {
   boundaryReduction.      create("boundaryReduction", 		(const void*)&gpu_boundaryReduction);
   boundaryReductionGroups.create("boundaryReductionGroups", (const void*)&gpu_boundaryReductionGroups);
   store_groups.			  create("store_group_list", 		(const void*)&store_group_list);
+  mergeTreeNodes.         create("merge_tree_nodes", 		(const void*)&merge_tree_nodes);
+  mergeTreeGroups.        create("merge_tree_groups", 		(const void*)&merge_tree_groups);
 
   // load tree-props kernels
   propsNonLeafD. create("compute_non_leaf", (const void*)&compute_non_leaf);
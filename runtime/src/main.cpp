@@ -205,6 +205,14 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
   float quickRatio = 0.1;
   bool  quickSync  = true;
   bool  useMPIIO = false;
+  int   letThreads    = 0;
+  bool  letPinThreads = false;
+  float letCacheTol   = 0;
+  int   letNodeSize   = 0;
+  bool  letGather     = false;
+  bool  lbCost        = false;
+  bool  ddNode        = false;
+  bool  overlapDom    = false;
 
 #if ENABLE_LOG
   ENABLE_RUNTIME_LOG = false;
@@ -269,6 +277,14 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
         ADDUSAGE("     --usempiio         use MPI-IO [disabled]");
 		ADDUSAGE("     --rmdist #         Particle removal distance (-1 to disable) [" << remoDistance << "]");
 		ADDUSAGE(" -r  --rebuild #        rebuild tree every # steps [" << rebuild_tree_rate << "]");
+    ADDUSAGE("     --letthreads #     number of threads used to build the LETs (0 = one per core) [" << letThreads << "]");
+    ADDUSAGE("     --letpin           pin the LET threads to the cores of the process cpuset");
+    ADDUSAGE("     --letnode #        aggregate the LETs for groups of at most # processes of a shared-memory node (0 = disabled) [" << letNodeSize << "]");
+    ADDUSAGE("     --letgather        gather the exported particles from the device buffer instead of copying all positions (host backend only)");
+    ADDUSAGE("     --lbcost           balance the domains on the interaction counts instead of the gravity time");
+    ADDUSAGE("     --ddnode           two-level domain decomposition, over the nodes and then over the processes of a node");
+    ADDUSAGE("     --overlapdomain    build and walk the staying particles while the redistributed ones are in flight, no barrier after it");
+    ADDUSAGE("     --letcache #       reuse LETs between tree rebuilds, walk with group boxes inflated by # length units (0 = disabled) [" << letCacheTol << "]");
 		ADDUSAGE("     --reducebodies #   cut down bodies dataset by # factor ");
 #ifdef USE_DUST
         ADDUSAGE("     --reducedust #     cut down dust dataset by # factor ");
@@ -332,6 +348,14 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
     opt.setOption( "rmdist");
     opt.setOption( "valueadd");
     opt.setOption( "reducebodies");
+    opt.setOption( "letthreads");
+    opt.setFlag  ( "letpin");
+    opt.setOption( "letcache");
+    opt.setOption( "letnode");
+    opt.setFlag  ( "letgather");
+    opt.setFlag  ( "lbcost");
+    opt.setFlag  ( "ddnode");
+    opt.setFlag  ( "overlapdomain");
 
 #if ENABLE_LOG
     opt.setFlag("log");
@@ -396,6 +420,21 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
     if ((optarg = opt.getValue("rebuild")))      rebuild_tree_rate  = atoi  (optarg);
     if ((optarg = opt.getValue("reducebodies"))) reduce_bodies_factor = atoi  (optarg);
     if ((optarg = opt.getValue("reducedust")))	 reduce_dust_factor = atoi  (optarg);
+    if ((optarg = opt.getValue("letthreads")))   letThreads         = atoi  (optarg);
+    if (opt.getValue("letpin")) letPinThreads = true;
+    if ((optarg = opt.getValue("letcache")))     letCacheTol        = (float) atof  (optarg);
+    if ((optarg = opt.getValue("letnode")))      letNodeSize        = atoi  (optarg);
+    if (opt.getValue("letgather")) letGather = true;
+    if (opt.getValue("lbcost"))    lbCost    = true;
+    if (opt.getValue("ddnode"))    ddNode    = true;
+    if (opt.getValue("overlapdomain")) overlapDom = true;
+#ifndef USE_HOST
+    if (letGather)
+    {
+      fprintf(stderr, "--letgather requires host accessible device memory and is only available with the host backend\n");
+      ::exit(1);
+    }
+#endif
 #if USE_OPENGL
     if ((optarg = opt.getValue("fullscreen")))	 fullScreenMode     = string(optarg);
     if ((optarg = opt.getValue("Tglow")))	 TstartGlow  = (float)atof(optarg);
@@ -561,6 +600,13 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
                                 timeStep,
                                 tEnd, iterEnd,
                                 rebuild_tree_rate, direct, shrMemPID);
+    tree->setLETThreads(letThreads, letPinThreads);
+    tree->setLETCache(letCacheTol);
+    tree->setLETNodeSize(letNodeSize);
+    tree->setLETGather(letGather);
+    tree->setLoadBalanceCost(lbCost);
+    tree->setNodeDecomposition(ddNode);
+    tree->setOverlapDomain(overlapDom);
 
 
 
@@ -599,6 +645,19 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
       cerr << "[INIT]\tRuntime logging is DISABLED \n";
 #endif
     cerr << "[INIT]\tDirect gravitation is " << (direct ? "ENABLED" : "DISABLED") << endl;
+    cerr << "[INIT]\tLET threads: \t"     << letThreads << "\t\tpinned: \t" << (letPinThreads ? "YES" : "NO") << endl;
+    if(letCacheTol > 0)
+      cerr << "[INIT]\tLET cache tolerance: " << letCacheTol << endl;
+    if(letNodeSize > 1)
+      cerr << "[INIT]\tLET node aggregation: " << letNodeSize << " processes" << endl;
+    if(letGather)
+      cerr << "[INIT]\tLET particle gather is ENABLED" << endl;
+    if(lbCost)
+      cerr << "[INIT]\tInteraction cost load balancing is ENABLED" << endl;
+    if(ddNode)
+      cerr << "[INIT]\tTwo-level domain decomposition is ENABLED" << endl;
+    if(overlapDom)
+      cerr << "[INIT]\tPipelined domain redistribution is ENABLED" << endl;
 #if USE_OPENGL
     cerr << "[INIT]\tTglow = " << TstartGlow << endl;
     cerr << "[INIT]\tdTglow = " << dTstartGlow << endl;
@@ -11,6 +11,7 @@
 
 
 #include "IDType.h"
+#include <array>
 
 #ifdef USE_MPI
     #include "BonsaiIO.h"
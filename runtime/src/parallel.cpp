@@ -220,9 +220,12 @@ struct GETLETBUFFERS
 
 
 #include "hostTreeBuild.h"
+#include "hostPHKey.h"
 
 #include "mpi.h"
 #include <omp.h>
+#include <sched.h>
+#include "LETWorkQueue.h"
 
 #include "MPIComm.h"
 template <> MPI_Datatype MPIComm_datatype<float>() {return MPI_FLOAT; }
@@ -1097,7 +1100,118 @@ int octree::SumOnRootRank(int value)
 
 //Functions related to domain decomposition
 
+//Relative cost of a particle for the load balancer. An approximate (particle-cell)
+//interaction takes about 65 flops, a direct (particle-particle) one 23. The constant
+//accounts for the work per particle that does not depend on the interactions
+static inline double interactionCost(const int2 count)
+{
+  return 1.0 + count.y + (65.0/23.0)*count.x;
+}
+
+//Sum the interaction cost of the previous step and decide, with hysteresis, if
+//the boundaries have to be updated: start when the most expensive process is
+//10% above average and continue until it is within 3%
+bool octree::updateCostImbalance(tree_structure &tree)
+{
+#ifdef USE_MPI
+  double costLocal = 0;
+#pragma omp parallel for reduction(+ : costLocal)
+  for(int i=0; i < tree.n; i++)
+    costLocal += interactionCost(tree.interactions[i]);
+
+  double costMax = 0, costSum = 0;
+  MPI_Allreduce(&costLocal, &costMax, 1, MPI_DOUBLE, MPI_MAX, mpiCommWorld);
+  MPI_Allreduce(&costLocal, &costSum, 1, MPI_DOUBLE, MPI_SUM, mpiCommWorld);
+
+  lbCostLocal = costLocal;
+  lbCostTotal = costSum;
+
+  const double costAvg   = costSum / nProcs;
+  const double imbalance = 100*(costMax-costAvg) / costAvg;
+  if(imbalance > 10) lbCostActive = true;
+  if(imbalance <  3) lbCostActive = false;
+
+  char buff[512];
+  sprintf(buff, "LBCOST-%d: iter: %d cost: %lg avg: %lg max: %lg imbalance: %lg update: %d\n",
+                procId, iter, costLocal, costAvg, costMax, imbalance, lbCostActive);
+  devContext->writeLogEvent(buff);
+#endif
+  return lbCostActive;
+}
+
+//Sets up the node level of the two-level domain decomposition
+void octree::initNodeDecomposition()
+{
+#ifdef USE_MPI
+  ddNode.init(mpiCommWorld);
+  if(procId == 0)
+  {
+    if(ddNode.isHierarchical())
+    {
+      LOGF(stderr, "Two-level domain decomposition: %d nodes with %d processes\n",
+                   ddNode.getNodeCount(), ddNode.getRanksPerNode());
+    }
+    else
+    {
+      LOGF(stderr, "Two-level domain decomposition requires the same number of consecutive ranks on every node, "
+                   "using a single level\n");
+    }
+  }
+#endif
+}
+
+//Per level load imbalance for the two-level decomposition. The load is the
+//interaction cost (with --lbcost) or the gravity time. Returns if the nodes are
+//imbalanced, which requires a global update, and sets updateNode if only the
+//processes of our node are
+bool octree::checkNodeImbalance(const float lastExecTime, const bool imbalanced, bool &updateNode)
+{
+  updateNode = false;
+#ifdef USE_MPI
+  if(!ddNode.isInitialized()) initNodeDecomposition();
+  if(!ddNode.isHierarchical()) return imbalanced;
+
+  const double load = (lbUseCost && interactionsOnHost) ? lbCostLocal : lastExecTime;
+
+  double nodeImbalance, rankImbalance, ownImbalance;
+  ddNode.levelImbalance(mpiCommWorld, load, nodeImbalance, rankImbalance, ownImbalance);
+
+  const bool updateGlobal = nodeImbalance > 10;
+  updateNode              = ownImbalance  > 10;
+
+  char buff[512];
+  sprintf(buff, "DDLEVEL-%d: iter: %d node: %d load: %lg nodeImbalance: %lg maxRankImbalance: %lg "
+                "ownRankImbalance: %lg globalUpdate: %d nodeUpdate: %d\n",
+                procId, iter, ddNode.getNodeId(), load, nodeImbalance, rankImbalance,
+                ownImbalance, updateGlobal, updateNode);
+  devContext->writeLogEvent(buff);
+  if(procId == 0)
+    LOGF(stderr, "Domain imbalance iter: %d between nodes: %lg %% within nodes (max): %lg %%\n",
+                 iter, nodeImbalance, rankImbalance);
+
+  return updateGlobal;
+#else
+  return imbalanced;
+#endif
+}
 
+//Samples keys (sorted) so that each sample represents the same cost
+static void sampleKeysByCost(const uint4 *keys, const int2 *interactions, const int n,
+                             const double costStride, std::vector<DD2D::Key> &samples)
+{
+  double costSum    = 0;
+  double nextSample = 0;
+  for(int i=0; i < n; i++)
+  {
+    costSum += interactionCost(interactions[i]);
+    while(costSum > nextSample)
+    {
+      samples.push_back(DD2D::Key((static_cast<unsigned long long>(keys[i].y) ) |
+                                  (static_cast<unsigned long long>(keys[i].x) << 32)));
+      nextSample += costStride;
+    }
+  }
+}
 
 void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSamples2,
     uint4 *globalSamples2, int  *nReceiveCnts2, int *nReceiveDpls2,
@@ -1126,6 +1240,9 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSa
 
     /* LB step */
 
+    //Sample on the interaction counts of the previous step instead of the timings
+    const bool costBased = lbUseCost && interactionsOnHost && !initialSetup && lbCostTotal > 0;
+
     double f_lb = 1.0;
 #if 1  /* LB: use load balancing */
     {
@@ -1171,6 +1288,7 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSa
 #endif  /* MEMB: end memory balance */
 
       f_lb  = timeLocal / timeSum * nProcs;
+      if(costBased) f_lb = lbCostLocal / lbCostTotal * nProcs;
       f_lb *= (double)nloc_mean/(double)nkeys_loc;
       f_lb  = std::max(std::min(fmax, f_lb), fmin);
     }
@@ -1178,7 +1296,11 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSa
 
     /*** particle sampling ***/
 
-    const int npx = myComm->n_proc_i;  /* number of procs doing domain decomposition */
+    int npx = myComm->n_proc_i;  /* number of procs doing domain decomposition */
+
+    //Two-level decomposition, the first level splits over the nodes
+    if(ddNodeLevel && !ddNode.isInitialized()) initNodeDecomposition();
+    if(ddNodeLevel && ddNode.isHierarchical()) npx = ddNode.getNodeCount();
 
     int nsamples_glb;
     if(initialSetup)
@@ -1202,7 +1324,17 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSa
     const double nTot = nTotalFreq_ull;
     const double stride1d = std::max(nTot/nsamples1d_glb, 1.0);
     const double stride2d = std::max(nTot/nsamples2d_glb, 1.0);
-    for (double i = 0; i < (double)nkeys_loc; i += stride1d)
+    if(costBased)
+    {
+      //Same number of samples, but placed on the cumulative cost of the particles
+      //so that the boundaries split the cost instead of the particle count
+      const double costPerKey = lbCostLocal / nkeys_loc;
+      sampleKeysByCost(&localTree.bodies_key[0], &localTree.interactions[0], nkeys_loc,
+                       stride1d*costPerKey, key_sample1d);
+      sampleKeysByCost(&localTree.bodies_key[0], &localTree.interactions[0], nkeys_loc,
+                       stride2d*costPerKey, key_sample2d);
+    }
+    for (double i = 0; i < (double)nkeys_loc && !costBased; i += stride1d)
     {
       const uint4 key = localTree.bodies_key[(int)i];
       key_sample1d.push_back(DD2D::Key(
@@ -1210,7 +1342,7 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSa
             (static_cast<unsigned long long>(key.x) << 32)
             ));
     }
-    for (double i = 0; i < (double)nkeys_loc; i += stride2d)
+    for (double i = 0; i < (double)nkeys_loc && !costBased; i += stride2d)
     {
       const uint4 key = localTree.bodies_key[(int)i];
       key_sample2d.push_back(DD2D::Key(
@@ -1275,7 +1407,7 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSa
       //std::stable_sort(globalSamples, globalSamples+totalCount, cmp_ph_key());
       __gnu_parallel::stable_sort(globalSamples, globalSamples+totalCount, cmp_ph_key());
 #else
-#if 0
+#if 1
       {
         const int BITS = 32*2;  /*  32*1 = 32 bit sort, 32*2 = 64 bit sort, 32*3 = 96 bit sort */
         typedef RadixSort<BITS> Radix;
@@ -1390,6 +1522,72 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSa
 #endif
 }
 
+//Moves the boundaries between the processes of our node, the boundaries of the
+//node itself are kept. Same sampling as the global update, but restricted to
+//the node and its communicator
+void octree::updateNodeBoundaries(uint4 *parallelBoundaries, const float lastExecTime)
+{
+#ifdef USE_MPI
+  const double t0 = get_time();
+
+  const int npy   = ddNode.getRanksPerNode();
+  const int first = ddNode.getNodeId()*npy;
+
+  const int    nkeys_loc = localTree.n;
+  const bool   costBased = lbUseCost && interactionsOnHost && lbCostTotal > 0;
+  const double load      = costBased ? lbCostLocal : lastExecTime;
+
+  double local[2] = {load, (double)nkeys_loc}, node[2];
+  MPI_Allreduce(local, node, 2, MPI_DOUBLE, MPI_SUM, ddNode.getNodeComm());
+  if(node[0] <= 0 || nkeys_loc == 0) node[0] = 0;
+
+  //Sampling rate relative to our share of the load of the node, with the same
+  //memory balance limit as the global update
+  const double nodeMean = node[1] / npy;
+  double f_lb = node[0] > 0 ? load / node[0] * npy : 1.0;
+  f_lb *= nodeMean / std::max(nkeys_loc, 1);
+  f_lb  = std::max(f_lb, 1.0/(1.0+0.3));
+
+  const double nsamples = std::max(32.0*npy, nodeMean / 30);
+  const double stride   = std::max(node[1] / (f_lb * nsamples), 1.0);
+
+  std::vector<DD2D::Key> samples;
+  if(costBased)
+  {
+    sampleKeysByCost(&localTree.bodies_key[0], &localTree.interactions[0], nkeys_loc,
+                     stride*lbCostLocal/nkeys_loc, samples);
+  }
+  for (double i = 0; i < (double)nkeys_loc && !costBased; i += stride)
+  {
+    const uint4 key = localTree.bodies_key[(int)i];
+    samples.push_back(DD2D::Key((static_cast<unsigned long long>(key.y) ) |
+                                (static_cast<unsigned long long>(key.x) << 32)));
+  }
+
+  const uint4 beg = parallelBoundaries[first];
+  const uint4 end = parallelBoundaries[first+npy];
+  const DD2D::Key begKey((static_cast<unsigned long long>(beg.y)) | (static_cast<unsigned long long>(beg.x) << 32));
+  const DD2D::Key endKey = (first+npy == nProcs) ? DD2D::Key::max() :
+                     DD2D::Key((static_cast<unsigned long long>(end.y)) | (static_cast<unsigned long long>(end.x) << 32));
+
+  std::vector<DD2D::Key> boundaries;
+  const bool updated = ddNode.chopNodeBoundaries(samples, begKey, endKey, boundaries);
+  if(updated)
+  {
+    for(int i=1; i < npy; i++)
+    {
+      parallelBoundaries[first+i] = (uint4){
+        (uint)((boundaries[i].key >> 32) & 0x00000000FFFFFFFF),
+        (uint)((boundaries[i].key      ) & 0x00000000FFFFFFFF),
+        0,0};
+    }
+  }
+
+  LOGF(stderr, "Node %d boundary update: %d samples: %d took: %lg\n",
+               ddNode.getNodeId(), updated, (int)samples.size(), get_time()-t0);
+#endif
+}
+
 //Uses one communication by storing data in one buffer and communicate required information,
 //such as box-sizes and number of sample particles on this process. Nsample is set to 0
 //since it is not used in this function/hash-method
@@ -1450,7 +1648,7 @@ void octree::sendCurrentRadiusInfo(real4 &rmin, real4 &rmax)
 
 //Function that uses the GPU to get a set of particles that have to be
 //send to other processes
-void octree::gpuRedistributeParticles_SFC(uint4 *boundaries)
+void octree::gpuRedistributeParticles_SFC(uint4 *boundaries, const bool deferArrivals)
 {
 #ifdef USE_MPI
   double tStart = get_time();
@@ -1516,6 +1714,7 @@ void octree::gpuRedistributeParticles_SFC(uint4 *boundaries)
   bool doInOneGo              = true;
   double tExtract             = 0;
   double ta2aSize             = 0;
+  bool   neighbourExchange    = false;
 
   int *nparticles  = &exchangePartBuffer[0*(nProcs+1)]; //nParticles to send per domain
   int *nreceive    = &exchangePartBuffer[2*(nProcs+1)]; //nParticles to receive per domain
@@ -1648,8 +1847,17 @@ void octree::gpuRedistributeParticles_SFC(uint4 *boundaries)
         sendOffset         += nParticlesPerDomain[i];
       }
 
+      //Only exchange the counts with our neighbours if nobody has to send
+      //outside its neighbour set, otherwise do the general all2all and use
+      //its result as the new neighbour set
       double tStarta2a = get_time();
-      MPI_Alltoall(nparticles, 1, MPI_INT, nreceive, 1, MPI_INT, mpiCommWorld);
+      if(!particleExchange.isInitialized()) particleExchange.init(mpiCommWorld);
+      neighbourExchange = particleExchange.exchangeCounts(nparticles, nreceive);
+      if(!neighbourExchange)
+      {
+        MPI_Alltoall(nparticles, 1, MPI_INT, nreceive, 1, MPI_INT, mpiCommWorld);
+        particleExchange.setNeighbours(nparticles, nreceive);
+      }
       ta2aSize = get_time()-tStarta2a;
     }//if tid == 1
   } //omp section
@@ -1658,20 +1866,25 @@ void octree::gpuRedistributeParticles_SFC(uint4 *boundaries)
 
   //LOGF(stderr,"Particle extraction took: %lg \n", get_time()-tStart);
 
-  int currentN = localTree.n;
-
   this->gpu_exchange_particles_with_overflow_check_SFC2(localTree, &extraBodyBuffer[0],
                                                         nparticles, nsendDispls, nreceive,
-                                                        nExportParticles);
+                                                        nExportParticles, neighbourExchange,
+                                                        deferArrivals);
   double tEnd = get_time();
 
   char buff5[1024];
-  sprintf(buff5,"EXCHANGE-%d: tCheckDomain: %lg ta2aSize: %lg tSort: %lg tExtract: %lg tDomainEx: %lg nExport: %d nImport: %d \n",
-      procId, tCheck-tStart, ta2aSize, tSort-tCheck, tExtract-tSort, tEnd-tExtract,nExportParticles, localTree.n - (currentN-nExportParticles));
+  sprintf(buff5,"EXCHANGE-%d: tCheckDomain: %lg ta2aSize: %lg tSort: %lg tExtract: %lg tDomainEx: %lg nExport: %d nImport: %d "
+                "neighbours: %d persistent: %d reused: %d rebuilt: %d\n",
+      procId, tCheck-tStart, ta2aSize, tSort-tCheck, tExtract-tSort, tEnd-tExtract,nExportParticles, pendingExchange.recvCount,
+      particleExchange.getNeighbourCount(), neighbourExchange,
+      particleExchange.getReuseCount(), particleExchange.getRebuildCount());
   devContext->writeLogEvent(buff5);
 
   if(!doInOneGo) delete[] extraBodyBuffer;
 
+  //The interaction counts no longer match the particles
+  interactionsOnHost = false;
+
 
 #if 0
   First step, partition?
@@ -1693,11 +1906,40 @@ void octree::gpuRedistributeParticles_SFC(uint4 *boundaries)
 #endif
 } //End gpuRedistributeParticles
 
-//Exchange particles with other processes
+//Grows the particle arrays to hold newN particles
+void octree::resizeParticleArrays(tree_structure &tree, const int newN)
+{
+  //Allocate MULTI_GPU_MEM_INCREASE% extra if we have to allocate, to reduce the total number of memory allocations
+  int memSize = newN;
+  if(tree.bodies_acc0.get_size() < newN)
+    memSize = newN * MULTI_GPU_MEM_INCREASE;
+
+  //LOGF(stderr,"Going to allocate memory for %d particles \n", newN);
+
+  //Have to resize the bodies vector to keep the numbering correct
+  //but do not reduce the size since we need to preserve the particles
+  //in the over sized memory
+  tree.bodies_pos. cresize(memSize + 1, false);
+  tree.bodies_acc0.cresize(memSize,     false);
+  tree.bodies_acc1.cresize(memSize,     false);
+  tree.bodies_vel. cresize(memSize,     false);
+  tree.bodies_time.cresize(memSize,     false);
+  tree.bodies_ids. cresize(memSize + 1, false);
+  tree.bodies_Ppos.cresize(memSize + 1, false);
+  tree.bodies_Pvel.cresize(memSize + 1, false);
+  tree.bodies_key. cresize(memSize + 1, false);
+  tree.bodies_h.   cresize(memSize + 1, false);
+}
+
+//Exchange particles with other processes. With deferArrivals the function
+//returns as soon as the sends and receives are posted, tree then only holds
+//the staying particles and the arrivals are picked up by the domain pipeline
 int octree::gpu_exchange_particles_with_overflow_check_SFC2(tree_structure &tree,
                                                             bodyStruct *particlesToSend,
                                                             int *nparticles, int *nsendDispls,
-                                                            int *nreceive, int nToSend)
+                                                            int *nreceive, int nToSend,
+                                                            bool neighbourExchange,
+                                                            bool deferArrivals)
 {
 #ifdef USE_MPI
 
@@ -1709,19 +1951,31 @@ int octree::gpu_exchange_particles_with_overflow_check_SFC2(tree_structure &tree
     recvCount     += nreceive[i];
   }
 
-  static std::vector<bodyStruct> recv_buffer3;
-  recv_buffer3.resize(recvCount);
+  PendingExchange &ex = pendingExchange;
+  assert(!ex.active && !ex.sendsActive);
 
-  int recvOffset = 0;
+  ex.recvBuffer.resize(recvCount);
+  ex.sendReq.clear();
+  ex.recvReq.clear();
+  ex.recvCount         = recvCount;
+  ex.nreceive          = nreceive;
+  ex.neighbourExchange = neighbourExchange;
 
+  //The caller releases its send buffer on return
+  if(deferArrivals)
+  {
+    ex.sendBuffer.assign(particlesToSend, particlesToSend + nToSend);
+    particlesToSend = nToSend > 0 ? &ex.sendBuffer[0] : NULL;
+  }
 
-  static MPI_Status stat[NMAXPROC];
-  static MPI_Request req[NMAXPROC*2];
-  assert(nProcs < NMAXPROC);
+  int recvOffset = 0;
+
+  //Same neighbours as before, use the persistent receives
+  if(neighbourExchange)
+    particleExchange.startExchange(particlesToSend, nparticles, nsendDispls, nreceive);
 
   //TODO this loop could overflow if scount > INT_MAX (same for rcount)
-  int nreq = 0;
-  for (int dist = 1; dist < nProcs; dist++)
+  for (int dist = 1; dist < nProcs && !neighbourExchange; dist++)
   {
     const int src    = (nProcs + procId - dist) % nProcs;
     const int dst    = (nProcs + procId + dist) % nProcs;
@@ -1733,25 +1987,42 @@ int octree::gpu_exchange_particles_with_overflow_check_SFC2(tree_structure &tree
 
     if (scount > 0)
     {
-      MPI_Isend(&particlesToSend[nsendDispls[dst]], scount, MPI_DOUBLE, dst, 1, mpiCommWorld, &req[nreq++]);
+      ex.sendReq.push_back(MPI_REQUEST_NULL);
+      MPI_Isend(&particlesToSend[nsendDispls[dst]], scount, MPI_DOUBLE, dst, 1, mpiCommWorld, &ex.sendReq.back());
     }
     if(rcount > 0)
     {
-      MPI_Irecv(&recv_buffer3[recvOffset], rcount, MPI_DOUBLE, src, 1, mpiCommWorld, &req[nreq++]);
+      ex.recvReq.push_back(MPI_REQUEST_NULL);
+      MPI_Irecv(&ex.recvBuffer[recvOffset], rcount, MPI_DOUBLE, src, 1, mpiCommWorld, &ex.recvReq.back());
       recvOffset += nreceive[src];
     }
   }
+  ex.active      = true;
+  ex.sendsActive = true;
 
   double t94 = get_time();
-  MPI_Waitall(nreq, req, stat);
-  double tSendEnd = get_time();
 
-  //If we arrive here all particles have been exchanged, move them to the GPU
-  LOGF(stderr,"Required inter-process communication time: %lg ,proc: %d\n", get_time()-tStart, procId);
+  if(deferArrivals)
+  {
+    //internalMoveSFC2 compacted the staying particles to the front of the arrays
+    execStream->sync();
+    tree.setN(tree.n - nToSend);
+
+    char buff5[1024];
+    sprintf(buff5,"EXCHANGEB-%d: tISendIRecv: %lg deferred: %d\n", procId, t94-tStart, recvCount);
+    devContext->writeLogEvent(buff5);
+    return 0;
+  }
+
+  waitParticleExchange();
+  double tSendEnd = get_time();
 
   //Compute the new number of particles:
   int newN = tree.n + recvCount - nToSend;
 
+  //If we arrive here all particles have been exchanged, move them to the GPU
+  LOGF(stderr,"Required inter-process communication time: %lg ,proc: %d\n", get_time()-tStart, procId);
+
   LOGF(stderr, "Exchange, received %d \tSend: %d newN: %d\n", recvCount, nToSend, newN);
 
   //make certain that the particle movement on the device is complete before we resize
@@ -1759,28 +2030,49 @@ int octree::gpu_exchange_particles_with_overflow_check_SFC2(tree_structure &tree
 
   double tSyncGPU = get_time();
 
-  //Allocate MULTI_GPU_MEM_INCREASE% extra if we have to allocate, to reduce the total number of memory allocations
-  int memSize = newN;
-  if(tree.bodies_acc0.get_size() < newN)
-    memSize = newN * MULTI_GPU_MEM_INCREASE;
+  resizeParticleArrays(tree, newN);
 
-  //LOGF(stderr,"Going to allocate memory for %d particles \n", newN);
+  double tAllocComplete = get_time();
 
-  //Have to resize the bodies vector to keep the numbering correct
-  //but do not reduce the size since we need to preserve the particles
-  //in the over sized memory
-  tree.bodies_pos. cresize(memSize + 1, false);
-  tree.bodies_acc0.cresize(memSize,     false);
-  tree.bodies_acc1.cresize(memSize,     false);
-  tree.bodies_vel. cresize(memSize,     false);
-  tree.bodies_time.cresize(memSize,     false);
-  tree.bodies_ids. cresize(memSize + 1, false);
-  tree.bodies_Ppos.cresize(memSize + 1, false);
-  tree.bodies_Pvel.cresize(memSize + 1, false);
-  tree.bodies_key. cresize(memSize + 1, false);
-  tree.bodies_h.   cresize(memSize + 1, false);
+  insertReceivedParticles(tree, recvCount > 0 ? &ex.recvBuffer[0] : NULL, recvCount, tree.n - nToSend);
+
+  //Resize the arrays of the tree
+  tree.setN(newN);
+  reallocateParticleMemory(tree);
+
+  double tEnd = get_time();
+
+  char buff5[1024];
+  sprintf(buff5,"EXCHANGEB-%d: tExSend: %lg tExGPUSync: %lg tExGPUAlloc: %lg tExGPUSend: %lg tISendIRecv: %lg tWaitall: %lg\n",
+                procId, tSendEnd-tStart, tSyncGPU-tSendEnd,
+                tAllocComplete-tSyncGPU, tEnd-tAllocComplete,
+                t94-tStart, tSendEnd-t94);
+  devContext->writeLogEvent(buff5);
+
+#endif
+
+//  localTree.bodies_Ppos.d2h();
+//  localTree.bodies_pos.d2h();
 
-  memSize = tree.bodies_acc0.get_size();
+//  for(int i=0; i < tree.n; i++)
+//  {
+//	  LOGF(stderr,"CURRENT: %d %f %f  \t %f %f\n",
+//			  i,
+//			  localTree.bodies_pos[i].x, localTree.bodies_pos[i].y,
+//			  localTree.bodies_Ppos[i].x, localTree.bodies_Ppos[i].y);
+//  }
+
+
+  return 0;
+}
+
+
+//Copies count received particles into the particle arrays of tree, starting
+//at index insertAt. The arrays must be large enough, the copy goes in batches
+//through the generalBuffer1 of the tree
+void octree::insertReceivedParticles(tree_structure &tree, bodyStruct *particles, const int count, int insertAt)
+{
+  int memSize = tree.bodies_acc0.get_size();
   //This one has to be at least the same size as the number of particles in order to
   //have enough space to store the other buffers
   //Can only be resized after we are done since we still have
@@ -1790,81 +2082,402 @@ int octree::gpu_exchange_particles_with_overflow_check_SFC2(tree_structure &tree
 
 
   //Now we have to copy the data in batches in case the generalBuffer1 is not large enough
-  //Amount we can store:
-  int spaceInIntSize    = 3*(memSize)*4;
+  //Amount we can store, a small tree still has the minimum sized generalBuffer1:
+  int spaceInIntSize    = tree.generalBuffer1.get_size() - 4096;
   int stepSize          = spaceInIntSize / (sizeof(bodyStruct) / sizeof(int));
 
   my_dev::dev_mem<bodyStruct>  bodyBuffer;
 
-  int memOffset1 = bodyBuffer.cmalloc_copy(localTree.generalBuffer1, stepSize, 0);
-
-  double tAllocComplete = get_time();
+  int memOffset1 = bodyBuffer.cmalloc_copy(tree.generalBuffer1, stepSize, 0);
 
+  int nExtract     = 0;
   int insertOffset = 0;
-  for(unsigned int i=0; i < recvCount; i+= stepSize)
+  for(int i=0; i < count; i+= stepSize)
   {
-    int items = min(stepSize, (int)(recvCount-i));
+    int items = min(stepSize, count-i);
 
     if(items > 0)
     {
       //Copy the data from the MPI receive buffers into the GPU-send buffer
 #pragma omp parallel for
         for(int cpIdx=0; cpIdx < items; cpIdx++)
-          bodyBuffer[cpIdx] = recv_buffer3[insertOffset+cpIdx]; //TODO can't we just copy directly from recv_buffer3?
+          bodyBuffer[cpIdx] = particles[insertOffset+cpIdx]; //TODO can't we just copy directly from the receive buffer?
 
       bodyBuffer.h2d(items);
 
-//      for(int z=0; z<items; z++)
-//      {
-//    	  LOGF(stderr,"RECV: %d\t%f %f %f %f\t%f %f %f %f\n",
-//      		z,
-//      		bodyBuffer[z].Ppos.x,bodyBuffer[z].Ppos.y,bodyBuffer[z].Ppos.z,bodyBuffer[z].Ppos.w,
-//      		bodyBuffer[z].Pvel.x,bodyBuffer[z].Pvel.y,bodyBuffer[z].Pvel.z,bodyBuffer[z].Pvel.w);
-//      }
-
-
       //Start the kernel that puts everything in place
       insertNewParticlesSFC.set_args(0,
-              &nToSend, &items, &tree.n, &insertOffset, localTree.bodies_Ppos.p(),
-              localTree.bodies_Pvel.p(), localTree.bodies_pos.p(), localTree.bodies_vel.p(),
-              localTree.bodies_acc0.p(), localTree.bodies_acc1.p(), localTree.bodies_time.p(),
-              localTree.bodies_ids.p(), localTree.bodies_key.p(), localTree.bodies_h.p(), bodyBuffer.p());
+              &nExtract, &items, &insertAt, &insertOffset, tree.bodies_Ppos.p(),
+              tree.bodies_Pvel.p(), tree.bodies_pos.p(), tree.bodies_vel.p(),
+              tree.bodies_acc0.p(), tree.bodies_acc1.p(), tree.bodies_time.p(),
+              tree.bodies_ids.p(), tree.bodies_key.p(), tree.bodies_h.p(), bodyBuffer.p());
       insertNewParticlesSFC.setWork(items, 128);
       insertNewParticlesSFC.execute2(execStream->s());
     }// if items > 0
     insertOffset += items;
-  } //for recvCount
+  } //for count
+}
 
-  //Resize the arrays of the tree
-  tree.setN(newN);
-  reallocateParticleMemory(tree);
+//Blocks until the particles of the pending exchange have been received and,
+//with waitSends, until our own particles have been sent. A process only enters
+//MPI again between its stages, so waiting for the sends early can stall on that
+void octree::waitParticleExchange(const bool waitSends)
+{
+#ifdef USE_MPI
+  PendingExchange &ex = pendingExchange;
+  if(ex.active)
+  {
+    if(ex.neighbourExchange)
+      particleExchange.finishReceives(ex.nreceive, ex.recvCount > 0 ? &ex.recvBuffer[0] : NULL);
+    else if(!ex.recvReq.empty())
+      MPI_Waitall(ex.recvReq.size(), &ex.recvReq[0], MPI_STATUSES_IGNORE);
+    ex.active = false;
+  }
+  if(waitSends && ex.sendsActive)
+  {
+    if(ex.neighbourExchange)
+      particleExchange.finishSends();
+    else if(!ex.sendReq.empty())
+      MPI_Waitall(ex.sendReq.size(), &ex.sendReq[0], MPI_STATUSES_IGNORE);
+    ex.sendsActive = false;
+  }
+#endif
+}
 
-  double tEnd = get_time();
+//Returns true if waitParticleExchange would not have to wait for the receives
+bool octree::testParticleExchange()
+{
+#ifdef USE_MPI
+  PendingExchange &ex = pendingExchange;
+  if(!ex.active) return true;
+
+  int flag = 1;
+  if(ex.neighbourExchange)
+    flag = particleExchange.testExchange(ex.nreceive);
+  else if(!ex.recvReq.empty())
+    MPI_Testall(ex.recvReq.size(), &ex.recvReq[0], &flag, MPI_STATUSES_IGNORE);
+  return flag;
+#else
+  return true;
+#endif
+}
 
-  char buff5[1024];
-  sprintf(buff5,"EXCHANGEB-%d: tExSend: %lg tExGPUSync: %lg tExGPUAlloc: %lg tExGPUSend: %lg tISendIRecv: %lg tWaitall: %lg\n",
-                procId, tSendEnd-tStart, tSyncGPU-tSendEnd,
-                tAllocComplete-tSyncGPU, tEnd-tAllocComplete,
-                t94-tStart, tSendEnd-t94);
-  devContext->writeLogEvent(buff5);
+//Completes the receives of a deferred exchange and puts the received particles
+//in the particle arrays of boundary
+void octree::loadBoundaryParticles(tree_structure &boundary)
+{
+#ifdef USE_MPI
+  waitParticleExchange(false);
 
+  const int recvCount = pendingExchange.recvCount;
+  boundary.setN(recvCount);
+
+  if(boundary.generalBuffer1.get_size() == 0)
+    allocateParticleMemory(boundary, false);
+  else
+    reallocateParticleMemory(boundary);
+
+  insertReceivedParticles(boundary, &pendingExchange.recvBuffer[0], recvCount, 0);
 #endif
+}
 
-//  localTree.bodies_Ppos.d2h();
-//  localTree.bodies_pos.d2h();
+//Completes a deferred exchange and adds the received particles to the end of tree
+void octree::appendReceivedParticles(tree_structure &tree)
+{
+#ifdef USE_MPI
+  waitParticleExchange();
 
-//  for(int i=0; i < tree.n; i++)
-//  {
-//	  LOGF(stderr,"CURRENT: %d %f %f  \t %f %f\n",
-//			  i,
-//			  localTree.bodies_pos[i].x, localTree.bodies_pos[i].y,
-//			  localTree.bodies_Ppos[i].x, localTree.bodies_Ppos[i].y);
-//  }
+  const int recvCount = pendingExchange.recvCount;
+  const int newN      = tree.n + recvCount;
 
+  resizeParticleArrays(tree, newN);
+  insertReceivedParticles(tree, recvCount > 0 ? &pendingExchange.recvBuffer[0] : NULL, recvCount, tree.n);
 
-  return 0;
+  tree.setN(newN);
+  reallocateParticleMemory(tree);
+#endif
 }
 
+//Adds the particles of boundary to the staying particles of tree. The two trees
+//are kept: a new root gets the roots of both as its children, so every level
+//moves down by one and the nodes, leaves and groups of boundary follow those of
+//tree. The results of the walks that are already done (acc1, density,
+//interaction counts, active flags) are in tree order and are appended as well
+void octree::mergeBoundaryTree(tree_structure &tree, tree_structure &boundary)
+{
+  const int nInterior = tree.n;
+  const int nBoundary = boundary.n;
+
+  //The arrays are resized below, the walks and the position copy of the LET have to be done
+  gravStream->sync();
+  LETDataToHostStream->sync();
+
+  //The merged tree is one level deeper, if that does not fit rebuild it instead
+  const int  nLevels = std::max(tree.n_levels, boundary.n_levels) + 1; //Levels of the source trees
+  const bool rebuild = nLevels + 1 >= MAXLEVELS;
+  if(rebuild)
+  {
+    applyParticleOrder(tree);
+    applyParticleOrder(boundary);
+  }
+
+  tree.setN(nInterior + nBoundary);
+  reallocateParticleMemory(tree);
+
+  tree.bodies_pos.    copy_devonly_async(boundary.bodies_pos,     nBoundary, nInterior, execStream->s());
+  tree.bodies_key.    copy_devonly_async(boundary.bodies_key,     nBoundary, nInterior, execStream->s());
+  tree.bodies_vel.    copy_devonly_async(boundary.bodies_vel,     nBoundary, nInterior, execStream->s());
+  tree.bodies_acc0.   copy_devonly_async(boundary.bodies_acc0,    nBoundary, nInterior, execStream->s());
+  tree.bodies_acc1.   copy_devonly_async(boundary.bodies_acc1,    nBoundary, nInterior, execStream->s());
+  tree.bodies_time.   copy_devonly_async(boundary.bodies_time,    nBoundary, nInterior, execStream->s());
+  tree.bodies_ids.    copy_devonly_async(boundary.bodies_ids,     nBoundary, nInterior, execStream->s());
+  tree.bodies_Ppos.   copy_devonly_async(boundary.bodies_Ppos,    nBoundary, nInterior, execStream->s());
+  tree.bodies_Pvel.   copy_devonly_async(boundary.bodies_Pvel,    nBoundary, nInterior, execStream->s());
+  tree.bodies_h.      copy_devonly_async(boundary.bodies_h,       nBoundary, nInterior, execStream->s());
+  tree.bodies_dens.   copy_devonly_async(boundary.bodies_dens,    nBoundary, nInterior, execStream->s());
+  tree.interactions.  copy_devonly_async(boundary.interactions,   nBoundary, nInterior, execStream->s());
+  tree.activePartlist.copy_devonly_async(boundary.activePartlist, nBoundary, nInterior, execStream->s());
+  tree.ngb.           copy_devonly_async(boundary.ngb,            nBoundary, nInterior, execStream->s());
+
+  if(rebuild)
+  {
+    //The union box of the predicted positions is still the one of parallelDataSummary
+    sort_bodies(tree, false);
+    reorderGravityResults(tree);
+
+    build(tree);
+    allocateTreePropMemory(tree);
+    compute_properties(tree);
+    return;
+  }
+
+  int nNodesI  = tree.n_nodes;
+  int nLeafsI  = tree.n_leafs;
+  int nGroupsI = tree.n_groups;
+
+  //Keep the node and group arrays of tree, they are overwritten by the merged ones
+  const int scratchSize = 24*nNodesI + 10*nGroupsI + 8*MAXLEVELS + 4096;
+  if(tree.generalBuffer1.get_size() < scratchSize)
+    tree.generalBuffer1.cresize(scratchSize, false);
+
+  my_dev::dev_mem<int4>  levelMapI, levelMapB;
+  my_dev::dev_mem<uint>  rootIdx;
+  my_dev::dev_mem<uint2> srcNodeBodies, srcGroupList;
+  my_dev::dev_mem<uint>  srcChildren,   srcLeafNodeIdx;
+  my_dev::dev_mem<real4> srcMultipole,  srcBoxSize,  srcBoxCenter;
+  my_dev::dev_mem<real4> srcGroupSize,  srcGroupCenter;
+
+  int memOffset = levelMapI.     cmalloc_copy(tree.generalBuffer1, MAXLEVELS,  0);
+      memOffset = levelMapB.     cmalloc_copy(tree.generalBuffer1, MAXLEVELS,  memOffset);
+      memOffset = rootIdx.       cmalloc_copy(tree.generalBuffer1, 1,          memOffset);
+      memOffset = srcNodeBodies. cmalloc_copy(tree.generalBuffer1, nNodesI,    memOffset);
+      memOffset = srcChildren.   cmalloc_copy(tree.generalBuffer1, nNodesI,    memOffset);
+      memOffset = srcLeafNodeIdx.cmalloc_copy(tree.generalBuffer1, nNodesI,    memOffset);
+      memOffset = srcMultipole.  cmalloc_copy(tree.generalBuffer1, 3*nNodesI,  memOffset);
+      memOffset = srcBoxSize.    cmalloc_copy(tree.generalBuffer1, nNodesI,    memOffset);
+      memOffset = srcBoxCenter.  cmalloc_copy(tree.generalBuffer1, nNodesI,    memOffset);
+      memOffset = srcGroupList.  cmalloc_copy(tree.generalBuffer1, nGroupsI,   memOffset);
+      memOffset = srcGroupSize.  cmalloc_copy(tree.generalBuffer1, nGroupsI,   memOffset);
+      memOffset = srcGroupCenter.cmalloc_copy(tree.generalBuffer1, nGroupsI,   memOffset);
+
+  srcNodeBodies. copy_devonly_async(tree.node_bodies,     nNodesI,   0, execStream->s());
+  srcChildren.   copy_devonly_async(tree.n_children,      nNodesI,   0, execStream->s());
+  srcLeafNodeIdx.copy_devonly_async(tree.leafNodeIdx,     nNodesI,   0, execStream->s());
+  srcMultipole.  copy_devonly_async(tree.multipole,       3*nNodesI, 0, execStream->s());
+  srcBoxSize.    copy_devonly_async(tree.boxSizeInfo,     nNodesI,   0, execStream->s());
+  srcBoxCenter.  copy_devonly_async(tree.boxCenterInfo,   nNodesI,   0, execStream->s());
+  srcGroupList.  copy_devonly_async(tree.group_list,      nGroupsI,  0, execStream->s());
+  srcGroupSize.  copy_devonly_async(tree.groupSizeInfo,   nGroupsI,  0, execStream->s());
+  srcGroupCenter.copy_devonly_async(tree.groupCenterInfo, nGroupsI,  0, execStream->s());
+
+  //Merged level L+1 holds the nodes of level L of tree followed by those of boundary,
+  //leafNodeIdx has the same order within its leaf and its non-leaf part
+  tree_structure         *src[2]      = {&tree, &boundary};
+  my_dev::dev_mem<int4>  *levelMap[2] = {&levelMapI, &levelMapB};
+  const int nLeafs     = nLeafsI + boundary.n_leafs;
+  int nodeOffset       = 1;
+  int leafOffset       = 0;
+  int nonLeafOffset    = nLeafs + 1;
+  int srcLeafOffset[2] = {0, 0};
+
+  uint2 mergedLevels[MAXLEVELS];
+  uint  mergedNodeLevels[MAXLEVELS];
+  mergedLevels[0]     = make_uint2(0, 1);
+  mergedNodeLevels[0] = nLeafs;
+  mergedNodeLevels[1] = nLeafs + 1;
+
+  for(int level=0; level < MAXLEVELS-1; level++)
+  {
+    const int levelStart = nodeOffset;
+    for(int t=0; t < 2; t++)
+    {
+      tree_structure &srcTree = *src[t];
+      const bool hasLevel = level <= srcTree.n_levels;
+      const int  nNodes   = hasLevel ? srcTree.level_list[level].y - srcTree.level_list[level].x : 0;
+      const int  nNonLeaf = level < srcTree.n_levels ? srcTree.node_level_list[level+1] - srcTree.node_level_list[level] : 0;
+      const int  nLeaf    = nNodes - nNonLeaf;
+
+      (*levelMap[t])[level] = make_int4(hasLevel ? srcTree.level_list[level].x : 0, nodeOffset,
+                                        leafOffset - srcLeafOffset[t],
+                                        nonLeafOffset - (hasLevel ? srcTree.node_level_list[level] : 0));
+      nodeOffset       += nNodes;
+      leafOffset       += nLeaf;
+      nonLeafOffset    += nNonLeaf;
+      srcLeafOffset[t] += nLeaf;
+    }
+    mergedLevels[level+1] = (nodeOffset > levelStart) ? make_uint2(levelStart, nodeOffset) : make_uint2(0, 0);
+    if(level+2 < MAXLEVELS) mergedNodeLevels[level+2] = nonLeafOffset;
+  }
+  assert(leafOffset == nLeafs && nodeOffset == 1 + nNodesI + boundary.n_nodes);
+  levelMapI.h2d();
+  levelMapB.h2d();
+
+  tree.n_nodes       = nodeOffset;
+  tree.n_leafs       = nLeafs;
+  tree.n_groups      = nGroupsI + boundary.n_groups;
+  tree.n_levels      = nLevels;
+  tree.startLevelMin = std::min(tree.startLevelMin, boundary.startLevelMin) + 1;
+
+  for(int i=0; i < MAXLEVELS; i++)  tree.level_list[i] = mergedLevels[i];
+  for(int i=0; i <= nLevels; i++)   tree.node_level_list[i] = mergedNodeLevels[i];
+  tree.level_list.h2d();
+  tree.node_level_list.h2d();
+
+  if(tree.node_bodies.get_size() < tree.n_nodes)
+  {
+    tree.node_bodies.cresize_nocpy(tree.n_nodes, false);
+    tree.n_children. cresize_nocpy(tree.n_nodes, false);
+  }
+  tree.leafNodeIdx.      cresize_nocpy(tree.n_nodes,  false);
+  tree.group_list.       cresize_nocpy(tree.n_groups, false);
+  tree.active_group_list.cresize_nocpy(tree.n_groups, false);
+  tree.activeGrpList.    cresize_nocpy(tree.n_groups, false);
+  allocateTreePropMemory(tree);
+
+  uint zero = 0, bodyOffset = nInterior, groupOffset = nGroupsI;
+  mergeTreeNodes.set_args(0, &nNodesI, &nLeafsI, &zero, levelMapI.p(), srcNodeBodies.p(), srcChildren.p(),
+                          srcLeafNodeIdx.p(), srcMultipole.p(), srcBoxSize.p(), srcBoxCenter.p(),
+                          tree.node_bodies.p(), tree.n_children.p(), tree.leafNodeIdx.p(), tree.multipole.p(),
+                          tree.boxSizeInfo.p(), tree.boxCenterInfo.p());
+  mergeTreeNodes.setWork(nNodesI, 128);
+  mergeTreeNodes.execute2(execStream->s());
+
+  mergeTreeNodes.set_args(0, &boundary.n_nodes, &boundary.n_leafs, &bodyOffset, levelMapB.p(),
+                          boundary.node_bodies.p(), boundary.n_children.p(), boundary.leafNodeIdx.p(),
+                          boundary.multipole.p(), boundary.boxSizeInfo.p(), boundary.boxCenterInfo.p(),
+                          tree.node_bodies.p(), tree.n_children.p(), tree.leafNodeIdx.p(), tree.multipole.p(),
+                          tree.boxSizeInfo.p(), tree.boxCenterInfo.p());
+  mergeTreeNodes.setWork(boundary.n_nodes, 128);
+  mergeTreeNodes.execute2(execStream->s());
+
+  //The particle order and group ids of tree stay as they are
+  mergeTreeGroups.set_args(0, &zero, &nGroupsI, &zero, &zero, tree.body2group_list.p(), tree.oriParticleOrder.p(),
+                           srcGroupList.p(), srcGroupSize.p(), srcGroupCenter.p(),
+                           tree.body2group_list.p(), tree.oriParticleOrder.p(), tree.group_list.p(),
+                           tree.groupSizeInfo.p(), tree.groupCenterInfo.p());
+  mergeTreeGroups.setWork(nGroupsI, 128);
+  mergeTreeGroups.execute2(execStream->s());
+
+  mergeTreeGroups.set_args(0, &boundary.n, &boundary.n_groups, &bodyOffset, &groupOffset,
+                           boundary.body2group_list.p(), boundary.oriParticleOrder.p(), boundary.group_list.p(),
+                           boundary.groupSizeInfo.p(), boundary.groupCenterInfo.p(),
+                           tree.body2group_list.p(), tree.oriParticleOrder.p(), tree.group_list.p(),
+                           tree.groupSizeInfo.p(), tree.groupCenterInfo.p());
+  mergeTreeGroups.setWork(std::max(nBoundary, boundary.n_groups), 128);
+  mergeTreeGroups.execute2(execStream->s());
+
+  //The new root, its children are the two old roots at node 1 and 2. Combined
+  //as in compute_non_leaf and compute_scaling, the quadrupoles are the central
+  //moments with Q1 stored as xy, xz, yz
+  execStream->sync();
+  tree.multipole.d2h(9);
+  tree.boxSizeInfo.d2h(3);
+  tree.boxCenterInfo.d2h(3);
+
+  double mass = 0, com[3] = {0, 0, 0}, Q[6] = {0, 0, 0, 0, 0, 0};
+  float  maxEps = -100.0f;
+  float3 r_min  = make_float3(+1e10f, +1e10f, +1e10f);
+  float3 r_max  = make_float3(-1e10f, -1e10f, -1e10f);
+  for(int i=1; i <= 2; i++)
+  {
+    const real4 mon = tree.multipole[3*i + 0];
+    const real4 Q0  = tree.multipole[3*i + 1];
+    const real4 Q1  = tree.multipole[3*i + 2];
+    maxEps = std::max(maxEps, Q0.w);
+
+    mass   += mon.w;
+    com[0] += mon.w*mon.x;
+    com[1] += mon.w*mon.y;
+    com[2] += mon.w*mon.z;
+    Q[0]   += mon.w*(Q0.x + (double)mon.x*mon.x);
+    Q[1]   += mon.w*(Q0.y + (double)mon.y*mon.y);
+    Q[2]   += mon.w*(Q0.z + (double)mon.z*mon.z);
+    Q[3]   += mon.w*(Q1.x + (double)mon.x*mon.y);
+    Q[4]   += mon.w*(Q1.y + (double)mon.x*mon.z);
+    Q[5]   += mon.w*(Q1.z + (double)mon.y*mon.z);
+
+    const real4 center = tree.boxCenterInfo[i];
+    const real4 size   = tree.boxSizeInfo[i];
+    r_min.x = fminf(r_min.x, center.x-size.x); r_max.x = fmaxf(r_max.x, center.x+size.x);
+    r_min.y = fminf(r_min.y, center.y-size.y); r_max.y = fmaxf(r_max.y, center.y+size.y);
+    r_min.z = fminf(r_min.z, center.z-size.z); r_max.z = fmaxf(r_max.z, center.z+size.z);
+  }
+
+  double im = 1.0/mass;
+  if(mass == 0) im = 0; //Allow tracer/massless particles
+  com[0] *= im; com[1] *= im; com[2] *= im;
+
+  tree.multipole[0] = make_float4(com[0], com[1], com[2], mass);
+  tree.multipole[1] = make_float4(Q[0]*im - com[0]*com[0], Q[1]*im - com[1]*com[1], Q[2]*im - com[2]*com[2], maxEps);
+  tree.multipole[2] = make_float4(Q[3]*im - com[0]*com[1], Q[4]*im - com[0]*com[2], Q[5]*im - com[1]*com[2], 0.0f);
+
+  const float3 boxCenter = make_float3(0.5f*(r_min.x + r_max.x), 0.5f*(r_min.y + r_max.y), 0.5f*(r_min.z + r_max.z));
+  const float3 boxSize   = make_float3(fmaxf(fabs(boxCenter.x-r_min.x), fabs(boxCenter.x-r_max.x)),
+                                       fmaxf(fabs(boxCenter.y-r_min.y), fabs(boxCenter.y-r_max.y)),
+                                       fmaxf(fabs(boxCenter.z-r_min.z), fabs(boxCenter.z-r_max.z)));
+
+  double s = sqrt((boxCenter.x-com[0])*(boxCenter.x-com[0]) + (boxCenter.y-com[1])*(boxCenter.y-com[1]) +
+                  (boxCenter.z-com[2])*(boxCenter.z-com[2]));
+  if(fabs(mass) < 1e-10) s = 0;
+
+  float l = 2*std::max(boxSize.x, std::max(boxSize.y, boxSize.z));
+  if(l < 0.000001) l = 0.000001;
+#ifdef IMPBH
+  float cellOp = (l/theta) + s;
+#else
+  float cellOp = (l/theta);
+#endif
+  cellOp = cellOp*cellOp;
+
+  tree.n_children[0]    = 1 | (2 << 28);
+  tree.node_bodies[0]   = make_uint2(0, tree.n);
+  tree.boxSizeInfo[0]   = make_float4(boxSize.x, boxSize.y, boxSize.z, host_int_as_float(tree.n_children[0]));
+  tree.boxCenterInfo[0] = make_float4(boxCenter.x, boxCenter.y, boxCenter.z, cellOp);
+  rootIdx[0]            = 0;
+
+  tree.multipole.h2d(3);
+  tree.boxSizeInfo.h2d(1);
+  tree.boxCenterInfo.h2d(1);
+  tree.n_children.h2d(1);
+  tree.node_bodies.h2d(1);
+  rootIdx.h2d();
+  tree.leafNodeIdx.copy_devonly_async(rootIdx, 1, nLeafs, execStream->s());
+
+  //The active groups, as in compute_properties
+  this->resetCompact();
+  tree.activeGrpList.zeroMemGPUAsync(execStream->s());
+  setActiveGrps.set_args(0, &tree.n, &t_current, tree.bodies_time.p(), tree.body2group_list.p(), tree.activeGrpList.p());
+  setActiveGrps.setWork(tree.n, 128);
+  setActiveGrps.execute2(execStream->s());
+  gpuCompact(tree.activeGrpList, tree.active_group_list, tree.n_groups, &tree.n_active_groups);
+
+  //build() starts this copy on the rebuild steps, the LET needs the merged positions
+  if(nProcs > 1 && !letGather)
+    tree.bodies_Ppos.d2h(tree.n, false, LETDataToHostStream->s());
+
+  //The scratch arrays in generalBuffer1 have to stay valid until the kernels are done
+  execStream->sync();
+}
 
 
 /********************************************************
@@ -1873,6 +2486,25 @@ int octree::gpu_exchange_particles_with_overflow_check_SFC2(tree_structure &tree
  *                                                      *
  ********************************************************/
 
+//The particles are read through this pointer by the boundary tree and LET code.
+//Normally that is the host copy of bodies_Ppos, which requires copying all
+//predicted positions every step. In gather mode the packing picks the selected
+//particles directly from the device buffer, that is only possible when it is
+//host accessible (host backend). Other builds reject --letgather at startup.
+void octree::setLETGather(const bool gather)
+{
+#ifndef USE_HOST
+  assert(!gather);
+#endif
+  letGather = gather;
+}
+
+real4 *octree::getLETBodies(tree_structure &tree)
+{
+  if(letGather) return (real4*)tree.bodies_Ppos.d();
+  return &tree.bodies_Ppos[0];
+}
+
 //Broadcast the group-tree structure (used during the LET creation)
 //First we gather the size, so we can create/allocate memory
 //and then we broad-cast the final structure
@@ -2047,7 +2679,7 @@ void octree::sendCurrentInfoGrpTree()
                         &localTree.boxCenterInfo[0],
                         &localTree.boxSizeInfo[0],
                         &localTree.multipole[0],
-                        &localTree.bodies_Ppos[0],
+                        getLETBodies(localTree),
                         smallTreeStart,
                         smallTreeEnd,
                         localTree.n_nodes, searchDepthUsed);
@@ -2198,7 +2830,7 @@ void octree::sendCurrentInfoGrpTree()
                            &localTree.boxCenterInfo[0],
                            &localTree.boxSizeInfo[0],
                            &localTree.multipole[0],
-                           &localTree.bodies_Ppos[0],
+                           getLETBodies(localTree),
                            smallTreeStart,
                            smallTreeEnd,
                            localTree.n_nodes, searchDepthUsed);
@@ -2245,7 +2877,7 @@ void octree::sendCurrentInfoGrpTree()
        &localTree.boxCenterInfo[0],
        &localTree.boxSizeInfo[0],
        &localTree.multipole[0],
-       &localTree.bodies_Ppos[0],
+       getLETBodies(localTree),
        localTree.level_list[localTree.startLevelMin].x,
        localTree.level_list[localTree.startLevelMin].y,
        localTree.n_nodes, 99);
@@ -2561,8 +3193,21 @@ int getLEToptQuickTreevsTree(
 }
 
 
+void packLET1(
+    const std::vector<int2> &LETBuffer_node,
+    const std::vector<int > &LETBuffer_ptcl,
+    LETBufferPool &letBufferPool,
+    real4 **LETBuffer_ptr,
+    const real4 *nodeCentre,
+    const real4 *nodeSize,
+    const real4 *multipole,
+    const real4 *bodies,
+    const int nExtra = 0);
+
+//nExtra elements are reserved behind the LET in the buffer
 int3 getLET1(
     GETLETBUFFERS &bufferStruct,
+    LETBufferPool &letBufferPool,
     real4 **LETBuffer_ptr,
     const real4 *nodeCentre,
     const real4 *nodeSize,
@@ -2575,7 +3220,8 @@ int3 getLET1(
     const real4 *groupCentreInfo,
     const int nGroups,
     const int nNodes,
-    unsigned long long &nflops)
+    unsigned long long &nflops,
+    const int nExtra = 0)
 {
   bufferStruct.LETBuffer_node.clear();
   bufferStruct.LETBuffer_ptcl.clear();
@@ -2593,9 +3239,6 @@ int3 getLET1(
     bufferStruct.LETBuffer_node.push_back((int2){node, host_float_as_int(nodeSize[node].w)});
 
 
-  const _v4sf*            bodiesV = (const _v4sf*)bodies;
-  const _v4sf*          nodeSizeV = (const _v4sf*)nodeSize;
-  const _v4sf*        nodeCentreV = (const _v4sf*)nodeCentre;
   const _v4sf*         multipoleV = (const _v4sf*)multipole;
   const _v4sf*   groupSizeV = (const _v4sf*)groupSizeInfo;
   const _v4sf* groupCenterV = (const _v4sf*)groupCentreInfo;
@@ -2748,11 +3391,38 @@ int3 getLET1(
   assert((int)bufferStruct.LETBuffer_ptcl.size() == nExportPtcl);
   assert((int)bufferStruct.LETBuffer_node.size() == nExportCell);
 
+  packLET1(bufferStruct.LETBuffer_node, bufferStruct.LETBuffer_ptcl, letBufferPool, LETBuffer_ptr,
+           nodeCentre, nodeSize, multipole, bodies, nExtra);
+
+  return (int3){nExportCell, nExportPtcl, depth};
+}
+
+//Copies the nodes and particles selected by getLET1 into a new LET buffer. The
+//lists only depend on the tree structure, so they can be used with updated
+//properties as long as the tree is not rebuilt.
+void packLET1(
+    const std::vector<int2> &LETBuffer_node,
+    const std::vector<int > &LETBuffer_ptcl,
+    LETBufferPool &letBufferPool,
+    real4 **LETBuffer_ptr,
+    const real4 *nodeCentre,
+    const real4 *nodeSize,
+    const real4 *multipole,
+    const real4 *bodies,
+    const int nExtra)
+{
+  const int nExportPtcl = LETBuffer_ptcl.size();
+  const int nExportCell = LETBuffer_node.size();
+
+  const _v4sf*            bodiesV = (const _v4sf*)bodies;
+  const _v4sf*          nodeSizeV = (const _v4sf*)nodeSize;
+  const _v4sf*        nodeCentreV = (const _v4sf*)nodeCentre;
+  const _v4sf*         multipoleV = (const _v4sf*)multipole;
+
   /* now copy data into LETBuffer */
   {
     //LETBuffer.resize(nExportPtcl + 5*nExportCell);
-#pragma omp critical //Malloc seems to be not so thread safe..
-    *LETBuffer_ptr = (real4*)malloc(sizeof(real4)*(1+ nExportPtcl + 5*nExportCell));
+    *LETBuffer_ptr = letBufferPool.acquire<real4>(1+ nExportPtcl + 5*nExportCell + nExtra);
     real4 *LETBuffer = *LETBuffer_ptr;
     _v4sf *vLETBuffer      = (_v4sf*)(&LETBuffer[1]);
     //_v4sf *vLETBuffer      = (_v4sf*)&LETBuffer     [0];
@@ -2761,12 +3431,12 @@ int3 getLET1(
     int multiStoreIdx = nStoreIdx + 2*nExportCell;
     for (int i = 0; i < nExportPtcl; i++)
     {
-      const int idx = bufferStruct.LETBuffer_ptcl[i];
+      const int idx = LETBuffer_ptcl[i];
       vLETBuffer[i] = bodiesV[idx];
     }
     for (int i = 0; i < nExportCell; i++)
     {
-      const int2 packed_idx = bufferStruct.LETBuffer_node[i];
+      const int2 packed_idx = LETBuffer_node[i];
       const int idx     = packed_idx.x;
       const float sizew = host_int_as_float(packed_idx.y);
       const _v4sf size  = VECINSERT(sizew,nodeSizeV[idx], 3);
@@ -2781,16 +3451,12 @@ int3 getLET1(
       nStoreIdx++;
     }
   }
-
-  return (int3){nExportCell, nExportPtcl, depth};
 }
 
 
 //April 3, 2014. JB: Disabled the copy/creation of tree. Since we don't do alltoallV sends
 //it now only counts/tests
-template<typename T>
 int getLEToptQuickFullTree(
-    std::vector<T> &LETBuffer,
     GETLETBUFFERS &bufferStruct,
     const int NCELLMAX,
     const int NDEPTHMAX,
@@ -2994,78 +3660,6 @@ int getLEToptQuickFullTree(
 
 
 
-//Compute PH key, same function as on device
-static uint4 host_get_key(int4 crd)
-{
-  const int bits = 30;  //20 to make it same number as morton order
-  int i,xi, yi, zi;
-  int mask;
-  int key;
-
-  //0= 000, 1=001, 2=011, 3=010, 4=110, 5=111, 6=101, 7=100
-  //000=0=0, 001=1=1, 011=3=2, 010=2=3, 110=6=4, 111=7=5, 101=5=6, 100=4=7
-  const int C[8] = {0, 1, 7, 6, 3, 2, 4, 5};
-
-  int temp;
-
-  mask = 1 << (bits - 1);
-  key  = 0;
-
-  uint4 key_new;
-
-  for(i = 0; i < bits; i++, mask >>= 1)
-  {
-    xi = (crd.x & mask) ? 1 : 0;
-    yi = (crd.y & mask) ? 1 : 0;
-    zi = (crd.z & mask) ? 1 : 0;
-
-    int index = (xi << 2) + (yi << 1) + zi;
-
-    if(index == 0)
-    {
-      temp = crd.z; crd.z = crd.y; crd.y = temp;
-    }
-    else  if(index == 1 || index == 5)
-    {
-      temp = crd.x; crd.x = crd.y; crd.y = temp;
-    }
-    else  if(index == 4 || index == 6)
-    {
-      crd.x = (crd.x) ^ (-1);
-      crd.z = (crd.z) ^ (-1);
-    }
-    else  if(index == 7 || index == 3)
-    {
-      temp = (crd.x) ^ (-1);
-      crd.x = (crd.y) ^ (-1);
-      crd.y = temp;
-    }
-    else
-    {
-      temp = (crd.z) ^ (-1);
-      crd.z = (crd.y) ^ (-1);
-      crd.y = temp;
-    }
-
-    key = (key << 3) + C[index];
-
-    if(i == 19)
-    {
-      key_new.y = key;
-      key = 0;
-    }
-    if(i == 9)
-    {
-      key_new.x = key;
-      key = 0;
-    }
-  } //end for
-
-  key_new.z = key;
-
-  return key_new;
-}
-
 typedef struct letObject
 {
   real4       *buffer;
@@ -3129,6 +3723,80 @@ void octree::checkGPUAndStartLETComputation(tree_structure &tree,
 }
 
 
+//Pins the calling LET thread to the tid-th core of the process cpuset, the
+//previous affinity of the thread is returned in oldCpuset
+static void pinThreadToCpuset(const int tid, const cpu_set_t &processCpuset, cpu_set_t &oldCpuset)
+{
+  sched_getaffinity(0, sizeof(cpu_set_t), &oldCpuset);
+
+  const int nCpus = CPU_COUNT(&processCpuset);
+  if(nCpus == 0) return;
+
+  int target = tid % nCpus;
+  for(int cpu=0; cpu < CPU_SETSIZE; cpu++)
+  {
+    if(!CPU_ISSET(cpu, &processCpuset)) continue;
+    if(target-- == 0)
+    {
+      cpu_set_t mask;
+      CPU_ZERO(&mask);
+      CPU_SET(cpu, &mask);
+      sched_setaffinity(0, sizeof(cpu_set_t), &mask);
+      return;
+    }
+  }
+}
+
+//Appends the groups of a remote process against which its LET is walked. With
+//USE_GROUP_TREE these are the end-points of the received group tree.
+static void appendLETGroups(const real4 *grpCenter, const int nGrp,
+                            std::vector<float4> &centres, std::vector<float4> &sizes)
+{
+#ifdef USE_GROUP_TREE
+  (void)nGrp; //The counts are stored in the group tree itself
+  const int nbody = host_float_as_int(grpCenter[0].x);
+  const int nnode = host_float_as_int(grpCenter[0].y);
+
+  const real4 *grpSize = &grpCenter[1+nbody];
+  grpCenter            = &grpCenter[1+nbody+nnode];
+
+  for(int startSearch=0; startSearch < nnode; startSearch++)
+  {
+    //Two tests, if its a  leaf, and/or if its a node and marked as end-point
+    if(((uint)host_float_as_int(grpSize[startSearch].w) == 0xFFFFFFFF) || grpCenter[startSearch].w <= 0) //Tree extract
+    {
+      sizes.push_back  (grpSize  [startSearch]);
+      centres.push_back(grpCenter[startSearch]);
+    }
+  }//end for
+#else
+  centres.insert(centres.end(), grpCenter,      grpCenter + nGrp);
+  sizes.insert  (sizes.end(),   grpCenter+nGrp, grpCenter + 2*nGrp);
+#endif
+}
+
+//A cached LET remains a superset of the required LET as long as, for every
+//group, the growth of the group box beyond the box used for the walk plus the
+//change of our own nodes (slack) stays within the margin by which the boxes
+//were inflated for the walk
+static bool letCacheIsValid(const octree::LETCacheEntry &entry,
+                            const real4 *grpCenter, const real4 *grpSize,
+                            const int nGroups, const float slack, const float margin)
+{
+  if(!entry.valid || (int)entry.grpCenter.size() != nGroups) return false;
+
+  for(int i=0; i < nGroups; i++)
+  {
+    const real4 &c0 = entry.grpCenter[i];
+    const real4 &s0 = entry.grpSize[i];
+    const float ex  = fabs(grpCenter[i].x - c0.x) + grpSize[i].x - s0.x;
+    const float ey  = fabs(grpCenter[i].y - c0.y) + grpSize[i].y - s0.y;
+    const float ez  = fabs(grpCenter[i].z - c0.z) + grpSize[i].z - s0.z;
+    if(std::max(ex, std::max(ey, ez)) + slack > margin) return false;
+  }
+  return true;
+}
+
 void octree::essential_tree_exchangeV2(tree_structure &tree,
                                        tree_structure &remote,
                                        vector<real4>  &topLevelTrees,
@@ -3144,7 +3812,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
   bool mergeOwntree = false;              //Default do not include our own tree-structure, thats mainly used for testing
   int procTrees     = 0;                  //Number of trees that we've received and processed
 
-  real4  *bodies              = &tree.bodies_Ppos[0];
+  real4  *bodies              = getLETBodies(tree); //Host copy or, in gather mode, the device buffer
   real4  *velocities          = &tree.bodies_Pvel[0];
   real4  *multipole           = &tree.multipole[0];
   real4  *nodeSizeInfo        = &tree.boxSizeInfo[0];
@@ -3179,10 +3847,9 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
   int resultOfQuickCheck[nProcs];
 
   int4 quickCheckSendSizes [nProcs];
-  int  quickCheckSendOffset[nProcs];
 
-  int4 quickCheckRecvSizes [nProcs];
-  int quickCheckRecvOffset[nProcs];
+  std::vector<char> letRequested(nProcs, 0);  //Processes that asked us for a LET
+  int nSkippedLETs = 0;                       //Speculative LETs that were not needed
 
 
   int nCompletedQuickCheck = 0;
@@ -3191,7 +3858,6 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
   quickCheckSendSizes[procId].x =  0;
   quickCheckSendSizes[procId].y =  0;
   quickCheckSendSizes[procId].z =  0;
-  quickCheckSendOffset[procId]  =  0;
 
   //For statistics
   int nQuickCheckSends          = 0;
@@ -3200,13 +3866,80 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
   int nQuickBoundaryOk          = 0;
 
 
-  omp_set_num_threads(16); //8 Piz-Daint, 16 Titan
+  //Thread 1 does the MPI communication, the others build LETs. The number of threads
+  //defaults to the number of cores in our cpuset
+  const static int MAX_THREAD = 64;
+  static __attribute__(( aligned(64) )) GETLETBUFFERS getLETBuffers[MAX_THREAD];
+
+  const int curOMPMax    = omp_get_max_threads();
+  const int nLETThreads  = std::max(2, std::min(MAX_THREAD, letThreads > 0 ? letThreads : omp_get_num_procs()));
+  omp_set_num_threads(nLETThreads);
+
+  cpu_set_t processCpuset;
+  CPU_ZERO(&processCpuset);
+  if(letPinThreads) sched_getaffinity(0, sizeof(cpu_set_t), &processCpuset);
+
+  //On steps without a tree rebuild the LET of a destination is packed from the node
+  //and particle lists of an earlier walk if its groups did not move too much
+  const bool useLETCache   = letCacheTol > 0 && rebuild_tree_rate > 1;
+  float      letCacheDisp  = 0;   //Maximum displacement of our particles since the rebuild
+  int        nLETCacheHits = 0, nLETCacheWalks = 0;
+  if(useLETCache)
+  {
+    const bool rebuilt = (iter % rebuild_tree_rate) == 0 || (int)letCachePos.size() != tree.n ||
+                         (int)letCache.size() != nProcs;
+    if(rebuilt)
+    {
+      letCache.assign(nProcs, LETCacheEntry());
+      letCachePos.assign(bodies, bodies + tree.n);
+    }
+    else
+    {
+      float maxDisp2 = 0;
+#pragma omp parallel for reduction(max : maxDisp2)
+      for(int i=0; i < tree.n; i++)
+      {
+        const float dx = bodies[i].x - letCachePos[i].x;
+        const float dy = bodies[i].y - letCachePos[i].y;
+        const float dz = bodies[i].z - letCachePos[i].z;
+        maxDisp2 = std::max(maxDisp2, dx*dx + dy*dy + dz*dz);
+      }
+      letCacheDisp = sqrt(maxDisp2);
+    }
+  }
+
+  //Node mode: LETs for processes that share a node are walked once and received
+  //once per node, the speculative LETs from the quick-check are not built so that
+  //all requests of a node can be merged
+  const bool letNodeMode = letNodeSize > 1;
+  std::vector< std::vector<int> > letNodeGroups;
+  std::vector<MPI_Request>        letForwardReqs;
+  std::vector<unsigned long long> letNodeOffsets(nProcs);   //Send buffers of the notifications
+  int letNodeOffsetsUsed = 0;
+  int nNodeLETsRecv = 0, nNodeLETsShared = 0;
+  if(letNodeMode)
+  {
+    if(!letNodeShare.isInitialized()) letNodeShare.init(mpiCommWorld, letNodeSize);
+    letNodeShare.beginExchange();
+  }
+
+  //Message tags, 999 is used for the LET data
+  const int LETREQUEST_TAG = 998;   //Sparse exchange of the quick-check results
+  const int LETNOTIFY_TAG  = 995;   //Offset of a node LET in the shared segment
+  const int LETFORWARD_TAG = 994;   //Copy of a node LET that did not fit in the segment
 
   letObject *computedLETs = new letObject[nProcs-1];
 
-  int omp_ticket      = 0;
-  int omp_ticket2     = 0;
-  int omp_ticket3     = 0;
+  //Destination ranks for the LET threads: the quick checks, the full LETs that follow
+  //from the quick checks and the full LETs that follow from the A2A result
+  LETWorkQueue quickCheckQueue(nLETThreads), fullLETQueue(nLETThreads), extraLETQueue(nLETThreads);
+  bool fullLETQueueFilled  = false;
+  bool extraLETQueueFilled = false;
+  {
+    std::vector<int> tickets(nProcs-1);
+    for(int i=0; i < nProcs-1; i++) tickets[i] = i;
+    quickCheckQueue.fill(tickets, 1);
+  }
   int nComputedLETs   = 0;
   int nReceived       = 0;
   int nSendOut        = 0;
@@ -3222,20 +3955,6 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
   assert(nProcs <= NPROCMAX);
 
 
-  const static int MAX_THREAD = 64;
-  assert(MAX_THREAD >= omp_get_num_threads());
-  static __attribute__(( aligned(64) )) GETLETBUFFERS getLETBuffers[MAX_THREAD];
-
-
-  static std::vector<v4sf> quickCheckData[NPROCMAX];
-
-//#ifdef doGETLETQUICK
-//  for (int i = 0; i < nProcs; i++)
-//  {
-//    quickCheckData[i].reserve(1+NCELLMAX*NLEAF*5*2);
-//    quickCheckData[i].clear();
-//  }
-//#endif
 
   std::vector<int> communicationStatus(nProcs);
   for(int i=0; i < nProcs; i++) communicationStatus[i] = 0;
@@ -3282,6 +4001,9 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
     int tid      = omp_get_thread_num();
     int nthreads = omp_get_num_threads();
 
+    cpu_set_t threadCpuset;
+    if(letPinThreads) pinThreadToCpuset(tid, processCpuset, threadCpuset);
+
     if(tid != 1) //Thread 0, does LET creation and GPU control, Thread == 1 does MPI communication, all others do LET creation
     {
       int DistanceCheck = 0;
@@ -3308,7 +4030,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
         //Check if we can start some GPU work
         if(tid == 0) //Check if GPU is free
         {
-          if(omp_ticket > (nProcs - 1))
+          if(quickCheckQueue.empty())
           {
             checkGPUAndStartLETComputation(tree, remote, topNodeOnTheFlyCount,
                                            nReceived, procTrees,  tStart, totalLETExTime,
@@ -3316,10 +4038,8 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
           }
         }//tid == 0
 
-        #pragma omp critical
-          currentTicket = omp_ticket++; //Get a unique ticket to determine which process to build the LET for
-
-        if(currentTicket >= (nProcs-1)) //Break out if we processed all nodes
+        //Get a unique ticket to determine which process to build the LET for
+        if(!quickCheckQueue.pop(tid, currentTicket)) //Break out if we processed all nodes
           break;
 
         bool doQuickLETCheck = (currentTicket < (nProcs - 1));
@@ -3366,7 +4086,6 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
             //Build the tree we possibly have to send to the remote process
             double bla3;
             const int sizeTree=  getLEToptQuickFullTree(
-                                            quickCheckData[ibox],
                                             getLETBuffers[tid],
                                             NCELLMAX,
                                             NDEPTHMAX,
@@ -3463,6 +4182,8 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
       }
       if(tid == 2) tStatsEndQuickCheck = get_time();
 
+      std::vector<real4> inflatedGrpSize;  //Group sizes used for cacheable LET walks
+
       while(1)
       {
 
@@ -3478,10 +4199,16 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
         int ibox          = 0;
         int currentTicket = 0;
 
+        //All quick checks are done so requiresFullLET is complete, the first thread here
+        //hands it to the queue
         #pragma omp critical
-                currentTicket = omp_ticket2++; //Get a unique ticket to determine which process to build the LET for
+        {
+          if(!fullLETQueueFilled && !letNodeMode) fullLETQueue.fill(requiresFullLET, 1);
+          fullLETQueueFilled = true;
+        }
 
-        if(currentTicket >= requiresFullLET.size())
+        //Get a unique ticket to determine which process to build the LET for
+        if(!fullLETQueue.pop(tid, ibox))                     //From the quickTest result list
         {
           //We processed the nodes we identified ourself using quickLET, next we
           //continue with the LETs that we need to do after the A2A.
@@ -3492,34 +4219,32 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
             usleep(10);
           }
 
-
           #pragma omp critical
-                  currentTicket = omp_ticket3++; //Get a unique ticket to determine which process to build the LET for
+          {
+            if(!extraLETQueueFilled) extraLETQueue.fill(idsThatNeedMoreThanBoundary, 1);
+            extraLETQueueFilled = true;
+          }
 
-          if(currentTicket >= idsThatNeedMoreThanBoundary.size())
+          if(!extraLETQueue.pop(tid, ibox))                  //From the A2A result list
             breakOutOfFullLoop = true;
-          else
-            ibox = idsThatNeedMoreThanBoundary[currentTicket]; //From the A2A result list
-        }
-        else
-        {
-          ibox = requiresFullLET[currentTicket];             //From the quickTest result list
         }
 
         //Jump out of the LET creation while
         if(breakOutOfFullLoop == true) break;
 
+        //Negative items are node LETs, walked against the groups of several processes
+        //of one node and sent to the first of them
+        const std::vector<int> *nodeMembers = (ibox < 0) ? &letNodeGroups[-ibox-1] : NULL;
 
+        //Once the requests are known there is no need to build LETs nobody asked for
+        if(nodeMembers == NULL && completedA2A && !letRequested[ibox])
+        {
+          #pragma omp atomic
+            nSkippedLETs++;
+          continue;
+        }
 
-        //Group info for this process
-        int idx          =   globalGrpTreeOffsets[ibox];
-        real4 *grpCenter =  &globalGrpTreeCntSize[idx];
-        idx             += this->globalGrpTreeCount[ibox] / 2; //Divide by two to get halfway
-        real4 *grpSize   =  &globalGrpTreeCntSize[idx];
-
-        //Start and endGrp, only used when not using a tree-structure for the groups
-        int startGrp = 0;
-        int endGrp   = this->globalGrpTreeCount[ibox] / 2;
+        const int destination = nodeMembers ? (*nodeMembers)[0] : ibox;
 
         int countNodes = 0, countParticles = 0;
 
@@ -3529,54 +4254,89 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
 
         double tStartEx = get_time();
 
-        //Extract the boundaries from the tree-structure
-        #ifdef USE_GROUP_TREE
-          std::vector<float4> boundaryCentres;
-          std::vector<float4> boundarySizes;
+        //Extract the groups of the destination(s)
+        std::vector<float4> boundaryCentres;
+        std::vector<float4> boundarySizes;
 
-          boundarySizes.reserve(endGrp);
-          boundaryCentres.reserve(endGrp);
-          boundarySizes.clear();
-          boundaryCentres.clear();
+        const int nMembers = nodeMembers ? nodeMembers->size() : 1;
+        for(int m=0; m < nMembers; m++)
+        {
+          const int member = nodeMembers ? (*nodeMembers)[m] : ibox;
+          appendLETGroups(&globalGrpTreeCntSize[globalGrpTreeOffsets[member]],
+                          this->globalGrpTreeCount[member] / 2,
+                          boundaryCentres, boundarySizes);
+        }
 
-          int nbody = host_float_as_int(grpCenter[0].x);
-          int nnode = host_float_as_int(grpCenter[0].y);
+        int startGrp     = 0;
+        int endGrp       = boundarySizes.size();
+        real4 *grpCenter = &boundaryCentres[0];
+        real4 *grpSize   = &boundarySizes  [0];
 
-          grpSize   = &grpCenter[1+nbody];
-          grpCenter = &grpCenter[1+nbody+nnode];
-
-          for(int startSearch=0; startSearch < nnode; startSearch++)
-          {
-            //Two tests, if its a  leaf, and/or if its a node and marked as end-point
-            if((host_float_as_int(grpSize[startSearch].w) == 0xFFFFFFFF) || grpCenter[startSearch].w <= 0) //Tree extract
-            {
-              boundarySizes.push_back  (grpSize  [startSearch]);
-              boundaryCentres.push_back(grpCenter[startSearch]);
-            }
-          }//end for
-
-          endGrp    = boundarySizes.size();
-          grpCenter = &boundaryCentres[0];
-          grpSize   = &boundarySizes  [0];
-        #endif
+        //Space behind a node LET for the list of processes it is meant for
+        const int nTail = nodeMembers ? (1 + nMembers + 3) / 4 : 0;
 
         double tEndEx = get_time();
 
         int2 usedStartEndNode = {(int)node_begend.x, (int)node_begend.y};
 
         assert(startGrp == 0);
-        int3  nExport = getLET1(
-                                getLETBuffers[tid],
-                                &LETDataBuffer,
-                                &nodeCenterInfo[0],
-                                &nodeSizeInfo[0],
-                                &multipole[0],
-                                usedStartEndNode.x, usedStartEndNode.y,
-                                &bodies[0],
-                                tree.n,
-                                grpSize, grpCenter,
-                                endGrp,
-                                tree.n_nodes, nflops);
+        int3 nExport;
+
+        //Our nodes can move by the particle displacement, their opening radius (l/theta + s)
+        //grows by at most 2/theta+2 times that
+        LETCacheEntry *cache = (useLETCache && !nodeMembers) ? &letCache[ibox] : NULL;
+        const float slack    = (letCacheDisp + (cache ? cache->refDisp : 0))*(3.0f + 2.0f/theta);
+
+        if(cache && letCacheIsValid(*cache, grpCenter, grpSize, endGrp, slack, letCacheTol))
+        {
+          packLET1(cache->node, cache->ptcl, letBufferPool, &LETDataBuffer,
+                   &nodeCenterInfo[0], &nodeSizeInfo[0], &multipole[0], &bodies[0]);
+          nExport = make_int3(cache->node.size(), cache->ptcl.size(), cache->depth);
+          #pragma omp atomic
+            nLETCacheHits++;
+        }
+        else
+        {
+          if(cache)
+          {
+            //Walk with inflated group boxes so the result stays valid for a while
+            cache->grpCenter.assign(grpCenter, grpCenter + endGrp);
+            cache->grpSize.assign  (grpSize,   grpSize   + endGrp);
+            inflatedGrpSize.assign (grpSize,   grpSize   + endGrp);
+            for(int i=0; i < endGrp; i++)
+            {
+              inflatedGrpSize[i].x += letCacheTol;
+              inflatedGrpSize[i].y += letCacheTol;
+              inflatedGrpSize[i].z += letCacheTol;
+            }
+            grpSize = &inflatedGrpSize[0];
+          }
+
+          nExport = getLET1(
+                            getLETBuffers[tid],
+                            letBufferPool,
+                            &LETDataBuffer,
+                            &nodeCenterInfo[0],
+                            &nodeSizeInfo[0],
+                            &multipole[0],
+                            usedStartEndNode.x, usedStartEndNode.y,
+                            &bodies[0],
+                            tree.n,
+                            grpSize, grpCenter,
+                            endGrp,
+                            tree.n_nodes, nflops, nTail);
+
+          if(cache)
+          {
+            cache->node    = getLETBuffers[tid].LETBuffer_node;
+            cache->ptcl    = getLETBuffers[tid].LETBuffer_ptcl;
+            cache->depth   = nExport.z;
+            cache->refDisp = letCacheDisp;
+            cache->valid   = true;
+            #pragma omp atomic
+              nLETCacheWalks++;
+          }
+        }
 
         countParticles  = nExport.y;
         countNodes      = nExport.x;
@@ -3587,7 +4347,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
         if (ENABLE_RUNTIME_LOG)
         {
           fprintf(stderr,"Proc: %d LET getLetOp count&fill [%d,%d]: Depth: %d Dest: %d Total : %lg (#P: %d \t#N: %d) nNodes= %d  nGroups= %d \tsince start: %lg \n",
-                          procId, procId, tid, nExport.z, ibox, get_time()-tz,countParticles,
+                          procId, procId, tid, nExport.z, destination, get_time()-tz,countParticles,
                           countNodes, tree.n_nodes, endGrp, get_time()-t0);
         }
 
@@ -3597,12 +4357,19 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
         LETDataBuffer[0].z = host_int_as_float(usedStartEndNode.x);     //First node on the level that indicates the start of the tree walk
         LETDataBuffer[0].w = host_int_as_float(usedStartEndNode.y);     //last  node on the level that indicates the start of the tree walk
 
+        if(nodeMembers)
+        {
+          int *tail = (int*)&LETDataBuffer[bufferSize];
+          tail[0]   = nMembers;
+          for(int m=0; m < nMembers; m++) tail[1+m] = (*nodeMembers)[m];
+        }
+
         //In a critical section to prevent multiple threads writing to the same location
         #pragma omp critical
         {
           computedLETs[nComputedLETs].buffer      = LETDataBuffer;
-          computedLETs[nComputedLETs].destination = ibox;
-          computedLETs[nComputedLETs].size        = sizeof(real4)*bufferSize;
+          computedLETs[nComputedLETs].destination = destination;
+          computedLETs[nComputedLETs].size        = sizeof(real4)*(bufferSize + nTail);
           nComputedLETs++;
         }
 
@@ -3664,64 +4431,87 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
 
 
 
-      //Send the sizes
-      LOGF(stderr, "Going to do the alltoall size communication! Iter: %d Since begin: %lg \n", iter, get_time()-tStart);
+      //Sparse exchange of the quick-check results (NBX). Only the processes whose
+      //boundary was not sufficient for us get a request, the others know that we use
+      //their boundary when they do not hear from us.
+      LOGF(stderr, "Going to do the sparse LET request exchange! Iter: %d Since begin: %lg \n", iter, get_time()-tStart);
       double t100 = get_time();
-      MPI_Alltoall(quickCheckSendSizes, 4, MPI_INT, quickCheckRecvSizes, 4, MPI_INT, mpiCommWorld);
-      LOGF(stderr, "Completed_alltoall size communication! Iter: %d Took: %lg ( %lg )\n", iter, get_time()-t100, get_time()-t0);
+      {
+        std::vector<int>         requestIds;
+        std::vector<MPI_Request> requestReqs;
+        for(int i=0; i < nProcs; i++)
+        {
+          if(i != procId && quickCheckSendSizes[i].y == 0) requestIds.push_back(i);
+        }
+        requestReqs.resize(requestIds.size());
+
+        for(unsigned int i=0; i < requestIds.size(); i++)
+        {
+          MPI_Issend(&quickCheckSendSizes[requestIds[i]], 4, MPI_INT, requestIds[i],
+                     LETREQUEST_TAG, mpiCommWorld, &requestReqs[i]);
+        }
+        nQuickCheckRealSends = requestIds.size();
+
+        MPI_Request barrierReq;
+        bool        inBarrier = false;
+        while(1)
+        {
+          int        flag = 0;
+          MPI_Status probeStatus;
+          MPI_Iprobe(MPI_ANY_SOURCE, LETREQUEST_TAG, mpiCommWorld, &flag, &probeStatus);
+          if(flag)
+          {
+            int4 remoteInfo;
+            MPI_Recv(&remoteInfo, 4, MPI_INT, probeStatus.MPI_SOURCE, LETREQUEST_TAG,
+                     mpiCommWorld, MPI_STATUS_IGNORE);
+            letRequested[probeStatus.MPI_SOURCE] = 1;
+            nQuickCheckReceives++;
+            continue;
+          }
+
+          int done = 0;
+          if(inBarrier)
+          {
+            MPI_Test(&barrierReq, &done, MPI_STATUS_IGNORE);
+            if(done) break;               //Everybody received all requests
+          }
+          else
+          {
+            //Once all our requests are matched we join the barrier
+            if(requestReqs.empty()) done = 1;
+            else MPI_Testall(requestReqs.size(), &requestReqs[0], &done, MPI_STATUSES_IGNORE);
+            if(done)
+            {
+              MPI_Ibarrier(mpiCommWorld, &barrierReq);
+              inBarrier = true;
+            }
+          }
+          if(!done) usleep(10);
+        }
+      }
+      LOGF(stderr, "Completed sparse LET request exchange! Iter: %d Took: %lg ( %lg ) requests send: %d recv: %d\n",
+                   iter, get_time()-t100, get_time()-t0, nQuickCheckRealSends, nQuickCheckReceives);
 
-      //If quickCheckRecvSizes[].y == 1 then the remote process used the boundary.
-      //do not send our quickCheck result!
-      int recvCountItems = 0;
       for (int i = 0; i < nProcs; i++)
       {
-        //Did the remote process use the boundaries, if so do not send LET data
-        if(quickCheckRecvSizes[i].y == 1)
-        { //Clear the size/data
-          quickCheckData[i].clear();
-          quickCheckSendSizes[i].x = 0;
-          quickCheckSendOffset[i] = 0;
+        if(i != procId && !letRequested[i])
+        {
+          //The remote process uses our boundary, do not send LET data
           nQuickBoundaryOk++;
-
-          //Mark as we can use small boundary
-          //this->fullGrpAndLETRequestStatistics[i] = make_uint2(1, 1);
         }
         else
         {
           //Did not use boundary, mark that for next run, so it sends full boundary
-          //if(iter  < 16) //TODO this stops updating this list after iteration 16, make dynamic
-	        //  this->fullGrpAndLETRequestStatistics[i] = make_uint2(0, 0);
           this->fullGrpAndLETRequestStatistics[i] = make_int2(-1, -1);
 
           if(i != procId) idsThatNeedExtraLET.push_back(i);
         }
 
-     /*   LOGF(stderr,"A2A data: %d %d  | %d %d | %d\n",
-            quickCheckRecvSizes[i].x, quickCheckRecvSizes[i].y,
-            quickCheckSendSizes[i].x, quickCheckSendSizes[i].y,
-            expectedLETCount);*/
-
-        if(quickCheckRecvSizes[i].x == 0 || quickCheckSendSizes[i].y == 0)
+        //If we did not use the boundary of that process it will send us a LET
+        if(i != procId && quickCheckSendSizes[i].y == 0)
           expectedLETCount++; //Increase the number of incoming trees
-
-
-        //Did we use the boundary of that tree, if so it should not send us anything
-        if(quickCheckSendSizes[i].y == 1)
-        {
-          quickCheckRecvSizes[i].x = 0;
-        }
-
-
-        quickCheckRecvOffset[i]   = recvCountItems*sizeof(real4);
-        recvCountItems           += quickCheckRecvSizes[i].x;
-        quickCheckRecvSizes[i].x  = quickCheckRecvSizes[i].x*sizeof(real4);
       }
 
-
-
-
-      expectedLETCount -= 1; //Don't count ourself
-
       nQuickCheckSends = nProcs-idsThatNeedExtraLET.size()-1;
 
       for(unsigned int i=0; i < idsThatNeedExtraLET.size(); i++)
@@ -3730,7 +4520,30 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
 
         //Check if this process is already on our list of processes that
         //require extra data
-         if(resultOfQuickCheck[boxID] != -1) idsThatNeedMoreThanBoundary.push_back(boxID);
+         if(resultOfQuickCheck[boxID] != -1 || letNodeMode) idsThatNeedMoreThanBoundary.push_back(boxID);
+      }
+
+      if(letNodeMode)
+      {
+        //Merge the requests of processes on the same node into one node LET
+        std::map<int, std::vector<int> > requestsPerNode;
+        for(unsigned int i=0; i < idsThatNeedMoreThanBoundary.size(); i++)
+          requestsPerNode[letNodeShare.nodeOf(idsThatNeedMoreThanBoundary[i])].push_back(idsThatNeedMoreThanBoundary[i]);
+
+        idsThatNeedMoreThanBoundary.clear();
+        for(std::map<int, std::vector<int> >::iterator it = requestsPerNode.begin(); it != requestsPerNode.end(); it++)
+        {
+          if(it->second.size() == 1)
+          {
+            idsThatNeedMoreThanBoundary.push_back(it->second[0]);
+          }
+          else
+          {
+            letNodeGroups.push_back(it->second);
+            idsThatNeedMoreThanBoundary.push_back(-(int)letNodeGroups.size());
+          }
+        }
+        requiresFullLETCount = 0;   //The speculative LETs were not queued
       }
 
       completedA2A = true;
@@ -3742,7 +4555,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
 
       tStatsEndAlltoAll = get_time();
 
-      LOGF(stderr, "Received trees using alltoall: %d qRecvSum %d  top-nodes: %d Send with alltoall: %d qSndSum: %d \tnBoundary: %d\n",
+      LOGF(stderr, "Received LET requests: %d qRecvSum %d  top-nodes: %d Send LET requests: %d qSndSum: %d \tnBoundary: %d\n",
                     nQuickCheckReceives, nReceived, topNodeOnTheFlyCount,
                     nQuickCheckRealSends, nQuickCheckRealSends+nQuickBoundaryOk,nBoundaryOk);
 
@@ -3759,6 +4572,13 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
           sleepAtTheEnd = false;
           for(int i=nSendOut; i < tempComputed; i++)
           {
+            if(!letRequested[computedLETs[i].destination])
+            {
+              //Speculative LET of a process that uses our boundary
+              letBufferPool.release(computedLETs[i].buffer);
+              computedLETs[i].buffer = NULL;
+              continue;
+            }
             MPI_Isend(&(computedLETs[i].buffer)[0],computedLETs[i].size,
                 MPI_BYTE, computedLETs[i].destination, 999,
                 mpiCommWorld, &(computedLETs[i].req));
@@ -3781,10 +4601,55 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
             int count;
             MPI_Get_count(&probeStatus, MPI_BYTE, &count);
 
+            real4 *recvDataBuffer = NULL;
+            int    bufferSource   = 0;    //0 pool buffer, 3 shared node segment
             double tY = get_time();
-            real4 *recvDataBuffer = new real4[count / sizeof(real4)];
+
+            if(probeStatus.MPI_TAG == LETNOTIFY_TAG)
+            {
+              //A process on our node received a node LET that includes us, use it in place
+              unsigned long long offset;
+              MPI_Recv(&offset, 1, MPI_UNSIGNED_LONG_LONG, probeStatus.MPI_SOURCE, LETNOTIFY_TAG, mpiCommWorld, &recvStatus);
+              letNodeShare.sync();
+              recvDataBuffer = (real4*)letNodeShare.remote(probeStatus.MPI_SOURCE, offset);
+              bufferSource   = 3;
+              nNodeLETsShared++;
+            }
+            else
+            {
+              unsigned long long offset = 0;
+              if(letNodeMode) recvDataBuffer = (real4*)letNodeShare.allocate(count, offset);
+              if(recvDataBuffer) bufferSource   = 3;
+              else               recvDataBuffer = letBufferPool.acquire<real4>((count + sizeof(real4) - 1) / sizeof(real4));
+              MPI_Recv(&recvDataBuffer[0], count, MPI_BYTE, probeStatus.MPI_SOURCE, probeStatus.MPI_TAG, mpiCommWorld,&recvStatus);
+
+              //A node LET carries the list of processes on our node it is meant for behind the tree
+              const int letBytes = sizeof(real4)*(1 + host_float_as_int(recvDataBuffer[0].x) +
+                                                  5*host_float_as_int(recvDataBuffer[0].y));
+              if(count > letBytes)
+              {
+                const int *tail = (const int*)((const char*)recvDataBuffer + letBytes);
+                if(bufferSource == 3)
+                {
+                  letNodeShare.sync();
+                  letNodeOffsets[letNodeOffsetsUsed] = offset;
+                }
+                for(int i=0; i < tail[0]; i++)
+                {
+                  if(tail[1+i] == procId) continue;
+                  letForwardReqs.push_back(MPI_Request());
+                  if(bufferSource == 3)
+                    MPI_Isend(&letNodeOffsets[letNodeOffsetsUsed], 1, MPI_UNSIGNED_LONG_LONG, tail[1+i],
+                              LETNOTIFY_TAG, mpiCommWorld, &letForwardReqs.back());
+                  else //Did not fit in the segment, send a copy
+                    MPI_Isend(recvDataBuffer, letBytes, MPI_BYTE, tail[1+i],
+                              LETFORWARD_TAG, mpiCommWorld, &letForwardReqs.back());
+                }
+                if(bufferSource == 3) letNodeOffsetsUsed++;
+                nNodeLETsRecv++;
+              }
+            }
             double tZ = get_time();
-            MPI_Recv(&recvDataBuffer[0], count, MPI_BYTE, probeStatus.MPI_SOURCE, probeStatus.MPI_TAG, mpiCommWorld,&recvStatus);
 
             LOGF(stderr, "Receive complete from: %d  || recvTree: %d since start: %lg ( %lg ) alloc: %lg Recv: %lg Size: %d\n",
                           recvStatus.MPI_SOURCE, 0, get_time()-tStart,get_time()-t0,tZ-tY, get_time()-tZ, count);
@@ -3793,17 +4658,17 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
 
 //            this->fullGrpAndLETRequestStatistics[probeStatus.MPI_SOURCE] = make_uint2(0, 0);
 
-            if( communicationStatus[probeStatus.MPI_SOURCE] == 2)
+            if(probeStatus.MPI_TAG == 999 && communicationStatus[probeStatus.MPI_SOURCE] == 2)
             {
               //We already used the boundary for this remote process, so don't use the custom tree
-              delete[] recvDataBuffer;
+              if(bufferSource == 0) letBufferPool.release(recvDataBuffer);
 
               fprintf(stderr,"Proc: %d , Iter: %d we received UNNEEDED LET data from proc: %d \n", procId,iter,probeStatus.MPI_SOURCE );
             }
             else
             {
               treeBuffers[nReceived] = recvDataBuffer;
-              treeBuffersSource[nReceived] = 0; //0 indicates point to point source
+              treeBuffersSource[nReceived] = bufferSource; //0 indicates point to point source
 
               //Increase the top-node count
               int topStart = host_float_as_int(treeBuffers[nReceived][0].z);
@@ -3831,7 +4696,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
 
         //Exit if we have send and received all there is
         if(nReceived == nProcs-1)                    //if we received data for all processes
-          if((nSendOut == nToSend))                  //If we sent out all the LETs we need to send
+          if((nSendOut + nSkippedLETs == nToSend))   //If we sent out all the LETs we need to send
             if(receivedLETCount == expectedLETCount) //If we received all LETS that we expect, which
               break;                                 //can be more than nReceived if we get double data
 
@@ -3843,7 +4708,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
           if(computedLETs[i].buffer != NULL) MPI_Test(&(computedLETs[i].req), &testFlag, &waitStatus);
           if (testFlag)
           {
-            free(computedLETs[i].buffer);
+            letBufferPool.release(computedLETs[i].buffer);
             computedLETs[i].buffer = NULL;
             testFlag               = 0;
           }
@@ -3853,31 +4718,61 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
       } //while (1) surrounding the thread-id==1 code
 
       //Wait till all outgoing sends have been completed
+      if(!letForwardReqs.empty())
+        MPI_Waitall(letForwardReqs.size(), &letForwardReqs[0], MPI_STATUSES_IGNORE);
+
       MPI_Status waitStatus;
       for(int i=0; i < nSendOut; i++)
       {
         if(computedLETs[i].buffer)
         {
           MPI_Wait(&(computedLETs[i].req), &waitStatus);
-          free(computedLETs[i].buffer);
+          letBufferPool.release(computedLETs[i].buffer);
           computedLETs[i].buffer = NULL;
         }
       }//for i < nSendOut
       tStartsEndGetLETSend = get_time();
     }//if tid = 1
+
+    if(letPinThreads) sched_setaffinity(0, sizeof(cpu_set_t), &threadCpuset);
   }//end OMP section
 
+  omp_set_num_threads(curOMPMax); //Restore the number of OMP threads
+
 #if 1 //Moved freeing of memory to here for ha-pacs workaround
   for(int i=0; i < nProcs-1; i++)
   {
     if(treeBuffersSource[i] == 0) //Check if its a point to point source
     {
-      delete[] treeBuffers[i];    //Free the memory of this part of the LET
+      letBufferPool.release(treeBuffers[i]);    //Return this part of the LET to the pool
       treeBuffers[i] = NULL;
     }
   }
 #endif
 
+  char buffPool[1024];
+  letBufferPool.endIteration(buffPool, procId, iter);
+  devContext->writeLogEvent(buffPool);
+
+  if(letNodeMode)
+  {
+    sprintf(buffPool, "LETNODE-%d: iter: %d nodeLETsSend: %d nodeLETsRecv: %d nodeLETsShared: %d\n",
+            procId, iter, (int)letNodeGroups.size(), nNodeLETsRecv, nNodeLETsShared);
+    devContext->writeLogEvent(buffPool);
+  }
+
+  if(useLETCache)
+  {
+    sprintf(buffPool, "LETCACHE-%d: iter: %d hits: %d walks: %d maxDisp: %lg\n",
+            procId, iter, nLETCacheHits, nLETCacheWalks, letCacheDisp);
+    devContext->writeLogEvent(buffPool);
+  }
+
+  sprintf(buffPool, "LETTHREADS-%d: iter: %d threads: %d pinned: %d steals: %d %d %d\n",
+          procId, iter, nLETThreads, letPinThreads, quickCheckQueue.getSteals(),
+          fullLETQueue.getSteals(), extraLETQueue.getSteals());
+  devContext->writeLogEvent(buffPool);
+
   char buff5[1024];
   sprintf(buff5,"LETTIME-%d: tInitLETEx: %lg tQuickCheck: %lg tQuickCheckWait: %lg tGetLET: %lg \
 tAlltoAll: %lg tGetLETSend: %lg tTotal: %lg mbSize-a2a: %f nA2AQsend: %d nA2AQrecv: %d nBoundRemote: %d nBoundLocal: %d\n",
@@ -4058,6 +4953,7 @@ void octree::mergeAndLaunchLETStructures(
 #ifndef DO_NOT_USE_TOP_TREE
   uint4 *keys          = new uint4[topNodeOnTheFlyCount];
   //Compute the keys for the top nodes based on their centers
+#pragma omp parallel for
   for(int i=0; i < topNodeOnTheFlyCount; i++)
   {
     real4 nodeCenter = topBoxCenters[i];
@@ -4066,7 +4962,7 @@ void octree::mergeAndLaunchLETStructures(
     crd.y = (int)((nodeCenter.y - tree.corner.y) / tree.corner.w);
     crd.z = (int)((nodeCenter.z - tree.corner.z) / tree.corner.w);
 
-    keys[i]   = host_get_key(crd);
+    keys[i]   = host_get_key_lut(crd.x, crd.y, crd.z);
     keys[i].w = i;
   }//for i,
 
@@ -4354,7 +5250,7 @@ void octree::mergeAndLaunchLETStructures(
 #if 0 //Ha-pacs fix
     if(treeBuffersSource[i+procTrees] == 0) //Check if its a point to point source
     {
-      delete[] treeBuffers[i+procTrees];    //Free the memory of this part of the LET
+      letBufferPool.release(treeBuffers[i+procTrees]);    //Return this part of the LET to the pool
       treeBuffers[i+procTrees] = NULL;
     }
 #endif
@@ -1,5 +1,7 @@
 #include "octree.h"
-#include "nvToolsExt.h"
+#ifndef USE_HOST
+  #include "nvToolsExt.h"
+#endif
 
 //External imports in order to call thrust or cub functions which have been compiled by nvcc
 extern "C" void thrustDataReorderU4 (const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<uint4>  &dIn, my_dev::dev_mem<uint4>  &dOut);
@@ -7,6 +9,8 @@ extern "C" void thrustDataReorderF4 (const int N, my_dev::dev_mem<uint> &permuta
 extern "C" void thrustDataReorderF2 (const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<float2> &dIn, my_dev::dev_mem<float2> &dOut);
 extern "C" void thrustDataReorderULL(const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<ullong> &dIn, my_dev::dev_mem<ullong> &dOut);
 extern "C" void thrustDataReorderF1 (const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<float>  &dIn, my_dev::dev_mem<float>  &dOut);
+extern "C" void thrustDataReorderI2 (const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<int2>   &dIn, my_dev::dev_mem<int2>   &dOut);
+extern "C" void thrustDataReorderU1 (const int N, my_dev::dev_mem<uint> &permutation, my_dev::dev_mem<uint>   &dIn, my_dev::dev_mem<uint>   &dOut);
 
 extern "C" void thrustSort(my_dev::dev_mem<uint4> &srcKeys,
                            my_dev::dev_mem<uint>  &permutation_buffer,
@@ -325,4 +329,50 @@ template<> void octree::dataReorder2<ullong>(const int N, my_dev::dev_mem<uint>
                                   my_dev::dev_mem<ullong>  &dIn, my_dev::dev_mem<ullong>  &dOut) {
   thrustDataReorderULL(N, permutation, dIn, dOut);
 }
+template<> void octree::dataReorder2<int2>(const int N, my_dev::dev_mem<uint> &permutation,
+                                my_dev::dev_mem<int2>  &dIn, my_dev::dev_mem<int2>  &dOut) {
+  thrustDataReorderI2(N, permutation, dIn, dOut);
+}
+template<> void octree::dataReorder2<uint>(const int N, my_dev::dev_mem<uint> &permutation,
+                                my_dev::dev_mem<uint>  &dIn, my_dev::dev_mem<uint>  &dOut) {
+  thrustDataReorderU1(N, permutation, dIn, dOut);
+}
+
+
+//Reorders the arrays that sort_bodies without full shuffle leaves in their old
+//order, afterwards all particle arrays are in tree order. oriParticleOrder is
+//not reset, the tree has to be sorted again before correct() reads through it
+void octree::applyParticleOrder(tree_structure &tree)
+{
+  my_dev::dev_mem<real4>  real4Buffer1;
+  my_dev::dev_mem<float2> float2Buffer;
+  real4Buffer1.cmalloc_copy(tree.generalBuffer1, tree.n, 0);
+  float2Buffer.cmalloc_copy(tree.generalBuffer1, tree.n, 0);
+
+  dataReorder(tree.n, tree.oriParticleOrder, tree.bodies_pos,  real4Buffer1, true, true);
+  dataReorder(tree.n, tree.oriParticleOrder, tree.bodies_vel,  real4Buffer1, true, true);
+  dataReorder(tree.n, tree.oriParticleOrder, tree.bodies_acc0, real4Buffer1, true, true);
+  dataReorder(tree.n, tree.oriParticleOrder, tree.bodies_Pvel, real4Buffer1, true, true);
+  dataReorder(tree.n, tree.oriParticleOrder, tree.bodies_time, float2Buffer, true, true);
+}
+
+//The walk results are written in tree order, move them along with the
+//particles after the tree has been sorted again
+void octree::reorderGravityResults(tree_structure &tree)
+{
+  my_dev::dev_mem<real4>  real4Buffer1;
+  my_dev::dev_mem<float2> float2Buffer;
+  my_dev::dev_mem<int2>   int2Buffer;
+  my_dev::dev_mem<uint>   uintBuffer;
+  real4Buffer1.cmalloc_copy(tree.generalBuffer1, tree.n, 0);
+  float2Buffer.cmalloc_copy(tree.generalBuffer1, tree.n, 0);
+  int2Buffer.  cmalloc_copy(tree.generalBuffer1, tree.n, 0);
+  uintBuffer.  cmalloc_copy(tree.generalBuffer1, tree.n, 0);
+
+  dataReorder(tree.n, tree.oriParticleOrder, tree.bodies_acc1,    real4Buffer1, true, true);
+  dataReorder(tree.n, tree.oriParticleOrder, tree.bodies_dens,    float2Buffer, true, true);
+  dataReorder(tree.n, tree.oriParticleOrder, tree.interactions,   int2Buffer,   true, true);
+  dataReorder(tree.n, tree.oriParticleOrder, tree.activePartlist, uintBuffer,   true, true);
+  dataReorder(tree.n, tree.oriParticleOrder, tree.ngb,            uintBuffer,   true, true);
+}
 
@@ -6,6 +6,10 @@
  */
 
 #include "tipsyIO.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 
@@ -152,6 +156,128 @@ void tipsyIO::writeFile(real4 *bodyPositions, real4 *bodyVelocities, ullong* bod
 }
 
 
+/*
+ * Reads records [iBeg, iEnd) of an open Tipsy file with large pread calls and converts
+ * them in parallel. Dark matter records come first, followed by the star records, both
+ * have a fixed size so the offset of any record follows from the header.
+ */
+void tipsyIO::readRecords(int fd, const dumpV2 &h, const int fileFormatVersion,
+                          const long long iBeg, const long long iEnd,
+                          std::vector<real4> &bodyPositions,
+                          std::vector<real4> &bodyVelocities,
+                          std::vector<ullong> &bodiesIDs,
+                          int reduce_bodies_factor)
+{
+  const long long NDMparticles = h.ndark;
+  const size_t    chunkSize    = 1 << 20;  //records per read
+
+  std::vector<char>   buffer;
+  std::vector<real4>  pos(chunkSize), vel(chunkSize);
+  std::vector<ullong> ids(chunkSize);
+  std::vector<char>   keep(chunkSize);
+
+  for(long long i0 = iBeg; i0 < iEnd; )
+  {
+    //A chunk never mixes dark matter and star records
+    const bool   isDark  = i0 < NDMparticles;
+    const long long iMax = isDark ? std::min(iEnd, NDMparticles) : iEnd;
+    const size_t n       = (size_t)std::min((long long)chunkSize, iMax - i0);
+    const size_t recSize = isDark ? sizeof(dark_particleV2) : sizeof(star_particleV2);
+    const off_t  offset  = sizeof(dumpV2) + (isDark ? i0*sizeof(dark_particleV2) :
+                                                      NDMparticles*sizeof(dark_particleV2) +
+                                                     (i0-NDMparticles)*sizeof(star_particleV2));
+
+    buffer.resize(n*recSize);
+    size_t nRead = 0;
+    while(nRead < buffer.size())
+    {
+      const ssize_t r = pread(fd, &buffer[nRead], buffer.size() - nRead, offset + nRead);
+      if(r <= 0)
+      {
+        LOG("Error while reading the input file \n");
+        ::exit(0);
+      }
+      nRead += r;
+    }
+
+#pragma omp parallel for schedule(static)
+    for(size_t j=0; j < n; j++)
+    {
+      const long long i = i0 + j;
+      real4  positions, velocity;
+      ullong idummy;
+      if(isDark)
+      {
+        dark_particleV2 d;
+        memcpy(&d, &buffer[j*recSize], sizeof(d));
+        positions.w       = d.mass;
+        positions.x       = d.pos[0];
+        positions.y       = d.pos[1];
+        positions.z       = d.pos[2];
+        velocity.x        = d.vel[0];
+        velocity.y        = d.vel[1];
+        velocity.z        = d.vel[2];
+        velocity.w        = 0;
+        idummy            = d.getID();
+
+        //Force compatibility with older 32bit ID files by mapping the particle IDs
+        if(fileFormatVersion == 0)
+        {
+          idummy    = d.getID_V1() + DARKMATTERID;
+        }
+      }
+      else
+      {
+        star_particleV2 s;
+        memcpy(&s, &buffer[j*recSize], sizeof(s));
+        positions.w       = s.mass;
+        positions.x       = s.pos[0];
+        positions.y       = s.pos[1];
+        positions.z       = s.pos[2];
+        velocity.x        = s.vel[0];
+        velocity.y        = s.vel[1];
+        velocity.z        = s.vel[2];
+        velocity.w        = 0;
+        idummy            = s.getID();
+
+        //Force compatibility with older 32bit ID files by mapping the particle IDs
+        if(fileFormatVersion == 0)
+        {
+          if(s.getID_V1() >= 100000000) idummy    = s.getID_V1() + BULGEID; //Bulge particles
+          else                          idummy    = s.getID_V1();           //Disk  particles
+        }
+      }
+
+      //Reduce the number of particles, but increase the mass per particle by the reduction factor
+      //We increase i by 1 before the check to retain compatibility with older Bonsai versions.
+      if( (i+1) % reduce_bodies_factor == 0 ) positions.w *= reduce_bodies_factor;
+      keep[j] = (i+1) % reduce_bodies_factor == 0;
+
+      pos[j] = positions;
+      vel[j] = velocity;
+      ids[j] = idummy;
+    }
+
+    for(size_t j=0; j < n; j++)
+    {
+      //Some input files have bugged z positions, ignore those particles and print a warning
+      if(pos[j].z < -10e10)
+      {
+         fprintf(stderr," Removing particle %lld because of Z is: %f \n", i0 + (long long)j, pos[j].z);
+         continue;
+      }
+      if(!keep[j]) continue;
+
+      bodyPositions.push_back(pos[j]);
+      bodyVelocities.push_back(vel[j]);
+      bodiesIDs.push_back(ids[j]);
+    }
+
+    i0 += n;
+  }
+}
+
+
 void tipsyIO::readFile(const MPI_Comm &mpiCommWorld,
                        std::vector<real4> &bodyPositions,
                        std::vector<real4> &bodyVelocities,
@@ -165,8 +291,8 @@ void tipsyIO::readFile(const MPI_Comm &mpiCommWorld,
 
 {
   /*
-    If the input file is a single file then process 0 does the file reading and sends
-    the data to the other processes.
+    If the input file is a single file then every process reads its own range of
+    records directly from the file.
     If we restart then it means each process as written it's own subset of data, and hence
     has to read in it's own data.
 
@@ -174,135 +300,54 @@ void tipsyIO::readFile(const MPI_Comm &mpiCommWorld,
     particle id on the location where previously the potential was stored.
   */
 
-  if(!restart && rank > 0)
-  {
-      ICRecv(0, rank, bodyPositions, bodyVelocities,  bodiesIDs, mpiCommWorld);
-  }
-  else
-  {
-      char fullFileName[256];
-      if(restart)   sprintf(fullFileName, "%s-%d", fileName.c_str(), rank);
-      else          sprintf(fullFileName, "%s",   fileName.c_str());
-
-      LOG("Trying to read file: %s \n", fullFileName);
-
-      std::ifstream inputFile(fullFileName, std::ios::in | std::ios::binary);
-      if(!inputFile.is_open())
-      {
-        LOG("Can't open input file \n");
-        ::exit(0);
-      }
-
-      //Read Tipsy header
-      dumpV2  h;
-      inputFile.read((char*)&h, sizeof(h));
-      int NTotal         = h.nbodies;
-      int NDMparticles   = h.ndark;
-      int NStarparticles = h.nstar;
-      snapshotTime       = (float) h.time;
-      assert(h.nsph == 0); //Bonsai does not support these particles
-      assert(NTotal == (NDMparticles+NStarparticles));
-
-      if(rank == 0) printf("File version: %d \n", h.version);
-      int                fileFormatVersion = 0;
-      if(h.version == 2) fileFormatVersion = 2;
-
-      ullong idummy;
-      real4  positions;
-      real4  velocity;
+  char fullFileName[256];
+  if(restart)   sprintf(fullFileName, "%s-%d", fileName.c_str(), rank);
+  else          sprintf(fullFileName, "%s",   fileName.c_str());
 
+  LOG("Trying to read file: %s \n", fullFileName);
 
-      //Rough divide
-      uint        perProc = (NTotal / procs) /reduce_bodies_factor;
-      if(restart) perProc =  NTotal          /reduce_bodies_factor; //don't subdivide when using restart
-      bodyPositions.reserve(perProc+10);
-      bodyVelocities.reserve(perProc+10);
-      bodiesIDs.reserve(perProc+10);
-      perProc -= 1;
-
-      //Start reading
-      int procCntr            = 1;
-      dark_particleV2 d;
-      star_particleV2 s;
-
-      for(int i=0; i < NTotal; i++)
-      {
-        if(i < NDMparticles)
-        {
-          inputFile.read((char*)&d, sizeof(d));
-          positions.w       = d.mass;
-          positions.x       = d.pos[0];
-          positions.y       = d.pos[1];
-          positions.z       = d.pos[2];
-          velocity.x        = d.vel[0];
-          velocity.y        = d.vel[1];
-          velocity.z        = d.vel[2];
-          velocity.w        = 0;
-          idummy            = d.getID();
-
-          //Force compatibility with older 32bit ID files by mapping the particle IDs
-          if(fileFormatVersion == 0)
-          {
-            idummy    = d.getID_V1() + DARKMATTERID;
-          }
-        }
-        else
-        {
-          inputFile.read((char*)&s, sizeof(s));
-          positions.w       = s.mass;
-          positions.x       = s.pos[0];
-          positions.y       = s.pos[1];
-          positions.z       = s.pos[2];
-          velocity.x        = s.vel[0];
-          velocity.y        = s.vel[1];
-          velocity.z        = s.vel[2];
-          velocity.w        = 0;
-          idummy            = s.getID();
-
-          //Force compatibility with older 32bit ID files by mapping the particle IDs
-          if(fileFormatVersion == 0)
-          {
-            if(s.getID_V1() >= 100000000) idummy    = s.getID_V1() + BULGEID; //Bulge particles
-            else                          idummy    = s.getID_V1();           //Disk  particles
-          }
-        }
-
-        //Some input files have bugged z positions, ignore those particles and print a warning
-        if(positions.z < -10e10)
-        {
-           fprintf(stderr," Removing particle %d because of Z is: %f \n", i, positions.z);
-           continue;
-        }
-
-        //Reduce the number of particles, but increase the mass per particle by the reduction factor
-        //We increase i by 1 before the check to retain compatibility with older Bonsai versions.
-        if( (i+1) % reduce_bodies_factor == 0 ) positions.w *= reduce_bodies_factor;
-        if( (i+1) % reduce_bodies_factor != 0 ) continue;
-
-        bodyPositions.push_back(positions);
-        bodyVelocities.push_back(velocity);
-        bodiesIDs.push_back(idummy);
+  const int fd = open(fullFileName, O_RDONLY);
+  if(fd < 0)
+  {
+    LOG("Can't open input file \n");
+    ::exit(0);
+  }
 
+  //Read Tipsy header
+  dumpV2  h;
+  if(pread(fd, &h, sizeof(h), 0) != sizeof(h))
+  {
+    LOG("Can't read the input file header \n");
+    ::exit(0);
+  }
+  int NTotal         = h.nbodies;
+  int NDMparticles   = h.ndark;
+  int NStarparticles = h.nstar;
+  snapshotTime       = (float) h.time;
+  assert(h.nsph == 0); //Bonsai does not support these particles
+  assert(NTotal == (NDMparticles+NStarparticles));
+
+  if(rank == 0) printf("File version: %d \n", h.version);
+  int                fileFormatVersion = 0;
+  if(h.version == 2) fileFormatVersion = 2;
+
+  //Contiguous range of records for this process, don't subdivide when using restart
+  long long iBeg = 0, iEnd = NTotal;
+  if(!restart)
+  {
+    iBeg = ((long long)NTotal *  rank   ) / procs;
+    iEnd = ((long long)NTotal * (rank+1)) / procs;
+  }
 
+  const size_t perProc = (iEnd - iBeg) / reduce_bodies_factor;
+  bodyPositions.reserve(perProc+10);
+  bodyVelocities.reserve(perProc+10);
+  bodiesIDs.reserve(perProc+10);
 
-        if(!restart)
-        {
-    #ifdef USE_MPI
-          if(bodyPositions.size() > perProc && procCntr != procs)
-          {
-            ICSend(procCntr,  &bodyPositions[0], &bodyVelocities[0],  &bodiesIDs[0], (int)bodyPositions.size(),mpiCommWorld);
-            procCntr++;
-
-            bodyPositions.clear();
-            bodyVelocities.clear();
-            bodiesIDs.clear();
-          }
-    #endif
-        }
-      }//end while
+  readRecords(fd, h, fileFormatVersion, iBeg, iEnd,
+              bodyPositions, bodyVelocities, bodiesIDs, reduce_bodies_factor);
 
-      inputFile.close();
+  close(fd);
 
-      LOGF(stderr,"NTotal: %d\tper proc: ~ %d\tFor ourself: %d\n", NTotal, perProc, (int)bodiesIDs.size());
-  }
+  LOGF(stderr,"NTotal: %d\tper proc: ~ %d\tFor ourself: %d\n", NTotal, (int)perProc, (int)bodiesIDs.size());
 }
@@ -0,0 +1,76 @@
+#include "BonsaiIO.h"
+#include "IDType.h"
+#include <sys/time.h>
+
+/* Serial, MPI free inspection of a BonsaiIO snapshot through a memory mapping.
+ * Only the pages of the requested fields are read from disk.
+ */
+
+static double wtime()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.e-6*tv.tv_usec;
+}
+
+template<typename T>
+static void positionStats(BonsaiIO::MMapReader &in, const std::string &name)
+{
+  BonsaiIO::DataType<T> pos(name);
+  const double t0 = wtime();
+  if (!in.view(pos))
+  {
+    fprintf(stderr, " %s  is not found, skipping\n", name.c_str());
+    return;
+  }
+
+  double mtot = 0, com[3] = {0.0, 0.0, 0.0};
+  for (size_t i = 0; i < pos.size(); i++)
+  {
+    mtot   += pos[i][3];
+    com[0] += pos[i][3]*pos[i][0];
+    com[1] += pos[i][3]*pos[i][1];
+    com[2] += pos[i][3]*pos[i][2];
+  }
+  if (mtot > 0)
+    for (int k = 0; k < 3; k++)
+      com[k] /= mtot;
+  const double dt = wtime() - t0;
+
+  fprintf(stderr, " %s: n= %zu  mtot= %g  com= %g %g %g  [%g sec, %g MB/s]\n",
+      name.c_str(), pos.size(), mtot, com[0], com[1], com[2],
+      dt, pos.getNumBytes()/dt/1e6);
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, " ------------------------------------------------------------------------\n");
+    fprintf(stderr, " Usage: \n");
+    fprintf(stderr, " %s  fileIn [field] \n", argv[0]);
+    fprintf(stderr, " ------------------------------------------------------------------------\n");
+    exit(-1);
+  }
+
+  const std::string fileIn(argv[1]);
+  const std::string field (argc > 2 ? argv[2] : "");
+
+  const double tOpen = wtime();
+  BonsaiIO::MMapReader in(fileIn);
+  const double dtOpen = wtime() - tOpen;
+
+  fprintf(stderr, " Input file:  %s  time= %g  [open= %g sec]\n", fileIn.c_str(), in.getTime(), dtOpen);
+  in.getHeader().printFields();
+
+  typedef float float4[4];
+  if (field.empty())
+  {
+    positionStats<float4>(in, "DM:POS:real4");
+    positionStats<float4>(in, "Stars:POS:real4");
+  }
+  else
+    positionStats<float4>(in, field);
+
+  return 0;
+}
@@ -4,6 +4,7 @@
 #include <cmath>
 #include <cassert>
 #include <algorithm>
+#include <numeric>
 #include "vector_math.h"
 #include "Texture.h"
 #include "Vertex.h"
@@ -41,6 +42,17 @@ class Splotch
       float x0,x1;
       float y0,y1;
     };
+
+    /* render() bins the visible quads into TILESIZE x TILESIZE screen tiles,
+     * every tile is rasterized by one thread into its own buffer */
+    enum {TILESIZE = 64};
+    struct Tile
+    {
+      float r[TILESIZE*TILESIZE];
+      float g[TILESIZE*TILESIZE];
+      float b[TILESIZE*TILESIZE];
+      float a[TILESIZE*TILESIZE];
+    };
     
     int width, height;
     std::vector<float4> image;
@@ -128,8 +140,9 @@ class Splotch
     void transform(const bool perspective);
     void depthSort();
 
-    // assumes atomic execution
-    Quad rasterize(const VertexView &vtx, const Quad &range, std::vector<color_t> &fb);
+    Quad clip(const VertexView &vtx, const Quad &range) const;
+    // fb is the tile of range, owned by the calling thread
+    Quad rasterize(const VertexView &vtx, const Quad &range, Tile &fb);
     void render();
     void finalize();
 
@@ -34,16 +34,16 @@ const char splotchPS[] =
 };
 
 
+/* branch free, so that it vectorizes over the pixels of a row */
 static inline float Wkernel(const float q2)
 {
   const float q = std::sqrt(q2);
   const float sigma = 8.0f/M_PI;
 
   const float qm = 1.0f - q;
-  if      (q < 0.5f) return sigma * (1.0f + (-6.0f)*q*q*qm);
-  else if (q < 1.0f) return sigma * 2.0f*qm*qm*qm;
+  const float w  = q < 0.5f ? 1.0f + (-6.0f)*q*q*qm : 2.0f*qm*qm*qm;
 
-  return 0.0f;
+  return q < 1.0f ? sigma * w : 0.0f;
 }
 
 template<typename T>
@@ -173,8 +173,8 @@ void Splotch::depthSort()
   swap(vtxArrayView,vtxView);
 }
 
-// assumes atomic execution
-Splotch::Quad Splotch::rasterize(const VertexView &vtx, const Splotch::Quad &range, std::vector<color_t> &fb)
+/* pixels of range that the quad of vtx covers */
+Splotch::Quad Splotch::clip(const VertexView &vtx, const Splotch::Quad &range) const
 {
   using std::max;
   using std::min;
@@ -186,27 +186,38 @@ Splotch::Quad Splotch::rasterize(const VertexView &vtx, const Splotch::Quad &ran
   q.x1  = min(range.x1, ceil (vtx.pos.x + vtx.pos.h));
   q.y0  = max(range.y0, floor(vtx.pos.y - vtx.pos.h));
   q.y1  = min(range.y1, ceil (vtx.pos.y + vtx.pos.h));
+  return q;
+}
+
+// fb is the tile of range, owned by the calling thread
+Splotch::Quad Splotch::rasterize(const VertexView &vtx, const Splotch::Quad &range, Tile &fb)
+{
+  const Quad q = clip(vtx, range);
 
   const float invh  = 1.0f/vtx.pos.h;
   const float invh2 = invh*invh;
-  const float width  = range.x1 - range.x0;
-  const float height = range.y1 - range.y0;
+  const int   width = range.x1 - range.x0;
+  const int   ix0   = q.x0 - range.x0;
+  const int   ix1   = q.x1 - range.x0;
+  const float4 color = vtx.color;
+
+  /* Blending ONE, SRC_ALPHA with the kernel as alpha */
   for (float iy = q.y0; iy < q.y1; iy++)
-    for(float ix = q.x0; ix < q.x1; ix++)
+  {
+    const float dy  = iy - vtx.pos.y;
+    const int   row = width*(iy - range.y0);
+    assert(row >= 0 && row + ix1 <= TILESIZE*TILESIZE);
+#pragma omp simd
+    for (int ix = ix0; ix < ix1; ix++)
     {
-      const float dx = ix - vtx.pos.x;
-      const float dy = iy - vtx.pos.y;
-      const float q2 = (dx*dx + dy*dy) * invh2;
-      const float fac = Wkernel(q2);
-
-      float4 color = vtx.color;
-      color.w = fac; /* alpha */
-
-      const int idx = (ix - range.x0) + width*(iy - range.y0);
-      assert(idx >= 0);
-      assert(idx < width*height);
-      fb[idx] = Blending::getColor<Blending::ONE,Blending::SRC_ALPHA>(fb[idx],color);
+      const float dx  = (range.x0 + ix) - vtx.pos.x;
+      const float fac = Wkernel((dx*dx + dy*dy) * invh2);
+      fb.r[row+ix] += color.x*fac;
+      fb.g[row+ix] += color.y*fac;
+      fb.b[row+ix] += color.z*fac;
+      fb.a[row+ix] += fac*fac;
     }
+  }
 
   return q;
 }
@@ -216,47 +227,93 @@ void Splotch::render()
   const int np = vtxArrayView.size();
 
   image.resize(width*height);
-  std::fill(image.begin(), image.end(), make_float4(0.0f));
 
-#define NTHREADMAX 256
-  std::vector<color_t> fbVec[NTHREADMAX];
-
-#pragma omp parallel
+  const int nTileX = (width  + TILESIZE - 1)/TILESIZE;
+  const int nTileY = (height + TILESIZE - 1)/TILESIZE;
+  const int nTile  = nTileX*nTileY;
+
+  Quad screen;
+  screen.x0 = 0;
+  screen.x1 = width;
+  screen.y0 = 0;
+  screen.y1 = height;
+
+  /* Bin the quads into the tiles they overlap. The vertices are split into
+   * nSlice contiguous slices, and the list of tile t is made of the bins
+   * [t*nSlice, (t+1)*nSlice), so it stays in vertex order */
+  const int nSlice = omp_get_max_threads();
+  const int ipers  = (np + nSlice - 1)/nSlice;
+  std::vector<int> binFirst(nTile*nSlice + 1, 0);
+
+  /* tiles [tx0,tx1] x [ty0,ty1] that the quad of vertex i overlaps */
+  auto tileRange = [&](const int i, int &tx0, int &tx1, int &ty0, int &ty1)
   {
-    const int nt = omp_get_num_threads();
-    assert(nt <= NTHREADMAX);
-    const int tid = omp_get_thread_num();
-    auto &fb = fbVec[tid];
-    fb.resize(width*height);
-    std::fill(fb.begin(), fb.end(), make_float4(0.0f));
-
-    Quad range;
-    range.x0 = 0;
-    range.x1 = width;
-    range.y0 = 0;
-    range.y1 = height;
-
-    if (tid == 0)
-      fprintf(stderr, "rasterize begin .. \n");
-
-    const int ipert  = (np+nt-1)/nt;
-    const int ibeg = tid * ipert;
-    const int iend = std::min(ibeg+ipert, np);
-
-    for (int i = ibeg; i < iend; i++)
+    const Quad q = clip(vtxArrayView[i], screen);
+    tx0 = int(q.x0)/TILESIZE;
+    tx1 = q.x1 > q.x0 ? (int(q.x1) - 1)/TILESIZE : tx0 - 1;
+    ty0 = int(q.y0)/TILESIZE;
+    ty1 = q.y1 > q.y0 ? (int(q.y1) - 1)/TILESIZE : ty0 - 1;
+  };
+
+#pragma omp parallel for schedule(static)
+  for (int s = 0; s < nSlice; s++)
+    for (int i = s*ipers; i < std::min(np, (s+1)*ipers); i++)
     {
-      rasterize(vtxArrayView[i], range, fb);
+      int tx0, tx1, ty0, ty1;
+      tileRange(i, tx0, tx1, ty0, ty1);
+      for (int ty = ty0; ty <= ty1; ty++)
+        for (int tx = tx0; tx <= tx1; tx++)
+          binFirst[(ty*nTileX + tx)*nSlice + s + 1]++;
     }
 
-    if (tid == 0)
-      fprintf(stderr, "rasterize end .. \n");
+  std::partial_sum(binFirst.begin(), binFirst.end(), binFirst.begin());
+  std::vector<int> binVtx(binFirst.back());
+  std::vector<int> binNext(binFirst.begin(), binFirst.end() - 1);
 
-#pragma omp barrier
+#pragma omp parallel for schedule(static)
+  for (int s = 0; s < nSlice; s++)
+    for (int i = s*ipers; i < std::min(np, (s+1)*ipers); i++)
+    {
+      int tx0, tx1, ty0, ty1;
+      tileRange(i, tx0, tx1, ty0, ty1);
+      for (int ty = ty0; ty <= ty1; ty++)
+        for (int tx = tx0; tx <= tx1; tx++)
+          binVtx[binNext[(ty*nTileX + tx)*nSlice + s]++] = i;
+    }
+
+  fprintf(stderr, "rasterize: nTile= %d  nBinned= %d \n", nTile, (int)binVtx.size());
+
+#pragma omp parallel
+  {
+    Tile fb;
 
-#pragma omp for schedule(runtime) 
-    for (int idx = 0; idx < width*height; idx++)
-      for (int k = 0; k < nt; k++)
-        image[idx] = Blending::getColor<Blending::ONE,Blending::ONE>(image[idx], fbVec[k][idx]);
+#pragma omp for schedule(dynamic)
+    for (int t = 0; t < nTile; t++)
+    {
+      Quad range;
+      range.x0 = (t%nTileX)*TILESIZE;
+      range.x1 = std::min(width,  int(range.x0) + TILESIZE);
+      range.y0 = (t/nTileX)*TILESIZE;
+      range.y1 = std::min(height, int(range.y0) + TILESIZE);
+      const int w = range.x1 - range.x0;
+      const int h = range.y1 - range.y0;
+
+      std::fill(fb.r, fb.r + w*h, 0.0f);
+      std::fill(fb.g, fb.g + w*h, 0.0f);
+      std::fill(fb.b, fb.b + w*h, 0.0f);
+      std::fill(fb.a, fb.a + w*h, 0.0f);
+
+      for (int k = binFirst[t*nSlice]; k < binFirst[(t+1)*nSlice]; k++)
+        rasterize(vtxArrayView[binVtx[k]], range, fb);
+
+      for (int j = 0; j < h; j++)
+        for (int i = 0; i < w; i++)
+        {
+          const int idx = j*w + i;
+          image[(int(range.y0) + j)*width + int(range.x0) + i] =
+            make_float4(fb.r[idx], fb.g[idx], fb.b[idx], fb.a[idx]);
+        }
+    }
   }
 }
 
@@ -0,0 +1,286 @@
+#pragma once
+
+/* Distributed mode of densCalc and cvt2grid. The particles are sorted into
+ * Morton key domains, one per rank, and each rank builds its Tree over its own
+ * domain. For the neighbour search a rank also imports the particles of the
+ * other domains that lie within the smoothing range of its own particles
+ * (halo). The results are sent back to the rank and index the particle was
+ * read from, so the output is written in the original order.
+ */
+
+#include <mpi.h>
+#include <vector>
+#include <algorithm>
+#include "Tree.h"
+
+struct DomainDecomposition
+{
+  typedef boundary<float> Boundary;
+
+  struct DomainParticle
+  {
+    vec3  pos;
+    float mass;
+    vec3  vel;
+    float h;
+    int   rank;  /* where the particle was read */
+    int   idx;
+  };
+
+  struct Result
+  {
+    float density;
+    float h;
+    int   idx;
+  };
+
+  MPI_Comm comm;
+  int myRank, nRank;
+
+  Boundary globalBox;                 /* of all particles */
+  std::vector<DomainParticle> ptcl;   /* own domain */
+  std::vector<DomainParticle> halo;   /* of the other domains, for the neighbour search */
+
+  DomainDecomposition(const MPI_Comm &_comm) : comm(_comm)
+  {
+    MPI_Comm_rank(comm, &myRank);
+    MPI_Comm_size(comm, &nRank);
+  }
+
+  template<typename T>
+  void alltoallv(const std::vector<std::vector<T> > &send, std::vector<T> &recv) const
+  {
+    std::vector<int> sendcount(nRank), recvcount(nRank);
+    std::vector<int> senddispl(nRank+1, 0), recvdispl(nRank+1, 0);
+    for (int p = 0; p < nRank; p++)
+    {
+      sendcount[p]   = send[p].size();
+      senddispl[p+1] = senddispl[p] + sendcount[p];
+    }
+    MPI_Alltoall(&sendcount[0], 1, MPI_INT, &recvcount[0], 1, MPI_INT, comm);
+    for (int p = 0; p < nRank; p++)
+      recvdispl[p+1] = recvdispl[p] + recvcount[p];
+
+    std::vector<T> sendbuf(std::max(1, senddispl[nRank]));
+    for (int p = 0; p < nRank; p++)
+      std::copy(send[p].begin(), send[p].end(), sendbuf.begin() + senddispl[p]);
+    recv.resize(std::max(1, recvdispl[nRank]));
+
+    MPI_Datatype MPI_ELEMENT;
+    MPI_Type_contiguous(sizeof(T), MPI_BYTE, &MPI_ELEMENT);
+    MPI_Type_commit(&MPI_ELEMENT);
+    MPI_Alltoallv(
+        &sendbuf[0], &sendcount[0], &senddispl[0], MPI_ELEMENT,
+        &recv   [0], &recvcount[0], &recvdispl[0], MPI_ELEMENT,
+        comm);
+    MPI_Type_free(&MPI_ELEMENT);
+    recv.resize(recvdispl[nRank]);
+  }
+
+  /* Sorts the particles that this rank has read into the domains. The domain
+   * boundaries are chosen on a global set of key samples, so that every domain
+   * gets about the same number of particles */
+  template<typename Tpos, typename Tvel>
+  void decompose(const Tpos &posArray, const Tvel &velArray)
+  {
+    const double t0 = MPI_Wtime();
+    const int np = posArray.getNumElements();
+
+    Boundary box;
+    for (int i = 0; i < np; i++)
+      box.merge(Boundary(vec3(posArray[i][0], posArray[i][1], posArray[i][2])));
+    MPI_Allreduce(MPI_IN_PLACE, &box.min[0], 3, MPI_FLOAT, MPI_MIN, comm);
+    MPI_Allreduce(MPI_IN_PLACE, &box.max[0], 3, MPI_FLOAT, MPI_MAX, comm);
+    globalBox = box;
+
+    const vec3  vsize = box.hlen();
+    const float rsize = std::max(vsize.x, std::max(vsize.y, vsize.z)) * 2.0f;
+    float rsize2 = 1.0;
+    while (rsize2 > rsize) rsize2 *= 0.5;
+    while (rsize2 < rsize) rsize2 *= 2.0;
+
+    typedef unsigned long long key_t;
+    std::vector<key_t> keys(np);
+    for (int i = 0; i < np; i++)
+      keys[i] = morton_key<vec3, float>(vec3(posArray[i][0], posArray[i][1], posArray[i][2]) - box.min, rsize2).val;
+
+    /* every rank samples with the same frequency, so the samples are
+     * distributed like the particles */
+    long long nGlb, npLoc = np;
+    MPI_Allreduce(&npLoc, &nGlb, 1, MPI_LONG_LONG, MPI_SUM, comm);
+    const int NSAMPLE    = 256;
+    const int sampleFreq = std::max(1LL, nGlb / (NSAMPLE*nRank));
+
+    std::vector<key_t> sorted(keys);
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<key_t> samples;
+    for (int i = 0; i < np; i += sampleFreq)
+      samples.push_back(sorted[i]);
+
+    int nSample = samples.size();
+    std::vector<int> sampleCount(nRank), sampleDispl(nRank+1, 0);
+    MPI_Allgather(&nSample, 1, MPI_INT, &sampleCount[0], 1, MPI_INT, comm);
+    for (int p = 0; p < nRank; p++)
+      sampleDispl[p+1] = sampleDispl[p] + sampleCount[p];
+    std::vector<key_t> allSamples(std::max(1, sampleDispl[nRank]));
+    MPI_Allgatherv(samples.empty() ? NULL : &samples[0], nSample, MPI_UNSIGNED_LONG_LONG,
+        &allSamples[0], &sampleCount[0], &sampleDispl[0], MPI_UNSIGNED_LONG_LONG, comm);
+    allSamples.resize(sampleDispl[nRank]);
+    std::sort(allSamples.begin(), allSamples.end());
+
+    /* domain p holds the keys in [split[p-1], split[p]) */
+    std::vector<key_t> split(nRank-1);
+    for (int p = 1; p < nRank; p++)
+      split[p-1] = allSamples.empty() ? 0 : allSamples[(size_t)p*allSamples.size()/nRank];
+
+    std::vector<std::vector<DomainParticle> > send(nRank);
+    for (int i = 0; i < np; i++)
+    {
+      const int dst = std::upper_bound(split.begin(), split.end(), keys[i]) - split.begin();
+      DomainParticle p;
+      p.pos  = vec3(posArray[i][0], posArray[i][1], posArray[i][2]);
+      p.mass = posArray[i][3];
+      p.vel  = vec3(velArray[i][0], velArray[i][1], velArray[i][2]);
+      p.h    = 0.0f;
+      p.rank = myRank;
+      p.idx  = i;
+      send[dst].push_back(p);
+    }
+    alltoallv(send, ptcl);
+
+    const double t1 = MPI_Wtime();
+    int nMin, nMax, nLoc = ptcl.size();
+    MPI_Allreduce(&nLoc, &nMin, 1, MPI_INT, MPI_MIN, comm);
+    MPI_Allreduce(&nLoc, &nMax, 1, MPI_INT, MPI_MAX, comm);
+    if (myRank == 0)
+      fprintf(stderr, " -- decompose: nMin= %d  nMax= %d  nSample= %d  in %g sec\n",
+          nMin, nMax, sampleDispl[nRank], t1 - t0);
+  }
+
+  /* Tree particles of the own domain followed by the halo, ID is the index in
+   * ptcl and halo respectively */
+  Particle::Vector treeParticles() const
+  {
+    Particle::Vector tp(ptcl.size() + halo.size());
+    for (size_t i = 0; i < tp.size(); i++)
+    {
+      const DomainParticle &p = i < ptcl.size() ? ptcl[i] : halo[i-ptcl.size()];
+      tp[i].ID   = i;
+      tp[i].pos  = p.pos;
+      tp[i].mass = p.mass;
+      tp[i].vel  = p.vel;
+      tp[i].set_h(p.h);
+    }
+    return tp;
+  }
+
+  static void collect(const Tree &tree, const int node, const Boundary &box, std::vector<int> &list)
+  {
+    const NodeHeap &heap = tree.node;
+    if (heap.np[node] == 0 || not_overlapped(heap.bound_inner[node], box))
+      return;
+    if (heap.is_leaf(node))
+    {
+      for (int i = 0; i < heap.np[node]; i++)
+      {
+        const Particle &p = tree.ptcl[heap.pfirst[node]+i];
+        if (overlapped(Boundary(p.pos), box))
+          list.push_back(p.ID);
+      }
+    }
+    else
+      for (int ic = 0; ic < 8; ic++)
+        collect(tree, heap.cfirst[node]+ic, box, list);
+  }
+
+  /* Imports the halo, the range of the own particle i is hrange[i]. The ranges
+   * are merged per group of tree nodes, and every rank sends the particles that
+   * are inside a group range of another rank */
+  void exchangeHalo(const std::vector<float> &hrange)
+  {
+    const double t0 = MPI_Wtime();
+
+    /* tree over the own domain only */
+    halo.clear();
+    const int NGROUP = 256;
+    std::vector<int> groups;
+    Tree tree(treeParticles());
+    if (!ptcl.empty())
+    {
+      tree.node.make_boundary();
+      tree.node.find_group_Node(0, NGROUP, groups);
+    }
+
+    std::vector<Boundary> boxes(groups.size());
+    for (size_t g = 0; g < groups.size(); g++)
+      for (int i = 0; i < tree.node.np[groups[g]]; i++)
+      {
+        const Particle &p = tree.ptcl[tree.node.pfirst[groups[g]]+i];
+        boxes[g].merge(Boundary(p.pos, hrange[p.ID]));
+      }
+
+    /* everyone gets the group ranges of everyone */
+    const int NFLOAT = sizeof(Boundary)/sizeof(float);
+    std::vector<int> boxCount(nRank), boxDispl(nRank+1, 0);
+    int nBox = boxes.size()*NFLOAT;
+    MPI_Allgather(&nBox, 1, MPI_INT, &boxCount[0], 1, MPI_INT, comm);
+    for (int p = 0; p < nRank; p++)
+      boxDispl[p+1] = boxDispl[p] + boxCount[p];
+    std::vector<Boundary> allBoxes(std::max(1, boxDispl[nRank]/NFLOAT));
+    MPI_Allgatherv(boxes.empty() ? NULL : &boxes[0], nBox, MPI_FLOAT,
+        &allBoxes[0], &boxCount[0], &boxDispl[0], MPI_FLOAT, comm);
+    for (int p = 0; p <= nRank; p++)
+      boxDispl[p] /= NFLOAT;
+
+    std::vector<std::vector<DomainParticle> > send(nRank);
+    std::vector<int> list, lastRank(ptcl.size(), -1);
+    for (int p = 0; p < nRank; p++)
+    {
+      if (p == myRank || ptcl.empty())
+        continue;
+      for (int b = boxDispl[p]; b < boxDispl[p+1]; b++)
+      {
+        list.clear();
+        collect(tree, 0, allBoxes[b], list);
+        for (size_t i = 0; i < list.size(); i++)
+          if (lastRank[list[i]] != p)
+          {
+            lastRank[list[i]] = p;
+            send[p].push_back(ptcl[list[i]]);
+          }
+      }
+    }
+    alltoallv(send, halo);
+
+    const double t1 = MPI_Wtime();
+    long long nHalo = halo.size(), nHaloGlb;
+    MPI_Allreduce(&nHalo, &nHaloGlb, 1, MPI_LONG_LONG, MPI_SUM, comm);
+    if (myRank == 0)
+      fprintf(stderr, " -- halo: nHalo= %lld  nBox= %d  in %g sec\n",
+          nHaloGlb, boxDispl[nRank], t1 - t0);
+  }
+
+  /* Sends the results of the own domain back to where the particles were read */
+  template<typename Trhoh>
+  void returnResults(const std::vector<float> &density, const std::vector<float> &h, Trhoh &rhohArray) const
+  {
+    std::vector<std::vector<Result> > send(nRank);
+    for (size_t i = 0; i < ptcl.size(); i++)
+    {
+      Result r;
+      r.density = density[i];
+      r.h       = h[i];
+      r.idx     = ptcl[i].idx;
+      send[ptcl[i].rank].push_back(r);
+    }
+    std::vector<Result> recv;
+    alltoallv(send, recv);
+
+    assert(recv.size() == rhohArray.getNumElements());
+    for (size_t i = 0; i < recv.size(); i++)
+    {
+      rhohArray[recv[i].idx][0] = recv[i].density;
+      rhohArray[recv[i].idx][1] = recv[i].h;
+    }
+  }
+};
@@ -1,8 +1,39 @@
+#pragma once
+
 #include <iostream>
+#include <vector>
 #include <omp.h>
+#include <immintrin.h>
 #include "Particle.h"
 #include "boundary.h"
 
+/* width of the leaf-leaf kernel, the instruction set this is compiled for */
+#if defined(__AVX512F__)
+  #define LEAF_SIMD_WIDTH 16
+#elif defined(__AVX__)
+  #define LEAF_SIMD_WIDTH 8
+#else
+  #define LEAF_SIMD_WIDTH 4
+#endif
+
+typedef float v_sf __attribute__((vector_size(LEAF_SIMD_WIDTH*sizeof(float))));
+typedef int   v_si __attribute__((vector_size(LEAF_SIMD_WIDTH*sizeof(int))));
+
+static inline v_sf v_sqrt(const v_sf x)
+{
+#if defined(__AVX512F__)
+  return (v_sf)_mm512_maskz_sqrt_ps(0xffff, (__m512)x);
+#elif defined(__AVX__)
+  return (v_sf)_mm256_sqrt_ps((__m256)x);
+#elif defined(__SSE__)
+  return (v_sf)_mm_sqrt_ps((__m128)x);
+#else
+  v_sf r;
+  for (int k = 0; k < LEAF_SIMD_WIDTH; k++) r[k] = sqrtf(x[k]);
+  return r;
+#endif
+}
+
 static inline float lWkernel(const float q)
 {
   const float sigma = 8.0f/M_PI;
@@ -24,172 +55,368 @@ static inline void lInteract(Particle &ip, Particle &jp, const float r2)
   ip.density += jp.mass * lWkernel(q) * hinv3;
 }
 
+/* lWkernel of LEAF_SIMD_WIDTH q's, zero outside of mask */
+static inline v_sf lWkernel_simd(const v_sf q, const v_si mask)
+{
+  const v_sf zero  = {};
+  const v_sf sigma = zero + float(8.0f/M_PI);
+  const v_sf qm    = 1.0f - q;
+  const v_sf w     = q < 0.5f ? sigma * (1.0f + (-6.0f)*q*q*qm) : sigma * 2.0f*qm*qm*qm;
+  return (mask & (q < 1.0f)) ? w : zero;
+}
+
 
-struct Node
+/* Octree over particles that are sorted by Morton key. The nodes are stored
+ * as a structure of arrays that belongs to the instance, so several trees can
+ * be used at the same time. A node with at least NLEAF particles is split,
+ * the 8 children of a node are contiguous.
+ * The tree is built from the key ranges of the particles: the top levels
+ * serially, until there are enough nodes to split for all threads, and the
+ * subtrees below these in parallel, each into its own heap that is appended
+ * to this one. */
+struct NodeHeap
 {
   static const int NLEAF = 32;
-  static std::vector<Particle> ptcl;
-  static std::vector<Node> Node_heap;
-  static std::vector<std::pair<Node*, Node*> > pair_list;
-  static void allocate(int nptcl, int nNode){
-    ptcl.reserve(nptcl);
-    Node_heap.reserve(nNode);
-  }
-  static void clear(){
-    ptcl.clear();
-    Node_heap.clear();
-  }
   typedef boundary<float> Boundary;
 
-  int np;     // number of Particle;
-  int depth;
-  float size;
-  int pfirst; // first Particle
-  int cfirst; // first child
-  Boundary bound_inner;
-  Boundary bound_outer;
+  Particle *ptcl;
+
+  /* structure of arrays copy of ptcl for the leaf-leaf kernel, padded by
+   * LEAF_SIMD_WIDTH; h is updated by make_boundary */
+  std::vector<float> px, py, pz, pmass, ph;
+
+  /* the neighbour search is only done for the active particles, and only
+   * walks the i-nodes that have one; all particles are active after build */
+  std::vector<char> active;      // per particle
+  std::vector<char> has_active;  // per node
+
+  std::vector<int>      np;      // number of Particle
+  std::vector<int>      depth;
+  std::vector<float>    size;
+  std::vector<int>      pfirst;  // first Particle
+  std::vector<int>      cfirst;  // first child
+  std::vector<Boundary> bound_inner;
+  std::vector<Boundary> bound_outer;
+
+  NodeHeap() : ptcl(NULL) {}
 
-  Node()           : np(0), depth(     0), pfirst(-1), cfirst(-1) {}
-  Node(int _depth, float _size) : np(0), depth(_depth), size(_size), pfirst(-1), cfirst(-1) {}
+  int  getNumNodes()      const { return np.size(); }
+  bool is_leaf(const int i) const { return np[i] < NLEAF; }
 
-  bool is_leaf() const
+  void clear()
   {
-    return np < NLEAF;
+    np.clear(); depth.clear(); size.clear(); pfirst.clear(); cfirst.clear();
+    bound_inner.clear(); bound_outer.clear();
   }
-  void push_particle(const int paddr, const int rshift)
+
+  int push_node(const int _np, const int _depth, const float _size, const int _pfirst)
+  {
+    np    .push_back(_np);
+    depth .push_back(_depth);
+    size  .push_back(_size);
+    pfirst.push_back(_np > 0 ? _pfirst : -1);
+    cfirst.push_back(-1);
+    return np.size() - 1;
+  }
+
+  /* Splits the particles of node i over its 8 children, on the key bits at rshift */
+  void split(const int i, const int rshift)
   {
     assert(rshift >= 0);
-    if(!is_leaf())
-    { // assign recursively
-      int ic = ptcl[paddr].octkey(rshift);
-      Node &child = Node_heap[cfirst + ic];
-      child.push_particle(paddr, rshift-3);
-    }
-    else
+    int       b = pfirst[i];
+    const int e = b + np[i];
+    cfirst[i] = np.size();
+    for (int ic = 0; ic < 8; ic++)
     {
-      if(-1 == pfirst)
+      /* first particle that goes into a later child */
+      int lo = b, hi = e;
+      while (lo < hi)
       {
-        assert(0 == np);
-        pfirst = paddr;
+        const int mid = (lo + hi) / 2;
+        if (ptcl[mid].octkey(rshift) <= ic) lo = mid + 1;
+        else                                hi = mid;
       }
+      push_node(lo - b, depth[i]+1, size[i]/2.0f, b);
+      b = lo;
     }
-    np++;
-    if(np == NLEAF)
-    { // shi's just become a mother
-      assert(pfirst >= 0);
-      cfirst = Node_heap.size();
-#if 0
-      for(int ic=0; ic<8; ic++){
-        Node_heap.push_back(Node(1+depth));
-      }
-#else
-      size_t new_size = Node_heap.size() + 8;
-      assert(Node_heap.capacity() >= new_size);
-      Node_heap.resize(new_size, Node(1+depth,size/2.0));
-#endif
-      for(int addr = pfirst; addr < pfirst+np; addr++)
+  }
+
+  void split_recursive(const int i, const int rshift)
+  {
+    split(i, rshift);
+    for (int ic = 0; ic < 8; ic++)
+      if (!is_leaf(cfirst[i] + ic))
+        split_recursive(cfirst[i] + ic, rshift-3);
+  }
+
+  /* Appends the nodes of a subtree that was built in sub, sub's node 0 is node i */
+  void append_subtree(const int i, const NodeHeap &sub, const int offset)
+  {
+    const int n = sub.getNumNodes();
+    cfirst[i] = sub.cfirst[0] < 0 ? -1 : offset + sub.cfirst[0] - 1;
+    for (int k = 1; k < n; k++)
+    {
+      np    [offset+k-1] = sub.np    [k];
+      depth [offset+k-1] = sub.depth [k];
+      size  [offset+k-1] = sub.size  [k];
+      pfirst[offset+k-1] = sub.pfirst[k];
+      cfirst[offset+k-1] = sub.cfirst[k] < 0 ? -1 : offset + sub.cfirst[k] - 1;
+    }
+  }
+
+  void build(Particle *_ptcl, const int nbody, const float rootSize)
+  {
+    ptcl = _ptcl;
+    clear();
+    push_node(nbody, 0, rootSize, 0);
+
+    /* top levels, breadth first */
+    const int ntask = 8*omp_get_max_threads();
+    int rshift = 60;
+    std::vector<int> level;
+    if (!is_leaf(0))
+      level.push_back(0);
+    while (!level.empty() && (int)level.size() < ntask)
+    {
+      std::vector<int> next;
+      for (size_t k = 0; k < level.size(); k++)
       {
-        int ic = ptcl[addr].octkey(rshift);
-        Node &child = Node_heap[cfirst + ic];
-        child.push_particle(addr, rshift-3);
+        split(level[k], rshift);
+        for (int ic = 0; ic < 8; ic++)
+          if (!is_leaf(cfirst[level[k]] + ic))
+            next.push_back(cfirst[level[k]] + ic);
       }
+      level.swap(next);
+      rshift -= 3;
+    }
+
+    /* subtrees */
+    const int nsub = level.size();
+    std::vector<NodeHeap> sub(nsub);
+#pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < nsub; k++)
+    {
+      const int i = level[k];
+      sub[k].ptcl = ptcl;
+      sub[k].push_node(np[i], depth[i], size[i], pfirst[i]);
+      sub[k].split_recursive(0, rshift);
+    }
+
+    std::vector<int> offset(nsub+1, np.size());
+    for (int k = 0; k < nsub; k++)
+      offset[k+1] = offset[k] + sub[k].getNumNodes() - 1;
+    const int nnode = offset[nsub];
+    np.resize(nnode); depth.resize(nnode); size.resize(nnode); pfirst.resize(nnode); cfirst.resize(nnode);
+#pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < nsub; k++)
+      append_subtree(level[k], sub[k], offset[k]);
+
+    bound_inner.resize(nnode);
+    bound_outer.resize(nnode);
+    active.assign(nbody, 1);
+    has_active.assign(nnode, 1);
+
+    const int npad = nbody + LEAF_SIMD_WIDTH;
+    px.assign(npad, 0.0f); py.assign(npad, 0.0f); pz.assign(npad, 0.0f);
+    pmass.assign(npad, 0.0f); ph.assign(npad, 0.0f);
+#pragma omp parallel for
+    for (int i = 0; i < nbody; i++)
+    {
+      px   [i] = ptcl[i].pos.x;
+      py   [i] = ptcl[i].pos.y;
+      pz   [i] = ptcl[i].pos.z;
+      pmass[i] = ptcl[i].mass;
     }
   }
-  void dump_tree(
-      int level,
-      std::ostream &ofs = std::cout) const{
-    if(is_leaf()){
-      for(int ip=0; ip<np; ip++){
-        const Particle &p = ptcl[ip+pfirst];
-        for(int i=0; i<level; i++) ofs << " ";
-        ofs << p.pos << std::endl;
-      }
-      ofs << std::endl;
-    }else{
-      for(int i=0; i<level; i++) ofs << ">";
-      ofs << std::endl;
-      for(int ic=0; ic<8; ic++){
-        const Node &child = Node_heap[cfirst + ic];
-        child.dump_tree(level+1, ofs);
+
+  /* Children have a larger index than their parent, so the internal nodes are
+   * done in reverse order after the leaves */
+  void make_boundary()
+  {
+    const int nnode = getNumNodes();
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < nnode; i++)
+    {
+      bound_inner[i] = Boundary();
+      bound_outer[i] = Boundary();
+      if (is_leaf(i))
+      {
+        has_active[i] = 0;
+        for (int ip = 0; ip < np[i]; ip++)
+        {
+          const Particle &p = ptcl[ip+pfirst[i]];
+          bound_inner[i].merge(Boundary(p.pos));
+          bound_outer[i].merge(Boundary(p.pos, p.get_h()));
+          ph[ip+pfirst[i]] = p.get_h();
+          has_active[i] |= active[ip+pfirst[i]];
+        }
       }
     }
+    for (int i = nnode-1; i >= 0; i--)
+      if (!is_leaf(i))
+      {
+        has_active[i] = 0;
+        for (int ic = 0; ic < 8; ic++)
+        {
+          const int c = cfirst[i] + ic;
+          if (np[c] > 0)
+          {
+            bound_inner[i].merge(bound_inner[c]);
+            bound_outer[i].merge(bound_outer[c]);
+            has_active[i] |= has_active[c];
+          }
+        }
+      }
   }
-  void make_boundary(){
-    if(is_leaf()){
-      for(int ip=0; ip<np; ip++){
-        const Particle &p = ptcl[ip+pfirst];
-        bound_inner.merge(Boundary(p.pos));
-        bound_outer.merge(Boundary(p.pos, p.get_h()));
+
+  /* After the h of the active particles has changed: only the outer bounds of
+   * the nodes that have an active particle are rebuilt, the inner bounds do
+   * not depend on h */
+  void update_boundary()
+  {
+    const int nnode = getNumNodes();
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < nnode; i++)
+    {
+      if (!is_leaf(i) || !has_active[i])
+        continue;
+      has_active[i] = 0;
+      for (int ip = 0; ip < np[i]; ip++)
+        has_active[i] |= active[ip+pfirst[i]];
+      if (!has_active[i])
+        continue;
+      bound_outer[i] = Boundary();
+      for (int ip = 0; ip < np[i]; ip++)
+      {
+        const Particle &p = ptcl[ip+pfirst[i]];
+        bound_outer[i].merge(Boundary(p.pos, p.get_h()));
+        ph[ip+pfirst[i]] = p.get_h();
       }
-    }else{
-      for(int ic=0; ic<8; ic++){
-        Node &child = Node_heap[cfirst + ic];
-        if(child.np > 0){
-          child.make_boundary();
-          bound_inner.merge(child.bound_inner);
-          bound_outer.merge(child.bound_outer);
-        }
+    }
+    for (int i = nnode-1; i >= 0; i--)
+    {
+      if (is_leaf(i) || !has_active[i])
+        continue;
+      has_active[i] = 0;
+      for (int ic = 0; ic < 8; ic++)
+        has_active[i] |= has_active[cfirst[i] + ic];
+      if (!has_active[i])
+        continue;
+      bound_outer[i] = Boundary();
+      for (int ic = 0; ic < 8; ic++)
+      {
+        const int c = cfirst[i] + ic;
+        if (np[c] > 0)
+          bound_outer[i].merge(bound_outer[c]);
       }
     }
   }
-  
-  void set_init_h(const float num, const float volume)
+
+  /* The volume of a node is that of the root divided by 8 per level */
+  void set_init_h(const float num, const float rootVolume)
   {
-    if(is_leaf()){
-      const float roh = float(np) / volume;
+    const int nnode = getNumNodes();
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < nnode; i++)
+    {
+      if (!is_leaf(i) || np[i] == 0)
+        continue;
+      float volume = rootVolume;
+      for (int d = 0; d < depth[i]; d++)
+        volume /= 8.0f;
+      const float roh = float(np[i]) / volume;
       const float h0 = cbrtf(num / roh);
-      for(int ip=0; ip<np; ip++){
-        Particle &p = ptcl[ip+pfirst];
-        p.set_h(h0);
-      }
+      for (int ip = 0; ip < np[i]; ip++)
+        ptcl[ip+pfirst[i]].set_h(h0);
+    }
+  }
+
+  void find_group_Node(
+      const int i,
+      const int ncrit,
+      std::vector<int> &group_list) const
+  {
+    if (np[i] == 0)
+      return;
+    if (np[i] < ncrit){
+      group_list.push_back(i);
     }else{
-      for(int ic=0; ic<8; ic++){
-        Node &child = Node_heap[cfirst + ic];
-        if(child.np > 0){
-          child.set_init_h(num, volume / 8.0f);
-        }
-      }
+      for(int ic=0; ic<8; ic++)
+        find_group_Node(cfirst[i] + ic, ncrit, group_list);
     }
   }
-  
 
-  static void find_neib_beween_leaves(const Node &ileaf, const Node &jleaf)
+  /* The i-particles are done LEAF_SIMD_WIDTH at a time, one per lane, the
+   * j-particles are broadcast. Lanes past the end of the leaf, and particles
+   * that are inactive, out of range of jleaf or have too many neighbours, are
+   * masked */
+  void find_neib_beween_leaves(const int ileaf, const int jleaf)
   {
-    for(int i=0; i<ileaf.np; i++){
-      Particle &ip = ptcl[i+ileaf.pfirst];
-      Boundary ibound(ip.pos, ip.get_h());
-      if(not_overlapped(ibound, jleaf.bound_inner)) continue;
-      float h2 = ip.get_h() * ip.get_h();
-      if (ip.nnb < 2222)
-        for(int j=0; j<jleaf.np; j++){
-          Particle &jp = ptcl[j+jleaf.pfirst];
-          const float r2 = (jp.pos - ip.pos).norm2();
-          if(r2 < h2)
-          {
-            ip.nnb++;
-            lInteract(ip, jp, r2);
-          }
+    const int W = LEAF_SIMD_WIDTH;
+    const int ib = pfirst[ileaf];
+    const int jb = pfirst[jleaf];
+    for(int i=0; i<np[ileaf]; i += W){
+      v_si lane = {};
+      bool any = false;
+      for(int k=0; k<W && i+k<np[ileaf]; k++){
+        const Particle &ip = ptcl[ib+i+k];
+        if (active[ib+i+k] && ip.nnb < 2222 && overlapped(Boundary(ip.pos, ip.get_h()), bound_inner[jleaf])){
+          lane[k] = -1;
+          any = true;
         }
+      }
+      if(!any) continue;
+
+      v_sf xi, yi, zi, hi;
+      __builtin_memcpy(&xi, &px[ib+i], sizeof(v_sf));
+      __builtin_memcpy(&yi, &py[ib+i], sizeof(v_sf));
+      __builtin_memcpy(&zi, &pz[ib+i], sizeof(v_sf));
+      __builtin_memcpy(&hi, &ph[ib+i], sizeof(v_sf));
+      const v_sf zero = {};
+      const v_sf h2   = hi*hi;
+      const v_sf hinv = lane ? 1.0f/hi : zero;
+
+      v_sf dens = {};
+      v_si nnb  = {};
+      for(int j=0; j<np[jleaf]; j++){
+        const v_sf dx = px[jb+j] - xi;
+        const v_sf dy = py[jb+j] - yi;
+        const v_sf dz = pz[jb+j] - zi;
+        const v_sf r2 = dx*dx + dy*dy + dz*dz;
+        const v_si in = lane & (r2 < h2);
+        nnb  -= in;
+        dens += pmass[jb+j] * lWkernel_simd(v_sqrt(r2)*hinv, in);
+      }
+
+      for(int k=0; k<W && i+k<np[ileaf]; k++){
+        if(!lane[k]) continue;
+        Particle &ip = ptcl[ib+i+k];
+        const float hinv3 = ip.get_hinv()*ip.get_hinv()*ip.get_hinv();
+        ip.nnb     += nnb[k];
+        ip.density += dens[k] * hinv3;
+      }
     }
   }
-  
-  friend void operator << (Node &iNode, Node &jNode)
+
+  /* neighbours in node j of the particles in node i */
+  void find_neib(const int iNode, const int jNode)
   {
-    if(overlapped(iNode.bound_outer, jNode.bound_inner)){
+    if(!has_active[iNode]) return;
+    if(overlapped(bound_outer[iNode], bound_inner[jNode])){
       bool itravel = false;
       bool jtravel = false;
-      if(iNode.is_leaf()){
-        if(jNode.is_leaf()){
+      if(is_leaf(iNode)){
+        if(is_leaf(jNode)){
           find_neib_beween_leaves(iNode, jNode);
           return;
         }else{
           jtravel = true;
         }
       }else{
-        if(jNode.is_leaf()){
+        if(is_leaf(jNode)){
           itravel = true;
         }else{
-          if(iNode.depth < jNode.depth){
+          if(depth[iNode] < depth[jNode]){
             itravel = true;
           }else{
             jtravel = true;
@@ -198,48 +425,34 @@ struct Node
       }
       if(itravel){
         for(int i=0; i<8; i++){
-          Node &ichild = Node_heap[i+iNode.cfirst];
-          if(ichild.np == 0) continue;
-          ichild << jNode;
+          const int ichild = i+cfirst[iNode];
+          if(np[ichild] == 0) continue;
+          find_neib(ichild, jNode);
         }
         return;
       }
       if(jtravel){
         for(int j=0; j<8; j++){
-          Node &jchild = Node_heap[j+jNode.cfirst];
-          if(jchild.np == 0) continue;
-          iNode << jchild;
+          const int jchild = j+cfirst[jNode];
+          if(np[jchild] == 0) continue;
+          find_neib(iNode, jchild);
         }
         return;
       }
     }
   }
-  
-  void find_group_Node(
-      int ncrit,
-      std::vector<Node *> &group_list){
-    if (np == 0)
-      return;
-    if(np < ncrit){
-      group_list.push_back(this);
-    }else{
-      for(int ic=0; ic<8; ic++){
-        Node &child = Node_heap[cfirst + ic];
-        child.find_group_Node(ncrit, group_list);
-      }
-    }
-  }
-  
-  friend void operator << (Particle &ip, Node &jNode)
+
+  /* neighbours in node j of particle ip */
+  void find_neib(Particle &ip, const int jNode)
   {
     Boundary bi(ip.pos, ip.get_h());
     if (ip.nnb < 2222)
-      if(overlapped(bi, jNode.bound_inner)){
-        if(jNode.is_leaf()){
+      if(overlapped(bi, bound_inner[jNode])){
+        if(is_leaf(jNode)){
           float h2 = ip.get_h() * ip.get_h();
-          for(int j=0; j<jNode.np; j++)
+          for(int j=0; j<np[jNode]; j++)
           {
-            Particle &jp = ptcl[j+jNode.pfirst];
+            Particle &jp = ptcl[j+pfirst[jNode]];
             const float r2 = (jp.pos - ip.pos).norm2();
             if(r2 < h2)
             {
@@ -250,12 +463,11 @@ struct Node
           }
         }else{
           for(int j=0; j<8; j++){
-            Node &jchild = Node_heap[j+jNode.cfirst];
-            if(jchild.np == 0) continue;
-            ip << jchild;
+            const int jchild = j+cfirst[jNode];
+            if(np[jchild] == 0) continue;
+            find_neib(ip, jchild);
           }
         }
       }
   }
-
 };
@@ -13,23 +13,26 @@ struct Tree
 {
   typedef boundary<float> Boundary;
 
-  Particle::Vector tree;
+  Particle::Vector ptcl;  /* sorted by key */
+  NodeHeap node;
   Boundary BBox;  /* bounding box */
-  std::vector<Node *> leafArray;
+  std::vector<int> leafArray;
 
   struct cmp_particle_key { bool operator() (const Particle &a, const Particle &b) {return a.key.val < b.key.val;} };
 
 
-  Tree(const Particle::Vector &ptcl_in, const int Nngb = -1)
+  Tree(const Particle::Vector &ptcl_in, const int Nngb = -1, const bool initH = true,
+       const Boundary &rootBox = Boundary())
   {
     const double t0 = wtime();
 
-    Node::clear();
-    std::vector<Particle> &ptcl = Node::ptcl;
     ptcl = ptcl_in;
     const int nbody = ptcl_in.size();
+    if (nbody == 0)
+      return;
 
-    /* import particles and compute the Bounding Box */
+    /* import particles and compute the Bounding Box, at least rootBox */
+    BBox = rootBox;
     for (int i = 0; i < nbody; i++)
       BBox.merge(Boundary(ptcl[i].pos));
 
@@ -48,62 +51,96 @@ struct Tree
 
     /* now build the tree */
 
+#pragma omp parallel for
     for (int i = 0; i < nbody; i++)
       ptcl[i].compute_key(BBox.min, rsize2);
 
     __gnu_parallel::sort(ptcl.begin(), ptcl.end(), cmp_particle_key());
 
-    Node::Node_heap.push_back(Node());
-    Node &root = Node::Node_heap[0];
-    root.size = rsize2;
-    for (int i = 0; i < nbody; i++)
-      root.push_particle(i, 60);
+    node.build(&ptcl[0], nbody, rsize2);
     
+    /* unless the particles come with a smoothing length already */
     const float volume = rsize*rsize*rsize;
-    root.set_init_h(float(Nngb), volume);
+    if (initH)
+      node.set_init_h(float(Nngb), volume);
     
-    root.find_group_Node(Node::NLEAF, leafArray);
+    node.find_group_Node(0, NodeHeap::NLEAF, leafArray);
     const double t1 = wtime();
-    fprintf(stderr, " -- Tree build is done in %g sec [ %g ptcl/sec ]\n",  t1 - t0, nbody/(t1 - t0));
-
-    const int niter = 10;
+    fprintf(stderr, " -- Tree build is done in %g sec [ %g ptcl/sec ]  nnode= %d\n",  t1 - t0, nbody/(t1 - t0), node.getNumNodes());
+
+    /* a particle is converged when its number of neighbours is within nnbTol
+     * of Nngb, its h then no longer changes and it is skipped in the
+     * following neighbour searches. The h of the others is scaled with the
+     * neighbour count, and bisected when that leaves the bracket [hlo, hhi]
+     * of the h's seen so far (hhi = 0 while there is no upper bound) */
+    const int niter  = 10;
+    const int nnbTol = std::max(1, Nngb/10);
     if (Nngb > 0)
+    {
+      std::vector<float> hlo(nbody, 0.0f), hhi(nbody, 0.0f);
+      std::vector<int> group_list;
+      node.find_group_Node(0, 2000, group_list);
+      node.make_boundary();
       for (int iter = 0; iter< niter; iter++)
       {
-        root.make_boundary();
 #pragma omp parallel for
         for (int i = 0; i < nbody; i++)
-          ptcl[i].nnb = 0;
+          if (node.active[i])
+          {
+            ptcl[i].nnb     = 0;
+            ptcl[i].density = 0.0f;
+          }
 
 #if 0  /* SLOW */
 #pragma omp parallel for
         for(int i=0; i<nbody; i++)
-          ptcl[i] << root;
+          if (node.active[i])
+            node.find_neib(ptcl[i], 0);
 #else /* FAST */
-        std::vector<Node *> group_list;
-        root.find_group_Node(2000, group_list);
 #pragma omp parallel for schedule(dynamic)
         for(int i=0; i<(int)group_list.size(); i++)
-          *group_list[i] << root;
+          node.find_neib(group_list[i], 0);
 #endif
+        const bool lastIter = iter == niter-1;
         using long_t = unsigned long long;
         long_t nbMean = 0;
         long_t nbMax  = 0;
         long_t nbMin  = 1<<30;
-#pragma omp parallel for reduction(+:nbMean) reduction(max:nbMax) reduction(min:nbMin)
+        int    nActive = 0;
+#pragma omp parallel for reduction(+:nbMean,nActive) reduction(max:nbMax) reduction(min:nbMin)
         for (int i = 0; i < nbody; i++)
         {
-          const float f = 0.5f * (1.0f + cbrtf(Nngb / (float)ptcl[i].nnb));
-          const float fScale = std::max(std::min(f,2.0f), 0.8f);
-          ptcl[i].set_h(ptcl[i].get_h() * fScale);
-
           nbMean += ptcl[i].nnb;
           nbMax   = std::max(nbMax, (long_t)ptcl[i].nnb);
           nbMin   = std::min(nbMin, (long_t)ptcl[i].nnb);
+          if (!node.active[i])
+            continue;
+          const int nnb = ptcl[i].nnb;
+          if (std::abs(nnb - Nngb) <= nnbTol || lastIter)
+          {
+            node.active[i] = 0;
+            continue;
+          }
+          nActive++;
+
+          const float h = ptcl[i].get_h();
+          if (nnb < Nngb) hlo[i] = std::max(hlo[i], h);
+          else            hhi[i] = hhi[i] > 0.0f ? std::min(hhi[i], h) : h;
+
+          const float f = 0.5f * (1.0f + cbrtf(Nngb / (float)nnb));
+          const float fScale = std::max(std::min(f,2.0f), 0.8f);
+          float hnew = h * fScale;
+          if (hnew <= hlo[i] || (hhi[i] > 0.0f && hnew >= hhi[i]))
+            hnew = 0.5f*(hlo[i] + hhi[i]);
+          ptcl[i].set_h(hnew);
         }
-        fprintf(stderr, "iteration= %d : nbMin= %g  nbMean= %g  nbMax= %g\n", 
-            iter, (float)nbMin, (float)nbMean/nbody, (float)nbMax);
+        fprintf(stderr, "iteration= %d : nbMin= %g  nbMean= %g  nbMax= %g  nActive= %d\n", 
+            iter, (float)nbMin, (float)nbMean/nbody, (float)nbMax, nActive);
+        if (nActive == 0)
+          break;
+        node.update_boundary();
       }
+    }
 
     const double t2 = wtime();
     fprintf(stderr, " -- Ngb find is done in %g sec [ %g ptcl/sec ]\n",  t2 - t1, nbody/(t2 - t1));
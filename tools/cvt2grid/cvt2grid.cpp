@@ -1,14 +1,12 @@
 #include "BonsaiIO.h"
 #include "IDType.h"
 #include "Tree.h"
+#include "DomainDecomposition.h"
 
 typedef float float5[5];
 typedef float float4[4];
 typedef float float3[3];
 typedef float float2[2];
-std::vector<Particle> Node::ptcl;
-std::vector<Node>     Node::Node_heap;
-std::vector<std::pair<Node*, Node*> > Node::pair_list;
   
 
 static double read(
@@ -94,8 +92,6 @@ int main(int argc, char * argv[])
   MPI_Comm_size(comm, &nRank);
   MPI_Comm_rank(comm, &myRank);
 
-  assert(nRank == 1 && myRank == 0);
-
   if (argc < 5)
   {
     if (myRank == 0)
@@ -188,63 +184,85 @@ int main(int argc, char * argv[])
     const auto &posArray = *dynamic_cast<BonsaiIO::DataType<float4>*>(dataStars[1]);
     const auto &velArray = *dynamic_cast<BonsaiIO::DataType<float3>*>(dataStars[2]);
     auto &rhohArray = *dynamic_cast<BonsaiIO::DataType<float2>*>(dataStars[3]);
-    const size_t np = posArray.getNumElements();
-    Particle::Vector ptcl(np);
+    /* with more than one rank every rank builds the tree of its own Morton key
+     * domain in the global box, only leaves that cross a domain boundary differ */
+    DomainDecomposition dd(comm);
+    Particle::Vector ptcl;
 
     fprintf(stderr, " -- create tree particles -- \n");
 
-    for (size_t i = 0; i < np; i++)
+    if (nRank > 1)
+    {
+      dd.decompose(posArray, velArray);
+      ptcl = dd.treeParticles();
+    }
+    else
     {
-      const auto &pos = posArray[i];
-      const auto &vel = velArray[i];
-      ptcl[i].ID   = i;
-      ptcl[i].pos  = vec3(pos[0], pos[1], pos[2]);
-      ptcl[i].mass = pos[3];
-      ptcl[i].vel  = vec3(vel[0], vel[1], vel[2]);
+      ptcl.resize(posArray.getNumElements());
+      for (size_t i = 0; i < ptcl.size(); i++)
+      {
+        const auto &pos = posArray[i];
+        const auto &vel = velArray[i];
+        ptcl[i].ID   = i;
+        ptcl[i].pos  = vec3(pos[0], pos[1], pos[2]);
+        ptcl[i].mass = pos[3];
+        ptcl[i].vel  = vec3(vel[0], vel[1], vel[2]);
+      }
     }
-    Node::allocate(np,np);
+    const size_t np = ptcl.size();
     fprintf(stderr, " -- build tree -- \n");
-    Tree tree(ptcl);
-
+    Tree tree(ptcl, -1, true, dd.globalBox);
     const auto &leafArray = tree.leafArray;
     const int nLeaf = leafArray.size();
 
     fprintf(stderr, " np= %d  nleaf= %d  NLEAF= %d\n",
-        (int)np, nLeaf, Node::NLEAF);
+        (int)np, nLeaf, NodeHeap::NLEAF);
 
-    rhohArray.resize(np);
+    std::vector<float> density(np), h(np);
     
     fprintf(stderr, " -- generate output data  -- \n");
 
     size_t npMean = 0;
     for (int i = 0; i < nLeaf; i++)
     {
-      const auto &leaf = *leafArray[i];
+      const int   leaf     = leafArray[i];
+      const int   leafNp   = tree.node.np[leaf];
+      const int   pfirst   = tree.node.pfirst[leaf];
+      const float leafSize = tree.node.size[leaf];
       vec3 pos(0.0);
       vec3 vel(0.0);
       float mass = 0.0;
-      npMean += leaf.np;
-      for (int j = 0; j < leaf.np; j++)
+      npMean += leafNp;
+      for (int j = 0; j < leafNp; j++)
       {
-        const auto &p = Node::ptcl[leaf.pfirst+j];
+        const auto &p = tree.ptcl[pfirst+j];
         mass += p.mass;
         pos += p.pos*p.mass;
         vel += p.vel*p.mass;
       }
       pos *= 1.0/mass;
       vel *= 1.0/mass;
-      const float volume = leaf.size*leaf.size*leaf.size;
+      const float volume = leafSize*leafSize*leafSize;
       const float rho = mass/volume;
-      const float h   = leaf.size;
-      for (int j = 0; j < leaf.np; j++)
+      for (int j = 0; j < leafNp; j++)
       {
-        const auto &p = Node::ptcl[leaf.pfirst+j];
-        rhohArray[p.ID][0] = rho;
-        rhohArray[p.ID][1] = h;
+        const auto &p = tree.ptcl[pfirst+j];
+        density[p.ID] = rho;
+        h      [p.ID] = leafSize;
       }
     }
     fprintf(stderr, "npMean= %g\n", 1.0*npMean/nLeaf);
 
+    rhohArray.resize(posArray.getNumElements());
+    if (nRank > 1)
+      dd.returnResults(density, h, rhohArray);
+    else
+      for (size_t i = 0; i < np; i++)
+      {
+        rhohArray[i][0] = density[i];
+        rhohArray[i][1] = h[i];
+      }
+
   }
 
 
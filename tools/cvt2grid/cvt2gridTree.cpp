@@ -6,9 +6,6 @@ typedef float float5[5];
 typedef float float4[4];
 typedef float float3[3];
 typedef float float2[2];
-std::vector<Particle> Node::ptcl;
-std::vector<Node>     Node::Node_heap;
-std::vector<std::pair<Node*, Node*> > Node::pair_list;
   
 
 static double read(
@@ -204,7 +201,6 @@ int main(int argc, char * argv[])
       ptcl[i].mass = pos[3];
       ptcl[i].vel  = vec3(vel[0], vel[1], vel[2]);
     }
-    Node::allocate(np,np);
     fprintf(stderr, " -- build tree -- \n");
     Tree tree(ptcl);
 
@@ -212,7 +208,7 @@ int main(int argc, char * argv[])
     const int nLeaf = leafArray.size();
 
     fprintf(stderr, " np= %d  nleaf= %d  NLEAF= %d\n",
-        (int)np, nLeaf, Node::NLEAF);
+        (int)np, nLeaf, NodeHeap::NLEAF);
 
     auto &posOut  = *dynamic_cast<BonsaiIO::DataType<float3>*>(data[0]);
     auto &attrOut = *dynamic_cast<BonsaiIO::DataType<float5>*>(data[1]);
@@ -225,14 +221,17 @@ int main(int argc, char * argv[])
     size_t npMean = 0;
     for (int i = 0; i < nLeaf; i++)
     {
-      const auto &leaf = *leafArray[i];
+      const int   leaf     = leafArray[i];
+      const int   leafNp   = tree.node.np[leaf];
+      const int   pfirst   = tree.node.pfirst[leaf];
+      const float leafSize = tree.node.size[leaf];
       vec3 pos(0.0);
       vec3 vel(0.0);
       float mass = 0.0;
-      npMean += leaf.np;
-      for (int i = 0; i < leaf.np; i++)
+      npMean += leafNp;
+      for (int i = 0; i < leafNp; i++)
       {
-        const auto &p = Node::ptcl[leaf.pfirst+i];
+        const auto &p = tree.ptcl[pfirst+i];
         mass += p.mass;
         pos += p.pos*p.mass;
         vel += p.vel*p.mass;
@@ -245,9 +244,9 @@ int main(int argc, char * argv[])
       attrOut[i][0] = vel.x;
       attrOut[i][1] = vel.y;
       attrOut[i][2] = vel.z;
-      const float volume = leaf.size*leaf.size*leaf.size;
+      const float volume = leafSize*leafSize*leafSize;
       attrOut[i][3] = mass/volume;
-      attrOut[i][4] = leaf.size;
+      attrOut[i][4] = leafSize;
 #if 0
       if (i%1000 == 0)
       {
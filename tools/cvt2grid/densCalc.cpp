@@ -1,14 +1,12 @@
 #include "BonsaiIO.h"
 #include "IDType.h"
 #include "Tree.h"
+#include "DomainDecomposition.h"
 
 typedef float float5[5];
 typedef float float4[4];
 typedef float float3[3];
 typedef float float2[2];
-std::vector<Particle> Node::ptcl;
-std::vector<Node>     Node::Node_heap;
-std::vector<std::pair<Node*, Node*> > Node::pair_list;
 
 template<typename Tpos, typename Tvel, typename Trhoh>
 void densityEstimator(const Tpos &posArray, const Tvel &velArray, Trhoh &rhohArray)
@@ -29,7 +27,6 @@ void densityEstimator(const Tpos &posArray, const Tvel &velArray, Trhoh &rhohArr
       ptcl[i].mass = pos[3];
       ptcl[i].vel  = vec3(vel[0], vel[1], vel[2]);
     }
-    Node::allocate(np,np);
     fprintf(stderr, " -- build tree -- \n");
     Tree tree(ptcl,32);
 
@@ -43,7 +40,7 @@ void densityEstimator(const Tpos &posArray, const Tvel &velArray, Trhoh &rhohArr
     long_t nbMin  = 1<<30;
     for (int i = 0; i < (int)np; i++)
     {
-      const auto &p = Node::ptcl[i];
+      const auto &p = tree.ptcl[i];
       nbMean += p.nnb;
       nbMax   = std::max(nbMax, (long_t)p.nnb);
       nbMin   = std::min(nbMin, (long_t)p.nnb);
@@ -54,6 +51,95 @@ void densityEstimator(const Tpos &posArray, const Tvel &velArray, Trhoh &rhohArr
         (float)nbMin, (float)nbMean/np, (float)nbMax);
 
   }
+
+/* Same on the Morton key domains of all ranks. The halo is taken from the
+ * smoothing lengths that a first pass over the own domain gives, times hfac.
+ * The h iteration can grow h by more than that, the particles for which it did
+ * have an incomplete neighbour list and the halo is exchanged again with a
+ * larger hfac */
+template<typename Tpos, typename Tvel, typename Trhoh>
+void distributedDensityEstimator(const MPI_Comm &comm, const Tpos &posArray, const Tvel &velArray, Trhoh &rhohArray)
+{
+    const int Nngb = 32;
+    DomainDecomposition dd(comm);
+    dd.decompose(posArray, velArray);
+
+    const int np = dd.ptcl.size();
+    std::vector<float> h0(np), density(np), h(np);
+    std::vector<int> nnb(np);
+
+    fprintf(stderr, " -- rank= %d: first pass on the own domain, np= %d -- \n", dd.myRank, np);
+    {
+      Tree tree(dd.treeParticles(),Nngb);
+      for (int i = 0; i < np; i++)
+        h0[tree.ptcl[i].ID] = tree.ptcl[i].get_h();
+    }
+    /* the second pass starts from these, also for the halo particles */
+    for (int i = 0; i < np; i++)
+      dd.ptcl[i].h = h0[i];
+
+    float hfac = 1.25f;
+    const int NROUNDMAX = 3;
+    long long nIncomplete = 0;
+    for (int round = 0; round < NROUNDMAX; round++)
+    {
+      std::vector<float> hrange(np);
+      for (int i = 0; i < np; i++)
+        hrange[i] = hfac*h0[i];
+      dd.exchangeHalo(hrange);
+
+      const int nTree = np + dd.halo.size();
+      fprintf(stderr, " -- rank= %d: build tree np= %d  nhalo= %d -- \n", dd.myRank, np, (int)dd.halo.size());
+      nIncomplete = 0;
+      {
+        Tree tree(dd.treeParticles(),Nngb,false);
+        for (int i = 0; i < nTree; i++)
+        {
+          const auto &p = tree.ptcl[i];
+          if (p.ID >= np)
+            continue;
+          density[p.ID] = p.density;
+          h      [p.ID] = p.get_h();
+          nnb    [p.ID] = p.nnb;
+          if (p.get_h() > hrange[p.ID])
+            nIncomplete++;
+        }
+      }
+
+      MPI_Allreduce(MPI_IN_PLACE, &nIncomplete, 1, MPI_LONG_LONG, MPI_SUM, comm);
+      if (dd.myRank == 0)
+        fprintf(stderr, "round= %d : hfac= %g  nIncomplete= %lld\n", round, hfac, nIncomplete);
+      if (nIncomplete == 0)
+        break;
+      hfac *= 2.0f;
+    }
+    /* the densities of these used an incomplete set of neighbours */
+    if (dd.myRank == 0 && nIncomplete > 0)
+      fprintf(stderr, " WARNING: %lld particles still have h beyond their halo range after %d rounds, their densities may be inaccurate\n",
+          nIncomplete, NROUNDMAX);
+
+    rhohArray.resize(posArray.getNumElements());
+    dd.returnResults(density, h, rhohArray);
+
+    using long_t = unsigned long long;
+    long_t nbSum = 0;
+    long_t nbMax = 0;
+    long_t nbMin = 1<<30;
+    for (int i = 0; i < np; i++)
+    {
+      nbSum += nnb[i];
+      nbMax  = std::max(nbMax, (long_t)nnb[i]);
+      nbMin  = std::min(nbMin, (long_t)nnb[i]);
+    }
+    long_t nGlb = np;
+    MPI_Allreduce(MPI_IN_PLACE, &nGlb,  1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    MPI_Allreduce(MPI_IN_PLACE, &nbSum, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    MPI_Allreduce(MPI_IN_PLACE, &nbMax, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, comm);
+    MPI_Allreduce(MPI_IN_PLACE, &nbMin, 1, MPI_UNSIGNED_LONG_LONG, MPI_MIN, comm);
+    if (dd.myRank == 0)
+      fprintf(stderr, "nbMin= %g  nbMean= %g  nbMax= %g\n", 
+          (float)nbMin, (float)nbSum/std::max(nGlb,(long_t)1), (float)nbMax);
+}
   
 
 static double read(
@@ -139,8 +225,6 @@ int main(int argc, char * argv[])
   MPI_Comm_size(comm, &nRank);
   MPI_Comm_rank(comm, &myRank);
 
-  assert(nRank == 1 && myRank == 0);
-
   if (argc < 5)
   {
     if (myRank == 0)
@@ -231,7 +315,13 @@ int main(int argc, char * argv[])
   fprintf(stderr, " ------ Stars --------- \n");
   fprintf(stderr, " ---------------------- \n");
 
-  if (!dataStars.empty())
+  if (!dataStars.empty() && nRank > 1)
+    distributedDensityEstimator(comm,
+        *dynamic_cast<BonsaiIO::DataType<float4>*>(dataStars[1]),
+        *dynamic_cast<BonsaiIO::DataType<float3>*>(dataStars[2]),
+        *dynamic_cast<BonsaiIO::DataType<float2>*>(dataStars[3])
+        );
+  else if (!dataStars.empty())
     densityEstimator(
         *dynamic_cast<BonsaiIO::DataType<float4>*>(dataStars[1]),
         *dynamic_cast<BonsaiIO::DataType<float3>*>(dataStars[2]),
@@ -242,7 +332,13 @@ int main(int argc, char * argv[])
   fprintf(stderr, " ------ DM --------- \n");
   fprintf(stderr, " ---------------------- \n");
 
-  if (!dataDM.empty())
+  if (!dataDM.empty() && nRank > 1)
+    distributedDensityEstimator(comm,
+        *dynamic_cast<BonsaiIO::DataType<float4>*>(dataDM[1]),
+        *dynamic_cast<BonsaiIO::DataType<float3>*>(dataDM[2]),
+        *dynamic_cast<BonsaiIO::DataType<float2>*>(dataDM[3])
+        );
+  else if (!dataDM.empty())
     densityEstimator(
         *dynamic_cast<BonsaiIO::DataType<float4>*>(dataDM[1]),
         *dynamic_cast<BonsaiIO::DataType<float3>*>(dataDM[2]),
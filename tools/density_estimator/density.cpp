@@ -1,9 +1,5 @@
 #include "density.h"
 
-std::vector<Particle> Node::ptcl;
-std::vector<Node>     Node::Node_heap;
-std::vector<std::pair<Node*, Node*> > Node::pair_list;
-
 int main(int argc, char * argv[])
 {
   Particle::Vector ptcl;
@@ -22,7 +18,6 @@ int main(int argc, char * argv[])
   }
   fprintf(stderr, "nbody= %d \n", nbody);
 
-  Node::allocate(nbody, nbody);
   Density density(ptcl, nbody);
 
   int ngb_min = nbody;
@@ -36,7 +31,7 @@ int main(int argc, char * argv[])
 #endif
   for (int i = 0; i < nbody; i++)
   {
-    std::vector<Particle> &ptcl = Node::ptcl;
+    const std::vector<Particle> &ptcl = density.ptcl;
     const Particle &p = ptcl[i];
 #if 0
     if (!(p.nnb == nnb[p.ID]))
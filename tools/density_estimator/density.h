@@ -15,6 +15,8 @@ struct Density
   typedef boundary<float> Boundary;
 
   Particle::Vector density;
+  Particle::Vector ptcl;  /* sorted by key */
+  NodeHeap node;
   Boundary BBox;  /* bounding box */
 
   struct cmp_particle_key 
@@ -38,7 +40,6 @@ struct Density
     const double t0 = wtime();
     fprintf(stderr, "Nuse= %d  \n", Nuse);
 
-    std::vector<Particle> &ptcl = Node::ptcl;
     ptcl.reserve(Nuse);
     const int Nin = ptcl_in.size();
     assert(Nuse <= Nin);
@@ -66,32 +67,29 @@ struct Density
 
     std::sort(ptcl.begin(), ptcl.end(), cmp_particle_key());
 
-    Node::Node_heap.push_back(Node());
-    Node &root = Node::Node_heap[0];
-    for (int i = 0; i < nbody; i++)
-      root.push_particle(i, 60);
+    node.build(&ptcl[0], nbody, rsize);
 
 #if 1  /* if h's are not know this set-up estimated range */
     const float volume = rsize*rsize*rsize;
-    root.set_init_h(float(Nngb), volume);
+    node.set_init_h(float(Nngb), volume);
 #endif
-    root.make_boundary();
+    node.make_boundary();
 
 #ifdef SLOW
 
 #pragma omp parallel for
     for(int i=0; i<nbody; i++)
-      ptcl[i] << root;
+      node.find_neib(ptcl[i], 0);
 #else /* FAST */
 
 #ifdef _OPENMP
-    std::vector<Node *> group_list;
-    root.find_group_Node(2000, group_list);
+    std::vector<int> group_list;
+    node.find_group_Node(0, 2000, group_list);
 #pragma omp parallel for schedule(dynamic)
     for(int i=0; i<(int)group_list.size(); i++)
-      *group_list[i] << root;
+      node.find_neib(group_list[i], 0);
 #else
-    root << root;
+    node.find_neib(0, 0);
 #endif /* _OPENMP */
 
 #endif /* SLOW */
@@ -2,10 +2,6 @@
 #include "density.h"
 
 
-std::vector<Particle> Node::ptcl;
-std::vector<Node>     Node::Node_heap;
-std::vector<std::pair<Node*, Node*> > Node::pair_list;
-
 #if 1
 #define DENSDM
 #endif
@@ -33,7 +29,6 @@ int main(int argc, char * argv[])
       (int)ptcl_dm  .size());
 
 
-  Node::allocate(nbody, nbody);
 #ifdef DENSDM
   const int N = (int)ptcl_dm.size();
   Density density(ptcl_dm, ptcl_dm.size(), 64);
@@ -51,7 +46,7 @@ int main(int argc, char * argv[])
   int nzero = 0;
   for (int i = 0; i < N; i++)
   {
-    std::vector<Particle> &ptcl = Node::ptcl;
+    const std::vector<Particle> &ptcl = density.ptcl;
     const Particle &p = ptcl[i];
 
     if (p.nnb > 128)